@@ -0,0 +1,123 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <memory>
+#include <new>
+#include <string>
+#include <vector>
+
+namespace chat {
+
+/**
+ * @brief Bump allocator for short lived, per packet, allocations
+ *
+ * Memory is handed out linearly from a buffer allocated once up front and
+ * is only reclaimed, all at once, by reset(). Requests that do not fit are
+ * passed on to the global heap, so correctness never depends on the arena
+ * size, only performance does.
+*/
+class arena {
+public:
+    /**
+     * @param capacity size in bytes of the arena's buffer
+    */
+    explicit arena(size_t capacity) :
+        buffer_{new char[capacity]}, capacity_{capacity} {
+    }
+
+    arena(const arena&) = delete;
+    arena& operator=(const arena&) = delete;
+
+    void * allocate(size_t bytes, size_t alignment) {
+        size_t start = (used_ + alignment - 1) & ~(alignment - 1);
+        if (start + bytes > capacity_) {
+            overflows_++;
+            return ::operator new(bytes);
+        }
+        used_ = start + bytes;
+        if (used_ > high_water_) {
+            high_water_ = used_;
+        }
+        return buffer_.get() + start;
+    }
+
+    void deallocate(void * ptr, size_t) {
+        // arena memory is only reclaimed by reset
+        if (!owns(ptr)) {
+            ::operator delete(ptr);
+        }
+    }
+
+    /**
+     * @brief Release everything allocated since the last reset
+    */
+    void reset() {
+        used_ = 0;
+    }
+
+    bool owns(const void * ptr) const {
+        auto p = static_cast<const char*>(ptr);
+        return p >= buffer_.get() && p < buffer_.get() + capacity_;
+    }
+
+    /** @brief largest number of bytes in use at once */
+    size_t high_water() const {
+        return high_water_;
+    }
+
+    /** @brief number of allocations that did not fit and went to the heap */
+    uint64_t overflows() const {
+        return overflows_;
+    }
+
+private:
+    std::unique_ptr<char[]> buffer_;
+    size_t capacity_;
+    size_t used_ = 0;
+    size_t high_water_ = 0;
+    uint64_t overflows_ = 0;
+};
+
+/**
+ * @brief Standard library allocator drawing from an arena
+*/
+template <typename T>
+struct arena_allocator {
+    typedef T value_type;
+
+    arena_allocator(arena& a) : arena_{&a} {
+    }
+
+    template <typename U>
+    arena_allocator(const arena_allocator<U>& other) : arena_{other.arena_} {
+    }
+
+    T * allocate(size_t n) {
+        return static_cast<T*>(arena_->allocate(n * sizeof(T), alignof(T)));
+    }
+
+    void deallocate(T * ptr, size_t n) {
+        arena_->deallocate(ptr, n * sizeof(T));
+    }
+
+    template <typename U>
+    bool operator==(const arena_allocator<U>& other) const {
+        return arena_ == other.arena_;
+    }
+
+    template <typename U>
+    bool operator!=(const arena_allocator<U>& other) const {
+        return arena_ != other.arena_;
+    }
+
+    arena * arena_;
+};
+
+typedef std::basic_string<char, std::char_traits<char>, arena_allocator<char>> arena_string;
+
+template <typename T>
+using arena_vector = std::vector<T, arena_allocator<T>>;
+
+}; // namespace chat
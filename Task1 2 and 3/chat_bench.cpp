@@ -0,0 +1,442 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <new>
+#include <string>
+#include <vector>
+
+#include <arpa/inet.h>
+
+#include "chat_egress.hpp"
+#include "chat_ex.hpp"
+#include "chat_scan.hpp"
+#include "chat_server.hpp"
+#include "chat_telemetry.hpp"
+#include "chat_trace.hpp"
+#include "chat_transport.hpp"
+
+// Time each benchmark runs for, in milliseconds, unless set with -t
+#define BENCH_TIME_MS 200
+// Fewest and most operations timed by each benchmark
+#define BENCH_MIN_OPS 3
+#define BENCH_MAX_OPS 100000
+// Text sent by the message benchmarks
+#define BENCH_MESSAGE "benchmark message"
+
+/**
+ * @brief number of global heap allocations made by this process
+*/
+std::atomic<uint64_t> heap_allocations{0};
+
+void * operator new(size_t size) {
+    heap_allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void * ptr = malloc(size > 0 ? size : 1)) {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void * ptr) noexcept {
+    free(ptr);
+}
+
+void operator delete(void * ptr, size_t) noexcept {
+    free(ptr);
+}
+
+/**
+ * @struct bench_result
+ * @brief Totals over the timed operations of a benchmark
+ * @var bench_result::ops_
+ *  Member 'ops_' operations timed
+ * @var bench_result::ns_
+ *  Member 'ns_' time spent in handle_packet
+ * @var bench_result::allocs_
+ *  Member 'allocs_' heap allocations made by handle_packet
+ * @var bench_result::sends_
+ *  Member 'sends_' datagrams sent by handle_packet
+ */
+struct bench_result {
+    uint64_t ops_;
+    uint64_t ns_;
+    uint64_t allocs_;
+    uint64_t sends_;
+};
+
+/**
+ * @brief everything a benchmark drives handle_packet with
+*/
+struct bench_server {
+    chat::memory_transport sock_;
+    // sends are made inline, so they are part of the measured time
+    chat::egress out_{sock_, 0};
+    online_users users_;
+};
+
+/**
+ * @brief name of synthetic user i
+*/
+std::string user_name(size_t i) {
+    return "u" + std::to_string(i);
+}
+
+/**
+ * @brief address of synthetic user i, distinct for every user
+*/
+sockaddr_in user_address(size_t i) {
+    sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(0x0a000000u + (uint32_t)(i / 50000));
+    address.sin_port = htons(10000 + (uint16_t)(i % 50000));
+    return address;
+}
+
+/**
+ * @brief build a packet as the server expects it
+*/
+chat::chat_message packet(chat::chat_type type, std::string_view username, std::string_view message) {
+    chat::chat_message msg{(uint8_t)type, '\0', '\0'};
+    memcpy(msg.username_, username.data(), username.length());
+    memcpy(msg.message_, message.data(), message.length());
+    return msg;
+}
+
+/**
+ * @brief put users u0 to u<count - 1> online, without going through JOIN
+*/
+void populate(online_users& users, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        add_user(users, user_name(i), user_address(i));
+    }
+}
+
+void depopulate(online_users& users) {
+    clear_state(users);
+}
+
+/**
+ * @brief hand a single packet to the server, outside of any measurement
+*/
+void deliver(bench_server& s, const chat::chat_message& msg, sockaddr_in from) {
+    bool exit_loop = false;
+    handle_packet(s.users_, (const char*)&msg, sizeof(msg), from, s.out_, exit_loop);
+}
+
+/**
+ * @brief time handle_packet, one packet per operation
+ *
+ * @param s server to drive
+ * @param min_ns run for at least this long
+ * @param prepare untimed, called with the operation number to fill in the packet and its sender
+ * @param finish untimed, called after each operation to restore the population
+*/
+template <typename Prepare, typename Finish>
+bench_result measure(bench_server& s, uint64_t min_ns, Prepare prepare, Finish finish) {
+    bench_result r{0, 0, 0, 0};
+    chat::chat_message msg;
+    sockaddr_in from;
+    bool exit_loop = false;
+
+    while ((r.ns_ < min_ns || r.ops_ < BENCH_MIN_OPS) && r.ops_ < BENCH_MAX_OPS) {
+        prepare(r.ops_, msg, from);
+
+        uint64_t sent = s.sock_.stats().sent_;
+        uint64_t allocations = heap_allocations.load(std::memory_order_relaxed);
+        uint64_t start_ns = chat::monotonic_ns();
+        handle_packet(s.users_, (const char*)&msg, sizeof(msg), from, s.out_, exit_loop);
+        r.ns_ += chat::monotonic_ns() - start_ns;
+        r.allocs_ += heap_allocations.load(std::memory_order_relaxed) - allocations;
+        r.sends_ += s.sock_.stats().sent_ - sent;
+
+        finish(r.ops_, msg, from);
+        r.ops_++;
+    }
+    return r;
+}
+
+void report(const char * handler, size_t users, size_t group, const bench_result& r) {
+    char group_text[24] = "-";
+    if (group > 0) {
+        snprintf(group_text, sizeof(group_text), "%zu", group);
+    }
+    printf("%-14s %8zu %6s %8llu %14.0f %10.2f %10.1f\n",
+        handler, users, group_text, (unsigned long long)r.ops_,
+        (double)r.ns_ / r.ops_, (double)r.allocs_ / r.ops_, (double)r.sends_ / r.ops_);
+    fflush(stdout);
+}
+
+/**
+ * @brief run every handler benchmark against a population of users
+ * @param users number of users online
+ * @param min_ns time each benchmark runs for
+*/
+void bench_population(size_t users, uint64_t min_ns) {
+    bench_server s;
+    populate(s.users_, users);
+    auto none = [](uint64_t, const chat::chat_message&, const sockaddr_in&) {};
+
+    // a user that is not part of the population joins, and leaves again untimed
+    const sockaddr_in newcomer = user_address(users);
+    report("join", users, 0, measure(s, min_ns,
+        [&](uint64_t, chat::chat_message& msg, sockaddr_in& from) {
+            msg = chat::join_msg("newcomer");
+            from = newcomer;
+        },
+        [&](uint64_t, const chat::chat_message&, const sockaddr_in&) {
+            deliver(s, chat::leave_msg(), newcomer);
+        }));
+
+    report("leave", users, 0, measure(s, min_ns,
+        [&](uint64_t, chat::chat_message& msg, sockaddr_in& from) {
+            deliver(s, chat::join_msg("newcomer"), newcomer);
+            msg = chat::leave_msg();
+            from = newcomer;
+        }, none));
+
+    report("broadcast", users, 0, measure(s, min_ns,
+        [&](uint64_t, chat::chat_message& msg, sockaddr_in& from) {
+            msg = chat::broadcast_msg("u0", BENCH_MESSAGE);
+            from = user_address(0);
+        }, none));
+
+    std::string dm_text = user_name(users - 1) + ":" + BENCH_MESSAGE;
+    report("directmessage", users, 0, measure(s, min_ns,
+        [&](uint64_t, chat::chat_message& msg, sockaddr_in& from) {
+            msg = chat::dm_msg("u0", dm_text);
+            from = user_address(0);
+        }, none));
+
+    report("list", users, 0, measure(s, min_ns,
+        [&](uint64_t, chat::chat_message& msg, sockaddr_in& from) {
+            msg = chat::list_msg();
+            from = user_address(0);
+        }, none));
+
+    // an online user outside every group, for the membership benchmarks
+    add_user(s.users_, "extra", user_address(users + 1));
+    const std::vector<std::string> extra{"extra"};
+
+    // groups of members spread over the population, created by their last member
+    for (size_t group: {2, 16, 128, 10000}) {
+        if (group > users) {
+            break;
+        }
+        std::vector<std::string> members;
+        for (size_t i = 0; i < group; i++) {
+            members.push_back(user_name(i * (users / group)));
+        }
+        const sockaddr_in creator = user_address((group - 1) * (users / group));
+
+        // only groups that fit in a single CREATEGROUP
+        size_t next = 0;
+        chat::creategroup_msg("", members, &next);
+        if (next == members.size()) {
+            report("creategroup", users, group, measure(s, min_ns,
+                [&](uint64_t op, chat::chat_message& msg, sockaddr_in& from) {
+                    msg = chat::creategroup_msg(
+                        "c" + std::to_string(users) + "_" + std::to_string(group) + "_" + std::to_string(op), members);
+                    from = creator;
+                }, none));
+        }
+
+        // larger groups are streamed in with GROUP_ADD
+        std::string groupname = "m" + std::to_string(users) + "_" + std::to_string(group);
+        deliver(s, chat::creategroup_msg(groupname, members, &next), creator);
+        while (next < members.size()) {
+            deliver(s, chat::group_members_msg(chat::GROUP_ADD, groupname, members, next, &next), creator);
+        }
+
+        report("messagegroup", users, group, measure(s, min_ns,
+            [&](uint64_t, chat::chat_message& msg, sockaddr_in& from) {
+                msg = chat::messagegroup_msg(groupname, BENCH_MESSAGE);
+                from = creator;
+            }, none));
+
+        report("groupadd", users, group, measure(s, min_ns,
+            [&](uint64_t, chat::chat_message& msg, sockaddr_in& from) {
+                msg = chat::group_members_msg(chat::GROUP_ADD, groupname, extra);
+                from = creator;
+            },
+            [&](uint64_t, const chat::chat_message&, const sockaddr_in&) {
+                deliver(s, chat::group_members_msg(chat::GROUP_REMOVE, groupname, extra), creator);
+            }));
+
+        report("groupremove", users, group, measure(s, min_ns,
+            [&](uint64_t, chat::chat_message& msg, sockaddr_in& from) {
+                deliver(s, chat::group_members_msg(chat::GROUP_ADD, groupname, extra), creator);
+                msg = chat::group_members_msg(chat::GROUP_REMOVE, groupname, extra);
+                from = creator;
+            }, none));
+
+        report("groupinfo", users, group, measure(s, min_ns,
+            [&](uint64_t, chat::chat_message& msg, sockaddr_in& from) {
+                msg = chat::group_info_msg(groupname);
+                from = creator;
+            }, none));
+    }
+
+    // every user narrows its presence interest to one other, the first also to the newcomer
+    for (size_t i = 0; i < users; i++) {
+        std::vector<std::string> interests{user_name((i + 1) % users)};
+        if (i == 0) {
+            interests.push_back("newcomer");
+        }
+        deliver(s, chat::presence_msg(user_name(i), interests), user_address(i));
+    }
+    deliver(s, chat::presence_msg("extra", {}), user_address(users + 1));
+
+    report("join/interest", users, 0, measure(s, min_ns,
+        [&](uint64_t, chat::chat_message& msg, sockaddr_in& from) {
+            msg = chat::join_msg("newcomer");
+            from = newcomer;
+        },
+        [&](uint64_t, const chat::chat_message&, const sockaddr_in&) {
+            deliver(s, chat::leave_msg(), newcomer);
+        }));
+
+    report("leave/interest", users, 0, measure(s, min_ns,
+        [&](uint64_t, chat::chat_message& msg, sockaddr_in& from) {
+            deliver(s, chat::join_msg("newcomer"), newcomer);
+            msg = chat::leave_msg();
+            from = newcomer;
+        }, none));
+
+    depopulate(s.users_);
+}
+
+/**
+ * @brief time TELEMETRY through handle_packet, for batches of samples, with an aggregate or raw subscriber
+ * @param min_ns time each benchmark runs for
+*/
+void bench_telemetry(uint64_t min_ns) {
+    bench_server s;
+    populate(s.users_, 2);
+    auto none = [](uint64_t, const chat::chat_message&, const sockaddr_in&) {};
+
+    printf("\n%-14s %8s %8s %14s %14s %10s\n", "telemetry", "samples", "ops", "ns/op", "ns/sample", "sends/op");
+    for (const char * mode: {"unsubscribed", "", TELEMETRY_RAW}) {
+        if (mode[0] != 'u') {
+            deliver(s, chat::telemetry_msg(chat::TELEMETRY_SUB, "sensor", mode), user_address(1));
+        }
+        for (size_t batch: {1, 16, 64, 128}) {
+            // eighths, so every sample is a short exact decimal
+            std::string samples;
+            for (size_t i = 0; i < batch; i++) {
+                chat::append_sample(samples, (double)(i % 1000) / 8);
+            }
+            bench_result r = measure(s, min_ns,
+                [&](uint64_t, chat::chat_message& msg, sockaddr_in& from) {
+                    msg = chat::telemetry_msg(chat::TELEMETRY, "sensor", samples);
+                    from = user_address(0);
+                }, none);
+            printf("%-14s %8zu %8llu %14.0f %14.1f %10.1f\n",
+                mode[0] == '\0' ? "aggregate" : mode, batch, (unsigned long long)r.ops_,
+                (double)r.ns_ / r.ops_, (double)r.ns_ / r.ops_ / batch, (double)r.sends_ / r.ops_);
+            fflush(stdout);
+        }
+    }
+    depopulate(s.users_);
+}
+
+/**
+ * @brief time a scanning kernel over one field
+ * @return ns per call
+*/
+template <typename Kernel>
+double time_kernel(uint64_t min_ns, Kernel kernel) {
+    // results are summed into a volatile so the calls are not optimised away
+    volatile size_t sink = 0;
+    uint64_t calls = 0;
+    uint64_t start_ns = chat::monotonic_ns();
+    uint64_t elapsed_ns = 0;
+    do {
+        for (int i = 0; i < 1000; i++) {
+            sink = sink + kernel();
+        }
+        calls += 1000;
+        elapsed_ns = chat::monotonic_ns() - start_ns;
+    } while (elapsed_ns < min_ns);
+    return (double)elapsed_ns / calls;
+}
+
+/**
+ * @brief time the field scanning kernels used to parse every packet, for a range of field lengths
+ * @param min_ns time each kernel runs for
+*/
+void bench_scan(uint64_t min_ns) {
+    printf("\n%-14s %8s %14s   (scan width %d bytes)\n", "kernel", "bytes", "ns/op", SCAN_WIDTH);
+    chat::chat_message msg{chat::LIST, '\0', '\0'};
+    for (size_t length: {16, 64, 256, MAX_MESSAGE_LENGTH - 1}) {
+        // a LIST field, usernames separated by ':'
+        for (size_t i = 0; i < length; i++) {
+            msg.message_[i] = i % 6 == 5 ? ':' : 'a' + i % 6;
+        }
+        msg.message_[length] = '\0';
+        std::string_view field = chat::field_view(msg.message_, MAX_MESSAGE_LENGTH);
+        std::vector<std::string_view> fields;
+        fields.reserve(MAX_MESSAGE_LENGTH);
+
+        printf("%-14s %8zu %14.1f\n", "field_length", length, time_kernel(min_ns, [&]() {
+            return chat::field_length(msg.message_, MAX_MESSAGE_LENGTH);
+        }));
+        printf("%-14s %8zu %14.1f\n", "valid_utf8", length, time_kernel(min_ns, [&]() {
+            return (size_t)chat::valid_utf8(field);
+        }));
+        printf("%-14s %8zu %14.1f\n", "split", length, time_kernel(min_ns, [&]() {
+            fields.clear();
+            chat::split(field, ':', fields);
+            return fields.size();
+        }));
+    }
+}
+
+/**
+ * @brief usage message for benchmark application
+*/
+void usage(const char * name) {
+    printf("USAGE: %s [-n <largest population>] [-t <ms per benchmark>]\n", name);
+}
+
+/**
+ * @brief entry point for handler microbenchmarks
+ *
+ * Every handler is driven in process, through an egress sending inline
+ * to a memory_transport, against populations of 1 to 100000 users, then
+ * telemetry ingest per sample.
+*/
+int main(int argc, char ** argv) {
+    size_t max_users = 100000;
+    uint64_t time_ms = BENCH_TIME_MS;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:t:")) != -1) {
+        switch (opt) {
+            case 'n': {
+                max_users = strtoul(optarg, nullptr, 10);
+                break;
+            }
+            case 't': {
+                time_ms = strtoull(optarg, nullptr, 10);
+                break;
+            }
+            default: {
+                usage(argv[0]);
+                return 0;
+            }
+        }
+    }
+
+    printf("%-14s %8s %6s %8s %14s %10s %10s\n",
+        "handler", "users", "group", "ops", "ns/op", "allocs/op", "sends/op");
+    for (size_t users = 1; users <= max_users; users *= 10) {
+        bench_population(users, time_ms * 1000000ull);
+    }
+    bench_telemetry(time_ms * 1000000ull);
+    bench_scan(time_ms * 1000000ull);
+
+    return 0;
+}
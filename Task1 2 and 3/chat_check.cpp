@@ -0,0 +1,415 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <atomic>
+#include <memory>
+#include <new>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <arpa/inet.h>
+
+#include "chat_egress.hpp"
+#include "chat_ex.hpp"
+#include "chat_gateway.hpp"
+#include "chat_lanes.hpp"
+#include "chat_ring.hpp"
+#include "chat_scan.hpp"
+#include "chat_server.hpp"
+#include "chat_transport.hpp"
+
+// Buffers of the ingress channel the lane checks route from
+#define CHECK_RING_CAPACITY 256
+// Chat a flooding sender has waiting in the bulk lane while the lane checks run
+#define CHECK_FLOOD_PACKETS 200
+// Chat the bulk lane holds in the shedding check, before some is shed
+#define CHECK_SHED_LIMIT 64
+// Users online, and members of the group, in the allocation check
+#define CHECK_ALLOC_USERS 16
+// Packets of each type counted in the allocation check, after as many to warm up
+#define CHECK_ALLOC_PACKETS 100
+// Users behind the gateway in the coalescing check, whose names outgrow one datagram
+#define CHECK_GATEWAY_SUBS 100
+
+/**
+ * @brief number of global heap allocations made by this process
+*/
+std::atomic<uint64_t> heap_allocations{0};
+
+void * operator new(size_t size) {
+    heap_allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void * ptr = malloc(size > 0 ? size : 1)) {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void * ptr) noexcept {
+    free(ptr);
+}
+
+void operator delete(void * ptr, size_t) noexcept {
+    free(ptr);
+}
+
+/**
+ * @brief everything the checks drive handle_packet with, every datagram sent is recorded
+*/
+struct check_server {
+    chat::memory_transport sock_;
+    chat::egress out_{sock_, 0};
+    online_users users_;
+
+    /**
+     * @param record whether to record the datagrams sent, or only count them
+    */
+    explicit check_server(bool record = true) : sock_{record} {
+    }
+
+    /**
+     * @brief hand a single packet to the server
+    */
+    void deliver(const chat::chat_message& msg, sockaddr_in from) {
+        bool exit_loop = false;
+        handle_packet(users_, (const char*)&msg, sizeof(msg), from, out_, exit_loop);
+    }
+
+    /**
+     * @brief position among the datagrams sent of the first one of a type to an address, -1 if none was sent
+     * @param to recipient
+     * @param type of message
+     * @param text the message must contain, "" for any
+    */
+    int sent(const sockaddr_in& to, chat::chat_type type, std::string_view text = "") const {
+        const auto& sent = sock_.sent();
+        for (size_t i = 0; i < sent.size(); i++) {
+            const chat::memory_transport::datagram& d = sent[i];
+            if (d.address_.sin_addr.s_addr != to.sin_addr.s_addr || d.address_.sin_port != to.sin_port ||
+                d.data_.length() < sizeof(chat::chat_message)) {
+                continue;
+            }
+            const chat::chat_message * msg = reinterpret_cast<const chat::chat_message*>(d.data_.data());
+            std::string_view message = chat::field_view(msg->message_, MAX_MESSAGE_LENGTH);
+            if (msg->type_ == type && message.find(text) != std::string_view::npos) {
+                return (int)i;
+            }
+        }
+        return -1;
+    }
+};
+
+/**
+ * @brief address of check user i
+*/
+sockaddr_in check_address(uint32_t i) {
+    sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(0x0a010000u + i);
+    address.sin_port = htons(20000);
+    return address;
+}
+
+/**
+ * @brief report a check
+ * @return passed
+*/
+bool check(bool passed, const char * what) {
+    printf("%s: %s\n", passed ? "PASS" : "FAIL", what);
+    return passed;
+}
+
+/**
+ * @brief a packet waiting in the lanes, as the ingress thread leaves it
+*/
+struct lane_packet {
+    chat::chat_message message_;
+    sockaddr_in client_address_;
+    uint64_t order_;
+};
+
+/**
+ * @brief a control packet is routed after the chat its sender sent before it, and before the chat sent after it
+ *
+ * Another sender's chat fills the bulk lane of the channel first, so the
+ * sender's chat is still in the channel, not yet queued, when its LEAVE is
+ * taken.
+*/
+bool check_lane_order() {
+    check_server s;
+    const sockaddr_in leaver = check_address(1);
+    const sockaddr_in listener = check_address(2);
+    const sockaddr_in flooder = check_address(3);
+    s.deliver(chat::join_msg("lane_leaver"), leaver);
+    s.deliver(chat::join_msg("lane_listener"), listener);
+    s.deliver(chat::join_msg("lane_flooder"), flooder);
+    s.sock_.clear();
+
+    auto channel = std::make_unique<chat::receive_channel<CHECK_RING_CAPACITY, lane_packet, chat::LANE_COUNT>>(
+        chat::OVERFLOW_BLOCK);
+    chat::fair_queue bulk{CHECK_RING_CAPACITY};
+    uint64_t received = 0;
+    auto receive = [&](const chat::chat_message& msg, const sockaddr_in& from) {
+        uint32_t slot = channel->acquire_wait();
+        (*channel)[slot] = lane_packet{msg, from, received++};
+        channel->send(slot, chat::lane_of(msg.type_));
+    };
+
+    for (int i = 0; i < CHECK_FLOOD_PACKETS; i++) {
+        receive(chat::broadcast_msg("lane_flooder", "flood"), flooder);
+    }
+    receive(chat::broadcast_msg("lane_leaver", "before leave"), leaver);
+    receive(chat::leave_msg(), leaver);
+    receive(chat::broadcast_msg("lane_leaver", "after leave"), leaver);
+
+    auto route = [&](uint32_t slot) {
+        s.deliver((*channel)[slot].message_, (*channel)[slot].client_address_);
+        channel->release(slot);
+    };
+    auto sender = [&](uint32_t slot) {
+        const sockaddr_in& address = (*channel)[slot].client_address_;
+        return ((uint64_t)address.sin_addr.s_addr << 16) | address.sin_port;
+    };
+    auto weight = [](uint32_t) { return 1; };
+    auto order = [&](uint32_t slot) { return (*channel)[slot].order_; };
+    uint32_t slot = 0;
+    while (chat::next_packet(*channel, bulk, sender, weight, order, route, slot)) {
+        route(slot);
+    }
+
+    int before = s.sent(listener, chat::BROADCAST, "before leave");
+    int lack = s.sent(leaver, chat::LACK);
+    int after = s.sent(listener, chat::BROADCAST, "after leave");
+    int flood = s.sent(listener, chat::BROADCAST, "flood");
+    s.deliver(chat::leave_msg(), listener);
+    s.deliver(chat::leave_msg(), flooder);
+    return check(before >= 0 && lack > before, "chat sent before a LEAVE is routed before it") &
+        check(after > lack, "chat sent after a LEAVE is routed after it") &
+        check(lack >= 0 && flood > lack, "a LEAVE is routed ahead of other senders' chat");
+}
+
+/**
+ * @brief a flooding sender has its own chat shed, not that of a sender keeping within its share
+*/
+bool check_lane_shedding() {
+    chat::fair_queue bulk{CHECK_SHED_LIMIT};
+    const uint64_t flooder = 1;
+    const uint64_t talker = 2;
+    uint64_t flooder_shed = 0;
+    uint64_t talker_shed = 0;
+    uint32_t shed;
+    // slots are numbered so that the talker's are odd
+    for (uint32_t i = 0; i < CHECK_FLOOD_PACKETS; i++) {
+        if (bulk.push(flooder, 2 * i, []() { return 1; }, shed)) {
+            (shed % 2 ? talker_shed : flooder_shed)++;
+        }
+        if (i % 10 == 0 && bulk.push(talker, 2 * i + 1, []() { return 1; }, shed)) {
+            (shed % 2 ? talker_shed : flooder_shed)++;
+        }
+    }
+    bool passed = check(bulk.size() == CHECK_SHED_LIMIT && flooder_shed > 0 && talker_shed == 0,
+        "a flooding sender has its own chat shed");
+
+    size_t released = 0;
+    bulk.clear([&](uint32_t) { released++; });
+    return passed & check(released == CHECK_SHED_LIMIT && bulk.empty(), "clearing the bulk lane hands back every packet");
+}
+
+/**
+ * @brief the memory readout is only sent to a user online
+*/
+bool check_stats_online() {
+    check_server s;
+    const sockaddr_in user = check_address(10);
+    const sockaddr_in stranger = check_address(11);
+    s.deliver(chat::join_msg("stats_user"), user);
+    s.sock_.clear();
+
+    s.deliver(chat::stats_msg(), stranger);
+    s.deliver(chat::stats_msg(), user);
+    bool passed = check(s.sent(stranger, chat::STATS) < 0 && s.sent(stranger, chat::ERROR) >= 0,
+        "STATS from an address not online is refused") &
+        check(s.sent(user, chat::STATS, "users=") >= 0, "STATS from a user online is answered");
+    s.deliver(chat::leave_msg(), user);
+    return passed;
+}
+
+/**
+ * @brief only a member of a group may add to it, remove from it, or list it
+*/
+bool check_group_members_only() {
+    check_server s;
+    const sockaddr_in creator = check_address(20);
+    const sockaddr_in member = check_address(21);
+    const sockaddr_in outsider = check_address(22);
+    s.deliver(chat::join_msg("group_creator"), creator);
+    s.deliver(chat::join_msg("group_member"), member);
+    s.deliver(chat::join_msg("group_outsider"), outsider);
+    s.deliver(chat::creategroup_msg("check_group", {"group_member"}), creator);
+    s.sock_.clear();
+
+    s.deliver(chat::group_members_msg(chat::GROUP_ADD, "check_group", {"group_outsider"}), outsider);
+    s.deliver(chat::group_members_msg(chat::GROUP_REMOVE, "check_group", {"group_member"}), outsider);
+    s.deliver(chat::group_info_msg("check_group"), outsider);
+    int refused = s.sent(outsider, chat::ERROR);
+    bool listed = s.sent(outsider, chat::GROUP_INFO) >= 0;
+    s.deliver(chat::messagegroup_msg("check_group", "members only"), creator);
+    bool passed = check(refused >= 0 && s.sent(outsider, chat::MESSAGEGROUP) < 0,
+        "GROUP_ADD from a non-member is refused") &
+        check(s.sent(member, chat::MESSAGEGROUP, "members only") >= 0, "GROUP_REMOVE from a non-member is refused") &
+        check(!listed, "GROUP_INFO from a non-member is refused");
+    s.deliver(chat::group_info_msg("check_group"), member);
+    passed &= check(s.sent(member, chat::GROUP_INFO, "group_creator") >= 0, "GROUP_INFO from a member is answered");
+
+    s.deliver(chat::group_members_msg(chat::GROUP_ADD, "check_group", {"group_outsider"}), member);
+    s.deliver(chat::messagegroup_msg("check_group", "welcome"), creator);
+    passed &= check(s.sent(outsider, chat::MESSAGEGROUP, "welcome") >= 0, "GROUP_ADD from a member is made");
+
+    s.deliver(chat::leave_msg(), creator);
+    s.deliver(chat::leave_msg(), member);
+    s.deliver(chat::leave_msg(), outsider);
+    return passed;
+}
+
+/**
+ * @brief a username filling its field, with no NUL, is refused rather than copied on
+*/
+bool check_unterminated_username() {
+    check_server s;
+    const sockaddr_in sender = check_address(30);
+    const sockaddr_in listener = check_address(31);
+    s.deliver(chat::join_msg("name_listener"), listener);
+    s.sock_.clear();
+
+    chat::chat_message broadcast = chat::broadcast_msg("", "unterminated");
+    memset(broadcast.username_, 'x', MAX_USERNAME_LENGTH);
+    s.deliver(broadcast, sender);
+    bool passed = check(s.sent(sender, chat::ERROR) >= 0 && s.sent(listener, chat::BROADCAST) < 0,
+        "a username with no NUL is refused");
+    s.deliver(chat::leave_msg(), listener);
+    return passed;
+}
+
+/**
+ * @brief chat is routed without touching the heap, once the server has warmed up
+ *
+ * Sends are only counted, as recording them allocates.
+*/
+bool check_steady_state_allocations() {
+    check_server s{false};
+    std::vector<std::string> members;
+    for (uint32_t i = 0; i < CHECK_ALLOC_USERS; i++) {
+        std::string username = "alloc_" + std::to_string(i);
+        s.deliver(chat::join_msg(username), check_address(40 + i));
+        members.push_back(username);
+    }
+    const sockaddr_in sender = check_address(40);
+    s.deliver(chat::creategroup_msg("alloc_group", members), sender);
+
+    const chat::chat_message packets[] = {
+        chat::broadcast_msg("alloc_0", "steady state"),
+        chat::dm_msg("alloc_1", "steady state"),
+        chat::list_msg(),
+        chat::messagegroup_msg("alloc_group", "steady state"),
+    };
+    const char * names[] = {"BROADCAST", "DIRECTMESSAGE", "LIST", "MESSAGEGROUP"};
+    bool passed = true;
+    for (size_t p = 0; p < sizeof(packets) / sizeof(packets[0]); p++) {
+        for (int i = 0; i < CHECK_ALLOC_PACKETS; i++) {
+            s.deliver(packets[p], sender);
+        }
+        uint64_t sent = s.sock_.stats().sent_;
+        uint64_t allocations = heap_allocations.load(std::memory_order_relaxed);
+        for (int i = 0; i < CHECK_ALLOC_PACKETS; i++) {
+            s.deliver(packets[p], sender);
+        }
+        allocations = heap_allocations.load(std::memory_order_relaxed) - allocations;
+        std::string what = std::string(names[p]) + " makes no heap allocation";
+        passed &= check(allocations == 0 && s.sock_.stats().sent_ > sent, what.c_str());
+    }
+
+    for (uint32_t i = 0; i < CHECK_ALLOC_USERS; i++) {
+        s.deliver(chat::leave_msg(), check_address(40 + i));
+    }
+    return passed;
+}
+
+/**
+ * @brief a message for users behind a gateway goes out as few datagrams as their names fit in, and without a heap
+ * allocation once warmed up
+*/
+bool check_gateway_coalescing() {
+    chat::gateway_table table;
+    const sockaddr_in gateway = check_address(60);
+    std::vector<sockaddr_in> subs;
+    std::string names;
+    for (uint32_t i = 0; i < CHECK_GATEWAY_SUBS; i++) {
+        std::string username = "coalesced_user_with_a_rather_long_name_" + std::to_string(i);
+        subs.push_back(table.attach("check_gateway", &gateway, username));
+        names += (i > 0 ? ":" : "") + username;
+    }
+    const chat::chat_message msg = chat::broadcast_msg("coalesced_sender", "to everyone behind the gateway");
+
+    chat::memory_transport recorded{true};
+    chat::egress recording{recorded, 0};
+    recording.set_gateways(&table);
+    {
+        chat::outgoing encoded = recording.encode(msg);
+        for (const sockaddr_in& sub: subs) {
+            recording.send(encoded, sub);
+        }
+    }
+    recording.flush();
+    std::string received;
+    bool to_gateway = true;
+    for (const chat::memory_transport::datagram& d: recorded.sent()) {
+        std::string_view recipients;
+        to_gateway &= d.address_.sin_addr.s_addr == gateway.sin_addr.s_addr && d.address_.sin_port == gateway.sin_port &&
+            chat::read_frame(d.data_.data(), (int)d.data_.length(), recipients);
+        received += (received.empty() ? "" : ":") + std::string{recipients};
+    }
+    size_t datagrams = (names.length() + GATEWAY_FRAME_NAMES - 1) / GATEWAY_FRAME_NAMES;
+    bool passed = check(to_gateway && recorded.sent().size() == datagrams && received == names,
+        "users behind a gateway are sent as few datagrams as their names fit in");
+
+    chat::memory_transport counted;
+    chat::egress counting{counted, 0};
+    counting.set_gateways(&table);
+    uint64_t allocations = 0;
+    for (int i = 0; i < 2 * CHECK_ALLOC_PACKETS; i++) {
+        uint64_t before = heap_allocations.load(std::memory_order_relaxed);
+        {
+            chat::outgoing encoded = counting.encode(msg);
+            for (const sockaddr_in& sub: subs) {
+                counting.send(encoded, sub);
+            }
+        }
+        counting.flush();
+        // the first messages warm up the egress
+        if (i >= CHECK_ALLOC_PACKETS) {
+            allocations += heap_allocations.load(std::memory_order_relaxed) - before;
+        }
+    }
+    return passed & check(allocations == 0 && counted.stats().sent_ > 0, "coalescing makes no heap allocation");
+}
+
+/**
+ * @brief entry point for the server checks
+ *
+ * Scenarios are driven in process through the handlers, and what the
+ * server sends back is checked.
+ *
+ * @return 0 if every check passed, 1 otherwise
+*/
+int main(int, char **) {
+    server_config config;
+    configure_state(config);
+
+    bool passed = check_lane_order() & check_lane_shedding() & check_stats_online() & check_group_members_only() &
+        check_unterminated_username() & check_steady_state_allocations() & check_gateway_coalescing();
+
+    printf("%s\n", passed ? "all checks passed" : "some checks failed");
+    return passed ? 0 : 1;
+}
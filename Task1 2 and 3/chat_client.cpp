@@ -1,352 +1,552 @@
-
-#include <arpa/inet.h>
-#include <stdio.h>
+#include <fcntl.h>
 #include <string.h>
 #include <unistd.h>
-#include <cstdlib>
+#include <sys/epoll.h>
 
-#include <atomic>
-#include <iostream>
+#include <arpa/inet.h>
+
+#include <algorithm>
+#include <utility>
+#include <vector>
 
 // IOT socket api
 #include <iot/socket.hpp>
 
-#include "chat_ex.hpp"
-#include <gui.hpp>
-#include <colors.hpp>
-#include <util.hpp>
+#include "chat_client.hpp"
+#include "chat_scan.hpp"
 
-namespace {
-std::atomic<bool> sent_leave{false};
-};
+namespace chat {
 
-//---------------------------------------------------------------------------------------
+client::client(std::string username, std::unique_ptr<transport> sock) :
+    username_{std::move(username)}, sock_{std::move(sock)} {
+    memset(&address_, 0, sizeof(address_));
+    memset(&server_, 0, sizeof(server_));
+}
 
-/**
- * @brief Convert a string command from the UI into a chat command.
- *  NOTE: It is only a subset of all command types.
- * 
- * @param cmd command to convert
- * @return command type ID representing the passed in command
-*/
-chat::chat_type to_type(std::string cmd) {
-    switch(string_to_int(cmd.c_str())) {
-    case string_to_int("join"): return chat::JOIN;
-    case string_to_int("bc"): return chat::BROADCAST;
-    case string_to_int("creategroup"): return chat::CREATEGROUP;
-    case string_to_int("msggroup"): return chat::MESSAGEGROUP;
-    case string_to_int("dm"): return chat::DIRECTMESSAGE;
-    case string_to_int("list"): return chat::LIST;
-    case string_to_int("leave"): return chat::LEAVE;
-    case string_to_int("exit"): return chat::EXIT;
-    default:
-        return chat::UNKNOWN; 
-    }
-
-  return chat::UNKNOWN; // unknowntype
+client::~client() {
+    stop_.store(true);
+    if (server_thread_.joinable()) {
+        // wake the receiver from recvfrom, it ignores the short datagram
+        if (state() != CLIENT_CLOSED && bound_) {
+            sock_->sendto("", 1, address_);
+        }
+        server_thread_.join();
+    }
+    if (group_thread_.joinable()) {
+        group_thread_.join();
+    }
 }
 
-//----------------------------------------------------------------------------------------
-
-std::pair<std::thread, Channel<chat::chat_message>> make_receiver(uwe::socket* sock) {
-    auto [tx, rx] = make_channel<chat::chat_message>();
-  
-    std::thread receiver_thread([tx = std::move(tx), sock]() mutable {
-        try {
-            for (;;) {
-                chat::chat_message msg;
-                sockaddr_in sender_address;
-                size_t sender_address_len = sizeof(sender_address);
-
-                // receive message from server
-                int len = sock->recvfrom(
-                    &msg, // Direct reference to msg as void*
-                    sizeof(msg), // length of message
-                    0, // flags, only 0 supported
-                    (sockaddr*)&sender_address, // source address
-                    &sender_address_len // length of source address, adjusted to size_t*
-                );
-
-                if (len == sizeof(chat::chat_message)) {
-                    // Message received successfully, send it over channel (tx) to main UI thread
-                    tx.send(msg);
-
-                    // exit receiver thread if necessary
-                    if (msg.type_ == chat::EXIT || (msg.type_ == chat::LACK && sent_leave.load())) {
-                        break;
-                    }
-                } else {
-                    // Handle error or unexpected packet size
-                    DEBUG("Error receiving packet or unexpected packet size\n");
-                }
-            }
+bool client::bind(const sockaddr_in& address) {
+    address_ = address;
+    bound_ = sock_->bind(address);
+    return bound_;
+}
+
+bool client::connect(const sockaddr_in& server, client_reactor * reactor) {
+    server_ = server;
+    reactor_ = reactor;
+
+    // without a handler, messages wait in pooled channels until polled
+    if (!handler_) {
+        unicast_.channel_ = std::make_unique<client_channel>(overflow_);
+        if (use_multicast_) {
+            group_.channel_ = std::make_unique<client_channel>(overflow_);
         }
-        catch(...) {
-            DEBUG("Caught exception in receiver thread\n");
+    }
+
+    state_.store(CLIENT_JOINING, std::memory_order_release);
+    if (reactor_ != nullptr) {
+        if (!reactor_->add(sock_->fd(), this, false)) {
+            DEBUG("Transport cannot be used with a reactor\n");
+            state_.store(CLIENT_CLOSED, std::memory_order_release);
+            return false;
         }
-    }); // Note the change here: removed incorrect argument
+    }
+    else {
+        server_thread_ = std::thread([this]() { run_server(); });
+    }
 
-    return {std::move(receiver_thread), std::move(rx)};
+    if (resuming_) {
+        send(resume_msg(username_, token_));
+        DEBUG("Resume message (%s) sent, waiting for JACK\n", username_.c_str());
+    }
+    else {
+        send(join_msg(username_));
+        DEBUG("Join message (%s) sent, waiting for JACK\n", username_.c_str());
+    }
+    return true;
 }
-int main(int argc, char ** argv) {
-    if (argc != 4) {
-        printf("USAGE: %s <ipaddress> <port> <username>\n", argv[0]);
-        exit(0);
+
+void client::keepalive() {
+    if (state() != CLIENT_ONLINE || idle_ms_ == 0) {
+        return;
+    }
+    uint64_t now_ns = monotonic_ns();
+    if (now_ns - keepalive_ns_ < std::min<uint64_t>(CLIENT_KEEPALIVE_MS, idle_ms_ / 2) * 1000000ull) {
+        return;
     }
+    keepalive_ns_ = now_ns;
+    send(resume_msg(username_, token_));
+}
 
-    std::string username{argv[3]};
-    // Set client IP address
-    uwe::set_ipaddr(argv[1]);
+void client::send(const chat_message& msg) {
+    if (!latency_) {
+        sock_->sendto(&msg, sizeof(chat_message), server_);
+        return;
+    }
 
-    const char* server_name = "192.168.1.27";
-	
-	const int server_port = SERVER_PORT;
+    // stamped in the server's clock once the offset is known, our own until then
+    latency_trailer trailer;
+    memset(&trailer, 0, sizeof(trailer));
+    trailer.magic_ = LATENCY_MAGIC;
+    trailer.stamps_[STAMP_CLIENT_SEND] = monotonic_ns();
+    if (offset_known_.load()) {
+        trailer.stamps_[STAMP_CLIENT_SEND] += offset_.load();
+        trailer.flags_ = LATENCY_SERVER_TIME;
+    }
 
-    sockaddr_in server_address;
-	memset(&server_address, 0, sizeof(server_address));
-	server_address.sin_family = AF_INET;
+    char datagram[TRACED_MESSAGE_LENGTH];
+    memcpy(datagram, &msg, sizeof(chat_message));
+    memcpy(datagram + sizeof(chat_message), &trailer, sizeof(trailer));
+    sock_->sendto(datagram, sizeof(datagram), server_);
+}
 
-	// creates binary representation of server name and stores it as sin_addr
-	inet_pton(AF_INET, server_name, &server_address.sin_addr);
+void client::publish(std::string_view stream, const std::vector<double>& samples) {
+    std::string text;
+    for (double value: samples) {
+        if (!append_sample(text, value)) {
+            send(telemetry_msg(TELEMETRY, stream, text));
+            text.clear();
+            append_sample(text, value);
+        }
+    }
+    if (!text.empty()) {
+        send(telemetry_msg(TELEMETRY, stream, text));
+    }
+}
 
-	// htons: port in network order format
-	server_address.sin_port = htons(server_port);
+void client::send_as(std::string_view username, const chat_message& msg) {
+    char datagram[GATEWAY_MESSAGE_LENGTH];
+    write_sub_message(datagram, msg, username);
+    sock_->sendto(datagram, sizeof(datagram), server_);
+}
 
-	// open socket
-	uwe::socket sock{AF_INET, SOCK_DGRAM, 0};
+void client::displayed() {
+    if (displaying_.empty()) {
+        return;
+    }
+    uint64_t now_ns = monotonic_ns() + offset_.load();
+    for (auto& message: displaying_) {
+        message.second.stamps_[STAMP_CLIENT_DISPLAY] = now_ns;
+        latency_->record(message.first, message.second);
+    }
+    displaying_.clear();
+}
 
-	// port for client
-	const int client_port = std::atoi(argv[2]);
+void client::trace_received(received_message& msg, bool record) {
+    char * packet = reinterpret_cast<char*>(&msg);
+    latency_trailer trailer;
+    if (!read_trailer(packet, msg.length_, trailer)) {
+        return;
+    }
+    uint64_t now_ns = monotonic_ns();
+
+    if (msg.message_.type_ == JACK && state() == CLIENT_JOINING) {
+        // our JOIN went out in our clock, so the JACK gives one round trip to estimate the offset from
+        int64_t to_server = (int64_t)(trailer.stamps_[STAMP_SERVER_RECV] - trailer.stamps_[STAMP_CLIENT_SEND]);
+        int64_t from_server = (int64_t)(trailer.stamps_[STAMP_SERVER_SEND] - now_ns);
+        offset_.store((to_server + from_server) / 2);
+        offset_known_.store(true);
+        DEBUG("Clock offset to server %lld ns, round trip %llu ns\n", (long long)offset_.load(),
+            (unsigned long long)((now_ns - trailer.stamps_[STAMP_CLIENT_SEND]) -
+            (trailer.stamps_[STAMP_SERVER_SEND] - trailer.stamps_[STAMP_SERVER_RECV])));
+    }
 
-	// socket address used for the client
-	struct sockaddr_in client_address;
-	memset(&client_address, 0, sizeof(client_address));
-	client_address.sin_family = AF_INET;
-	client_address.sin_port = htons(client_port);
-	inet_pton(AF_INET, uwe::get_ipaddr().c_str(), &client_address.sin_addr);
+    trailer.stamps_[STAMP_CLIENT_RECV] = now_ns + offset_.load();
+    if (record) {
+        latency_->record(msg.message_.type_, trailer);
+    }
+    else {
+        write_stamp(packet, STAMP_CLIENT_RECV, trailer.stamps_[STAMP_CLIENT_RECV]);
+    }
+}
 
-	sock.bind((struct sockaddr *)&client_address, sizeof(client_address));
+void client::direct_message(std::string_view to, std::string_view message) {
+    if (!peer_to_peer_) {
+        relay_message(to, message);
+        return;
+    }
+
+    uint64_t now_ns = monotonic_ns();
+    std::unique_lock<std::mutex> lock{peers_lock_};
+    auto it = peers_.find(to);
+    if (it == peers_.end()) {
+        it = peers_.emplace(to, peer{}).first;
+    }
+    peer& p = it->second;
+
+    if (p.state_ == PEER_DIRECT && now_ns < p.expires_ns_) {
+        std::string_view safe_message = message.substr(0, MAX_MESSAGE_LENGTH - 1);
+        std::string tag = p.token_ + ':' + std::to_string(p.next_seq_);
+        chat_message msg = dm_msg(username_, safe_message);
+        memcpy(&msg.groupname_[0], tag.data(), std::min<size_t>(tag.length(), MAX_USERNAME_LENGTH - 1));
+        p.unacked_.push_back(unacked_dm{p.next_seq_++, now_ns, std::string{safe_message}});
+        sock_->sendto(&msg, sizeof(msg), p.address_);
+        return;
+    }
 
-    chat::chat_message msg = chat::join_msg(username);
+    // the token ran out, or it is time to try again
+    bool ask = (p.state_ == PEER_DIRECT || now_ns >= p.retry_ns_);
+    if (ask) {
+        p.state_ = PEER_PENDING;
+        p.retry_ns_ = now_ns + CLIENT_PEER_SETUP_MS * 1000000ull;
+    }
+    lock.unlock();
 
-    // send data
-	int len = sock.sendto(
-        reinterpret_cast<const char*>(&msg), sizeof(chat::chat_message), 0,
-        (sockaddr*)&server_address, sizeof(server_address));
-        
-    DEBUG("Join message (%s) sent, waiting for JACK\n", username.c_str());
-    // wait for JACK
-    sock.recvfrom(reinterpret_cast<char*>(&msg), sizeof(chat::chat_message), 0, nullptr, nullptr);
+    if (ask) {
+        send(peer_msg(username_, to));
+    }
+    relay_message(to, message);
+}
 
-    if (msg.type_ == chat::JACK) {
-        DEBUG("Received jack\n");
+void client::relay_message(std::string_view to, std::string_view message) {
+    std::string content;
+    content.reserve(to.length() + 1 + message.length());
+    content.append(to);
+    content.push_back(':');
+    content.append(message);
+    send(dm_msg(username_, content));
+}
 
-        // create GUI thread and communication channels
-        auto [gui_thread, gui_tx, gui_rx] = chat::make_gui();
-        auto [rec_thread, rec_rx] = make_receiver(&sock);
-
-        // going to need recv thread for messages from server
-
-        bool exit_loop = false;
-        for(;!exit_loop;) {
-            // check and see if any GUI messages to handle
-            if (!gui_rx.empty() && !sent_leave) {
-                auto result = gui_rx.recv();
-                if (result) {
-                    auto cmds = split(*result, ':');
-                    if (cmds.size() > 1) {
-                        chat::chat_type type = to_type(cmds[0]);
-                        switch(type) {
-                            case chat::EXIT: {
-                                DEBUG("Received Exit from GUI\n");
-                                chat::chat_message exit_msg = chat::exit_msg();
-                                sock.sendto(reinterpret_cast<const char*>(&exit_msg), sizeof(chat::chat_message), 0,
-                                            (sockaddr*)&server_address, sizeof(server_address));
-                                exit_loop = true;  // Exit the main loop, leading to application shutdown
-                                break;
-                            }
-                            case chat::LEAVE: {
-                                DEBUG("Received LEAVE from GUI\n");
-
-                                sent_leave = true;
-                                chat::chat_message leave_msg = chat::leave_msg();
-                                sock.sendto(reinterpret_cast<const char*>(&leave_msg), sizeof(chat::chat_message), 0, (sockaddr*)&server_address, sizeof(server_address));
-                                break;
-                            }
-                            case chat::LIST: { 
-                                DEBUG("Received LIST from GUI\n");
-                                // you need to fill in
-                                break;
-                            }
-                            case chat::DIRECTMESSAGE: {
-                                if (cmds.size() >= 3) {
-                                // Extract recipient username and actual message
-                                std::string recipient_username = cmds[1];
-                                std::string actual_message = cmds[2];
-                                for (size_t i = 3; i < cmds.size(); ++i) {
-                                    actual_message += ":" + cmds[i];
-                                }
-                                chat::chat_message dm_msg = chat::dm_msg(username, recipient_username + ":" + actual_message);
-                                sock.sendto(reinterpret_cast<const char*>(&dm_msg), sizeof(dm_msg), 0,
-                                            (sockaddr*)&server_address, sizeof(server_address));
-                                }
-                                break;
-                                }                        
-                            case chat::CREATEGROUP: {
-                                if (cmds.size() >= 2) {
-                                    std::string groupname = cmds[1];
-                                    std::vector<std::string> usernames;
-                                    for (size_t i = 2; i < cmds.size(); ++i) {
-                                        usernames.push_back(cmds[i]);
-                                    }
-                                    chat::chat_message group_msg = chat::creategroup_msg(groupname, usernames);
-                                    sock.sendto(reinterpret_cast<const char*>(&group_msg), sizeof(group_msg), 0,
-                                                (sockaddr*)&server_address, sizeof(server_address));
-                                }
-                                break;
-                            }
-                            case chat::MESSAGEGROUP: {
-                                    // Inside the main loop where commands from the GUI are processed
-                                    if (cmds.size() >= 3 && cmds[0] == "msggroup") {
-                                        std::string groupname = cmds[1];
-                                        std::string message = cmds[2];
-                                        for (size_t i = 3; i < cmds.size(); ++i) {
-                                            message += ":" + cmds[i]; // Assuming ':' is not used in group names
-                                        }
-                                        
-                                        chat::chat_message msg = chat::messagegroup_msg(groupname, message);
-                                        sock.sendto(reinterpret_cast<const char*>(&msg), sizeof(msg), 0,
-                                                    (sockaddr*)&server_address, sizeof(server_address));
-                                    }
-                                break;
-                            }
-
-                            default: {
-                                // the default case is that the command is a username for DM
-                                // <username> : message
-                                if (cmds.size() == 2) {
-                                    DEBUG("Received message from GUI\n");
-                                }
-                                break;
-                            }
-                        } 
-                    }
-                    else {
-                        // message to broadcast to everyone online
-                        chat::chat_message msg = chat::broadcast_msg(username, *result);
-                        // send data
-                        int len = sock.sendto(
-                            reinterpret_cast<const char*>(&msg), sizeof(chat::chat_message), 0,
-                            (sockaddr*)&server_address, sizeof(server_address));
-                    }
+void client::check_peers() {
+    std::vector<std::pair<std::string, std::string>> relay;
+    uint64_t now_ns = monotonic_ns();
+    {
+        std::lock_guard<std::mutex> lock{peers_lock_};
+        for (auto it = peers_.begin(); it != peers_.end();) {
+            peer& p = it->second;
+            if (!p.unacked_.empty() && now_ns - p.unacked_.front().sent_ns_ >= CLIENT_PEER_ACK_MS * 1000000ull) {
+                DEBUG("No ack from %s, relaying until the token expires\n", it->first.c_str());
+                for (unacked_dm& dm: p.unacked_) {
+                    relay.emplace_back(it->first, std::move(dm.message_));
                 }
+                p.unacked_.clear();
+                p.state_ = PEER_RELAY;
+                p.retry_ns_ = p.expires_ns_;
             }
-            //check to see if any messages received from the server
-            if (!rec_rx.empty() && !exit_loop) {
-                auto result = rec_rx.recv();
-                if (result) {
-                    switch ((*result).type_) {
-                        case chat::LEAVE: {
-                            chat::display_command cmd{chat::GUI_USER_REMOVE};
-                            cmd.text_ = std::string{(char*)(*result).username_};
-                            gui_tx.send(cmd);
-                            break;
-                        }
-                        case chat::EXIT: {
-                            DEBUG("Received EXIT\n");
-                            exit_loop = true;
-                            break;
-                        }
-                        case chat::LACK: {
-                            DEBUG("Received LACK\n");
-                            if (sent_leave) {
-                                exit_loop = true;
-                                break;
-                            }
-                        }
-                        case chat::BROADCAST: {
-                            std::string msg{(char*)(*result).username_};
-                            msg.append(": ");
-                            msg.append((char*)(*result).message_);
-                            chat::display_command cmd{chat::GUI_CONSOLE, msg};
-                            gui_tx.send(cmd);
-                            break;
-                        }
-                        case chat::DIRECTMESSAGE: {
-                             // The direct message content is in the format "<sender>:<message>"
-                            std::string sender(reinterpret_cast<char*>((*result).username_));
-                            std::string content = std::string(reinterpret_cast<char*>((*result).message_));
-                            
-                            // Construct a display message
-                            std::string display_message = "DM from " + sender + ": " + content;
-
-                            // Send a command to the GUI to display the direct message
-                            chat::display_command dm_cmd{chat::GUI_CONSOLE, display_message};
-                            gui_tx.send(dm_cmd);
-
-                            break;
-                        } case chat::MESSAGEGROUP: {
-                                if (result->type_ == chat::MESSAGEGROUP) {
-                                std::string groupname(reinterpret_cast<char*>(result->groupname_));
-                                std::string sender(reinterpret_cast<char*>(result->username_));
-                                std::string content(reinterpret_cast<char*>(result->message_));
-                                
-                                // Construct a display message indicating it's from a group
-                                std::string display_message = "Group [" + groupname + "] " + sender + ": " + content;
-                                
-                                // Send a command to the GUI to display the group message
-                                chat::display_command dm_cmd{chat::GUI_CONSOLE, display_message};
-                                gui_tx.send(dm_cmd);
-                            }
-                            break;
-                        }
-                        case chat::LIST: {
-                            bool end = false;
-                            auto users = split(std::string{(char*)(*result).username_}, ':');
-                            for (auto u: users) {
-                                if (u.compare("END") == 0) {   
-                                    end = true;
-                                    break;
-                                }
-                                chat::display_command cmd{chat::GUI_USER_ADD, u};
-                                gui_tx.send(cmd);
-                            }
-
-                            if (!end) {
-                                auto users = split(std::string{(char*)(*result).message_}, ':');
-                                for (auto u: users) {
-                                    if (u.compare("END") == 0) {
-                                        break;
-                                    }
-                                }
-                            }
-
-                            break;
-                        }
-                        case chat::ERROR: {
-                            break;
-                        }
-                        default: {
-
-                        }
-                    }
-                }
+            // nothing left to wait for, the next DM starts over
+            if (p.unacked_.empty() && now_ns >= p.expires_ns_ && now_ns >= p.retry_ns_) {
+                it = peers_.erase(it);
+            }
+            else {
+                ++it;
             }
         }
+    }
+    for (const auto& dm: relay) {
+        relay_message(dm.first, dm.second);
+    }
+}
+
+void client::create_group(std::string_view groupname, const std::vector<std::string>& usernames) {
+    size_t next = 0;
+    send(creategroup_msg(groupname, usernames, &next));
+    send_members(GROUP_ADD, groupname, usernames, next);
+}
+
+void client::send_members(
+    chat_type type, std::string_view groupname, const std::vector<std::string>& usernames, size_t first) {
+    while (first < usernames.size()) {
+        size_t next = first;
+        send(group_members_msg(type, groupname, usernames, first, &next));
+        if (next == first) {
+            // too long to ever fit, skip it
+            next++;
+        }
+        first = next;
+    }
+}
+
+void client::leave() {
+    left_.store(true);
+    send(leave_msg());
+}
 
-        DEBUG("Exited loop\n");
-        // send message to GUI to exit
-        chat::display_command cmd{chat::GUI_EXIT};
-        gui_tx.send(cmd);
-        gui_thread.join();
-        rec_thread.join();
-        
-        // so done...
-        DEBUG("Time to rest\n");
+uint64_t client::dropped() const {
+    uint64_t dropped = 0;
+    if (unicast_.channel_) {
+        dropped += unicast_.channel_->dropped();
+    }
+    if (group_.channel_) {
+        dropped += group_.channel_->dropped();
+    }
+    return dropped;
+}
+
+client::receive_status client::receive_server(received_message& msg) {
+    sockaddr_in sender_address;
+    int len;
+    if (gateway_handler_) {
+        len = sock_->recvfrom(frame_.data(), frame_.size(), sender_address);
+        if (len > 0 && receive_frame(len)) {
+            return RECEIVED_SKIPPED;
+        }
+        if (len > 0) {
+            memcpy(&msg.message_, frame_.data(), std::min<size_t>(len, sizeof(msg.message_) + sizeof(msg.trailer_)));
+        }
     }
     else {
-        DEBUG("Received invalid jack\n");
+        len = sock_->recvfrom(&msg.message_, sizeof(msg.message_) + sizeof(msg.trailer_), sender_address);
+    }
+    if (len < 0) {
+        // would block, or error
+        return RECEIVED_NOTHING;
+    }
+    msg.length_ = len;
+    if (len != sizeof(chat_message) && len != (int)TRACED_MESSAGE_LENGTH) {
+        if (!stop_.load()) {
+            DEBUG("Error receiving packet or unexpected packet size\n");
+        }
+        return RECEIVED_SKIPPED;
     }
+    // brokering and acks stay in the client, DMs from peers are delivered like relayed ones
+    if (msg.message_.type_ == PEER || (msg.message_.type_ == DIRECTMESSAGE && msg.message_.groupname_[0] != '\0')) {
+        return receive_peer(msg.message_, sender_address) ? RECEIVED_MESSAGE : RECEIVED_SKIPPED;
+    }
+    return RECEIVED_MESSAGE;
+}
+
+bool client::receive_frame(int len) {
+    std::string_view recipients;
+    if (!read_frame(frame_.data(), len, recipients)) {
+        return false;
+    }
+    chat_message msg;
+    memcpy(&msg, frame_.data(), sizeof(msg));
+    while (!recipients.empty()) {
+        size_t separator = recipients.find(':');
+        gateway_handler_(recipients.substr(0, separator), msg);
+        recipients.remove_prefix(separator == std::string_view::npos ? recipients.length() : separator + 1);
+    }
+    return true;
+}
+
+bool client::receive_peer(chat_message& msg, const sockaddr_in& from) {
+    std::string_view name = field_view(msg.username_, MAX_USERNAME_LENGTH);
+    std::string_view tag = field_view(msg.groupname_, MAX_USERNAME_LENGTH);
+    uint64_t now_ns = monotonic_ns();
+    std::unique_lock<std::mutex> lock{peers_lock_};
+
+    if (tag.empty()) {
+        // a grant, which only the server may send
+        if (msg.type_ != PEER || from.sin_addr.s_addr != server_.sin_addr.s_addr || from.sin_port != server_.sin_port) {
+            return false;
+        }
+        auto it = peers_.find(name);
+        if (it == peers_.end()) {
+            it = peers_.emplace(name, peer{}).first;
+        }
+        peer& p = it->second;
+        std::string_view token;
+        uint32_t ttl_ms;
+        if (!parse_peer_grant(field_view(msg.message_, MAX_MESSAGE_LENGTH), p.address_, token, ttl_ms)) {
+            DEBUG("Server will not broker %s, relaying\n", it->first.c_str());
+            p.state_ = PEER_RELAY;
+            p.token_.clear();
+            p.expires_ns_ = 0;
+            p.retry_ns_ = now_ns + CLIENT_PEER_RETRY_MS * 1000000ull;
+            return false;
+        }
+        DEBUG("Brokered %s as a peer for %u ms\n", it->first.c_str(), ttl_ms);
+        p.state_ = PEER_DIRECT;
+        p.token_ = std::string{token};
+        p.expires_ns_ = now_ns + ttl_ms * 1000000ull;
+        p.retry_ns_ = 0;
+        return false;
+    }
+
+    // from a peer, which must be the one brokered, at its address, with its token
+    auto it = peers_.find(name);
+    size_t separator = tag.find(':');
+    if (it == peers_.end() || separator == std::string_view::npos || it->second.token_.empty() ||
+        now_ns >= it->second.expires_ns_ || tag.substr(0, separator) != it->second.token_ ||
+        from.sin_addr.s_addr != it->second.address_.sin_addr.s_addr || from.sin_port != it->second.address_.sin_port) {
+        return false;
+    }
+    uint32_t seq = (uint32_t)strtoul(std::string{tag.substr(separator + 1)}.c_str(), nullptr, 10);
+
+    if (msg.type_ == PEER) {
+        auto& unacked = it->second.unacked_;
+        auto acked = std::remove_if(unacked.begin(), unacked.end(), [seq](const unacked_dm& dm) { return dm.seq_ == seq; });
+        unacked.erase(acked, unacked.end());
+        return false;
+    }
+    lock.unlock();
+
+    chat_message ack = peer_msg(username_, "", tag);
+    sock_->sendto(&ack, sizeof(ack), from);
+    // delivered just as if it had been relayed
+    memset(&msg.groupname_[0], 0, sizeof(msg.groupname_));
+    return true;
+}
+
+client::receive_status client::receive_group(received_message& msg) {
+    if (!multicast_.recv(msg.message_)) {
+        // timed out, would block, or error
+        return RECEIVED_NOTHING;
+    }
+    msg.length_ = sizeof(chat_message);
+    // the server sends to the whole group, including the user the message originates from
+    if (msg.message_.groupname_[0] != '\0' &&
+        strncmp((const char*)msg.message_.groupname_, username_.c_str(), MAX_USERNAME_LENGTH) == 0) {
+        return RECEIVED_SKIPPED;
+    }
+    return RECEIVED_MESSAGE;
+}
+
+bool client::update_state(const chat_message& msg) {
+    if (state() == CLIENT_JOINING) {
+        if (resuming_ && msg.type_ == ERROR) {
+            // the server no longer has the session, start a new one
+            DEBUG("Resume rejected, joining\n");
+            resuming_ = false;
+            send(join_msg(username_));
+            return false;
+        }
+        if (resuming_ && msg.type_ != JACK) {
+            // sent to our address before the server saw the RESUME, still ours
+            return false;
+        }
+        if (msg.type_ != JACK) {
+            DEBUG("Received invalid jack\n");
+            state_.store(CLIENT_CLOSED, std::memory_order_release);
+            return true;
+        }
+        DEBUG("Received jack\n");
+        token_ = std::string{field_view(msg.username_, MAX_USERNAME_LENGTH)};
+        idle_ms_ = jack_idle_ms(msg);
+        state_.store(CLIENT_ONLINE, std::memory_order_release);
+        join_group(msg);
+        return false;
+    }
+
+    if (msg.type_ == EXIT || (msg.type_ == LACK && left_.load())) {
+        state_.store(CLIENT_CLOSED, std::memory_order_release);
+        return true;
+    }
+    return false;
+}
+
+void client::join_group(const chat_message& jack) {
+    // join the server's multicast group, if it has one, otherwise stay on unicast
+    std::string_view group = field_view(jack.message_, MAX_MESSAGE_LENGTH);
+    if (!use_multicast_ || group.empty()) {
+        return;
+    }
+    if (!multicast_.join(group)) {
+        DEBUG("Failed to join multicast group, using unicast\n");
+        return;
+    }
+    if (reactor_ != nullptr) {
+        if (!reactor_->add(multicast_.fd(), this, true)) {
+            return;
+        }
+    }
+    else {
+        group_thread_ = std::thread([this]() { run_group(); });
+    }
+    DEBUG("Joined multicast group %.*s\n", (int)group.length(), group.data());
+    send(multicast_msg(true));
+}
+
+void client::run_server() {
+    try {
+        while (!stop_.load()) {
+            if (receive_one(unicast_, [this](received_message& msg) { return receive_server(msg); }) == RECEIVED_FINAL) {
+                break;
+            }
+        }
+    }
+    catch(...) {
+        DEBUG("Caught exception in receiver thread\n");
+    }
+}
+
+void client::run_group() {
+    try {
+        // receives time out, so the session ending is noticed
+        while (!stop_.load() && state() != CLIENT_CLOSED) {
+            receive_one(group_, [this](received_message& msg) { return receive_group(msg); });
+        }
+    }
+    catch(...) {
+        DEBUG("Caught exception in multicast receiver thread\n");
+    }
+}
+
+//---------------------------------------------------------------------------------------
+
+client_reactor::client_reactor() : epoll_{epoll_create1(0)} {
+    thread_ = std::thread([this]() { run(); });
+}
 
-    return 0;
+void client_reactor::stop() {
+    if (!thread_.joinable()) {
+        return;
+    }
+    running_.store(false);
+    thread_.join();
+    close(epoll_);
+}
+
+bool client_reactor::add(int fd, client * c, bool group) {
+    if (fd < 0) {
+        return false;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    auto w = std::make_unique<watch>(watch{c, fd, group});
+    epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = w.get();
+
+    std::lock_guard<std::mutex> lock{watches_lock_};
+    if (epoll_ctl(epoll_, EPOLL_CTL_ADD, fd, &event) != 0) {
+        return false;
+    }
+    watches_.push_back(std::move(w));
+    return true;
+}
+
+void client_reactor::run() {
+    epoll_event events[REACTOR_BATCH];
+    while (running_.load()) {
+        // wakes periodically to notice stop
+        int n = epoll_wait(epoll_, events, REACTOR_BATCH, 100);
+        for (int i = 0; i < n; i++) {
+            watch& w = *static_cast<watch*>(events[i].data.ptr);
+            client& c = *w.client_;
+
+            // level triggered, so whatever is left after a batch is picked up next time round
+            client::receive_status status = client::RECEIVED_NOTHING;
+            for (int count = 0; count < REACTOR_BATCH; count++) {
+                if (w.group_) {
+                    status = c.receive_one(c.group_, [&c](received_message& msg) { return c.receive_group(msg); });
+                }
+                else {
+                    status = c.receive_one(c.unicast_, [&c](received_message& msg) { return c.receive_server(msg); });
+                }
+                if (status == client::RECEIVED_NOTHING || status == client::RECEIVED_FINAL) {
+                    break;
+                }
+            }
+
+            if (status == client::RECEIVED_FINAL || c.state() == CLIENT_CLOSED) {
+                epoll_ctl(epoll_, EPOLL_CTL_DEL, w.fd_, nullptr);
+            }
+        }
+    }
 }
+
+}; // namespace chat
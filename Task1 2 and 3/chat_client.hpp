@@ -0,0 +1,649 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <stddef.h>
+
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <arpa/inet.h>
+
+#include "chat_ex.hpp"
+#include "chat_gateway.hpp"
+#include "chat_latency.hpp"
+#include "chat_multicast.hpp"
+#include "chat_ring.hpp"
+#include "chat_telemetry.hpp"
+#include "chat_transport.hpp"
+
+// Number of received messages that can be waiting to be polled
+#define CLIENT_RECV_CAPACITY 256
+// Most messages the reactor receives from one socket before moving on to the next
+#define REACTOR_BATCH 64
+// Longest keepalive sends go apart, in milliseconds, they go at least twice in the server's idle period
+#define CLIENT_KEEPALIVE_MS 5000
+// How long a DM sent straight to a peer waits for its ack before it is relayed, in milliseconds
+#define CLIENT_PEER_ACK_MS 250
+// How long to wait for the server to broker a peer before asking again, in milliseconds
+#define CLIENT_PEER_SETUP_MS 1000
+// How long to relay DMs to a user the server would not broker before asking again, in milliseconds
+#define CLIENT_PEER_RETRY_MS 30000
+
+namespace chat {
+
+class client_reactor;
+
+/**
+ * @brief A datagram received by a client
+*/
+struct received_message {
+    chat_message message_;
+    // latency trailer of traced messages, received along with message_
+    char trailer_[sizeof(latency_trailer)];
+    int length_;
+};
+
+static_assert(offsetof(received_message, trailer_) == sizeof(chat_message), "trailer must follow the message");
+
+typedef receive_channel<CLIENT_RECV_CAPACITY, received_message> client_channel;
+
+/**
+ * @brief Callback for messages received by a client
+ *
+ * Called on the thread that received the message, so it must not block.
+*/
+typedef std::function<void(const chat_message&)> message_handler;
+
+/**
+ * @brief Callback for messages a gateway receives for the users behind it
+ *
+ * Called once for each user a message is for, on the thread that received
+ * it, so it must not block.
+*/
+typedef std::function<void(std::string_view username, const chat_message&)> gateway_handler;
+
+/**
+ * @brief State of a client's session with the server
+*/
+enum client_state {
+    CLIENT_IDLE,
+    CLIENT_JOINING,
+    CLIENT_ONLINE,
+    CLIENT_CLOSED,
+};
+
+/**
+ * @brief Headless chat client
+ *
+ * Implements the client side of the protocol without any UI. All calls are
+ * non-blocking: connect sends JOIN and returns, the session is online once
+ * the JACK arrives.
+ *
+ * Received messages are either passed to a handler, set with on_message, or
+ * queued for poll. They are received by a thread per socket, or, when
+ * connected through a client_reactor, by the reactor's single thread, so
+ * a process can drive thousands of clients.
+ *
+ * The send functions may be called from any one thread.
+*/
+class client {
+public:
+    /**
+     * @param username to join as
+     * @param sock transport to the server, defaults to the iot socket library
+    */
+    explicit client(std::string username, std::unique_ptr<transport> sock = std::make_unique<iot_transport>());
+
+    client(const client&) = delete;
+    client& operator=(const client&) = delete;
+
+    /**
+     * @brief Stop receiving, waiting for the receiver threads
+    */
+    ~client();
+
+    /**
+     * @brief Bind the client to a local address
+     * @param address to bind to
+     * @return true on success
+    */
+    bool bind(const sockaddr_in& address);
+
+    /**
+     * @brief Pass received messages to a handler instead of queueing them, must be set before connect
+     * @param handler called with every received message
+    */
+    void on_message(message_handler handler) {
+        handler_ = std::move(handler);
+    }
+
+    /**
+     * @brief Act as a gateway, passing messages for the users behind it to a handler, must be set before connect
+     *
+     * Messages for the gateway itself are delivered as usual. Needs a
+     * transport that reaches other hosts, as the server refuses gateways
+     * attached through shared memory.
+     * @param handler called for each user behind the gateway a message is for
+    */
+    void on_gateway_message(gateway_handler handler) {
+        gateway_handler_ = std::move(handler);
+        frame_.resize(GATEWAY_FRAME_LENGTH);
+    }
+
+    /**
+     * @brief Put a user online behind this gateway, its JACK or ERROR goes to the gateway handler
+    */
+    void sub_join(std::string_view username) {
+        send(sub_msg(SUB_JOIN, username));
+    }
+
+    /**
+     * @brief Take a user behind this gateway offline, its LACK goes to the gateway handler
+    */
+    void sub_leave(std::string_view username) {
+        send(sub_msg(SUB_LEAVE, username));
+    }
+
+    /**
+     * @brief Send a message for a user behind this gateway, e.g. a BROADCAST or LIST
+     * @param username of the user behind the gateway
+     * @param msg message, which is never traced
+    */
+    void send_as(std::string_view username, const chat_message& msg);
+
+    /**
+     * @brief Whether to join the server's multicast group, when it offers one. Defaults to true.
+    */
+    void use_multicast(bool enable) {
+        use_multicast_ = enable;
+    }
+
+    /**
+     * @brief What to do with messages arriving while every polled buffer is full, must be set before connect
+     *
+     * OVERFLOW_DROP discards and counts them. OVERFLOW_BLOCK stops receiving
+     * until poll frees a buffer, leaving them queued in the socket, so a
+     * shared reactor waits too. The message that ends the session is never
+     * dropped. Has no effect with on_message. Defaults to OVERFLOW_DROP.
+    */
+    void overflow(overflow_policy policy) {
+        overflow_ = policy;
+    }
+
+    /**
+     * @brief Send DMs straight to their recipient, once the server has brokered a path to it
+     *
+     * The first DM to a user is relayed by the server, which is asked for
+     * the user's address and a token. Later ones go straight to the user,
+     * until the token expires and the server is asked again. A DM the user
+     * has not acked within CLIENT_PEER_ACK_MS is relayed by check_peers, as
+     * is every DM to the user until the token expires, so a DM whose ack was
+     * lost arrives twice. Needs a transport that reaches other hosts, so not
+     * shm_client_transport. DMs sent straight to us are accepted either way.
+     * Defaults to false.
+    */
+    void peer_to_peer(bool enable) {
+        peer_to_peer_ = enable;
+    }
+
+    /**
+     * @brief Trace the latency of messages sent and received, must be set before connect
+     *
+     * Messages go out with a latency trailer, and the trailers of messages
+     * received are recorded, either when received or, for messages read with
+     * poll, when displayed.
+     * @param recorder to record to, may be shared between clients
+    */
+    void trace_latency(std::shared_ptr<latency_recorder> recorder) {
+        latency_ = std::move(recorder);
+    }
+
+    /**
+     * @brief Record the messages polled since the last call as displayed now
+    */
+    void displayed();
+
+    /**
+     * @brief Estimated offset of the server's clock from ours in ns, 0 until the JACK of a traced session
+    */
+    int64_t clock_offset() const {
+        return offset_.load();
+    }
+
+    /**
+     * @brief Resume a session on connect rather than join, must be set before connect
+     *
+     * If the server no longer has the session, the client joins instead.
+     * @param token resume token of the session, as from resume_token
+    */
+    void resume(std::string token) {
+        token_ = std::move(token);
+        resuming_ = !token_.empty();
+    }
+
+    /**
+     * @brief Resume token of the session, valid once online
+    */
+    const std::string& resume_token() const {
+        return token_;
+    }
+
+    /**
+     * @brief Keep the session from being suspended by a server that suspends silent sessions
+     *
+     * May be called as often as convenient. Nothing is sent unless the JACK
+     * said the server suspends silent sessions, and then a RESUME goes out
+     * every CLIENT_KEEPALIVE_MS, or half the server's idle period if shorter.
+    */
+    void keepalive();
+
+    /**
+     * @brief Start the session, sending JOIN, or RESUME if resuming
+     * @param server address of the chat server
+     * @param reactor if not nullptr, receive on the reactor's thread rather than a thread of our own
+     * @return false if the client could not start receiving
+    */
+    bool connect(const sockaddr_in& server, client_reactor * reactor = nullptr);
+
+    void send(const chat_message& msg);
+
+    void broadcast(std::string_view message) {
+        send(broadcast_msg(username_, message));
+    }
+
+    void direct_message(std::string_view to, std::string_view message);
+
+    /**
+     * @brief Relay DMs sent straight to a peer that were not acked in time, call every so often with peer_to_peer on
+    */
+    void check_peers();
+
+    /**
+     * @brief Create a group, members that do not fit in the CREATEGROUP follow as GROUP_ADD
+    */
+    void create_group(std::string_view groupname, const std::vector<std::string>& usernames);
+
+    /**
+     * @brief Add members to a group, in as many GROUP_ADD messages as it takes
+    */
+    void add_to_group(std::string_view groupname, const std::vector<std::string>& usernames) {
+        send_members(GROUP_ADD, groupname, usernames, 0);
+    }
+
+    /**
+     * @brief Remove members from a group, in as many GROUP_REMOVE messages as it takes
+    */
+    void remove_from_group(std::string_view groupname, const std::vector<std::string>& usernames) {
+        send_members(GROUP_REMOVE, groupname, usernames, 0);
+    }
+
+    /**
+     * @brief Ask for the members of a group, which arrive as GROUP_INFO messages
+    */
+    void group_info(std::string_view groupname) {
+        send(group_info_msg(groupname));
+    }
+
+    /**
+     * @brief Only be sent JOIN and LEAVE for these users, "*" for everyone or "@groups" for group co-members
+    */
+    void set_presence(const std::vector<std::string>& interests) {
+        send(presence_msg(username_, interests));
+    }
+
+    void message_group(std::string_view groupname, std::string_view message) {
+        send(messagegroup_msg(groupname, message));
+    }
+
+    void list() {
+        send(list_msg());
+    }
+
+    /**
+     * @brief Publish samples to a telemetry stream, in as many TELEMETRY messages as it takes
+    */
+    void publish(std::string_view stream, const std::vector<double>& samples);
+
+    /**
+     * @brief Subscribe to a telemetry stream, for one TELEMETRY_WINDOW per window, or every TELEMETRY if raw
+    */
+    void subscribe_telemetry(std::string_view stream, bool raw = false) {
+        send(telemetry_msg(TELEMETRY_SUB, stream, raw ? TELEMETRY_RAW : ""));
+    }
+
+    void unsubscribe_telemetry(std::string_view stream) {
+        send(telemetry_msg(TELEMETRY_SUB, stream, TELEMETRY_OFF));
+    }
+
+    /**
+     * @brief Ask for the server's memory readout, which arrives as a STATS message
+    */
+    void stats() {
+        send(stats_msg());
+    }
+
+    /**
+     * @brief Leave the server, the session closes on the LACK
+    */
+    void leave();
+
+    /**
+     * @brief Ask the server to shut down, the session closes on the EXIT
+    */
+    void exit() {
+        send(exit_msg());
+    }
+
+    /**
+     * @brief Handle the next queued message, if any
+     *
+     * Messages from the server come before those from the multicast group.
+     * The message is only valid during the call.
+     * @param handle called with the message
+     * @return true if a message was handled
+    */
+    template <typename Handle>
+    bool poll(Handle handle) {
+        uint32_t slot;
+        client_channel * channel = nullptr;
+        if (unicast_.channel_ && unicast_.channel_->recv(slot)) {
+            channel = unicast_.channel_.get();
+        }
+        else if (group_.channel_ && group_.channel_->recv(slot)) {
+            channel = group_.channel_.get();
+        }
+        if (channel == nullptr) {
+            return false;
+        }
+        const received_message& msg = (*channel)[slot];
+        handle(msg.message_);
+        if (latency_) {
+            latency_trailer trailer;
+            if (read_trailer(reinterpret_cast<const char*>(&msg), msg.length_, trailer)) {
+                displaying_.emplace_back(msg.message_.type_, trailer);
+            }
+        }
+        channel->release(slot);
+        return true;
+    }
+
+    client_state state() const {
+        return state_.load(std::memory_order_acquire);
+    }
+
+    /**
+     * @brief true once leave has been called
+    */
+    bool has_left() const {
+        return left_.load();
+    }
+
+    const std::string& username() const {
+        return username_;
+    }
+
+    /**
+     * @brief Number of messages dropped because the poll queue was full
+    */
+    uint64_t dropped() const;
+
+private:
+    friend class client_reactor;
+
+    enum receive_status {
+        RECEIVED_NOTHING,
+        RECEIVED_SKIPPED,
+        RECEIVED_MESSAGE,
+        RECEIVED_FINAL,
+    };
+
+    /**
+     * @brief Messages from one socket, on their way to the handler or poll
+    */
+    struct inbox {
+        // nullptr when messages go to the handler
+        std::unique_ptr<client_channel> channel_;
+        // buffer kept until a message is delivered in it
+        uint32_t slot_;
+        bool have_slot_ = false;
+        received_message overflow_;
+    };
+
+    /**
+     * @brief How DMs to a user are sent
+    */
+    enum peer_state {
+        PEER_PENDING,   // relayed, while the server brokers
+        PEER_DIRECT,    // straight to the user
+        PEER_RELAY,     // relayed, the server refused or the direct path failed
+    };
+
+    /**
+     * @brief A DM sent straight to a peer, kept until it is acked
+    */
+    struct unacked_dm {
+        uint32_t seq_;
+        uint64_t sent_ns_;
+        std::string message_;
+    };
+
+    /**
+     * @brief A user DMs are, or may be, exchanged with directly
+    */
+    struct peer {
+        peer_state state_ = PEER_PENDING;
+        sockaddr_in address_;
+        std::string token_;
+        // when the token expires, 0 without one
+        uint64_t expires_ns_ = 0;
+        // when to ask the server again, while pending or relaying
+        uint64_t retry_ns_ = 0;
+        uint32_t next_seq_ = 0;
+        std::deque<unacked_dm> unacked_;
+    };
+
+    receive_status receive_server(received_message& msg);
+    receive_status receive_group(received_message& msg);
+
+    /**
+     * @brief Pass a coalesced datagram, received into frame_, to the gateway handler
+     * @param len length of datagram
+     * @return false if the datagram is not coalesced
+    */
+    bool receive_frame(int len);
+
+    /**
+     * @brief Handle a PEER, or a DM sent straight to us by a peer
+     * @param msg received message
+     * @param from address msg was received from
+     * @return true if msg is a DM from a peer, to be delivered
+    */
+    bool receive_peer(chat_message& msg, const sockaddr_in& from);
+
+    /**
+     * @brief Send a DM through the server
+    */
+    void relay_message(std::string_view to, std::string_view message);
+
+    /**
+     * @brief Send GROUP_ADD or GROUP_REMOVE messages until every member from first on is sent
+    */
+    void send_members(
+        chat_type type, std::string_view groupname, const std::vector<std::string>& usernames, size_t first);
+
+    /**
+     * @brief Receive one message into an inbox and deliver it
+     * @param in inbox to deliver to
+     * @param receive fills in the next message
+    */
+    template <typename Receive>
+    receive_status receive_one(inbox& in, Receive receive) {
+        if (in.channel_ && !in.have_slot_) {
+            if (in.channel_->policy() == OVERFLOW_BLOCK) {
+                if (!in.channel_->acquire_wait(in.slot_, [this]() { return stop_.load(); })) {
+                    return RECEIVED_NOTHING;
+                }
+                in.have_slot_ = true;
+            }
+            else {
+                in.have_slot_ = in.channel_->acquire(in.slot_);
+            }
+        }
+
+        received_message& msg = in.have_slot_ ? (*in.channel_)[in.slot_] : in.overflow_;
+        receive_status status = receive(msg);
+        if (status != RECEIVED_MESSAGE) {
+            return status;
+        }
+
+        if (latency_) {
+            trace_received(msg, !in.channel_);
+        }
+        bool final = &in == &unicast_ && update_state(msg.message_);
+        if (!in.channel_) {
+            if (handler_) {
+                handler_(msg.message_);
+            }
+        }
+        else {
+            if (!in.have_slot_) {
+                if (!final) {
+                    in.channel_->record_drop();
+                    return RECEIVED_SKIPPED;
+                }
+                // never lose the message that ends the session
+                in.slot_ = in.channel_->acquire_wait();
+                (*in.channel_)[in.slot_] = msg;
+            }
+            in.channel_->send(in.slot_);
+            in.have_slot_ = false;
+        }
+        return final ? RECEIVED_FINAL : RECEIVED_MESSAGE;
+    }
+
+    /**
+     * @brief Stamp a received traced message, estimating the clock offset from our JACK
+     * @param msg received message
+     * @param record record it now, as it is not waiting to be displayed
+    */
+    void trace_received(received_message& msg, bool record);
+
+    /**
+     * @brief Follow the session through a message from the server
+     * @return true if no more messages are expected
+    */
+    bool update_state(const chat_message& msg);
+
+    /**
+     * @brief Join the multicast group announced in a JACK and start receiving from it
+    */
+    void join_group(const chat_message& jack);
+
+    void run_server();
+    void run_group();
+
+    std::string username_;
+    std::unique_ptr<transport> sock_;
+    sockaddr_in address_;
+    sockaddr_in server_;
+    bool bound_ = false;
+    bool use_multicast_ = true;
+    overflow_policy overflow_ = OVERFLOW_DROP;
+    bool peer_to_peer_ = false;
+    // written by the receiver only until the session is online
+    std::string token_;
+    // how long the server lets the session be silent, from the JACK, 0 if it never suspends it
+    uint32_t idle_ms_ = 0;
+    bool resuming_ = false;
+    uint64_t keepalive_ns_ = 0;
+    message_handler handler_;
+    gateway_handler gateway_handler_;
+    // receives coalesced datagrams, which are longer than a received_message
+    std::vector<char> frame_;
+    client_reactor * reactor_ = nullptr;
+
+    std::shared_ptr<latency_recorder> latency_;
+    // server clock minus ours, once known
+    std::atomic<int64_t> offset_{0};
+    std::atomic<bool> offset_known_{false};
+    // polled traced messages waiting to be displayed
+    std::vector<std::pair<uint8_t, latency_trailer>> displaying_;
+
+    // peers by username, shared by the sender and the receiver
+    std::mutex peers_lock_;
+    std::map<std::string, peer, std::less<>> peers_;
+
+    std::atomic<client_state> state_{CLIENT_IDLE};
+    std::atomic<bool> left_{false};
+    std::atomic<bool> stop_{false};
+
+    inbox unicast_;
+    inbox group_;
+    multicast_receiver multicast_;
+    std::thread server_thread_;
+    std::thread group_thread_;
+};
+
+/**
+ * @brief Receives for many clients on a single thread
+ *
+ * Requires clients on kernel sockets (udp_transport). The reactor must be
+ * stopped, or destroyed, before the clients connected through it.
+*/
+class client_reactor {
+public:
+    client_reactor();
+
+    client_reactor(const client_reactor&) = delete;
+    client_reactor& operator=(const client_reactor&) = delete;
+
+    ~client_reactor() {
+        stop();
+    }
+
+    /**
+     * @brief Stop the reactor's thread
+    */
+    void stop();
+
+private:
+    friend class client;
+
+    /**
+     * @brief A socket waited on by the reactor
+    */
+    struct watch {
+        client * client_;
+        int fd_;
+        bool group_;
+    };
+
+    /**
+     * @brief Start waiting on a client's socket
+     * @param fd socket descriptor, made non-blocking
+     * @param c client the socket belongs to
+     * @param group true for the client's multicast group, false for the server socket
+     * @return false if the socket cannot be waited on
+    */
+    bool add(int fd, client * c, bool group);
+
+    void run();
+
+    int epoll_;
+    std::atomic<bool> running_{true};
+    // watches live until the reactor is gone, as events may still refer to them
+    std::mutex watches_lock_;
+    std::vector<std::unique_ptr<watch>> watches_;
+    std::thread thread_;
+};
+
+}; // namespace chat
@@ -0,0 +1,461 @@
+
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <cstdlib>
+
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <thread>
+
+// IOT socket api
+#include <iot/socket.hpp>
+
+#include "chat_client.hpp"
+#include "chat_ex.hpp"
+#include "chat_display.hpp"
+#include "chat_scan.hpp"
+#include "chat_shm.hpp"
+#include <gui.hpp>
+#include <colors.hpp>
+#include <util.hpp>
+
+//---------------------------------------------------------------------------------------
+
+/**
+ * @brief Convert a string command from the UI into a chat command.
+ *  NOTE: It is only a subset of all command types.
+ * 
+ * @param cmd command to convert
+ * @return command type ID representing the passed in command
+*/
+chat::chat_type to_type(std::string_view cmd) {
+    switch(string_to_int(std::string{cmd}.c_str())) {
+    case string_to_int("join"): return chat::JOIN;
+    case string_to_int("bc"): return chat::BROADCAST;
+    case string_to_int("creategroup"): return chat::CREATEGROUP;
+    case string_to_int("msggroup"): return chat::MESSAGEGROUP;
+    case string_to_int("groupadd"): return chat::GROUP_ADD;
+    case string_to_int("groupremove"): return chat::GROUP_REMOVE;
+    case string_to_int("groupinfo"): return chat::GROUP_INFO;
+    case string_to_int("presence"): return chat::PRESENCE;
+    case string_to_int("stats"): return chat::STATS;
+    case string_to_int("telemetry"): return chat::TELEMETRY;
+    case string_to_int("subscribe"): return chat::TELEMETRY_SUB;
+    case string_to_int("dm"): return chat::DIRECTMESSAGE;
+    case string_to_int("list"): return chat::LIST;
+    case string_to_int("leave"): return chat::LEAVE;
+    case string_to_int("exit"): return chat::EXIT;
+    default:
+        return chat::UNKNOWN; 
+    }
+
+  return chat::UNKNOWN; // unknowntype
+}
+
+int main(int argc, char ** argv) {
+    // multicast is used when the server offers it, unless asked not to
+    bool use_multicast = true;
+    // optional latency tracing, sampled to this file
+    std::string latency_path;
+    // Unix socket of a server on this host, to attach to through shared memory
+    std::string local_path;
+    // file keeping the resume token, so a restarted client takes its session back
+    std::string resume_path;
+    // DMs go straight to their recipient once the server brokers a path
+    bool peer_to_peer = false;
+
+    bool valid = argc >= 4;
+    for (int i = 4; i < argc; i++) {
+        if (strcmp(argv[i], "unicast") == 0) {
+            use_multicast = false;
+        }
+        else if (strncmp(argv[i], "latency=", 8) == 0) {
+            latency_path = argv[i] + 8;
+        }
+        else if (strncmp(argv[i], "local=", 6) == 0) {
+            local_path = argv[i] + 6;
+        }
+        else if (strncmp(argv[i], "resume=", 7) == 0) {
+            resume_path = argv[i] + 7;
+        }
+        else if (strcmp(argv[i], "p2p") == 0) {
+            peer_to_peer = true;
+        }
+        else {
+            valid = false;
+        }
+    }
+    if (!valid) {
+        printf("USAGE: %s <ipaddress> <port> <username> [unicast] [latency=<trace file>] [local=<server socket>] "
+            "[resume=<token file>] [p2p]\n", argv[0]);
+        exit(0);
+    }
+
+    std::string username{argv[3]};
+    // Set client IP address
+    uwe::set_ipaddr(argv[1]);
+
+    const char* server_name = "192.168.1.27";
+	
+	const int server_port = SERVER_PORT;
+
+    sockaddr_in server_address;
+	memset(&server_address, 0, sizeof(server_address));
+	server_address.sin_family = AF_INET;
+
+	// creates binary representation of server name and stores it as sin_addr
+	inet_pton(AF_INET, server_name, &server_address.sin_addr);
+
+	// htons: port in network order format
+	server_address.sin_port = htons(server_port);
+
+	// open socket, or attach to a server on this host, falling back to UDP if there is none
+    std::unique_ptr<chat::transport> transport = std::make_unique<chat::iot_transport>();
+    if (!local_path.empty()) {
+        auto local = std::make_unique<chat::shm_client_transport>(local_path);
+        if (local->attach()) {
+            transport = std::move(local);
+            // everything goes through the server's shared memory, there is no direct path to a peer
+            peer_to_peer = false;
+        }
+        else {
+            DEBUG("No server to attach to on %s, using UDP\n", local_path.c_str());
+        }
+    }
+	chat::client client{username, std::move(transport)};
+	client.use_multicast(use_multicast);
+    client.peer_to_peer(peer_to_peer);
+
+    std::shared_ptr<chat::latency_recorder> latency;
+    if (!latency_path.empty()) {
+        latency = std::make_shared<chat::latency_recorder>();
+        if (!latency->open(latency_path)) {
+            DEBUG("Failed to open latency trace %s\n", latency_path.c_str());
+        }
+        client.trace_latency(latency);
+    }
+
+	// port for client
+	const int client_port = std::atoi(argv[2]);
+
+	// socket address used for the client
+	struct sockaddr_in client_address;
+	memset(&client_address, 0, sizeof(client_address));
+	client_address.sin_family = AF_INET;
+	client_address.sin_port = htons(client_port);
+	inet_pton(AF_INET, uwe::get_ipaddr().c_str(), &client_address.sin_addr);
+
+	client.bind(client_address);
+
+    // resume the session of a previous run, if it is still there
+    if (!resume_path.empty()) {
+        std::ifstream in{resume_path};
+        std::string token;
+        if (std::getline(in, token)) {
+            client.resume(token);
+        }
+    }
+
+    // send JOIN, or RESUME, and wait for JACK
+    client.connect(server_address);
+    while (client.state() == chat::CLIENT_JOINING) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    if (client.state() == chat::CLIENT_ONLINE && !resume_path.empty()) {
+        std::ofstream out{resume_path, std::ios::trunc};
+        out << client.resume_token() << std::endl;
+    }
+
+    if (client.state() == chat::CLIENT_ONLINE) {
+        // create GUI thread and communication channels
+        auto [gui_thread, gui_tx, gui_rx] = chat::make_gui();
+        chat::display_batcher display;
+
+        bool exit_loop = false;
+        for(;!exit_loop;) {
+            // the server may suspend sessions it does not hear from
+            if (!client.has_left()) {
+                client.keepalive();
+                client.check_peers();
+            }
+
+            // check and see if any GUI messages to handle
+            if (!gui_rx.empty() && !client.has_left()) {
+                auto result = gui_rx.recv();
+                if (result) {
+                    // views into the command, which stays alive until it is handled
+                    std::vector<std::string_view> cmds;
+                    chat::split(*result, ':', cmds);
+                    if (cmds.size() > 1) {
+                        chat::chat_type type = to_type(cmds[0]);
+                        switch(type) {
+                            case chat::EXIT: {
+                                DEBUG("Received Exit from GUI\n");
+                                client.exit();
+                                exit_loop = true;  // Exit the main loop, leading to application shutdown
+                                break;
+                            }
+                            case chat::LEAVE: {
+                                DEBUG("Received LEAVE from GUI\n");
+                                client.leave();
+                                break;
+                            }
+                            case chat::LIST: { 
+                                DEBUG("Received LIST from GUI\n");
+                                // you need to fill in
+                                break;
+                            }
+                            case chat::DIRECTMESSAGE: {
+                                if (cmds.size() >= 3) {
+                                // Extract recipient username and actual message, which may itself contain ':'
+                                std::string_view recipient_username = cmds[1];
+                                std::string_view actual_message =
+                                    std::string_view{*result}.substr(cmds[0].length() + cmds[1].length() + 2);
+                                client.direct_message(recipient_username, actual_message);
+                                }
+                                break;
+                                }                        
+                            case chat::CREATEGROUP: {
+                                if (cmds.size() >= 2) {
+                                    std::string_view groupname = cmds[1];
+                                    std::vector<std::string> usernames;
+                                    for (size_t i = 2; i < cmds.size(); ++i) {
+                                        usernames.emplace_back(cmds[i]);
+                                    }
+                                    client.create_group(groupname, usernames);
+                                }
+                                break;
+                            }
+                            case chat::MESSAGEGROUP: {
+                                    // Inside the main loop where commands from the GUI are processed
+                                    if (cmds.size() >= 3 && cmds[0] == "msggroup") {
+                                        // Assuming ':' is not used in group names, the rest is the message
+                                        std::string_view groupname = cmds[1];
+                                        std::string_view message =
+                                            std::string_view{*result}.substr(cmds[0].length() + cmds[1].length() + 2);
+
+                                        client.message_group(groupname, message);
+                                    }
+                                break;
+                            }
+                            case chat::GROUP_ADD:
+                            case chat::GROUP_REMOVE: {
+                                if (cmds.size() >= 3) {
+                                    std::vector<std::string> usernames;
+                                    for (size_t i = 2; i < cmds.size(); ++i) {
+                                        usernames.emplace_back(cmds[i]);
+                                    }
+                                    if (type == chat::GROUP_ADD) {
+                                        client.add_to_group(cmds[1], usernames);
+                                    }
+                                    else {
+                                        client.remove_from_group(cmds[1], usernames);
+                                    }
+                                }
+                                break;
+                            }
+                            case chat::GROUP_INFO: {
+                                client.group_info(cmds[1]);
+                                break;
+                            }
+                            case chat::PRESENCE: {
+                                std::vector<std::string> interests;
+                                for (size_t i = 1; i < cmds.size(); ++i) {
+                                    interests.emplace_back(cmds[i]);
+                                }
+                                client.set_presence(interests);
+                                break;
+                            }
+                            case chat::STATS: {
+                                client.stats();
+                                break;
+                            }
+                            case chat::TELEMETRY: {
+                                // telemetry:<stream>:<sample>:<sample>...
+                                if (cmds.size() >= 3) {
+                                    std::vector<double> samples;
+                                    for (size_t i = 2; i < cmds.size(); ++i) {
+                                        samples.push_back(strtod(std::string{cmds[i]}.c_str(), nullptr));
+                                    }
+                                    client.publish(cmds[1], samples);
+                                }
+                                break;
+                            }
+                            case chat::TELEMETRY_SUB: {
+                                // subscribe:<stream>[:raw|:off]
+                                if (cmds.size() >= 2) {
+                                    if (cmds.size() >= 3 && cmds[2] == TELEMETRY_OFF) {
+                                        client.unsubscribe_telemetry(cmds[1]);
+                                    }
+                                    else {
+                                        client.subscribe_telemetry(cmds[1], cmds.size() >= 3 && cmds[2] == TELEMETRY_RAW);
+                                    }
+                                }
+                                break;
+                            }
+
+                            default: {
+                                // the default case is that the command is a username for DM
+                                // <username> : message
+                                if (cmds.size() == 2) {
+                                    DEBUG("Received message from GUI\n");
+                                }
+                                break;
+                            }
+                        } 
+                    }
+                    else {
+                        // message to broadcast to everyone online
+                        client.broadcast(*result);
+                    }
+                }
+            }
+            //check to see if any messages received from the server
+            if (!exit_loop) {
+                client.poll([&](const chat::chat_message& msg) {
+                    // handled in place, the buffer is released once done
+                    const chat::chat_message * result = &msg;
+                    switch ((*result).type_) {
+                        case chat::LEAVE: {
+                            display.user_remove(std::string{(const char*)(*result).username_});
+                            break;
+                        }
+                        case chat::EXIT: {
+                            DEBUG("Received EXIT\n");
+                            exit_loop = true;
+                            break;
+                        }
+                        case chat::LACK: {
+                            DEBUG("Received LACK\n");
+                            if (client.has_left()) {
+                                exit_loop = true;
+                                break;
+                            }
+                        }
+                        case chat::BROADCAST: {
+                            std::string msg{(const char*)(*result).username_};
+                            msg.append(": ");
+                            msg.append((const char*)(*result).message_);
+                            display.console(std::move(msg));
+                            break;
+                        }
+                        case chat::DIRECTMESSAGE: {
+                             // The direct message content is in the format "<sender>:<message>"
+                            std::string sender(reinterpret_cast<const char*>((*result).username_));
+                            std::string content = std::string(reinterpret_cast<const char*>((*result).message_));
+                        
+                            // Construct a display message
+                            std::string display_message = "DM from " + sender + ": " + content;
+
+                            // Queue the direct message for display
+                            display.console(std::move(display_message));
+
+                            break;
+                        } case chat::MESSAGEGROUP: {
+                                if (result->type_ == chat::MESSAGEGROUP) {
+                                std::string groupname(reinterpret_cast<const char*>(result->groupname_));
+                                std::string sender(reinterpret_cast<const char*>(result->username_));
+                                std::string content(reinterpret_cast<const char*>(result->message_));
+                            
+                                // Construct a display message indicating it's from a group
+                                std::string display_message = "Group [" + groupname + "] " + sender + ": " + content;
+                            
+                                // Queue the group message for display
+                                display.console(std::move(display_message));
+                            }
+                            break;
+                        }
+                        case chat::LIST: {
+                            bool end = false;
+                            // split in place, the fields end with a ':' so skip the empty last entry
+                            std::vector<std::string_view> users;
+                            chat::split(chat::field_view((*result).username_, MAX_USERNAME_LENGTH), ':', users);
+                            for (auto u: users) {
+                                if (u.compare("END") == 0) {   
+                                    end = true;
+                                    break;
+                                }
+                                if (!u.empty()) {
+                                    display.user_add(std::string{u});
+                                }
+                            }
+
+                            if (!end) {
+                                users.clear();
+                                chat::split(chat::field_view((*result).message_, MAX_MESSAGE_LENGTH), ':', users);
+                                for (auto u: users) {
+                                    if (u.compare("END") == 0) {
+                                        break;
+                                    }
+                                    if (!u.empty()) {
+                                        display.user_add(std::string{u});
+                                    }
+                                }
+                            }
+
+                            break;
+                        }
+                        case chat::GROUP_INFO: {
+                            std::string groupname{chat::field_view((*result).username_, MAX_USERNAME_LENGTH)};
+                            std::string members{chat::field_view((*result).message_, MAX_MESSAGE_LENGTH)};
+                            display.console("Group [" + groupname + "] members: " + members);
+                            break;
+                        }
+                        case chat::STATS: {
+                            display.console("Server memory: " +
+                                std::string{chat::field_view((*result).message_, MAX_MESSAGE_LENGTH)});
+                            break;
+                        }
+                        case chat::TELEMETRY:
+                        case chat::TELEMETRY_WINDOW: {
+                            std::string stream{chat::field_view((*result).username_, MAX_USERNAME_LENGTH)};
+                            std::string text{chat::field_view((*result).message_, MAX_MESSAGE_LENGTH)};
+                            chat::telemetry_window window;
+                            if ((*result).type_ == chat::TELEMETRY) {
+                                display.console("Telemetry [" + stream + "] " + text);
+                            }
+                            else if (chat::parse_window(text, window)) {
+                                char line[160];
+                                snprintf(line, sizeof(line), "n %llu min %g max %g mean %g last %g",
+                                    (unsigned long long)window.count_, window.min_, window.max_, window.mean_, window.last_);
+                                display.console("Telemetry [" + stream + "] " + line);
+                            }
+                            break;
+                        }
+                        case chat::ERROR: {
+                            break;
+                        }
+                        default: {
+
+                        }
+                    }
+                });
+            }
+
+            // redraw at most once per frame, however many messages arrived
+            if (display.flush(gui_tx)) {
+                client.displayed();
+            }
+        }
+
+        DEBUG("Exited loop (%llu messages dropped)\n", (unsigned long long)client.dropped());
+        // send message to GUI to exit
+        display.flush(gui_tx, true);
+        chat::display_command cmd{chat::GUI_EXIT};
+        gui_tx.send(cmd);
+        gui_thread.join();
+
+        if (latency) {
+            DEBUG("Latency:\n%s", latency->report().c_str());
+        }
+
+        // so done...
+        DEBUG("Time to rest\n");
+    }
+
+    return 0;
+}
@@ -0,0 +1,115 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <chrono>
+#include <deque>
+#include <map>
+#include <set>
+#include <string>
+
+#include <gui.hpp>
+
+// Minimum time between two GUI updates, i.e. the frame budget
+#define GUI_FRAME_MS 50
+// Maximum number of console lines kept for a single frame
+#define GUI_MAX_FRAME_LINES 256
+
+namespace chat {
+
+/**
+ * @brief Coalesces console output and roster changes into GUI frames
+ *
+ * Instead of sending one display_command per incoming message, the client
+ * queues lines and roster changes here and flushes them at most once per
+ * GUI_FRAME_MS. Console lines of a frame are sent as a single GUI_CONSOLE
+ * command; if more than GUI_MAX_FRAME_LINES arrive in one frame only the
+ * newest are kept. Roster changes are reduced to the final state of each
+ * user, and only users whose state differs from what the GUI shows are sent.
+*/
+class display_batcher {
+public:
+    /**
+     * @brief Queue a line for the console
+     * @param line to display
+    */
+    void console(std::string line) {
+        if (lines_.size() == GUI_MAX_FRAME_LINES) {
+            lines_.pop_front();
+            skipped_++;
+        }
+        lines_.push_back(std::move(line));
+    }
+
+    /**
+     * @brief Queue adding a user to the roster
+     * @param username of online user
+    */
+    void user_add(const std::string& username) {
+        roster_[username] = true;
+    }
+
+    /**
+     * @brief Queue removing a user from the roster
+     * @param username of user that went offline
+    */
+    void user_remove(const std::string& username) {
+        roster_[username] = false;
+    }
+
+    /**
+     * @brief Send queued updates to the GUI if the frame budget has elapsed
+     * @param gui_tx channel to the GUI thread
+     * @param force send now, regardless of frame budget
+     * @return true if updates were sent
+    */
+    template <typename Tx>
+    bool flush(Tx& gui_tx, bool force = false) {
+        if (lines_.empty() && roster_.empty()) {
+            return false;
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        if (!force && now - last_flush_ < std::chrono::milliseconds(GUI_FRAME_MS)) {
+            return false;
+        }
+        last_flush_ = now;
+
+        for (const auto& user: roster_) {
+            if (user.second && shown_.insert(user.first).second) {
+                gui_tx.send(display_command{GUI_USER_ADD, user.first});
+            }
+            else if (!user.second && shown_.erase(user.first) > 0) {
+                gui_tx.send(display_command{GUI_USER_REMOVE, user.first});
+            }
+        }
+        roster_.clear();
+
+        if (!lines_.empty()) {
+            std::string text;
+            if (skipped_ > 0) {
+                text = "[" + std::to_string(skipped_) + " messages skipped]\n";
+                skipped_ = 0;
+            }
+            for (const auto& line: lines_) {
+                text.append(line);
+                text.push_back('\n');
+            }
+            text.pop_back();
+            lines_.clear();
+            gui_tx.send(display_command{GUI_CONSOLE, text});
+        }
+        return true;
+    }
+
+private:
+    std::deque<std::string> lines_;
+    uint64_t skipped_ = 0;
+    // pending roster changes, true for add and false for remove
+    std::map<std::string, bool> roster_;
+    // users currently displayed by the GUI
+    std::set<std::string> shown_;
+    std::chrono::steady_clock::time_point last_flush_;
+};
+
+}; // namespace chat
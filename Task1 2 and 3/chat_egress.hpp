@@ -0,0 +1,563 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <arpa/inet.h>
+
+#include "chat_ex.hpp"
+#include "chat_gateway.hpp"
+#include "chat_lanes.hpp"
+#include "chat_latency.hpp"
+#include "chat_multicast.hpp"
+#include "chat_ring.hpp"
+#include "chat_transport.hpp"
+
+// Number of threads sending to clients
+#define EGRESS_WORKERS 4
+// Number of sends that can be queued for a single worker
+#define EGRESS_QUEUE_SIZE 16384
+// Number of distinct outgoing messages that can be in flight
+#define EGRESS_POOL_SIZE 4096
+// Number of handshake replies that can be queued for a single worker
+#define EGRESS_CONTROL_QUEUE_SIZE 1024
+// Buffers of the pool only handshake replies may take
+#define EGRESS_CONTROL_RESERVE 64
+// Bytes in each chunk the recipient names of a coalesced datagram are kept in
+#define EGRESS_NAMES_CHUNK 256
+// Number of chunks of recipient names that can be in flight
+#define EGRESS_NAMES_POOL_SIZE 16384
+// Gateways the egress remembers the last datagram of, beyond which it forgets gateways no longer sent to
+#define EGRESS_OPEN_FRAMES_MAX 4096
+
+namespace chat {
+
+class egress;
+
+/**
+ * @brief Handle to a message encoded into the egress pool
+ *
+ * Owned by the thread that encoded it, which may send it to any number of
+ * recipients. The buffer returns to the pool once the handle is gone and
+ * every queued send of it has completed.
+*/
+class outgoing {
+public:
+    outgoing(outgoing&& other) : egress_{other.egress_}, slot_{other.slot_} {
+        other.egress_ = nullptr;
+    }
+
+    outgoing(const outgoing&) = delete;
+    outgoing& operator=(const outgoing&) = delete;
+
+    inline ~outgoing();
+
+private:
+    friend class egress;
+
+    outgoing(egress * e, uint32_t slot) : egress_{e}, slot_{slot} {
+    }
+
+    egress * egress_;
+    uint32_t slot_;
+};
+
+/**
+ * @brief Egress stage of the server pipeline
+ *
+ * Messages are encoded once into a pooled buffer and queued, together with
+ * the recipient, to one of a fixed set of worker threads which do the actual
+ * sendto calls. Each recipient address always maps to the same worker, so
+ * the workers own disjoint slices of the recipients and messages to a
+ * client keep their order.
+ *
+ * encode and send must only be called from one thread (the router). Queues
+ * are spsc_rings; buffers freed by a worker travel back to the router on a
+ * per worker ring, so no locks are taken.
+ *
+ * Without workers every send is made inline, on the router, which keeps
+ * in process runs (benchmarks, tests) deterministic.
+ *
+ * Sends to users behind a gateway are held until flush, and a message for
+ * several users behind the same gateway goes out as one coalesced datagram.
+ * Only consecutive sends of a message to a gateway's users are coalesced,
+ * so every user still receives its messages in order. Coalesced datagrams
+ * are not traced. Their recipient names are kept in chained chunks of a
+ * pool of their own, which travel back from the workers like the message
+ * buffers, so coalescing allocates nothing once warmed up.
+ *
+ * Replies to handshakes (JACK, LACK) are queued in a control lane of their
+ * own, which workers always empty first, and have a reserve of the pool to
+ * themselves, so they are not held up behind a large fan-out of chat. An
+ * EXIT keeps its place behind the chat queued before it, as it is the last
+ * thing a client hears.
+*/
+class egress {
+public:
+    /**
+     * @param sock transport to send from, must outlive the egress
+     * @param workers number of sender threads, 0 to send on the calling thread
+    */
+    explicit egress(transport& sock, size_t workers = EGRESS_WORKERS) :
+        sock_{sock}, buffers_{new buffer[EGRESS_POOL_SIZE]}, chunks_{new names_chunk[EGRESS_NAMES_POOL_SIZE]} {
+        free_.reserve(EGRESS_POOL_SIZE);
+        for (uint32_t slot = EGRESS_POOL_SIZE; slot > 0; slot--) {
+            free_.push_back(slot - 1);
+        }
+        free_chunks_.reserve(EGRESS_NAMES_POOL_SIZE);
+        for (uint32_t chunk = EGRESS_NAMES_POOL_SIZE; chunk > 0; chunk--) {
+            free_chunks_.push_back(chunk - 1);
+        }
+        for (size_t i = 0; i < workers; i++) {
+            workers_.push_back(std::make_unique<worker>());
+        }
+        for (auto& w: workers_) {
+            w->thread_ = std::thread([this, w = w.get()]() { run(*w); });
+        }
+    }
+
+    egress(const egress&) = delete;
+    egress& operator=(const egress&) = delete;
+
+    /**
+     * @brief Send everything still queued and stop the workers
+    */
+    ~egress() {
+        running_.store(false);
+        for (auto& w: workers_) {
+            w->bell_.ring();
+        }
+        for (auto& w: workers_) {
+            w->thread_.join();
+        }
+    }
+
+    /**
+     * @brief Copy a message into a pool buffer, ready to be sent to many recipients
+     * @param msg to encode
+     * @return handle for the encoded message
+    */
+    outgoing encode(const chat_message& msg) {
+        uint32_t slot = acquire(control(msg.type_));
+        buffer& b = buffers_[slot];
+        b.message_ = msg;
+        b.traced_ = latency_ != nullptr;
+        if (b.traced_) {
+            b.latency_ = *latency_;
+            b.latency_.stamps_[STAMP_SERVER_HANDLED] = monotonic_ns();
+        }
+        b.refs_.store(1, std::memory_order_relaxed);
+        return outgoing{this, slot};
+    }
+
+    /**
+     * @brief The message an encoded handle holds
+    */
+    const chat_message& message(const outgoing& msg) const {
+        return buffers_[msg.slot_].message_;
+    }
+
+    /**
+     * @brief Trace messages encoded from now on
+     * @param latency stamps of the packet being handled, nullptr to stop tracing
+    */
+    void set_latency(const latency_trailer * latency) {
+        latency_ = latency;
+    }
+
+    /**
+     * @brief Queue an encoded message for a recipient
+     * @param msg encoded message
+     * @param to recipient address
+    */
+    void send(const outgoing& msg, const sockaddr_in& to) {
+        if (gateways_ != nullptr && is_sub_address(to)) {
+            coalesce(msg.slot_, to);
+            return;
+        }
+        if (workers_.empty()) {
+            transmit(buffers_[msg.slot_], to, -1);
+            return;
+        }
+        buffers_[msg.slot_].refs_.fetch_add(1, std::memory_order_relaxed);
+        queue(job{msg.slot_, to, -1});
+    }
+
+    /**
+     * @brief Send to the users behind gateways through their gateway
+     * @param gateways users behind gateways, must outlive the egress
+    */
+    void set_gateways(const gateway_table * gateways) {
+        gateways_ = gateways;
+    }
+
+    /**
+     * @brief Send the coalesced datagrams held for gateways, called by the router once done with a packet
+    */
+    void flush() {
+        if (frames_.empty()) {
+            return;
+        }
+        for (frame& f: frames_) {
+            if (workers_.empty()) {
+                transmit(buffers_[f.slot_], f.to_, f.first_);
+                release(f.slot_, nullptr);
+                release_names(f.first_, nullptr);
+            }
+            else {
+                // the worker hands the names back once sent
+                queue(job{f.slot_, f.to_, (int32_t)f.first_});
+            }
+        }
+        frames_.clear();
+        // datagrams remembered from before are stale from now on
+        flushes_++;
+        if (open_frames_.size() > EGRESS_OPEN_FRAMES_MAX) {
+            open_frames_.clear();
+        }
+    }
+
+    /**
+     * @brief Send multicast traffic through the given sender
+     * @param multicast sender for the server's group, must outlive the egress
+    */
+    void set_multicast(multicast_sender * multicast) {
+        multicast_ = multicast;
+    }
+
+    /**
+     * @brief Queue an encoded message for every member of the multicast group
+     * @param msg encoded message
+    */
+    void send_multicast(const outgoing& msg) {
+        send(msg, multicast_->address());
+    }
+
+    /**
+     * @brief Queue a message for a single recipient
+     * @param msg to send
+     * @param to recipient address
+    */
+    void send(const chat_message& msg, const sockaddr_in& to) {
+        send(encode(msg), to);
+    }
+
+private:
+    friend class outgoing;
+
+    struct buffer {
+        chat_message message_;
+        // sent after the message if traced_
+        latency_trailer latency_;
+        bool traced_;
+        std::atomic<uint32_t> refs_;
+    };
+
+    /**
+     * @brief Part of the recipient names of a coalesced datagram, which are separated by ':'
+    */
+    struct names_chunk {
+        // next chunk of the same names, -1 for the last
+        int32_t next_;
+        uint32_t length_;
+        char names_[EGRESS_NAMES_CHUNK - 2 * sizeof(uint32_t)];
+    };
+
+    struct job {
+        uint32_t slot_;
+        sockaddr_in to_;
+        // first chunk of the names of the users behind the gateway at to_ a coalesced datagram is for,
+        // -1 for a plain send
+        int32_t names_;
+    };
+
+    /**
+     * @brief A coalesced datagram waiting for flush
+    */
+    struct frame {
+        uint32_t slot_;
+        sockaddr_in to_;
+        // chunks of the recipient names, and their total length
+        uint32_t first_;
+        uint32_t last_;
+        size_t length_;
+    };
+
+    /**
+     * @brief The last datagram held for a gateway, if no flush came since
+    */
+    struct open_frame {
+        size_t frame_;
+        uint64_t flushes_;
+    };
+
+    struct worker {
+        spsc_ring<job, EGRESS_QUEUE_SIZE> jobs_;
+        // handshake replies, sent ahead of jobs_
+        spsc_ring<job, EGRESS_CONTROL_QUEUE_SIZE> control_;
+        // buffers this worker released, on their way back to the router
+        spsc_ring<uint32_t, EGRESS_POOL_SIZE> freed_;
+        // chunks of names this worker sent, on their way back to the router
+        spsc_ring<uint32_t, EGRESS_NAMES_POOL_SIZE> freed_chunks_;
+        doorbell bell_;
+        std::thread thread_;
+    };
+
+    /**
+     * @brief A message goes in the control lane
+    */
+    static bool control(uint8_t type) {
+        return lane_of(type) == LANE_CONTROL && type != EXIT;
+    }
+
+    /**
+     * @brief Take a free buffer, waiting for the workers if all are in flight
+     * @param handshake buffer is for a handshake reply, which may take the reserve
+    */
+    uint32_t acquire(bool handshake) {
+        size_t reserve = handshake ? 0 : EGRESS_CONTROL_RESERVE;
+        while (free_.size() <= reserve) {
+            uint32_t slot;
+            for (auto& w: workers_) {
+                while (w->freed_.pop(slot)) {
+                    free_.push_back(slot);
+                }
+            }
+            if (free_.size() <= reserve) {
+                std::this_thread::yield();
+            }
+        }
+        uint32_t slot = free_.back();
+        free_.pop_back();
+        return slot;
+    }
+
+    /**
+     * @brief Take a free chunk of names, waiting for the workers if all are in flight
+     *
+     * Datagrams held for flush keep their chunks, so when none are free the
+     * held ones are sent first. Only called where no frame is being written.
+    */
+    void reserve_chunk() {
+        if (free_chunks_.empty()) {
+            flush();
+        }
+        while (free_chunks_.empty()) {
+            uint32_t chunk;
+            for (auto& w: workers_) {
+                while (w->freed_chunks_.pop(chunk)) {
+                    free_chunks_.push_back(chunk);
+                }
+            }
+            if (free_chunks_.empty()) {
+                std::this_thread::yield();
+            }
+        }
+    }
+
+    /**
+     * @brief Take a chunk reserve_chunk made sure of
+    */
+    uint32_t take_chunk() {
+        uint32_t chunk = free_chunks_.back();
+        free_chunks_.pop_back();
+        chunks_[chunk].next_ = -1;
+        chunks_[chunk].length_ = 0;
+        return chunk;
+    }
+
+    /**
+     * @brief Add to the names of a held datagram, chaining a new chunk when the last is full
+    */
+    void append_names(frame& f, const char * data, size_t length) {
+        f.length_ += length;
+        while (length > 0) {
+            names_chunk& last = chunks_[f.last_];
+            size_t room = sizeof(last.names_) - last.length_;
+            if (room == 0) {
+                uint32_t chunk = take_chunk();
+                last.next_ = (int32_t)chunk;
+                f.last_ = chunk;
+                continue;
+            }
+            size_t n = std::min(room, length);
+            memcpy(last.names_ + last.length_, data, n);
+            last.length_ += n;
+            data += n;
+            length -= n;
+        }
+    }
+
+    /**
+     * @brief Return the chunks of a datagram's names to the pool
+     * @param first chunk of the names
+     * @param from worker that sent the datagram, nullptr for the router
+    */
+    void release_names(uint32_t first, worker * from) {
+        int32_t chunk = (int32_t)first;
+        while (chunk >= 0) {
+            // a chunk handed back may be taken again at once
+            int32_t next = chunks_[chunk].next_;
+            if (from == nullptr) {
+                free_chunks_.push_back(chunk);
+            }
+            else {
+                from->freed_chunks_.push(chunk);
+            }
+            chunk = next;
+        }
+    }
+
+    /**
+     * @brief Drop a reference to a buffer, returning it to the pool on the last one
+     * @param slot buffer
+     * @param from worker dropping the reference, nullptr for the router
+    */
+    void release(uint32_t slot, worker * from) {
+        if (buffers_[slot].refs_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            if (from == nullptr) {
+                free_.push_back(slot);
+            }
+            else {
+                from->freed_.push(slot);
+            }
+        }
+    }
+
+    /**
+     * @brief Queue a send to the worker owning its recipient
+    */
+    void queue(const job& j) {
+        worker& w = *workers_[(j.to_.sin_addr.s_addr ^ (j.to_.sin_port * 2654435761u)) % workers_.size()];
+        if (control(buffers_[j.slot_].message_.type_)) {
+            while (!w.control_.push(j)) {
+                w.bell_.ring();
+                std::this_thread::yield();
+            }
+            w.bell_.ring();
+            return;
+        }
+        while (!w.jobs_.push(j)) {
+            // worker is full, wait for it to catch up
+            w.bell_.ring();
+            std::this_thread::yield();
+        }
+        w.bell_.ring();
+    }
+
+    /**
+     * @brief Hold a send to a user behind a gateway, adding the user to the gateway's last datagram if it is of the same message
+    */
+    void coalesce(uint32_t slot, const sockaddr_in& to) {
+        const gateway_table::value_type * user = gateways_->find(to);
+        if (user == nullptr) {
+            // taken offline since
+            return;
+        }
+        const sockaddr_in& gateway = *user->second.gateway_address_;
+        uint64_t gateway_key = ((uint64_t)gateway.sin_addr.s_addr << 16) | gateway.sin_port;
+        const std::string& username = user->first;
+        // a name takes at most one more chunk, and may flush what is held
+        reserve_chunk();
+
+        open_frame& open = open_frames_[gateway_key];
+        if (open.flushes_ == flushes_) {
+            frame& f = frames_[open.frame_];
+            if (f.slot_ == slot && f.length_ + 1 + username.length() <= GATEWAY_FRAME_NAMES) {
+                append_names(f, ":", 1);
+                append_names(f, username.data(), username.length());
+                return;
+            }
+        }
+        buffers_[slot].refs_.fetch_add(1, std::memory_order_relaxed);
+        uint32_t chunk = take_chunk();
+        frames_.push_back(frame{slot, gateway, chunk, chunk, 0});
+        append_names(frames_.back(), username.data(), username.length());
+        open = open_frame{frames_.size() - 1, flushes_};
+    }
+
+    /**
+     * @brief Send an encoded buffer to a recipient, the multicast group, or as a coalesced datagram to a gateway
+    */
+    void transmit(const buffer& b, const sockaddr_in& to, int32_t names) {
+        if (names >= 0) {
+            char recipients[GATEWAY_FRAME_NAMES];
+            size_t length = 0;
+            for (int32_t chunk = names; chunk >= 0; chunk = chunks_[chunk].next_) {
+                memcpy(recipients + length, chunks_[chunk].names_, chunks_[chunk].length_);
+                length += chunks_[chunk].length_;
+            }
+            char datagram[GATEWAY_FRAME_LENGTH];
+            length = write_frame(datagram, b.message_, std::string_view{recipients, length});
+            sock_.sendto(datagram, length, to);
+        }
+        else if (multicast_ != nullptr && IN_MULTICAST(ntohl(to.sin_addr.s_addr))) {
+            multicast_->send(b.message_);
+        }
+        else if (b.traced_) {
+            char datagram[TRACED_MESSAGE_LENGTH];
+            memcpy(datagram, &b.message_, sizeof(chat_message));
+            memcpy(datagram + sizeof(chat_message), &b.latency_, sizeof(latency_trailer));
+            write_stamp(datagram, STAMP_SERVER_SEND, monotonic_ns());
+            sock_.sendto(datagram, sizeof(datagram), to);
+        }
+        else {
+            sock_.sendto(&b.message_, sizeof(chat_message), to);
+        }
+    }
+
+    void run(worker& w) {
+        for (;;) {
+            job j;
+            if (w.control_.pop(j) || w.jobs_.pop(j)) {
+                transmit(buffers_[j.slot_], j.to_, j.names_);
+                if (j.names_ >= 0) {
+                    release_names(j.names_, &w);
+                }
+                release(j.slot_, &w);
+            }
+            else if (!running_.load()) {
+                break;
+            }
+            else {
+                w.bell_.wait([&]() { return !w.control_.empty() || !w.jobs_.empty() || !running_.load(); });
+            }
+        }
+    }
+
+    transport& sock_;
+    multicast_sender * multicast_ = nullptr;
+    const gateway_table * gateways_ = nullptr;
+    // coalesced datagrams held until flush, and the last one of each gateway, only touched by the router
+    std::vector<frame> frames_;
+    std::unordered_map<uint64_t, open_frame> open_frames_;
+    // flushes so far, telling which entries of open_frames_ are stale
+    uint64_t flushes_ = 1;
+    // stamps of the packet being handled, only touched by the router
+    const latency_trailer * latency_ = nullptr;
+    std::unique_ptr<buffer[]> buffers_;
+    // free buffers, only touched by the router
+    std::vector<uint32_t> free_;
+    std::unique_ptr<names_chunk[]> chunks_;
+    // free chunks of names, only touched by the router
+    std::vector<uint32_t> free_chunks_;
+    std::vector<std::unique_ptr<worker>> workers_;
+    std::atomic<bool> running_{true};
+};
+
+outgoing::~outgoing() {
+    if (egress_ != nullptr) {
+        egress_->release(slot_, nullptr);
+    }
+}
+
+}; // namespace chat
@@ -1,8 +1,10 @@
 #pragma once
 
 #include <stdint.h>
+#include <stdlib.h>
 
 #include <string>
+#include <string_view>
 #include <cstring>
 #include <arpa/inet.h>
 #include <vector>
@@ -14,6 +16,9 @@
 // Server always run on this port
 #define SERVER_PORT 8867
 
+// Port multicast traffic is sent to, when the server has multicast enabled
+#define MULTICAST_PORT 8868
+
 namespace chat { 
 
 /**
@@ -22,6 +27,9 @@ namespace chat {
  * Client join server message
  * @var chat_type::JACK
  * Client ACK in reply to JOIN
+ * Carries the server's multicast group as "<ip>:<port>" in the message, empty if multicast is off,
+ * the session's resume token in the username field, and in the group field how long the server lets
+ * a session be silent before suspending it, in milliseconds, empty if it never does
  * @var chat_type::BROADCAST
  * Client sends message to all online users
  * @var chat_type::DIRECTMESSAGE
@@ -39,6 +47,46 @@ namespace chat {
  * Server sends to all online users informing them to terminate
  * @var chat_type::ERROR
  * Server sends to client if an error has occured
+ * @var chat_type::MULTICAST
+ * Client requests ("on") or cancels ("off") delivery of broadcast and presence traffic by multicast
+ * @var chat_type::GROUP_ADD
+ * Client adds the online users listed in the message to the group named in the username field
+ * @var chat_type::GROUP_REMOVE
+ * Client removes the users listed in the message from the group named in the username field
+ * @var chat_type::GROUP_INFO
+ * Client requests the members of the group named in the username field
+ * Server sends the members (might be multiple of these terminated with user END)
+ * @var chat_type::PRESENCE
+ * Client, named in the username field, sets whose JOIN and LEAVE it is sent: usernames, "*" for
+ * everyone or "@groups" for members of its groups, separated by ':' in the message
+ * @var chat_type::RESUME
+ * Client, named in the username field, takes its session back with the resume token in the message,
+ * from whatever address it now sends from. Server replies with JACK, then the messages held for the
+ * session while it was suspended, or with an ERROR. Also sent by online clients to keep their session alive
+ * @var chat_type::STATS
+ * Client requests the server's memory readout
+ * Server sends the readout in the message, as space separated <name>=<value> pairs
+ * @var chat_type::PEER
+ * Client, named in the username field, asks for a direct path to the user named in the message.
+ * Server sends both users the other's name in the username field, and the grant
+ * "<ip>:<port>:<token>:<ttl ms>" in the message, or only the sender an empty message if it refuses.
+ * Between peers, acks a DIRECTMESSAGE tagged "<token>:<seq>" in the groupname field, with the same tag
+ * @var chat_type::SUB_JOIN
+ * Gateway puts the user named in the username field online behind it, see chat_gateway.hpp
+ * Server sends the user's JACK, or ERROR, through the gateway
+ * @var chat_type::SUB_LEAVE
+ * Gateway takes the user named in the username field offline
+ * Server sends the user's LACK through the gateway
+ * @var chat_type::TELEMETRY
+ * Client publishes samples, decimal numbers separated by ':' in the message, to the stream named in the
+ * username field, see chat_telemetry.hpp
+ * Server passes it on as it is to the stream's raw subscribers
+ * @var chat_type::TELEMETRY_SUB
+ * Client subscribes to the stream named in the username field, for aggregates with an empty message,
+ * for every sample with "raw", or unsubscribes with "off"
+ * @var chat_type::TELEMETRY_WINDOW
+ * Server sends the aggregate of a stream, named in the username field, over one window as
+ * "<count>:<min>:<max>:<mean>:<last>" in the message
  * 
 */
 enum chat_type {
@@ -53,6 +101,19 @@ enum chat_type {
     CREATEGROUP,
     MESSAGEGROUP,
     ERROR,
+    MULTICAST,
+    GROUP_ADD,
+    GROUP_REMOVE,
+    GROUP_INFO,
+    PRESENCE,
+    RESUME,
+    STATS,
+    PEER,
+    SUB_JOIN,
+    SUB_LEAVE,
+    TELEMETRY,
+    TELEMETRY_SUB,
+    TELEMETRY_WINDOW,
     UNKNOWN,
 };
 
@@ -63,7 +124,7 @@ enum chat_type {
  * @return true if a valid type, otherwise false
 */
 inline bool is_valid_type(chat_type type) {
-    return type >= JOIN && type <= ERROR;   
+    return type >= JOIN && type < UNKNOWN;   
 }
 
 /** 
@@ -88,10 +149,10 @@ struct chat_message {
  * @param username to be stored in the message
  * @return the chat message
 */
-inline chat_message join_msg(std::string username) {
+inline chat_message join_msg(std::string_view username) {
     chat_message msg;
     msg.type_ = JOIN;
-    memcpy(&msg.username_[0], username.c_str(), username.length());
+    memcpy(&msg.username_[0], username.data(), username.length());
     msg.username_[username.length()] = '\0';
     msg.message_[0] = '\0';
     return msg;
@@ -99,11 +160,159 @@ inline chat_message join_msg(std::string username) {
 
 /**
  * @brief Create a JACK message
+ * @param multicast group clients may join, as "<ip>:<port>", empty for none
+ * @param idle_ms how long a session may be silent before it is suspended, 0 if never
+ * @return the chat message
+*/
+inline chat_message jack_msg(std::string_view multicast = "", uint32_t idle_ms = 0) {
+    chat_message msg{JACK, '\0', '\0'};
+    memcpy(&msg.message_[0], multicast.data(), multicast.length());
+    msg.message_[multicast.length()] = '\0';
+    if (idle_ms > 0) {
+        std::string idle = std::to_string(idle_ms);
+        memcpy(&msg.groupname_[0], idle.data(), idle.length());
+    }
+    return msg;
+}
 
+/**
+ * @brief How long the server sending a JACK lets a session be silent before suspending it
+ * @return milliseconds, 0 if it never suspends sessions
+*/
+inline uint32_t jack_idle_ms(const chat_message& jack) {
+    std::string idle{(const char *)jack.groupname_, strnlen((const char *)jack.groupname_, MAX_USERNAME_LENGTH)};
+    return (uint32_t)strtoul(idle.c_str(), nullptr, 10);
+}
+
+/**
+ * @brief Create a JACK message for a session
+ * @param jack JACK message to start from
+ * @param token resume token of the session
+ * @return the chat message
+*/
+inline chat_message jack_msg(const chat_message& jack, std::string_view token) {
+    chat_message msg = jack;
+    std::string_view safe_token = token.substr(0, MAX_USERNAME_LENGTH - 1);
+    memcpy(&msg.username_[0], safe_token.data(), safe_token.length());
+    msg.username_[safe_token.length()] = '\0';
+    return msg;
+}
+
+/**
+ * @brief Create a RESUME message
+ * @param username of the session
+ * @param token resume token of the session, from its JACK
+ * @return the chat message
+*/
+inline chat_message resume_msg(std::string_view username, std::string_view token) {
+    chat_message msg{RESUME, {'\0'}, {'\0'}, {'\0'}};
+    std::string_view safe_username = username.substr(0, MAX_USERNAME_LENGTH - 1);
+    memcpy(&msg.username_[0], safe_username.data(), safe_username.length());
+    std::string_view safe_token = token.substr(0, MAX_MESSAGE_LENGTH - 1);
+    memcpy(&msg.message_[0], safe_token.data(), safe_token.length());
+    return msg;
+}
+
+/**
+ * @brief Create a STATS message
+ * @param report memory readout, when sent by the server
  * @return the chat message
 */
-inline chat_message jack_msg() {
-    return chat_message{JACK, '\0', '\0'};
+inline chat_message stats_msg(std::string_view report = "") {
+    chat_message msg{STATS, {'\0'}, {'\0'}, {'\0'}};
+    std::string_view safe_report = report.substr(0, MAX_MESSAGE_LENGTH - 1);
+    memcpy(&msg.message_[0], safe_report.data(), safe_report.length());
+    return msg;
+}
+
+/**
+ * @brief Create a PEER message
+ * @param username of the sending client when asking the server, of the other peer otherwise
+ * @param message user asked for, or the grant when sent by the server
+ * @param tag "<token>:<seq>" of the DIRECTMESSAGE acked, when sent between peers
+ * @return the chat message
+*/
+inline chat_message peer_msg(std::string_view username, std::string_view message = "", std::string_view tag = "") {
+    chat_message msg{PEER, {'\0'}, {'\0'}, {'\0'}};
+    std::string_view safe_username = username.substr(0, MAX_USERNAME_LENGTH - 1);
+    memcpy(&msg.username_[0], safe_username.data(), safe_username.length());
+    std::string_view safe_message = message.substr(0, MAX_MESSAGE_LENGTH - 1);
+    memcpy(&msg.message_[0], safe_message.data(), safe_message.length());
+    std::string_view safe_tag = tag.substr(0, MAX_USERNAME_LENGTH - 1);
+    memcpy(&msg.groupname_[0], safe_tag.data(), safe_tag.length());
+    return msg;
+}
+
+/**
+ * @brief Create a SUB_JOIN or SUB_LEAVE message
+ * @param type SUB_JOIN or SUB_LEAVE
+ * @param username of the user behind the gateway
+ * @return the chat message
+*/
+inline chat_message sub_msg(chat_type type, std::string_view username) {
+    chat_message msg{(uint8_t)type, {'\0'}, {'\0'}, {'\0'}};
+    std::string_view safe_username = username.substr(0, MAX_USERNAME_LENGTH - 1);
+    memcpy(&msg.username_[0], safe_username.data(), safe_username.length());
+    return msg;
+}
+
+/**
+ * @brief Create a TELEMETRY, TELEMETRY_SUB or TELEMETRY_WINDOW message
+ * @param type of message
+ * @param stream name of the stream
+ * @param message samples, mode or aggregate
+ * @return the chat message
+*/
+inline chat_message telemetry_msg(chat_type type, std::string_view stream, std::string_view message = "") {
+    chat_message msg{(uint8_t)type, {'\0'}, {'\0'}, {'\0'}};
+    std::string_view safe_stream = stream.substr(0, MAX_USERNAME_LENGTH - 1);
+    memcpy(&msg.username_[0], safe_stream.data(), safe_stream.length());
+    std::string_view safe_message = message.substr(0, MAX_MESSAGE_LENGTH - 1);
+    memcpy(&msg.message_[0], safe_message.data(), safe_message.length());
+    return msg;
+}
+
+/**
+ * @brief Format the grant of a PEER sent by the server
+ * @param address the peer is reached at
+ * @param token shared by the two peers
+ * @param ttl_ms how long the token lasts
+ * @return "<ip>:<port>:<token>:<ttl ms>"
+*/
+inline std::string peer_grant(const sockaddr_in& address, std::string_view token, uint32_t ttl_ms) {
+    char ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &address.sin_addr, ip, sizeof(ip));
+    std::string grant{ip};
+    grant += ':' + std::to_string(ntohs(address.sin_port)) + ':';
+    grant.append(token);
+    grant += ':' + std::to_string(ttl_ms);
+    return grant;
+}
+
+/**
+ * @brief Parse the grant of a PEER sent by the server
+ * @param grant "<ip>:<port>:<token>:<ttl ms>"
+ * @param address receives the address the peer is reached at
+ * @param token receives the token, a view into grant
+ * @param ttl_ms receives how long the token lasts
+ * @return false if grant is empty, the server refused, or malformed
+*/
+inline bool parse_peer_grant(std::string_view grant, sockaddr_in& address, std::string_view& token, uint32_t& ttl_ms) {
+    size_t port_pos = grant.find(':');
+    size_t token_pos = port_pos == std::string_view::npos ? port_pos : grant.find(':', port_pos + 1);
+    size_t ttl_pos = token_pos == std::string_view::npos ? token_pos : grant.find(':', token_pos + 1);
+    if (ttl_pos == std::string_view::npos || ttl_pos == token_pos + 1) {
+        return false;
+    }
+    std::string ip{grant.substr(0, port_pos)};
+    std::string port{grant.substr(port_pos + 1, token_pos - port_pos - 1)};
+    std::string ttl{grant.substr(ttl_pos + 1)};
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons((uint16_t)strtoul(port.c_str(), nullptr, 10));
+    token = grant.substr(token_pos + 1, ttl_pos - token_pos - 1);
+    ttl_ms = (uint32_t)strtoul(ttl.c_str(), nullptr, 10);
+    return inet_pton(AF_INET, ip.c_str(), &address.sin_addr) == 1 && address.sin_port != 0 && ttl_ms > 0;
 }
 
 /**
@@ -112,11 +321,11 @@ inline chat_message jack_msg() {
  * @param message to be stored in the message
  * @return the chat message
 */
-inline chat_message broadcast_msg(std::string username, std::string message) {
+inline chat_message broadcast_msg(std::string_view username, std::string_view message) {
     chat_message msg{BROADCAST, '\0', '\0'};
-    memcpy(&msg.username_[0], username.c_str(), username.length());
+    memcpy(&msg.username_[0], username.data(), username.length());
     msg.username_[username.length()] = '\0';
-    memcpy(&msg.message_[0], message.c_str(), message.length());
+    memcpy(&msg.message_[0], message.data(), message.length());
     msg.message_[message.length()] = '\0';
     return msg;
 }
@@ -127,11 +336,11 @@ inline chat_message broadcast_msg(std::string username, std::string message) {
  * @param message to be stored in the message
  * @return the chat message
 */
-inline chat_message dm_msg(std::string username, std::string message) {
+inline chat_message dm_msg(std::string_view username, std::string_view message) {
     chat_message msg{DIRECTMESSAGE, '\0', '\0'};
-    memcpy(&msg.username_[0], username.c_str(), username.length());
+    memcpy(&msg.username_[0], username.data(), username.length());
     msg.username_[username.length()] = '\0';
-    memcpy(&msg.message_[0], message.c_str(), message.length());
+    memcpy(&msg.message_[0], message.data(), message.length());
     msg.message_[message.length()] = '\0';
     return msg;
 }
@@ -142,11 +351,11 @@ inline chat_message dm_msg(std::string username, std::string message) {
  * @param message to be stored in the message
  * @return the chat message
 */
-inline chat_message list_msg(std::string username = "", std::string message = "") {
+inline chat_message list_msg(std::string_view username = "", std::string_view message = "") {
     chat_message msg{LIST, '\0', '\0'};
-    memcpy(&msg.username_[0], username.c_str(), username.length());
+    memcpy(&msg.username_[0], username.data(), username.length());
     msg.username_[username.length()] = '\0';
-    memcpy(&msg.message_[0], message.c_str(), message.length());
+    memcpy(&msg.message_[0], message.data(), message.length());
     msg.message_[message.length()] = '\0';
     return msg;
 }
@@ -185,47 +394,136 @@ inline chat_message error_msg(uint16_t err) {
     *((int *)(&msg.message_[0])) = htons(err);
     return msg;
 }
+/**
+ * @brief Append usernames to a message field, separated by ':', for as long as they fit
+ * @param field message field, kept NUL terminated
+ * @param used bytes of the field already in use
+ * @param usernames to append
+ * @param first index of the first username to append
+ * @return index of the first username that did not fit, usernames.size() if all did
+*/
+inline size_t pack_usernames(int8_t * field, size_t used, const std::vector<std::string>& usernames, size_t first) {
+    size_t next = first;
+    for (; next < usernames.size(); next++) {
+        size_t separator = used > 0 ? 1 : 0;
+        // keep room for the terminating NUL
+        if (used + separator + usernames[next].length() >= MAX_MESSAGE_LENGTH) {
+            break;
+        }
+        if (separator) {
+            field[used++] = ':';
+        }
+        memcpy(&field[used], usernames[next].data(), usernames[next].length());
+        used += usernames[next].length();
+    }
+    field[used] = '\0';
+    return next;
+}
+
 /**
  * @brief Create a CREATEGROUP message
- * @param username to be stored in the message
+ *
+ * The message is the group name followed by as many members as fit, the
+ * rest can be added with GROUP_ADD.
+ *
  * @param groupname to be stored in the message
+ * @param usernames members of the group
+ * @param next if not nullptr, receives the index of the first member that did not fit
  * @return the chat message
 */
-
-inline chat_message creategroup_msg(std::string groupname, std::vector<std::string> usernames) {
+inline chat_message creategroup_msg(
+    std::string_view groupname, const std::vector<std::string>& usernames, size_t * next = nullptr) {
     chat_message msg{CREATEGROUP, {'\0'}, {'\0'}, {'\0'}};
     
     // Set the groupname_ field
-    std::string safe_groupname = groupname.substr(0, MAX_USERNAME_LENGTH - 1);
-    memcpy(&msg.groupname_[0], safe_groupname.c_str(), safe_groupname.length());
+    std::string_view safe_groupname = groupname.substr(0, MAX_USERNAME_LENGTH - 1);
+    memcpy(&msg.groupname_[0], safe_groupname.data(), safe_groupname.length());
     msg.groupname_[safe_groupname.length()] = '\0';
 
-    // Concatenate usernames for the message_ field
-    std::string concatenatedUsernames;
-    for (const std::string& username : usernames) {
-        if (concatenatedUsernames.length() + username.length() + 1 >= MAX_MESSAGE_LENGTH - 1) {
-            break;
-        }
-        if (!concatenatedUsernames.empty()) concatenatedUsernames += ":";
-        concatenatedUsernames += username;
+    // the server takes the group name from the start of the message
+    memcpy(&msg.message_[0], safe_groupname.data(), safe_groupname.length());
+    size_t packed = pack_usernames(msg.message_, safe_groupname.length(), usernames, 0);
+    if (next != nullptr) {
+        *next = packed;
     }
 
-    // Set the message_ field with concatenated usernames
-    memcpy(&msg.message_[0], concatenatedUsernames.c_str(), concatenatedUsernames.length());
-    msg.message_[concatenatedUsernames.length()] = '\0';
+    return msg;
+}
 
+/**
+ * @brief Create a GROUP_ADD or GROUP_REMOVE message
+ * @param type GROUP_ADD or GROUP_REMOVE
+ * @param groupname to be stored in the message
+ * @param usernames members to add or remove
+ * @param first index of the first member to store
+ * @param next if not nullptr, receives the index of the first member that did not fit
+ * @return the chat message
+*/
+inline chat_message group_members_msg(
+    chat_type type, std::string_view groupname, const std::vector<std::string>& usernames,
+    size_t first = 0, size_t * next = nullptr) {
+    chat_message msg{(uint8_t)type, {'\0'}, {'\0'}, {'\0'}};
+    std::string_view safe_groupname = groupname.substr(0, MAX_USERNAME_LENGTH - 1);
+    memcpy(&msg.username_[0], safe_groupname.data(), safe_groupname.length());
+    size_t packed = pack_usernames(msg.message_, 0, usernames, first);
+    if (next != nullptr) {
+        *next = packed;
+    }
     return msg;
 }
 
-inline chat_message messagegroup_msg(std::string groupname, std::string message) {
+/**
+ * @brief Create a GROUP_INFO message
+ * @param groupname to be stored in the message
+ * @param message to be stored in the message, members separated by ':' when sent by the server
+ * @return the chat message
+*/
+inline chat_message group_info_msg(std::string_view groupname, std::string_view message = "") {
+    chat_message msg{GROUP_INFO, {'\0'}, {'\0'}, {'\0'}};
+    std::string_view safe_groupname = groupname.substr(0, MAX_USERNAME_LENGTH - 1);
+    memcpy(&msg.username_[0], safe_groupname.data(), safe_groupname.length());
+    memcpy(&msg.message_[0], message.data(), message.length());
+    return msg;
+}
+
+inline chat_message messagegroup_msg(std::string_view groupname, std::string_view message) {
     chat_message msg{MESSAGEGROUP, '\0', '\0'};
-    memcpy(&msg.groupname_[0], groupname.c_str(), groupname.length());
+    // the server looks the group up by the username field
+    memcpy(&msg.username_[0], groupname.data(), groupname.length());
+    memcpy(&msg.groupname_[0], groupname.data(), groupname.length());
     msg.groupname_[groupname.length()] = '\0';
-    memcpy(&msg.message_[0], message.c_str(), message.length());
+    memcpy(&msg.message_[0], message.data(), message.length());
+    msg.message_[message.length()] = '\0';
+    return msg;
+}
+
+/**
+ * @brief Create a MULTICAST message
+ * @param enable true to receive broadcast and presence traffic by multicast, false for unicast
+ * @return the chat message
+*/
+inline chat_message multicast_msg(bool enable) {
+    std::string_view message = enable ? "on" : "off";
+    chat_message msg{MULTICAST, '\0', '\0'};
+    memcpy(&msg.message_[0], message.data(), message.length());
     msg.message_[message.length()] = '\0';
     return msg;
 }
 
+/**
+ * @brief Create a PRESENCE message
+ * @param username of the sending client
+ * @param interests usernames, "*" or "@groups", as many as fit in the message
+ * @return the chat message
+*/
+inline chat_message presence_msg(std::string_view username, const std::vector<std::string>& interests) {
+    chat_message msg{PRESENCE, {'\0'}, {'\0'}, {'\0'}};
+    std::string_view safe_username = username.substr(0, MAX_USERNAME_LENGTH - 1);
+    memcpy(&msg.username_[0], safe_username.data(), safe_username.length());
+    pack_usernames(msg.message_, 0, interests, 0);
+    return msg;
+}
+
 /**
  * @brief Print a chat message to stdout
  * @param message to be printed
@@ -235,5 +533,7 @@ void print_message(chat_message message);
 #define ERR_USER_ALREADY_ONLINE 0
 #define ERR_UNKNOWN_USERNAME    1
 #define ERR_UNEXPECTED_MSG      2
+#define ERR_RESUME_REJECTED     3
+#define ERR_MEMORY_FULL         4
 
 }; // namespace chat
\ No newline at end of file
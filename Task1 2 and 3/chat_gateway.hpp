@@ -0,0 +1,316 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+#include <map>
+#include <set>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include <arpa/inet.h>
+
+#include "chat_ex.hpp"
+#include "chat_memory.hpp"
+
+/**
+ * @brief Gateways, many users over one address
+ *
+ * A gateway is a client that joins as usual and then puts users online
+ * behind it with SUB_JOIN. Each of them is given an address of its own in
+ * GATEWAY_SUB_NET, which never appears on the wire, so the server handles
+ * them like any other user. What is sent to them is coalesced: a message
+ * for several users behind the same gateway goes out as one datagram, the
+ * message followed by GATEWAY_MAGIC and the users' names separated by ':'.
+ * The gateway sends for one of its users by following the message with a
+ * gateway_trailer naming the user.
+*/
+
+// Marks the trailer of a datagram to or from a gateway
+#define GATEWAY_MAGIC 0x57544147u
+// First address given to the users behind gateways, 240.0.0.0/4 is reserved and never routed
+#define GATEWAY_SUB_NET 0xf0000000u
+// Most bytes of names in one coalesced datagram, a message for more users than fit goes out in several
+#define GATEWAY_FRAME_NAMES 4096
+// Longest coalesced datagram
+#define GATEWAY_FRAME_LENGTH (sizeof(chat::chat_message) + sizeof(uint32_t) + GATEWAY_FRAME_NAMES)
+
+namespace chat {
+
+/**
+ * @struct gateway_trailer
+ * @brief Follows a chat_message a gateway sends for one of its users
+ * @var gateway_trailer::magic_
+ *  Member 'magic_' always GATEWAY_MAGIC
+ * @var gateway_trailer::username_
+ *  Member 'username_' user the message is from, NUL terminated
+ */
+struct gateway_trailer {
+    uint32_t magic_;
+    char username_[MAX_USERNAME_LENGTH];
+};
+
+/**
+ * @brief Length of a datagram sent by a gateway for one of its users
+*/
+#define GATEWAY_MESSAGE_LENGTH (sizeof(chat::chat_message) + sizeof(chat::gateway_trailer))
+
+/**
+ * @brief An address is one given to a user behind a gateway
+*/
+inline bool is_sub_address(const sockaddr_in& address) {
+    return (ntohl(address.sin_addr.s_addr) & 0xf0000000u) == GATEWAY_SUB_NET;
+}
+
+/**
+ * @brief Write a message a gateway sends for one of its users
+ * @param datagram to write to, GATEWAY_MESSAGE_LENGTH long
+ * @param msg message
+ * @param username user the message is from
+*/
+inline void write_sub_message(char * datagram, const chat_message& msg, std::string_view username) {
+    gateway_trailer trailer;
+    memset(&trailer, 0, sizeof(trailer));
+    trailer.magic_ = GATEWAY_MAGIC;
+    std::string_view safe_username = username.substr(0, MAX_USERNAME_LENGTH - 1);
+    memcpy(trailer.username_, safe_username.data(), safe_username.length());
+    memcpy(datagram, &msg, sizeof(chat_message));
+    memcpy(datagram + sizeof(chat_message), &trailer, sizeof(trailer));
+}
+
+/**
+ * @brief Read the user a gateway sent a message for
+ * @param packet received datagram
+ * @param len length of datagram
+ * @param username receives the user, a view into packet
+ * @return false if the datagram was not sent for a user behind a gateway
+*/
+inline bool read_sub_message(const char * packet, int len, std::string_view& username) {
+    if (len != (int)GATEWAY_MESSAGE_LENGTH) {
+        return false;
+    }
+    const gateway_trailer * trailer = reinterpret_cast<const gateway_trailer*>(packet + sizeof(chat_message));
+    uint32_t magic;
+    memcpy(&magic, &trailer->magic_, sizeof(magic));
+    if (magic != GATEWAY_MAGIC) {
+        return false;
+    }
+    username = std::string_view{trailer->username_, strnlen(trailer->username_, MAX_USERNAME_LENGTH)};
+    return true;
+}
+
+/**
+ * @brief Write a coalesced datagram
+ * @param datagram to write to, GATEWAY_FRAME_LENGTH long
+ * @param msg message
+ * @param recipients users behind the gateway the message is for, separated by ':'
+ * @return length of the datagram
+*/
+inline size_t write_frame(char * datagram, const chat_message& msg, std::string_view recipients) {
+    uint32_t magic = GATEWAY_MAGIC;
+    size_t names = std::min<size_t>(recipients.length(), GATEWAY_FRAME_NAMES);
+    memcpy(datagram, &msg, sizeof(chat_message));
+    memcpy(datagram + sizeof(chat_message), &magic, sizeof(magic));
+    memcpy(datagram + sizeof(chat_message) + sizeof(magic), recipients.data(), names);
+    return sizeof(chat_message) + sizeof(magic) + names;
+}
+
+/**
+ * @brief Read the recipients of a coalesced datagram
+ * @param packet received datagram
+ * @param len length of datagram
+ * @param recipients receives the users the message is for, separated by ':', a view into packet
+ * @return false if the datagram is not coalesced
+*/
+inline bool read_frame(const char * packet, int len, std::string_view& recipients) {
+    size_t header = sizeof(chat_message) + sizeof(uint32_t);
+    if (len <= (int)header || len > (int)GATEWAY_FRAME_LENGTH) {
+        return false;
+    }
+    uint32_t magic;
+    memcpy(&magic, packet + sizeof(chat_message), sizeof(magic));
+    if (magic != GATEWAY_MAGIC) {
+        return false;
+    }
+    recipients = std::string_view{packet + header, len - header};
+    return true;
+}
+
+/**
+ * @brief The users behind each gateway, and the addresses they were given
+ *
+ * Only touched by the router, the egress looks users up by address while
+ * the router sends to them.
+*/
+class gateway_table {
+public:
+    /**
+     * @brief A user behind a gateway
+    */
+    struct sub {
+        std::string gateway_;
+        // address of the gateway's own session, which follows it when it resumes elsewhere
+        const sockaddr_in * gateway_address_;
+        sockaddr_in address_;
+    };
+
+    typedef std::map<std::string, sub, std::less<>>::value_type value_type;
+
+    /**
+     * @brief Cap the memory held for users behind gateways, 0 for no cap
+    */
+    void set_cap(size_t bytes) {
+        memory_.set_cap(bytes);
+    }
+
+    /**
+     * @brief Put a user behind a gateway, giving it a new address
+     * @param gateway username of the gateway
+     * @param gateway_address address of the gateway's session, must stay valid while the user is attached
+     * @param username of user
+     * @return address given to the user
+    */
+    sockaddr_in attach(std::string_view gateway, const sockaddr_in * gateway_address, std::string_view username) {
+        sockaddr_in address;
+        memset(&address, 0, sizeof(address));
+        address.sin_family = AF_INET;
+        // 28 bits of address and 16 of port, which a server does not run out of
+        address.sin_addr.s_addr = htonl(GATEWAY_SUB_NET | (uint32_t)((next_ >> 16) & 0x0fffffffu));
+        address.sin_port = htons((uint16_t)(next_ & 0xffffu));
+        next_++;
+        attach(gateway, gateway_address, username, address);
+        return address;
+    }
+
+    /**
+     * @brief Put a user behind a gateway at the address it was given, e.g. by a server being taken over
+    */
+    void attach(std::string_view gateway, const sockaddr_in * gateway_address, std::string_view username,
+        const sockaddr_in& address) {
+        detach(username);
+        auto it = subs_.emplace(username, sub{std::string{gateway}, gateway_address, address}).first;
+        addresses_[key(address)] = &*it;
+        gateways_[it->second.gateway_].emplace(username);
+        memory_.charge(sub_bytes(username, gateway));
+        // addresses given from now on must not collide with those taken over
+        next_ = std::max(next_, index(address) + 1);
+    }
+
+    /**
+     * @brief Take a user from behind its gateway, if it is behind one
+    */
+    void detach(std::string_view username) {
+        auto it = subs_.find(username);
+        if (it == subs_.end()) {
+            return;
+        }
+        addresses_.erase(key(it->second.address_));
+        if (auto gateway = gateways_.find(it->second.gateway_); gateway != gateways_.end()) {
+            gateway->second.erase(it->first);
+            if (gateway->second.empty()) {
+                gateways_.erase(gateway);
+            }
+        }
+        memory_.credit(sub_bytes(it->first, it->second.gateway_));
+        subs_.erase(it);
+    }
+
+    void clear() {
+        subs_.clear();
+        addresses_.clear();
+        gateways_.clear();
+        memory_.reset();
+    }
+
+    /**
+     * @brief A user behind a gateway, nullptr if it is not behind one
+    */
+    const sub * find(std::string_view username) const {
+        auto it = subs_.find(username);
+        return it == subs_.end() ? nullptr : &it->second;
+    }
+
+    /**
+     * @brief The user given an address, nullptr if no user has it
+    */
+    const value_type * find(const sockaddr_in& address) const {
+        auto it = addresses_.find(key(address));
+        return it == addresses_.end() ? nullptr : it->second;
+    }
+
+    /**
+     * @brief Users behind a gateway, copied so they can be taken offline while walking them
+    */
+    std::vector<std::string> subs(std::string_view gateway) const {
+        std::vector<std::string> users;
+        if (auto it = gateways_.find(gateway); it != gateways_.end()) {
+            users.assign(it->second.begin(), it->second.end());
+        }
+        return users;
+    }
+
+    /**
+     * @brief Number of users behind a gateway
+    */
+    size_t count(std::string_view gateway) const {
+        auto it = gateways_.find(gateway);
+        return it == gateways_.end() ? 0 : it->second.size();
+    }
+
+    /**
+     * @brief Call f with the username and sub of every user behind every gateway
+    */
+    template <typename F>
+    void for_each(F f) const {
+        for (const auto& entry: subs_) {
+            f(entry.first, entry.second);
+        }
+    }
+
+    /**
+     * @brief Users behind all gateways
+    */
+    size_t size() const {
+        return subs_.size();
+    }
+
+    bool full() const {
+        return memory_.full();
+    }
+
+    const memory_account& memory() const {
+        return memory_;
+    }
+
+private:
+    static uint64_t key(const sockaddr_in& address) {
+        return ((uint64_t)address.sin_addr.s_addr << 16) | address.sin_port;
+    }
+
+    static uint64_t index(const sockaddr_in& address) {
+        return ((uint64_t)(ntohl(address.sin_addr.s_addr) & 0x0fffffffu) << 16) | ntohs(address.sin_port);
+    }
+
+    /**
+     * @brief Estimated heap held for a user behind a gateway
+    */
+    static size_t sub_bytes(std::string_view username, std::string_view gateway) {
+        return node_bytes(sizeof(value_type), username.length()) + string_bytes(gateway.length()) +
+            node_bytes(sizeof(std::pair<const uint64_t, const value_type *>)) +
+            node_bytes(sizeof(std::string), username.length());
+    }
+
+    std::map<std::string, sub, std::less<>> subs_;
+    // users by the address they were given
+    std::unordered_map<uint64_t, const value_type *> addresses_;
+    // users behind each gateway
+    std::map<std::string, std::set<std::string, std::less<>>, std::less<>> gateways_;
+    uint64_t next_ = 0;
+    memory_account memory_;
+};
+
+}; // namespace chat
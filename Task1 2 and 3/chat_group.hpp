@@ -0,0 +1,386 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "chat_memory.hpp"
+
+// How long a group with no member online is kept, by default, in milliseconds
+#define GROUP_TTL_MS 3600000
+// How often groups are looked over for abandoned ones, in milliseconds
+#define GROUP_SWEEP_MS 1000
+// Most members looked up for being online in one look over, the rest wait for the next
+#define GROUP_SWEEP_BUDGET 4096
+
+namespace chat {
+
+/**
+ * @brief Members of a chat group
+ *
+ * Members are hashed by name, so adding or removing one takes the same
+ * time however large the group is, and are also kept in a dense array for
+ * fan-out. Removing a member moves the last one into its place, so the
+ * fan-out order is not stable across removals.
+*/
+class group_members {
+public:
+    group_members() = default;
+    group_members(const group_members&) = delete;
+    group_members& operator=(const group_members&) = delete;
+    group_members(group_members&&) = default;
+    group_members& operator=(group_members&&) = default;
+
+    /**
+     * @brief Add a member
+     * @param username of member
+     * @return false if already a member
+    */
+    bool add(std::string_view username) {
+        auto [it, added] = index_.emplace(std::string{username}, members_.size());
+        if (added) {
+            // the map's nodes do not move when it rehashes, so the pointer stays valid
+            members_.push_back(&*it);
+            bytes_ += member_bytes(username);
+        }
+        return added;
+    }
+
+    /**
+     * @brief Remove a member
+     * @param username of member
+     * @return false if not a member
+    */
+    bool remove(std::string_view username) {
+        auto it = index_.find(std::string{username});
+        if (it == index_.end()) {
+            return false;
+        }
+        size_t position = it->second;
+        members_[position] = members_.back();
+        members_[position]->second = position;
+        members_.pop_back();
+        index_.erase(it);
+        bytes_ -= member_bytes(username);
+        return true;
+    }
+
+    bool contains(std::string_view username) const {
+        return index_.find(std::string{username}) != index_.end();
+    }
+
+    size_t size() const {
+        return members_.size();
+    }
+
+    bool empty() const {
+        return members_.empty();
+    }
+
+    /**
+     * @brief Estimated heap held by the members, in bytes
+    */
+    size_t memory() const {
+        return bytes_;
+    }
+
+    /**
+     * @brief Note activity in the group, which keeps it from being deleted as abandoned
+    */
+    void touch(uint64_t now_ns) {
+        touched_ns_ = now_ns;
+    }
+
+    uint64_t touched_ns() const {
+        return touched_ns_;
+    }
+
+    /**
+     * @brief Call a function with the name of every member
+    */
+    template <typename Visit>
+    void for_each(Visit visit) const {
+        for (const auto * member: members_) {
+            visit(member->first);
+        }
+    }
+
+    /**
+     * @brief Call a predicate with the name of members until it returns true
+     * @param looked_up receives the number of members the predicate was called with
+     * @return true if the predicate returned true for a member
+    */
+    template <typename Predicate>
+    bool any_of(Predicate predicate, size_t& looked_up) const {
+        looked_up = 0;
+        for (const auto * member: members_) {
+            looked_up++;
+            if (predicate(member->first)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+private:
+    static size_t member_bytes(std::string_view username) {
+        return node_bytes(sizeof(std::pair<const std::string, size_t>), username.length()) + sizeof(void *);
+    }
+
+    std::unordered_map<std::string, size_t> index_;
+    // dense, for fan-out, each entry is the member's node in index_
+    std::vector<std::pair<const std::string, size_t>*> members_;
+    size_t bytes_ = 0;
+    uint64_t touched_ns_ = 0;
+};
+
+/**
+ * @brief Every chat group, by name, with an account of the memory they hold
+ *
+ * Groups are only changed through the table, so its account stays up to
+ * date, and so does its index of the groups each user is a member of. A
+ * group none of whose members has been online for the time to
+ * live is abandoned, and is deleted by expire, which looks over a bounded
+ * number of groups on each call and carries on from there on the next.
+*/
+class group_table {
+public:
+    using map = std::map<std::string, group_members, std::less<>>;
+    using iterator = map::iterator;
+    using const_iterator = map::const_iterator;
+
+    /**
+     * @brief Delete abandoned groups, and cap the table
+     * @param ttl_ms how long a group with no member online is kept, 0 to keep groups forever
+     * @param cap most memory groups may hold, in bytes, 0 for no cap
+    */
+    void configure(uint32_t ttl_ms, size_t cap) {
+        ttl_ns_ = ttl_ms * 1000000ull;
+        memory_.set_cap(cap);
+    }
+
+    iterator find(std::string_view groupname) {
+        return groups_.find(groupname);
+    }
+
+    const_iterator find(std::string_view groupname) const {
+        return groups_.find(groupname);
+    }
+
+    iterator begin() {
+        return groups_.begin();
+    }
+
+    iterator end() {
+        return groups_.end();
+    }
+
+    const_iterator begin() const {
+        return groups_.begin();
+    }
+
+    const_iterator end() const {
+        return groups_.end();
+    }
+
+    size_t size() const {
+        return groups_.size();
+    }
+
+    /**
+     * @brief At the cap, so groups should not be created or grown
+    */
+    bool full() const {
+        return memory_.full();
+    }
+
+    const memory_account& memory() const {
+        return memory_;
+    }
+
+    /**
+     * @brief Create an empty group, or find the group if it already exists
+     * @param groupname of group
+     * @param now_ns current time
+    */
+    iterator create(std::string_view groupname, uint64_t now_ns) {
+        auto [it, added] = groups_.emplace(groupname, group_members{});
+        if (added) {
+            memory_.charge(group_bytes(groupname));
+            it->second.touch(now_ns);
+        }
+        return it;
+    }
+
+    /**
+     * @brief Add a member to a group
+     * @return false if already a member
+    */
+    bool add(iterator it, std::string_view username) {
+        size_t before = it->second.memory();
+        if (!it->second.add(username)) {
+            return false;
+        }
+        memory_.charge(it->second.memory() - before);
+        join(username, &*it);
+        return true;
+    }
+
+    /**
+     * @brief Remove a member from a group, which is kept even once empty
+     * @return false if not a member
+    */
+    bool remove(iterator it, std::string_view username) {
+        size_t before = it->second.memory();
+        if (!it->second.remove(username)) {
+            return false;
+        }
+        memory_.credit(before - it->second.memory());
+        leave(username, &*it);
+        return true;
+    }
+
+    void erase(iterator it) {
+        it->second.for_each([&](const std::string& member) {
+            leave(member, &*it);
+        });
+        memory_.credit(group_bytes(it->first) + it->second.memory());
+        groups_.erase(it);
+    }
+
+    void clear() {
+        groups_.clear();
+        memberships_.clear();
+        memory_.reset();
+        cursor_.clear();
+    }
+
+    /**
+     * @brief Call a function with the name and members of every group a user is a member of
+    */
+    template <typename Visit>
+    void for_each_group(std::string_view username, Visit visit) const {
+        auto it = memberships_.find(username);
+        if (it == memberships_.end()) {
+            return;
+        }
+        for (const map::value_type * group: it->second) {
+            visit(group->first, group->second);
+        }
+    }
+
+    /**
+     * @brief Time to call expire
+    */
+    bool due(uint64_t now_ns) const {
+        return expiring() && now_ns - swept_ns_ >= GROUP_SWEEP_MS * 1000000ull;
+    }
+
+    /**
+     * @brief Abandoned groups are deleted, so expire should be called
+    */
+    bool expiring() const {
+        return ttl_ns_ > 0;
+    }
+
+    /**
+     * @brief Look over the next groups, deleting those abandoned for the time to live
+     * @param now_ns current time
+     * @param online called with a member's name, true if the member is online
+     * @param deleted called with the name of each group before it is deleted
+    */
+    template <typename Online, typename Deleted>
+    void expire(uint64_t now_ns, Online online, Deleted deleted) {
+        swept_ns_ = now_ns;
+        if (!expiring()) {
+            return;
+        }
+        size_t budget = GROUP_SWEEP_BUDGET;
+        size_t visits = groups_.size();
+        auto it = groups_.upper_bound(cursor_);
+        for (; visits > 0 && budget > 0; visits--) {
+            if (it == groups_.end()) {
+                it = groups_.begin();
+            }
+            cursor_ = it->first;
+            group_members& members = it->second;
+            size_t looked_up = 0;
+            bool abandoned = !members.any_of(online, looked_up);
+            budget -= std::min(budget, std::max<size_t>(looked_up, 1));
+            if (!abandoned) {
+                // a group is abandoned from when it was last seen with a member online
+                members.touch(now_ns);
+                ++it;
+            }
+            else if (now_ns - members.touched_ns() >= ttl_ns_) {
+                deleted(it->first);
+                erase(it++);
+            }
+            else {
+                ++it;
+            }
+        }
+    }
+
+private:
+    using groups_of = std::vector<const map::value_type *>;
+
+    static size_t group_bytes(std::string_view groupname) {
+        return node_bytes(sizeof(map::value_type), groupname.length());
+    }
+
+    static size_t user_bytes(std::string_view username) {
+        return node_bytes(sizeof(std::pair<const std::string, groups_of>), username.length());
+    }
+
+    /**
+     * @brief Index a user as a member of a group
+    */
+    void join(std::string_view username, const map::value_type * group) {
+        auto it = memberships_.find(username);
+        if (it == memberships_.end()) {
+            it = memberships_.emplace(username, groups_of{}).first;
+            memory_.charge(user_bytes(username));
+        }
+        it->second.push_back(group);
+        memory_.charge(sizeof(void *));
+    }
+
+    /**
+     * @brief Take a group out of a user's index, and the user once in no group
+    */
+    void leave(std::string_view username, const map::value_type * group) {
+        auto it = memberships_.find(username);
+        if (it == memberships_.end()) {
+            return;
+        }
+        groups_of& of = it->second;
+        if (auto at = std::find(of.begin(), of.end(), group); at != of.end()) {
+            *at = of.back();
+            of.pop_back();
+            memory_.credit(sizeof(void *));
+        }
+        if (of.empty()) {
+            memory_.credit(user_bytes(it->first));
+            memberships_.erase(it);
+        }
+    }
+
+    map groups_;
+    // groups each user is a member of, map nodes do not move so the pointers stay valid
+    std::map<std::string, groups_of, std::less<>> memberships_;
+    memory_account memory_;
+    uint64_t ttl_ns_ = GROUP_TTL_MS * 1000000ull;
+    uint64_t swept_ns_ = 0;
+    // name of the last group looked over, expire carries on after it
+    std::string cursor_;
+};
+
+}; // namespace chat
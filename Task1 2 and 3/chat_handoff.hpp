@@ -0,0 +1,329 @@
+#pragma once
+
+#include <poll.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <string>
+#include <string_view>
+
+#include <arpa/inet.h>
+
+#include "chat_ex.hpp"
+
+/**
+ * @brief Server state image format
+ *
+ * An image is everything a new server process needs to carry on from a
+ * running one. It starts with HANDOFF_MAGIC and a uint32_t version, then
+ * each section is a uint32_t count followed by its entries. Strings are a
+ * uint16_t length followed by the bytes, as names, e.g. of groups, may be as
+ * long as a message (MAX_MESSAGE_LENGTH). All fields are in host byte order, except for
+ * addresses and ports which are kept in network byte order, as in sockaddr_in.
+*/
+#define HANDOFF_MAGIC "CHIM"
+#define HANDOFF_VERSION 6
+
+// How long the new server waits for the running one to hand over, in milliseconds
+#define HANDOFF_TIMEOUT_MS 5000
+
+namespace chat {
+
+/**
+ * @brief Builds a state image
+*/
+class image_writer {
+public:
+    image_writer() {
+        data_.append(HANDOFF_MAGIC, 4);
+        put_u32(HANDOFF_VERSION);
+    }
+
+    void put_u8(uint8_t value) {
+        data_.push_back((char)value);
+    }
+
+    void put_u16(uint16_t value) {
+        data_.append((const char*)&value, sizeof(value));
+    }
+
+    void put_u32(uint32_t value) {
+        data_.append((const char*)&value, sizeof(value));
+    }
+
+    void put_string(std::string_view value) {
+        static_assert(MAX_MESSAGE_LENGTH <= UINT16_MAX, "strings in an image have a uint16_t length");
+        put_u16((uint16_t)value.length());
+        data_.append(value.data(), (uint16_t)value.length());
+    }
+
+    void put_address(const sockaddr_in& address) {
+        put_u32(address.sin_addr.s_addr);
+        put_u16(address.sin_port);
+    }
+
+    const std::string& data() const {
+        return data_;
+    }
+
+private:
+    std::string data_;
+};
+
+/**
+ * @brief Reads a state image
+ *
+ * Reads past the end of the image, or of a malformed image, fail and
+ * leave the reader !ok().
+*/
+class image_reader {
+public:
+    explicit image_reader(std::string_view data) : data_{data} {
+        ok_ = data_.length() >= 4 && memcmp(data_.data(), HANDOFF_MAGIC, 4) == 0;
+        pos_ = 4;
+        ok_ = ok_ && get_u32() == HANDOFF_VERSION;
+    }
+
+    bool ok() const {
+        return ok_;
+    }
+
+    /**
+     * @brief Everything in the image has been read
+    */
+    bool at_end() const {
+        return !ok_ || pos_ == data_.length();
+    }
+
+    uint8_t get_u8() {
+        uint8_t value = 0;
+        get(&value, sizeof(value));
+        return value;
+    }
+
+    uint16_t get_u16() {
+        uint16_t value = 0;
+        get(&value, sizeof(value));
+        return value;
+    }
+
+    uint32_t get_u32() {
+        uint32_t value = 0;
+        get(&value, sizeof(value));
+        return value;
+    }
+
+    std::string_view get_string() {
+        size_t length = get_u16();
+        if (!ok_ || data_.length() - pos_ < length) {
+            ok_ = false;
+            return std::string_view{};
+        }
+        std::string_view value = data_.substr(pos_, length);
+        pos_ += length;
+        return value;
+    }
+
+    sockaddr_in get_address() {
+        sockaddr_in address;
+        memset(&address, 0, sizeof(address));
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = get_u32();
+        address.sin_port = get_u16();
+        return address;
+    }
+
+private:
+    void get(void * value, size_t length) {
+        if (!ok_ || data_.length() - pos_ < length) {
+            ok_ = false;
+            return;
+        }
+        memcpy(value, data_.data() + pos_, length);
+        pos_ += length;
+    }
+
+    std::string_view data_;
+    size_t pos_;
+    bool ok_;
+};
+
+/**
+ * @brief Fill in a Unix socket address
+ * @return false if the path is too long
+*/
+inline bool unix_address(const std::string& path, sockaddr_un& address) {
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (path.length() >= sizeof(address.sun_path)) {
+        return false;
+    }
+    memcpy(address.sun_path, path.c_str(), path.length());
+    return true;
+}
+
+/**
+ * @brief Write a whole buffer to a stream socket
+*/
+inline bool write_all(int fd, const char * data, size_t length) {
+    while (length > 0) {
+        ssize_t n = ::write(fd, data, length);
+        if (n <= 0) {
+            return false;
+        }
+        data += n;
+        length -= n;
+    }
+    return true;
+}
+
+/**
+ * @brief Read a whole buffer from a stream socket
+*/
+inline bool read_all(int fd, char * data, size_t length) {
+    while (length > 0) {
+        ssize_t n = ::read(fd, data, length);
+        if (n <= 0) {
+            return false;
+        }
+        data += n;
+        length -= n;
+    }
+    return true;
+}
+
+/**
+ * @brief Unix socket on which a running server waits for its replacement
+*/
+class handoff_listener {
+public:
+    handoff_listener() = default;
+    handoff_listener(const handoff_listener&) = delete;
+    handoff_listener& operator=(const handoff_listener&) = delete;
+
+    ~handoff_listener() {
+        if (fd_ >= 0) {
+            close(fd_);
+        }
+    }
+
+    /**
+     * @brief Listen on a path, replacing any socket a previous server left there
+     * @param path of the Unix socket
+     * @return true if listening
+    */
+    bool listen(const std::string& path) {
+        sockaddr_un address;
+        if (!unix_address(path, address)) {
+            return false;
+        }
+        fd_ = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd_ < 0) {
+            return false;
+        }
+        unlink(path.c_str());
+        return ::bind(fd_, (const sockaddr*)&address, sizeof(address)) == 0 && ::listen(fd_, 1) == 0;
+    }
+
+    /**
+     * @brief Wait for a new server to connect
+     * @param timeout_ms how long to wait
+     * @return connection to the new server, -1 if none arrived
+    */
+    int accept(int timeout_ms) {
+        pollfd p{fd_, POLLIN, 0};
+        if (poll(&p, 1, timeout_ms) <= 0) {
+            return -1;
+        }
+        return ::accept(fd_, nullptr, nullptr);
+    }
+
+private:
+    int fd_ = -1;
+};
+
+/**
+ * @brief Pass a socket and the state image to the new server
+ * @param conn connection from handoff_listener::accept
+ * @param fd socket to pass
+ * @param image state image
+ * @return true if everything was sent
+*/
+inline bool send_handoff(int conn, int fd, const std::string& image) {
+    uint32_t size = image.size();
+    iovec iov{&size, sizeof(size)};
+    char control[CMSG_SPACE(sizeof(int))];
+    memset(control, 0, sizeof(control));
+
+    msghdr header;
+    memset(&header, 0, sizeof(header));
+    header.msg_iov = &iov;
+    header.msg_iovlen = 1;
+    header.msg_control = control;
+    header.msg_controllen = sizeof(control);
+
+    cmsghdr * c = CMSG_FIRSTHDR(&header);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(c), &fd, sizeof(int));
+
+    if (sendmsg(conn, &header, 0) != sizeof(size)) {
+        return false;
+    }
+    return write_all(conn, image.data(), image.size());
+}
+
+/**
+ * @brief Take over from the server listening on a path
+ * @param path of the running server's Unix socket
+ * @param image receives the state image
+ * @return the running server's socket, -1 if there is no server to take over from
+*/
+inline int receive_handoff(const std::string& path, std::string& image) {
+    sockaddr_un address;
+    if (!unix_address(path, address)) {
+        return -1;
+    }
+    int conn = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (conn < 0) {
+        return -1;
+    }
+    timeval timeout{HANDOFF_TIMEOUT_MS / 1000, (HANDOFF_TIMEOUT_MS % 1000) * 1000};
+    setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    if (::connect(conn, (const sockaddr*)&address, sizeof(address)) != 0) {
+        close(conn);
+        return -1;
+    }
+
+    uint32_t size = 0;
+    iovec iov{&size, sizeof(size)};
+    char control[CMSG_SPACE(sizeof(int))];
+    msghdr header;
+    memset(&header, 0, sizeof(header));
+    header.msg_iov = &iov;
+    header.msg_iovlen = 1;
+    header.msg_control = control;
+    header.msg_controllen = sizeof(control);
+
+    int fd = -1;
+    if (recvmsg(conn, &header, MSG_WAITALL) == sizeof(size)) {
+        for (cmsghdr * c = CMSG_FIRSTHDR(&header); c != nullptr; c = CMSG_NXTHDR(&header, c)) {
+            if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS) {
+                memcpy(&fd, CMSG_DATA(c), sizeof(int));
+            }
+        }
+    }
+    image.resize(size);
+    if (fd >= 0 && !read_all(conn, image.data(), size)) {
+        close(fd);
+        fd = -1;
+    }
+    close(conn);
+    return fd;
+}
+
+}; // namespace chat
@@ -0,0 +1,282 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <deque>
+#include <unordered_map>
+
+#include "chat_ex.hpp"
+
+// Most senders kept once they have nothing waiting, before the idle ones are forgotten
+#define LANE_IDLE_SENDERS 1024
+
+namespace chat {
+
+/**
+ * @brief Lane a message travels in through the server
+ * @var traffic_lane::LANE_CONTROL
+ * Joins, leaves, resumes, exits and the replies to them, always taken first
+ * @var traffic_lane::LANE_BULK
+ * Chat and everything else, shared between senders
+*/
+enum traffic_lane {
+    LANE_CONTROL = 0,
+    LANE_BULK,
+    LANE_COUNT,
+};
+
+/**
+ * @brief Lane of a message, by its type
+*/
+inline traffic_lane lane_of(uint8_t type) {
+    switch (type) {
+        case JOIN:
+        case JACK:
+        case LEAVE:
+        case LACK:
+        case EXIT:
+        case RESUME:
+        case SUB_JOIN:
+        case SUB_LEAVE:
+            return LANE_CONTROL;
+        default:
+            return LANE_BULK;
+    }
+}
+
+/**
+ * @brief Packets waiting in the bulk lane, queued per sender and served in weighted turns
+ *
+ * Deficit round robin: every sender with packets waiting is served up to
+ * its weight in packets before the next one's turn, so a sender flooding
+ * the server delays its own packets rather than everyone's. Once more than
+ * the limit are waiting, a packet is dropped without looking through the
+ * senders: the newest of the sender pushing if it holds more than its
+ * weighted share of the limit, otherwise the newest of the sender that
+ * has held the most for its weight, which is the flooding sender's own.
+ *
+ * Packets are held by index, e.g. of a receive_channel buffer, and senders
+ * by a key of their address.
+*/
+class fair_queue {
+public:
+    /**
+     * @param limit most packets waiting, before some are dropped
+    */
+    explicit fair_queue(size_t limit) : limit_{limit} {
+    }
+
+    /**
+     * @brief Queue a packet behind the sender's earlier ones
+     * @param sender key of the sender
+     * @param slot packet
+     * @param weight called for the sender's share, in packets per turn, when it starts waiting
+     * @param dropped receives the packet dropped to stay within the limit
+     * @return true if a packet was dropped, and must be released by the caller
+    */
+    template <typename Weight>
+    bool push(uint64_t sender, uint32_t slot, Weight weight, uint32_t& dropped) {
+        queue& q = senders_[sender];
+        if (!q.listed_) {
+            q.listed_ = true;
+            q.weight_ = std::max<uint32_t>(weight(), 1);
+            q.credit_ = q.weight_;
+            turns_.push_back(&q);
+            listed_weight_ += q.weight_;
+        }
+        q.slots_.push_back(slot);
+        if (heaviest_ == nullptr || q.slots_.size() * heaviest_->weight_ > heaviest_->slots_.size() * q.weight_) {
+            heaviest_ = &q;
+        }
+        if (++size_ <= limit_) {
+            return false;
+        }
+
+        queue * victim = q.slots_.size() * listed_weight_ > limit_ * q.weight_ ? &q : heaviest_;
+        dropped = victim->slots_.back();
+        victim->slots_.pop_back();
+        emptied(*victim);
+        size_--;
+        dropped_++;
+        return true;
+    }
+
+    /**
+     * @brief Take the next packet, of the sender whose turn it is
+     * @return false if nothing is waiting
+    */
+    bool pop(uint32_t& slot) {
+        while (!turns_.empty()) {
+            queue& q = *turns_.front();
+            if (q.slots_.empty()) {
+                // emptied by pop_from, or by a drop
+                unlist(q);
+                continue;
+            }
+            slot = q.slots_.front();
+            q.slots_.pop_front();
+            size_--;
+            emptied(q);
+            if (q.slots_.empty()) {
+                unlist(q);
+            }
+            else if (--q.credit_ == 0) {
+                q.credit_ = q.weight_;
+                turns_.pop_front();
+                turns_.push_back(&q);
+            }
+            forget_idle();
+            return true;
+        }
+        forget_idle();
+        return false;
+    }
+
+    /**
+     * @brief Take the oldest packet of a sender, out of turn
+     * @param sender key of the sender
+     * @param slot receives the packet
+     * @param earlier called with the oldest packet, false leaves it waiting
+     * @return false if the sender has nothing waiting, or earlier refused it
+    */
+    template <typename Earlier>
+    bool pop_from(uint64_t sender, uint32_t& slot, Earlier earlier) {
+        auto it = senders_.find(sender);
+        if (it == senders_.end() || it->second.slots_.empty() || !earlier(it->second.slots_.front())) {
+            return false;
+        }
+        slot = it->second.slots_.front();
+        it->second.slots_.pop_front();
+        emptied(it->second);
+        size_--;
+        return true;
+    }
+
+    /**
+     * @brief Forget every packet and sender
+     * @param release called with each packet still waiting, which must be released by the caller
+    */
+    template <typename Release>
+    void clear(Release release) {
+        for (auto& sender: senders_) {
+            for (uint32_t slot: sender.second.slots_) {
+                release(slot);
+            }
+        }
+        turns_.clear();
+        senders_.clear();
+        heaviest_ = nullptr;
+        listed_weight_ = 0;
+        size_ = 0;
+    }
+
+    bool empty() const {
+        return size_ == 0;
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+    /**
+     * @brief Packets dropped because more than the limit were waiting
+    */
+    uint64_t dropped() const {
+        return dropped_;
+    }
+
+private:
+    struct queue {
+        std::deque<uint32_t> slots_;
+        uint32_t weight_ = 1;
+        // packets left in the sender's current turn
+        uint32_t credit_ = 0;
+        // in turns_, which it may still be for a while after its packets are gone
+        bool listed_ = false;
+    };
+
+    /**
+     * @brief Take a sender whose turn it is out of the turns, once it has nothing waiting
+    */
+    void unlist(queue& q) {
+        q.listed_ = false;
+        listed_weight_ -= q.weight_;
+        turns_.pop_front();
+    }
+
+    /**
+     * @brief Stop counting a sender as the heaviest once it has nothing waiting
+    */
+    void emptied(const queue& q) {
+        if (&q == heaviest_ && q.slots_.empty()) {
+            heaviest_ = nullptr;
+        }
+    }
+
+    /**
+     * @brief Forget the senders with nothing waiting, once there are many and none waits
+    */
+    void forget_idle() {
+        if (turns_.empty() && senders_.size() > LANE_IDLE_SENDERS) {
+            senders_.clear();
+        }
+    }
+
+    size_t limit_;
+    size_t size_ = 0;
+    uint64_t dropped_ = 0;
+    // queues are never moved, turns_ points into senders_
+    std::unordered_map<uint64_t, queue> senders_;
+    std::deque<queue *> turns_;
+    // sender that held the most for its weight when it last pushed, nullptr once it has nothing waiting
+    queue * heaviest_ = nullptr;
+    // weights of the senders in turns_
+    uint64_t listed_weight_ = 0;
+};
+
+/**
+ * @brief Take the next packet to route from a channel received into in lanes
+ *
+ * A control packet is taken ahead of all chat waiting, but the chat its own
+ * sender sent before it is handed to route first. The bulk lane of the
+ * channel is emptied into the queue only once the control packet is taken,
+ * so that chat received before it is in the queue by then.
+ *
+ * @param channel receive_channel with LANE_COUNT lanes
+ * @param bulk queue chat waits in between the channel and the router
+ * @param sender called with a packet for the key of its sender
+ * @param weight called with a packet for its sender's share of the bulk lane
+ * @param order called with a packet for when it was received, counting up
+ * @param route called with each packet to be routed ahead of the one taken
+ * @param slot receives the packet to route
+ * @return false if nothing is waiting
+*/
+template <typename Channel, typename Sender, typename Weight, typename Order, typename Route>
+bool next_packet(Channel& channel, fair_queue& bulk, Sender sender, Weight weight, Order order, Route route,
+    uint32_t& slot) {
+    bool control = channel.recv(slot, LANE_CONTROL);
+
+    // chat waits in its sender's queue, and the senders take turns
+    uint32_t waiting;
+    uint32_t shed;
+    while (channel.recv(waiting, LANE_BULK)) {
+        if (bulk.push(sender(waiting), waiting, [&]() { return weight(waiting); }, shed)) {
+            channel.release(shed);
+        }
+    }
+
+    if (!control) {
+        return bulk.pop(slot);
+    }
+    // control goes first, though not ahead of the chat its own sender sent before it
+    uint64_t received = order(slot);
+    uint32_t earlier;
+    while (bulk.pop_from(sender(slot), earlier, [&](uint32_t oldest) { return order(oldest) < received; })) {
+        route(earlier);
+    }
+    return true;
+}
+
+}; // namespace chat
@@ -0,0 +1,274 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <mutex>
+#include <string>
+
+#include "chat_ex.hpp"
+#include "chat_trace.hpp"
+
+/**
+ * @brief End to end latency tracing
+ *
+ * A traced datagram is a chat_message followed by a latency_trailer, so
+ * untraced peers keep sending and receiving plain messages. The trailer
+ * collects a monotonic timestamp at every hop. The server copies the
+ * trailer of the packet it is handling onto every message that packet
+ * causes, so the receiving client sees the sender's stamps too.
+ *
+ * Stamps are in the server's clock. Clients estimate their offset to it
+ * from their own JOIN/JACK exchange, and convert their stamps once the
+ * offset is known (LATENCY_SERVER_TIME).
+*/
+#define LATENCY_MAGIC 0x43544c59u
+// The client stamps are in the server's clock
+#define LATENCY_SERVER_TIME 1u
+// Histogram buckets, bucket i counts latencies below 2^i ns
+#define LATENCY_BUCKETS 40
+// Every n-th complete record is written to the latency trace file
+#define LATENCY_SAMPLE_EVERY 16
+
+namespace chat {
+
+enum latency_stamp {
+    STAMP_CLIENT_SEND,
+    STAMP_SERVER_RECV,
+    STAMP_SERVER_ROUTE,
+    STAMP_SERVER_HANDLED,
+    STAMP_SERVER_SEND,
+    STAMP_CLIENT_RECV,
+    STAMP_CLIENT_DISPLAY,
+    STAMP_COUNT,
+};
+
+enum latency_hop {
+    HOP_UPLINK,     // client send to server receive
+    HOP_QUEUE,      // server receive to routing
+    HOP_HANDLER,    // routing to the handler encoding the message
+    HOP_EGRESS,     // encoding to the egress worker sending it
+    HOP_DOWNLINK,   // server send to client receive
+    HOP_DISPLAY,    // client receive to the GUI displaying it
+    HOP_TOTAL,      // client send to the last stamp
+    HOP_COUNT,
+};
+
+inline const char * hop_name(latency_hop hop) {
+    static const char * names[HOP_COUNT] = {
+        "uplink", "queue", "handler", "egress", "downlink", "display", "total" };
+    return names[hop];
+}
+
+/**
+ * @struct latency_trailer
+ * @brief Timestamps following a traced chat_message
+ * @var latency_trailer::magic_
+ *  Member 'magic_' always LATENCY_MAGIC
+ * @var latency_trailer::flags_
+ *  Member 'flags_' LATENCY_SERVER_TIME if the client stamps are in the server's clock
+ * @var latency_trailer::stamps_
+ *  Member 'stamps_' monotonic time in ns at each latency_stamp, 0 if not reached
+ */
+struct latency_trailer {
+    uint32_t magic_;
+    uint32_t flags_;
+    uint64_t stamps_[STAMP_COUNT];
+};
+
+/**
+ * @brief Length of a datagram carrying a latency trailer
+*/
+#define TRACED_MESSAGE_LENGTH (sizeof(chat::chat_message) + sizeof(chat::latency_trailer))
+
+/**
+ * @brief Read the latency trailer of a datagram
+ * @param packet received datagram
+ * @param len length of datagram
+ * @param trailer receives the trailer
+ * @return true if the datagram is traced
+*/
+inline bool read_trailer(const char * packet, int len, latency_trailer& trailer) {
+    if (len != (int)TRACED_MESSAGE_LENGTH) {
+        return false;
+    }
+    memcpy(&trailer, packet + sizeof(chat_message), sizeof(trailer));
+    return trailer.magic_ == LATENCY_MAGIC;
+}
+
+/**
+ * @brief Stamp a traced datagram in place
+*/
+inline void write_stamp(char * packet, latency_stamp stamp, uint64_t ns) {
+    memcpy(packet + sizeof(chat_message) + offsetof(latency_trailer, stamps_) + stamp * sizeof(uint64_t),
+        &ns, sizeof(ns));
+}
+
+/**
+ * @brief Log2 bucketed latency histogram
+*/
+class latency_histogram {
+public:
+    void record(uint64_t ns) {
+        int bucket = 0;
+        while (bucket < LATENCY_BUCKETS - 1 && ns >= (1ull << bucket)) {
+            bucket++;
+        }
+        counts_[bucket]++;
+        count_++;
+        sum_ += ns;
+        if (ns > max_) {
+            max_ = ns;
+        }
+    }
+
+    /**
+     * @brief Upper bound of the bucket holding a percentile
+     * @param p percentile, 0 to 100
+    */
+    uint64_t percentile(double p) const {
+        uint64_t target = (uint64_t)(count_ * p / 100.0);
+        uint64_t seen = 0;
+        for (int bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+            seen += counts_[bucket];
+            if (seen > target) {
+                return 1ull << bucket;
+            }
+        }
+        return max_;
+    }
+
+    uint64_t count() const {
+        return count_;
+    }
+
+    uint64_t mean() const {
+        return count_ == 0 ? 0 : sum_ / count_;
+    }
+
+    uint64_t max() const {
+        return max_;
+    }
+
+private:
+    uint64_t counts_[LATENCY_BUCKETS] = { 0 };
+    uint64_t count_ = 0;
+    uint64_t sum_ = 0;
+    uint64_t max_ = 0;
+};
+
+/**
+ * @brief Aggregates latency trailers into per hop histograms
+ *
+ * Can be shared by any number of clients and threads. Every
+ * LATENCY_SAMPLE_EVERY-th record is also written, one line of per hop
+ * latencies in ns, to an optional trace file.
+*/
+class latency_recorder {
+public:
+    latency_recorder() = default;
+    latency_recorder(const latency_recorder&) = delete;
+    latency_recorder& operator=(const latency_recorder&) = delete;
+
+    ~latency_recorder() {
+        if (file_ != nullptr) {
+            fclose(file_);
+        }
+    }
+
+    /**
+     * @brief Sample records to a file
+     * @param path of trace file
+     * @param sample_every write every n-th record
+     * @return true if the file was opened
+    */
+    bool open(const std::string& path, uint32_t sample_every = LATENCY_SAMPLE_EVERY) {
+        file_ = fopen(path.c_str(), "w");
+        if (file_ == nullptr) {
+            return false;
+        }
+        sample_every_ = sample_every > 0 ? sample_every : 1;
+        fprintf(file_, "type");
+        for (int hop = 0; hop < HOP_COUNT; hop++) {
+            fprintf(file_, ",%s", hop_name((latency_hop)hop));
+        }
+        fprintf(file_, "\n");
+        return true;
+    }
+
+    /**
+     * @brief Record the hops of a received message
+     * @param type of message
+     * @param trailer stamps, in the server's clock
+    */
+    void record(uint8_t type, const latency_trailer& trailer) {
+        int64_t hops[HOP_COUNT];
+        const uint64_t * s = trailer.stamps_;
+        bool from_client = (trailer.flags_ & LATENCY_SERVER_TIME) != 0 && s[STAMP_CLIENT_SEND] != 0;
+        hops[HOP_UPLINK] = from_client ? span(s[STAMP_CLIENT_SEND], s[STAMP_SERVER_RECV]) : -1;
+        hops[HOP_QUEUE] = span(s[STAMP_SERVER_RECV], s[STAMP_SERVER_ROUTE]);
+        hops[HOP_HANDLER] = span(s[STAMP_SERVER_ROUTE], s[STAMP_SERVER_HANDLED]);
+        hops[HOP_EGRESS] = span(s[STAMP_SERVER_HANDLED], s[STAMP_SERVER_SEND]);
+        hops[HOP_DOWNLINK] = span(s[STAMP_SERVER_SEND], s[STAMP_CLIENT_RECV]);
+        hops[HOP_DISPLAY] = span(s[STAMP_CLIENT_RECV], s[STAMP_CLIENT_DISPLAY]);
+        uint64_t last = s[STAMP_CLIENT_DISPLAY] != 0 ? s[STAMP_CLIENT_DISPLAY] : s[STAMP_CLIENT_RECV];
+        hops[HOP_TOTAL] = from_client ? span(s[STAMP_CLIENT_SEND], last) : -1;
+
+        std::lock_guard<std::mutex> lock{lock_};
+        for (int hop = 0; hop < HOP_COUNT; hop++) {
+            if (hops[hop] >= 0) {
+                histograms_[hop].record(hops[hop]);
+            }
+        }
+        if (file_ != nullptr && records_++ % sample_every_ == 0) {
+            fprintf(file_, "%d", type);
+            for (int hop = 0; hop < HOP_COUNT; hop++) {
+                fprintf(file_, ",%lld", (long long)hops[hop]);
+            }
+            fprintf(file_, "\n");
+        }
+    }
+
+    /**
+     * @brief Summary of every hop, one line each
+    */
+    std::string report() {
+        std::lock_guard<std::mutex> lock{lock_};
+        std::string text;
+        char line[160];
+        for (int hop = 0; hop < HOP_COUNT; hop++) {
+            const latency_histogram& h = histograms_[hop];
+            if (h.count() == 0) {
+                continue;
+            }
+            snprintf(line, sizeof(line), "%-8s n %llu mean %.3f ms p50 < %.3f ms p99 < %.3f ms max %.3f ms\n",
+                hop_name((latency_hop)hop), (unsigned long long)h.count(), h.mean() / 1e6,
+                h.percentile(50) / 1e6, h.percentile(99) / 1e6, h.max() / 1e6);
+            text.append(line);
+        }
+        return text;
+    }
+
+private:
+    /**
+     * @brief Time between two stamps, -1 if either is missing
+     *
+     * Offset estimates are not exact, so a small negative span is reported as 0.
+    */
+    static int64_t span(uint64_t from, uint64_t to) {
+        if (from == 0 || to == 0) {
+            return -1;
+        }
+        return to > from ? (int64_t)(to - from) : 0;
+    }
+
+    std::mutex lock_;
+    latency_histogram histograms_[HOP_COUNT];
+    FILE * file_ = nullptr;
+    uint32_t sample_every_ = LATENCY_SAMPLE_EVERY;
+    uint64_t records_ = 0;
+};
+
+}; // namespace chat
@@ -0,0 +1,412 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <arpa/inet.h>
+
+#include "chat_client.hpp"
+#include "chat_ex.hpp"
+#include "chat_latency.hpp"
+#include "chat_shm.hpp"
+#include "chat_trace.hpp"
+#include "chat_transport.hpp"
+
+// How long to wait for the server before giving up on a phase
+#define LOAD_TIMEOUT_NS 30000000000ull
+// How long deliveries may stall before the rest are counted as lost
+#define LOAD_IDLE_NS 2000000000ull
+// Text of the broadcasts sent by the load clients
+#define LOAD_MESSAGE "load test"
+// How long the handshake probe waits for a JACK or LACK before counting it as lost
+#define LOAD_HANDSHAKE_TIMEOUT_MS 1000
+// Username the handshake probe joins as
+#define LOAD_PROBE_USER "loadprobe"
+
+/**
+ * @brief wait until a condition holds, or the phase times out
+ * @return true if the condition holds
+*/
+template <typename Condition>
+bool wait_for(Condition condition) {
+    uint64_t start_ns = chat::monotonic_ns();
+    while (!condition()) {
+        if (chat::monotonic_ns() - start_ns > LOAD_TIMEOUT_NS) {
+            return false;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return true;
+}
+
+/**
+ * @brief wait until a counter reaches its target, or stops moving
+ * @return true if the target was reached
+*/
+bool wait_for_count(const std::atomic<uint64_t>& counter, uint64_t target) {
+    uint64_t last = counter.load();
+    uint64_t last_ns = chat::monotonic_ns();
+    return wait_for([&]() {
+        uint64_t now = counter.load();
+        uint64_t now_ns = chat::monotonic_ns();
+        if (now != last) {
+            last = now;
+            last_ns = now_ns;
+        }
+        return now >= target || now_ns - last_ns > LOAD_IDLE_NS;
+    }) && counter.load() >= target;
+}
+
+/**
+ * @struct handshake_times
+ * @brief How long the server took to answer the handshakes of the probe
+ * @var handshake_times::jack_ns_
+ *  Member 'jack_ns_' JOIN to JACK of every handshake answered
+ * @var handshake_times::lack_ns_
+ *  Member 'lack_ns_' LEAVE to LACK of every handshake answered
+ * @var handshake_times::lost_
+ *  Member 'lost_' replies not received in time
+*/
+struct handshake_times {
+    std::vector<uint64_t> jack_ns_;
+    std::vector<uint64_t> lack_ns_;
+    int lost_ = 0;
+};
+
+/**
+ * @brief wait for a reply of a type, skipping whatever else the probe is sent
+ * @param sock probe socket
+ * @param type of reply
+ * @param sent_ns when the request was sent
+ * @return time from the request to the reply, 0 if it did not come in time
+*/
+uint64_t await_reply(chat::udp_transport& sock, chat::chat_type type, uint64_t sent_ns) {
+    chat::chat_message msg;
+    sockaddr_in from;
+    for (;;) {
+        uint64_t waited_ms = (chat::monotonic_ns() - sent_ns) / 1000000;
+        if (waited_ms >= LOAD_HANDSHAKE_TIMEOUT_MS) {
+            return 0;
+        }
+        pollfd pfd{sock.fd(), POLLIN, 0};
+        if (poll(&pfd, 1, LOAD_HANDSHAKE_TIMEOUT_MS - waited_ms) <= 0) {
+            continue;
+        }
+        while (sock.try_receive(&msg, sizeof(msg), from) > 0) {
+            if (msg.type_ == type) {
+                return chat::monotonic_ns() - sent_ns;
+            }
+        }
+    }
+}
+
+/**
+ * @brief join and leave over and over, as a client blocked on its JACK would, timing the replies
+ * @param sock probe socket, bound
+ * @param server_address address of server
+ * @param count most handshakes
+ * @param stop set to end the run early
+ * @param times receives the replies' times
+*/
+void probe_handshakes(
+    chat::udp_transport& sock, const sockaddr_in& server_address, int count,
+    const std::atomic<bool>& stop, handshake_times& times) {
+    const chat::chat_message join = chat::join_msg(LOAD_PROBE_USER);
+    const chat::chat_message leave = chat::leave_msg();
+    for (int i = 0; i < count && !stop.load(); i++) {
+        uint64_t sent_ns = chat::monotonic_ns();
+        sock.sendto(&join, sizeof(join), server_address);
+        if (uint64_t jack_ns = await_reply(sock, chat::JACK, sent_ns)) {
+            times.jack_ns_.push_back(jack_ns);
+        }
+        else {
+            times.lost_++;
+        }
+        sent_ns = chat::monotonic_ns();
+        sock.sendto(&leave, sizeof(leave), server_address);
+        if (uint64_t lack_ns = await_reply(sock, chat::LACK, sent_ns)) {
+            times.lack_ns_.push_back(lack_ns);
+        }
+        else {
+            times.lost_++;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+}
+
+/**
+ * @brief print the median, 99th percentile and worst of the probe's handshakes
+*/
+void report_handshakes(const char * phase, handshake_times& times) {
+    auto quantiles = [](std::vector<uint64_t>& ns, char * text, size_t length) {
+        if (ns.empty()) {
+            snprintf(text, length, "none");
+            return;
+        }
+        std::sort(ns.begin(), ns.end());
+        snprintf(text, length, "p50 %.3f ms, p99 %.3f ms, max %.3f ms",
+            ns[ns.size() / 2] / 1e6, ns[ns.size() * 99 / 100] / 1e6, ns.back() / 1e6);
+    };
+    char jack[128];
+    char lack[128];
+    quantiles(times.jack_ns_, jack, sizeof(jack));
+    quantiles(times.lack_ns_, lack, sizeof(lack));
+    printf("%zu handshakes %s: JACK %s; LACK %s; %d lost\n",
+        times.jack_ns_.size(), phase, jack, lack, times.lost_);
+}
+
+/**
+ * @brief entry point for the load generator, drives many clients from a single reactor thread
+*/
+int main(int argc, char ** argv) {
+    int clients = 100;
+    int broadcasts = 1;
+    int first_port = 20000;
+    bool use_multicast = false;
+    const char * server_name = "192.168.1.27";
+    const char * client_name = "127.0.0.1";
+    const char * latency_path = nullptr;
+    // clients attach to the server through shared memory, rather than UDP
+    const char * local_path = nullptr;
+    // users behind each client, which then acts as a gateway and only they broadcast
+    int gateway_users = 0;
+    // handshakes timed by a probe client, idle and while the broadcasts are delivered
+    int handshakes = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:b:p:a:c:ml:L:g:j:")) != -1) {
+        switch (opt) {
+            case 'n': {
+                clients = atoi(optarg);
+                break;
+            }
+            case 'b': {
+                broadcasts = atoi(optarg);
+                break;
+            }
+            case 'p': {
+                first_port = atoi(optarg);
+                break;
+            }
+            case 'a': {
+                server_name = optarg;
+                break;
+            }
+            case 'c': {
+                client_name = optarg;
+                break;
+            }
+            case 'm': {
+                use_multicast = true;
+                break;
+            }
+            case 'l': {
+                latency_path = optarg;
+                break;
+            }
+            case 'L': {
+                local_path = optarg;
+                break;
+            }
+            case 'g': {
+                gateway_users = atoi(optarg);
+                break;
+            }
+            case 'j': {
+                handshakes = atoi(optarg);
+                break;
+            }
+            default: {
+                printf(
+                    "USAGE: %s [-n clients] [-b broadcasts per client] [-p first port] "
+                    "[-a server address] [-c client address] [-m] [-l <latency trace file>] "
+                    "[-L <local server socket>] [-g <users per gateway>] [-j <handshakes to time>]\n", argv[0]);
+                return 0;
+            }
+        }
+    }
+
+    sockaddr_in server_address;
+    memset(&server_address, 0, sizeof(server_address));
+    server_address.sin_family = AF_INET;
+    server_address.sin_port = htons(SERVER_PORT);
+    inet_pton(AF_INET, server_name, &server_address.sin_addr);
+
+    std::atomic<uint64_t> received{0};
+    std::atomic<uint64_t> last_received_ns{0};
+    std::atomic<int> online{0};
+    std::atomic<int> subs_online{0};
+    std::vector<uint64_t> join_ns(clients, 0);
+
+    // one recorder for all clients, when tracing latency
+    std::shared_ptr<chat::latency_recorder> latency;
+    if (latency_path != nullptr) {
+        latency = std::make_shared<chat::latency_recorder>();
+        if (!latency->open(latency_path)) {
+            printf("failed to open %s\n", latency_path);
+            return 1;
+        }
+    }
+
+    chat::client_reactor reactor;
+    std::vector<std::unique_ptr<chat::client>> group;
+    group.reserve(clients);
+
+    uint64_t start_ns = chat::monotonic_ns();
+    for (int i = 0; i < clients; i++) {
+        std::unique_ptr<chat::transport> transport;
+        if (local_path != nullptr) {
+            auto local = std::make_unique<chat::shm_client_transport>(local_path);
+            if (!local->attach()) {
+                printf("failed to attach to %s\n", local_path);
+                return 1;
+            }
+            transport = std::move(local);
+        }
+        else {
+            transport = std::make_unique<chat::udp_transport>();
+        }
+        auto c = std::make_unique<chat::client>("load" + std::to_string(i), std::move(transport));
+
+        sockaddr_in client_address;
+        memset(&client_address, 0, sizeof(client_address));
+        client_address.sin_family = AF_INET;
+        client_address.sin_port = htons(first_port + i);
+        inet_pton(AF_INET, client_name, &client_address.sin_addr);
+        if (!c->bind(client_address)) {
+            printf("failed to bind port %d\n", first_port + i);
+            return 1;
+        }
+
+        c->use_multicast(use_multicast);
+        if (latency) {
+            c->trace_latency(latency);
+        }
+        c->on_message([&, i, start_ns](const chat::chat_message& msg) {
+            if (msg.type_ == chat::JACK) {
+                join_ns[i] = chat::monotonic_ns() - start_ns;
+                online.fetch_add(1);
+            }
+            else if (msg.type_ == chat::BROADCAST &&
+                     strncmp((const char*)msg.message_, LOAD_MESSAGE, MAX_MESSAGE_LENGTH) == 0) {
+                received.fetch_add(1, std::memory_order_relaxed);
+                last_received_ns.store(chat::monotonic_ns(), std::memory_order_relaxed);
+            }
+        });
+        if (gateway_users > 0) {
+            c->on_gateway_message([&](std::string_view, const chat::chat_message& msg) {
+                if (msg.type_ == chat::JACK) {
+                    subs_online.fetch_add(1);
+                }
+                else if (msg.type_ == chat::BROADCAST &&
+                         strncmp((const char*)msg.message_, LOAD_MESSAGE, MAX_MESSAGE_LENGTH) == 0) {
+                    received.fetch_add(1, std::memory_order_relaxed);
+                    last_received_ns.store(chat::monotonic_ns(), std::memory_order_relaxed);
+                }
+            });
+        }
+        c->connect(server_address, &reactor);
+        group.push_back(std::move(c));
+    }
+
+    bool joined = wait_for([&]() { return online.load() == clients; });
+    uint64_t joined_ns = chat::monotonic_ns() - start_ns;
+    std::vector<uint64_t> sorted = join_ns;
+    std::sort(sorted.begin(), sorted.end());
+    printf("%d/%d clients joined in %.3f ms (JACK p50 %.3f ms, p99 %.3f ms)\n",
+        online.load(), clients, joined_ns / 1e6,
+        sorted[clients / 2] / 1e6, sorted[std::min(clients - 1, clients * 99 / 100)] / 1e6);
+
+    // the users behind each gateway, once the gateways are online
+    int subs = clients * gateway_users;
+    if (joined && subs > 0) {
+        start_ns = chat::monotonic_ns();
+        // a gateway at a time, so the server's socket is not flooded with joins
+        for (int i = 0; i < clients && joined; i++) {
+            for (int j = 0; j < gateway_users; j++) {
+                group[i]->sub_join("load" + std::to_string(i) + "_" + std::to_string(j));
+            }
+            joined = wait_for([&]() { return subs_online.load() == (i + 1) * gateway_users; });
+        }
+        printf("%d/%d users joined behind %d gateways in %.3f ms\n",
+            subs_online.load(), subs, clients, (chat::monotonic_ns() - start_ns) / 1e6);
+    }
+
+    // one more client, on the port after the load clients', which only joins and leaves
+    chat::udp_transport probe;
+    std::atomic<bool> probe_stop{false};
+    handshake_times loaded;
+    std::thread probe_thread;
+    if (joined && handshakes > 0) {
+        sockaddr_in probe_address;
+        memset(&probe_address, 0, sizeof(probe_address));
+        probe_address.sin_family = AF_INET;
+        probe_address.sin_port = htons(first_port + clients);
+        inet_pton(AF_INET, client_name, &probe_address.sin_addr);
+        if (!probe.bind(probe_address)) {
+            printf("failed to bind port %d\n", first_port + clients);
+            return 1;
+        }
+        handshake_times idle;
+        probe_handshakes(probe, server_address, handshakes, probe_stop, idle);
+        report_handshakes("idle", idle);
+    }
+
+    if (joined && broadcasts > 0) {
+        // every broadcast goes to everyone else online, and only the users behind gateways send when there are any
+        uint64_t users = clients + subs;
+        uint64_t senders = subs > 0 ? subs : clients;
+        uint64_t expected = senders * broadcasts * (users - 1);
+        if (handshakes > 0) {
+            probe_thread = std::thread([&]() {
+                probe_handshakes(probe, server_address, handshakes, probe_stop, loaded);
+            });
+        }
+        start_ns = chat::monotonic_ns();
+        for (int b = 0; b < broadcasts; b++) {
+            for (int i = 0; i < clients; i++) {
+                if (gateway_users == 0) {
+                    group[i]->broadcast(LOAD_MESSAGE);
+                }
+                for (int j = 0; j < gateway_users; j++) {
+                    std::string username = "load" + std::to_string(i) + "_" + std::to_string(j);
+                    group[i]->send_as(username, chat::broadcast_msg(username, LOAD_MESSAGE));
+                }
+            }
+        }
+        wait_for_count(received, expected);
+        uint64_t elapsed_ns = std::max(last_received_ns.load(), start_ns + 1) - start_ns;
+        printf("delivered %llu/%llu broadcasts in %.3f ms (%.0f messages/s)\n",
+            (unsigned long long)received.load(), (unsigned long long)expected,
+            elapsed_ns / 1e6, received.load() * 1e9 / elapsed_ns);
+        if (probe_thread.joinable()) {
+            // only the handshakes made while the broadcasts were delivered count
+            probe_stop.store(true);
+            probe_thread.join();
+            report_handshakes("under load", loaded);
+        }
+    }
+
+    for (auto& c: group) {
+        c->leave();
+    }
+    wait_for([&]() {
+        return std::all_of(group.begin(), group.end(), [](auto& c) { return c->state() == chat::CLIENT_CLOSED; });
+    });
+    reactor.stop();
+
+    if (latency) {
+        printf("%s", latency->report().c_str());
+    }
+
+    return 0;
+}
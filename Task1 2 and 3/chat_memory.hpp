@@ -0,0 +1,163 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string_view>
+
+/**
+ * @brief Memory accounting of the server state
+ *
+ * Each part of the state that grows with use keeps an account of the heap
+ * it holds. The bytes are estimated from what is stored, rather than
+ * measured, so keeping them up to date costs next to nothing. An account
+ * can be capped, and the part then refuses to grow once it has reached the
+ * cap, e.g. JOIN is refused while users is at its cap.
+*/
+
+// Estimated heap taken by a node of a std::map, std::set or hash table, besides its value, in bytes
+#define MEMORY_NODE_BYTES 48
+// Longest string kept inside a std::string itself, without a heap block
+#define MEMORY_SSO_LENGTH 15
+
+namespace chat {
+
+/**
+ * @brief Parts of the server state with an account
+*/
+enum memory_pool {
+    MEMORY_USERS,       // users online, their addresses and presence entries
+    MEMORY_GROUPS,      // groups and their members
+    MEMORY_SESSIONS,    // resume tokens, and messages held for suspended sessions
+    MEMORY_GATEWAYS,    // users behind gateways, and the addresses they were given
+    MEMORY_TELEMETRY,   // telemetry streams, their subscriptions and accumulators
+    MEMORY_POOLS,
+};
+
+inline const char * memory_pool_name(memory_pool pool) {
+    static const char * names[MEMORY_POOLS] = {"users", "groups", "sessions", "gateways", "telemetry"};
+    return names[pool];
+}
+
+/**
+ * @brief Estimated heap held by a std::string of a length
+*/
+inline size_t string_bytes(size_t length) {
+    return length > MEMORY_SSO_LENGTH ? length + 1 : 0;
+}
+
+/**
+ * @brief Estimated heap held by a node of a std::map, std::set or hash table
+ * @param value size of the node's value, key included
+ * @param key_length length of a string key, whose characters may take a heap block of their own
+*/
+inline size_t node_bytes(size_t value, size_t key_length = 0) {
+    return MEMORY_NODE_BYTES + value + string_bytes(key_length);
+}
+
+/**
+ * @brief Heap held by a part of the server state, and its cap
+*/
+class memory_account {
+public:
+    void charge(size_t bytes) {
+        used_ += bytes;
+        high_water_ = std::max(high_water_, used_);
+    }
+
+    void credit(size_t bytes) {
+        used_ -= std::min(bytes, used_);
+    }
+
+    void reset() {
+        used_ = 0;
+    }
+
+    /**
+     * @brief Cap the account, 0 for no cap
+    */
+    void set_cap(size_t bytes) {
+        cap_ = bytes;
+    }
+
+    /**
+     * @brief At or over the cap, so nothing more should be charged
+    */
+    bool full() const {
+        return cap_ > 0 && used_ >= cap_;
+    }
+
+    size_t used() const {
+        return used_;
+    }
+
+    size_t cap() const {
+        return cap_;
+    }
+
+    size_t high_water() const {
+        return high_water_;
+    }
+
+private:
+    size_t used_ = 0;
+    size_t cap_ = 0;
+    size_t high_water_ = 0;
+};
+
+/**
+ * @brief Resident set size of this process, in bytes, 0 if it cannot be read
+*/
+inline size_t resident_bytes() {
+    FILE * statm = fopen("/proc/self/statm", "r");
+    if (statm == nullptr) {
+        return 0;
+    }
+    unsigned long size = 0;
+    unsigned long resident = 0;
+    if (fscanf(statm, "%lu %lu", &size, &resident) != 2) {
+        resident = 0;
+    }
+    fclose(statm);
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+/**
+ * @brief Parse a cap given as "<pool>=<size>", the size in bytes or with a K, M or G suffix
+ * @param text to parse
+ * @param pool receives the pool capped
+ * @param bytes receives the cap
+ * @return false if the text is not a cap
+*/
+inline bool parse_memory_cap(const char * text, memory_pool& pool, size_t& bytes) {
+    const char * equals = strchr(text, '=');
+    if (equals == nullptr) {
+        return false;
+    }
+    std::string_view name{text, (size_t)(equals - text)};
+    for (int p = 0; p < MEMORY_POOLS; p++) {
+        if (name == memory_pool_name((memory_pool)p)) {
+            char * end = nullptr;
+            unsigned long long value = strtoull(equals + 1, &end, 10);
+            switch (*end) {
+                case 'G': value <<= 10; // fall through
+                case 'M': value <<= 10; // fall through
+                case 'K': value <<= 10; end++; break;
+                default: break;
+            }
+            if (end == equals + 1 || *end != '\0') {
+                return false;
+            }
+            pool = (memory_pool)p;
+            bytes = value;
+            return true;
+        }
+    }
+    return false;
+}
+
+}; // namespace chat
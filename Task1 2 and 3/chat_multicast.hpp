@@ -0,0 +1,189 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <string>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "chat_ex.hpp"
+
+namespace chat {
+
+/**
+ * @brief Parse "<ip>:<port>" into an address
+ * @param text to parse
+ * @param address receives the parsed address
+ * @return true if text held a valid IPv4 address and port
+*/
+inline bool parse_address(std::string_view text, sockaddr_in& address) {
+    auto separator = text.find(':');
+    if (separator == std::string_view::npos) {
+        return false;
+    }
+    std::string ip{text.substr(0, separator)};
+    std::string port{text.substr(separator + 1)};
+
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(atoi(port.c_str()));
+    return inet_pton(AF_INET, ip.c_str(), &address.sin_addr) == 1 && address.sin_port != 0;
+}
+
+/**
+ * @brief Sends datagrams to a multicast group
+ *
+ * The iot socket library only simulates unicast, so multicast traffic goes
+ * through a kernel UDP socket. Loopback is enabled so clients on the
+ * server's own host receive the group's traffic too.
+*/
+class multicast_sender {
+public:
+    multicast_sender() = default;
+    multicast_sender(const multicast_sender&) = delete;
+    multicast_sender& operator=(const multicast_sender&) = delete;
+
+    ~multicast_sender() {
+        if (fd_ >= 0) {
+            close(fd_);
+        }
+    }
+
+    /**
+     * @brief Create the socket used for sending to a group
+     * @param group multicast group address
+     * @param interface address of the interface to send on, empty for the default
+     * @return true on success
+    */
+    bool open(const std::string& group, const std::string& interface) {
+        memset(&group_, 0, sizeof(group_));
+        group_.sin_family = AF_INET;
+        group_.sin_port = htons(MULTICAST_PORT);
+        if (inet_pton(AF_INET, group.c_str(), &group_.sin_addr) != 1 ||
+            !IN_MULTICAST(ntohl(group_.sin_addr.s_addr))) {
+            return false;
+        }
+
+        fd_ = ::socket(AF_INET, SOCK_DGRAM, 0);
+        if (fd_ < 0) {
+            return false;
+        }
+
+        unsigned char ttl = 1;
+        unsigned char loop = 1;
+        setsockopt(fd_, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+        setsockopt(fd_, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop));
+        if (!interface.empty()) {
+            in_addr iface;
+            if (inet_pton(AF_INET, interface.c_str(), &iface) != 1 ||
+                setsockopt(fd_, IPPROTO_IP, IP_MULTICAST_IF, &iface, sizeof(iface)) != 0) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool is_open() const {
+        return fd_ >= 0;
+    }
+
+    /** @brief the group, as announced in JACK */
+    std::string group() const {
+        char ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &group_.sin_addr, ip, sizeof(ip));
+        return std::string{ip} + ":" + std::to_string(ntohs(group_.sin_port));
+    }
+
+    const sockaddr_in& address() const {
+        return group_;
+    }
+
+    /**
+     * @brief Send a message to every member of the group
+     * @param msg to send
+    */
+    void send(const chat_message& msg) {
+        ::sendto(fd_, &msg, sizeof(msg), 0, (const sockaddr*)&group_, sizeof(group_));
+    }
+
+private:
+    int fd_ = -1;
+    sockaddr_in group_;
+};
+
+/**
+ * @brief Receives datagrams sent to a multicast group
+*/
+class multicast_receiver {
+public:
+    multicast_receiver() = default;
+    multicast_receiver(const multicast_receiver&) = delete;
+    multicast_receiver& operator=(const multicast_receiver&) = delete;
+
+    ~multicast_receiver() {
+        if (fd_ >= 0) {
+            close(fd_);
+        }
+    }
+
+    /**
+     * @brief Join a group
+     *
+     * Receives time out periodically, so a receiving thread can notice when
+     * it should stop.
+     * @param group "<ip>:<port>" as sent in JACK
+     * @return true if the group was joined
+    */
+    bool join(std::string_view group) {
+        sockaddr_in address;
+        if (!parse_address(group, address) || !IN_MULTICAST(ntohl(address.sin_addr.s_addr))) {
+            return false;
+        }
+
+        fd_ = ::socket(AF_INET, SOCK_DGRAM, 0);
+        if (fd_ < 0) {
+            return false;
+        }
+
+        int reuse = 1;
+        setsockopt(fd_, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        timeval timeout{0, 200000};
+        setsockopt(fd_, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+        // bind to the group, so only its traffic is received on this port
+        if (::bind(fd_, (const sockaddr*)&address, sizeof(address)) != 0) {
+            return false;
+        }
+
+        ip_mreq membership;
+        membership.imr_multiaddr = address.sin_addr;
+        membership.imr_interface.s_addr = htonl(INADDR_ANY);
+        return setsockopt(fd_, IPPROTO_IP, IP_ADD_MEMBERSHIP, &membership, sizeof(membership)) == 0;
+    }
+
+    /**
+     * @brief Receive the next message from the group
+     * @param msg receives the message
+     * @return true if a complete message was received, false on timeout or error
+    */
+    bool recv(chat_message& msg) {
+        return ::recv(fd_, &msg, sizeof(msg), 0) == sizeof(msg);
+    }
+
+    /**
+     * @brief Socket descriptor, for waiting on the group with poll/epoll
+    */
+    int fd() const {
+        return fd_;
+    }
+
+private:
+    int fd_ = -1;
+};
+
+}; // namespace chat
@@ -0,0 +1,329 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "chat_ex.hpp"
+
+// Presence interest in every user, what a session starts with
+#define PRESENCE_ALL "*"
+// Presence interest in the members of every group the session is in
+#define PRESENCE_GROUPS "@groups"
+
+namespace chat {
+
+/**
+ * @brief Set of small integers, a bit each, that grows to the largest one set
+*/
+class bitset {
+public:
+    void set(uint32_t i) {
+        if (i / 64 >= words_.size()) {
+            words_.resize(i / 64 + 1, 0);
+        }
+        words_[i / 64] |= 1ull << (i % 64);
+    }
+
+    void reset(uint32_t i) {
+        if (i / 64 < words_.size()) {
+            words_[i / 64] &= ~(1ull << (i % 64));
+        }
+    }
+
+    bool test(uint32_t i) const {
+        return i / 64 < words_.size() && (words_[i / 64] >> (i % 64)) & 1;
+    }
+
+    void clear() {
+        words_.clear();
+    }
+
+    /**
+     * @brief Set every bit that is set in another
+    */
+    void merge(const bitset& other) {
+        if (other.words_.size() > words_.size()) {
+            words_.resize(other.words_.size(), 0);
+        }
+        for (size_t w = 0; w < other.words_.size(); w++) {
+            words_[w] |= other.words_[w];
+        }
+    }
+
+    /**
+     * @brief Call a function with every bit set, in order
+    */
+    template <typename Visit>
+    void for_each(Visit visit) const {
+        for (size_t w = 0; w < words_.size(); w++) {
+            for (uint64_t bits = words_[w]; bits != 0; bits &= bits - 1) {
+                visit((uint32_t)(w * 64 + __builtin_ctzll(bits)));
+            }
+        }
+    }
+
+private:
+    std::vector<uint64_t> words_;
+};
+
+/**
+ * @brief Which sessions want JOIN and LEAVE announcements about which users
+ *
+ * Every name that is online, or that someone is interested in, has a small
+ * id, reused once neither holds. Interest in a user is kept as a bitset of
+ * the ids of the sessions that hold it, so the sessions to announce a user
+ * to are found without looking at the rest. Sessions interested in
+ * everyone, which is where every session starts, and in their group
+ * co-members, are kept in bitsets of their own.
+*/
+class presence_index {
+public:
+    /**
+     * @brief A session comes online, interested in everyone
+    */
+    void join(std::string_view username) {
+        uint32_t session = intern(username);
+        if (!entries_[session].online_) {
+            entries_[session].online_ = true;
+            sessions_++;
+            everyone_.set(session);
+            everyone_count_++;
+        }
+    }
+
+    /**
+     * @brief A session goes offline, dropping its interests
+    */
+    void leave(std::string_view username) {
+        auto it = ids_.find(std::string{username});
+        if (it == ids_.end() || !entries_[it->second].online_) {
+            return;
+        }
+        uint32_t session = it->second;
+        forget_interest(session);
+        entries_[session].online_ = false;
+        sessions_--;
+        release(session);
+    }
+
+    void clear() {
+        ids_.clear();
+        entries_.clear();
+        free_.clear();
+        everyone_.clear();
+        groups_.clear();
+        sessions_ = 0;
+        everyone_count_ = 0;
+        groups_count_ = 0;
+    }
+
+    /**
+     * @brief Replace the interests of an online session
+     * @param username of session
+     * @param interests PRESENCE_ALL, PRESENCE_GROUPS or usernames, anything iterable of std::string_view
+    */
+    template <typename Interests>
+    void set_interest(std::string_view username, const Interests& interests) {
+        auto it = ids_.find(std::string{username});
+        if (it == ids_.end() || !entries_[it->second].online_) {
+            return;
+        }
+        uint32_t session = it->second;
+        forget_interest(session);
+
+        for (std::string_view interest : interests) {
+            if (interest == PRESENCE_ALL) {
+                if (!everyone_.test(session)) {
+                    everyone_.set(session);
+                    everyone_count_++;
+                }
+            }
+            else if (interest == PRESENCE_GROUPS) {
+                if (!groups_.test(session)) {
+                    groups_.set(session);
+                    groups_count_++;
+                }
+            }
+            else if (!interest.empty() && interest.length() < MAX_USERNAME_LENGTH) {
+                uint32_t subject = intern(interest);
+                if (!entries_[subject].watchers_.test(session)) {
+                    entries_[subject].watchers_.set(session);
+                    entries_[subject].watched_by_++;
+                    entries_[session].interests_.push_back(subject);
+                }
+            }
+        }
+    }
+
+    /**
+     * @brief Every online session is interested in everyone, as with no interests set
+    */
+    bool everyone_interested() const {
+        return everyone_count_ == sessions_;
+    }
+
+    /**
+     * @brief Some session is interested in its group co-members
+    */
+    bool groups_wanted() const {
+        return groups_count_ > 0;
+    }
+
+    /**
+     * @brief Sessions interested in a user, other than through groups
+     * @param subject username the announcement is about
+     * @param sessions receives the ids of the sessions
+    */
+    void interested(std::string_view subject, bitset& sessions) const {
+        sessions = everyone_;
+        auto it = ids_.find(std::string{subject});
+        if (it != ids_.end()) {
+            sessions.merge(entries_[it->second].watchers_);
+        }
+    }
+
+    /**
+     * @brief Add a co-member of the subject's groups, if interested in them
+    */
+    void add_co_member(std::string_view member, bitset& sessions) const {
+        auto it = ids_.find(std::string{member});
+        if (it != ids_.end() && groups_.test(it->second)) {
+            sessions.set(it->second);
+        }
+    }
+
+    /**
+     * @brief Add or remove an online session
+    */
+    void mark(std::string_view username, bitset& sessions, bool include) const {
+        auto it = ids_.find(std::string{username});
+        if (it != ids_.end() && entries_[it->second].online_) {
+            if (include) {
+                sessions.set(it->second);
+            }
+            else {
+                sessions.reset(it->second);
+            }
+        }
+    }
+
+    /**
+     * @brief Username of an id
+    */
+    const std::string& name(uint32_t id) const {
+        return entries_[id].name_;
+    }
+
+    /**
+     * @brief A session has interests other than everyone
+    */
+    bool narrowed(std::string_view username) const {
+        auto it = ids_.find(std::string{username});
+        if (it == ids_.end()) {
+            return false;
+        }
+        uint32_t session = it->second;
+        return !everyone_.test(session) || groups_.test(session) || !entries_[session].interests_.empty();
+    }
+
+    /**
+     * @brief Interests of a session, as would be passed to set_interest
+    */
+    void interests(std::string_view username, std::vector<std::string_view>& interests) const {
+        auto it = ids_.find(std::string{username});
+        if (it == ids_.end()) {
+            return;
+        }
+        uint32_t session = it->second;
+        if (everyone_.test(session)) {
+            interests.push_back(PRESENCE_ALL);
+        }
+        if (groups_.test(session)) {
+            interests.push_back(PRESENCE_GROUPS);
+        }
+        for (uint32_t subject : entries_[session].interests_) {
+            interests.push_back(entries_[subject].name_);
+        }
+    }
+
+private:
+    struct entry {
+        std::string name_;
+        bool online_ = false;
+        // sessions interested in this user
+        bitset watchers_;
+        size_t watched_by_ = 0;
+        // users this session is interested in by name
+        std::vector<uint32_t> interests_;
+    };
+
+    /**
+     * @brief Id of a name, allocating one if it has none
+    */
+    uint32_t intern(std::string_view name) {
+        auto [it, added] = ids_.emplace(std::string{name}, 0);
+        if (added) {
+            if (free_.empty()) {
+                it->second = entries_.size();
+                entries_.emplace_back();
+            }
+            else {
+                it->second = free_.back();
+                free_.pop_back();
+            }
+            entries_[it->second].name_ = it->first;
+        }
+        return it->second;
+    }
+
+    /**
+     * @brief Give up an id, once its name is neither online nor of interest
+    */
+    void release(uint32_t id) {
+        entry& e = entries_[id];
+        if (e.online_ || e.watched_by_ > 0) {
+            return;
+        }
+        ids_.erase(e.name_);
+        e = entry{};
+        free_.push_back(id);
+    }
+
+    void forget_interest(uint32_t session) {
+        if (everyone_.test(session)) {
+            everyone_.reset(session);
+            everyone_count_--;
+        }
+        if (groups_.test(session)) {
+            groups_.reset(session);
+            groups_count_--;
+        }
+        std::vector<uint32_t> subjects;
+        subjects.swap(entries_[session].interests_);
+        for (uint32_t subject : subjects) {
+            entries_[subject].watchers_.reset(session);
+            entries_[subject].watched_by_--;
+            release(subject);
+        }
+    }
+
+    std::unordered_map<std::string, uint32_t> ids_;
+    // indexed by id
+    std::vector<entry> entries_;
+    // ids given up, for reuse
+    std::vector<uint32_t> free_;
+    // sessions interested in everyone
+    bitset everyone_;
+    // sessions interested in their group co-members
+    bitset groups_;
+    size_t sessions_ = 0;
+    size_t everyone_count_ = 0;
+    size_t groups_count_ = 0;
+};
+
+}; // namespace chat
@@ -0,0 +1,277 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <new>
+#include <thread>
+
+#include <arpa/inet.h>
+
+#include "chat_egress.hpp"
+#include "chat_ex.hpp"
+#include "chat_server.hpp"
+#include "chat_trace.hpp"
+#include "chat_transport.hpp"
+
+/**
+ * @brief number of global heap allocations made by this process
+*/
+std::atomic<uint64_t> heap_allocations{0};
+
+void * operator new(size_t size) {
+    heap_allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void * ptr = malloc(size > 0 ? size : 1)) {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void * ptr) noexcept {
+    free(ptr);
+}
+
+void operator delete(void * ptr, size_t) noexcept {
+    free(ptr);
+}
+
+/**
+ * @brief how captured packets are fed back into the server
+ * @var replay_mode::LOOPBACK
+ * Packets are sent over the network to a running chat_server, each from a
+ * socket bound to the packet's original source address
+ * @var replay_mode::HANDLER
+ * Packets are passed straight to handle_packet, bypassing the ingress stage,
+ * and sends are made in process. The server state runs on the trace's
+ * timeline, and is swept at the recorded times, so sessions, groups and
+ * telemetry windows expire as they did when captured, at any speed.
+*/
+enum replay_mode {
+    LOOPBACK = 0,
+    HANDLER,
+};
+
+/**
+ * @brief time on the trace's timeline of the packet being replayed, in HANDLER mode
+*/
+uint64_t replay_now_ns = 0;
+
+uint64_t replay_clock() {
+    return replay_now_ns;
+}
+
+/**
+ * @brief usage message for replay application
+*/
+void usage(const char * name) {
+    printf("USAGE: %s [-m loopback|handler] [-s <speed>|max] [-a <server ip>] "
+        "[-I <session idle ms> [-G <session grace ms>]] [-T <group ttl ms>] <trace file>\n", name);
+}
+
+/**
+ * @brief replay a captured trace
+ *
+ * @param trace to replay
+ * @param mode where packets are delivered
+ * @param speed replay speed relative to capture time, 0 for as fast as possible
+ * @param server_address address of the chat server, used in LOOPBACK mode
+ * @param config expiry of the server state, used in HANDLER mode
+*/
+void replay(
+    chat::trace_reader& trace, replay_mode mode, double speed, struct sockaddr_in& server_address,
+    const server_config& config) {
+
+    // sockets in LOOPBACK mode, one per original source IP:PORT, null for a source that could not be bound
+    std::map<uint64_t, std::unique_ptr<chat::udp_transport>> sources;
+    // sources not bound to their original address, and packets not sent for want of a socket
+    uint64_t moved_sources = 0;
+    uint64_t unsent_packets = 0;
+
+    // state for HANDLER mode, sending in process so only the handlers are timed
+    online_users online_users;
+    chat::memory_transport sock;
+    chat::egress out{sock, 0};
+    bool exit_loop = false;
+    if (mode == HANDLER) {
+        configure_state(config);
+        set_state_clock(replay_clock);
+    }
+
+    chat::trace_record_header record;
+    static char buffer[1 << 16];
+
+    uint64_t packets = 0;
+    uint64_t handler_ns = 0;
+
+    // per message type packet and heap allocation counts, in HANDLER mode
+    uint64_t type_packets[chat::UNKNOWN + 1] = { 0 };
+    uint64_t type_allocations[chat::UNKNOWN + 1] = { 0 };
+    uint64_t start_ns = chat::monotonic_ns();
+
+    while (!exit_loop && trace.next(record, buffer)) {
+        if (speed > 0) {
+            uint64_t due_ns = start_ns + (uint64_t)(record.timestamp_ns_ / speed);
+            uint64_t now_ns = chat::monotonic_ns();
+            if (due_ns > now_ns) {
+                std::this_thread::sleep_for(std::chrono::nanoseconds(due_ns - now_ns));
+            }
+        }
+
+        struct sockaddr_in client_address;
+        memset(&client_address, 0, sizeof(client_address));
+        client_address.sin_family = AF_INET;
+        client_address.sin_addr.s_addr = record.addr_;
+        client_address.sin_port = record.port_;
+
+        if (mode == LOOPBACK) {
+            uint64_t key = ((uint64_t)record.addr_ << 16) | record.port_;
+            auto search = sources.find(key);
+            if (search == sources.end()) {
+                auto source = std::make_unique<chat::udp_transport>();
+                if (!source->bind(client_address)) {
+                    // not an address of this host, or in use: any port of our own still keeps the source apart
+                    struct sockaddr_in any_address;
+                    memset(&any_address, 0, sizeof(any_address));
+                    any_address.sin_family = AF_INET;
+                    any_address.sin_addr.s_addr = htonl(INADDR_ANY);
+                    if (source->bind(any_address)) {
+                        moved_sources++;
+                    }
+                    else {
+                        char name[INET_ADDRSTRLEN];
+                        inet_ntop(AF_INET, &client_address.sin_addr, name, sizeof(name));
+                        printf("cannot bind %s:%d, its packets are not replayed\n", name, ntohs(client_address.sin_port));
+                        source.reset();
+                    }
+                }
+                search = sources.emplace(key, std::move(source)).first;
+            }
+            if (search->second) {
+                search->second->sendto(buffer, record.length_, server_address);
+            }
+            else {
+                unsent_packets++;
+            }
+        }
+        else {
+            // expire what would have expired by the time the packet was captured
+            replay_now_ns = start_ns + record.timestamp_ns_;
+            if (sweep_due(replay_now_ns)) {
+                sweep_state(online_users, replay_now_ns, out);
+            }
+
+            // the type byte is unsigned, a corrupt one must not index past the counters
+            uint8_t type = record.length_ > 0 ? (uint8_t)buffer[0] : (uint8_t)chat::UNKNOWN;
+            if (type >= chat::UNKNOWN) {
+                type = chat::UNKNOWN;
+            }
+            uint64_t before_allocations = heap_allocations.load(std::memory_order_relaxed);
+            uint64_t before_ns = chat::monotonic_ns();
+            handle_packet(online_users, buffer, record.length_, client_address, out, exit_loop);
+            handler_ns += chat::monotonic_ns() - before_ns;
+            type_packets[type]++;
+            type_allocations[type] += heap_allocations.load(std::memory_order_relaxed) - before_allocations;
+        }
+        packets++;
+    }
+
+    if (mode == HANDLER) {
+        set_state_clock(chat::monotonic_ns);
+    }
+
+    uint64_t elapsed_ns = chat::monotonic_ns() - start_ns;
+    printf("replayed %llu packets in %.3f ms (%.0f packets/s)\n",
+        (unsigned long long)packets, elapsed_ns / 1e6,
+        elapsed_ns > 0 ? packets * 1e9 / elapsed_ns : 0.0);
+    if (mode == LOOPBACK && (moved_sources > 0 || unsent_packets > 0)) {
+        printf("%llu of %zu sources replayed from another address, %llu packets not sent\n",
+            (unsigned long long)moved_sources, sources.size(), (unsigned long long)unsent_packets);
+    }
+    if (mode == HANDLER && packets > 0) {
+        printf("handler time %.0f ns/packet\n", (double)handler_ns / packets);
+        printf("%-6s %10s %16s\n", "type", "packets", "allocs/packet");
+        for (int type = 0; type <= chat::UNKNOWN; type++) {
+            if (type_packets[type] > 0) {
+                printf("%-6d %10llu %16.2f\n", type, (unsigned long long)type_packets[type],
+                    (double)type_allocations[type] / type_packets[type]);
+            }
+        }
+    }
+}
+
+/**
+ * @brief entry point for trace replay application
+*/
+int main(int argc, char ** argv) {
+    replay_mode mode = LOOPBACK;
+    double speed = 1.0;
+    const char * server_name = "192.168.1.27";
+    server_config config;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "m:s:a:I:G:T:")) != -1) {
+        switch (opt) {
+            case 'm': {
+                if (strcmp(optarg, "loopback") == 0) {
+                    mode = LOOPBACK;
+                }
+                else if (strcmp(optarg, "handler") == 0) {
+                    mode = HANDLER;
+                }
+                else {
+                    usage(argv[0]);
+                    return 0;
+                }
+                break;
+            }
+            case 's': {
+                speed = strcmp(optarg, "max") == 0 ? 0.0 : atof(optarg);
+                break;
+            }
+            case 'a': {
+                server_name = optarg;
+                break;
+            }
+            case 'I': {
+                config.session_idle_ms_ = atoi(optarg);
+                break;
+            }
+            case 'G': {
+                config.session_grace_ms_ = atoi(optarg);
+                break;
+            }
+            case 'T': {
+                config.group_ttl_ms_ = atoi(optarg);
+                break;
+            }
+            default: {
+                usage(argv[0]);
+                return 0;
+            }
+        }
+    }
+
+    if (optind != argc - 1) {
+        usage(argv[0]);
+        return 0;
+    }
+
+    chat::trace_reader trace;
+    if (!trace.open(argv[optind])) {
+        printf("%s is not a valid trace file\n", argv[optind]);
+        return 1;
+    }
+
+    struct sockaddr_in server_address;
+    memset(&server_address, 0, sizeof(server_address));
+    server_address.sin_family = AF_INET;
+    server_address.sin_port = htons(SERVER_PORT);
+    inet_pton(AF_INET, server_name, &server_address.sin_addr);
+
+    replay(trace, mode, speed, server_address, config);
+
+    return 0;
+}
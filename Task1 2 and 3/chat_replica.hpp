@@ -0,0 +1,519 @@
+#pragma once
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+
+#include <arpa/inet.h>
+
+// IOT socket api
+#include <iot/socket.hpp>
+
+#include "chat_handoff.hpp"
+#include "chat_latency.hpp"
+#include "chat_ring.hpp"
+
+/**
+ * @brief Replication of server state to a standby
+ *
+ * A standby server connects to the primary over TCP and is sent a frame
+ * with a state image, as used for handoff, followed by frames of changes.
+ * The router records each change as it makes it, and a replication thread
+ * ships what has built up every REPLICA_BATCH_MS, so the router never waits
+ * on the standby. When there is nothing to ship, an empty batch is sent
+ * every REPLICA_HEARTBEAT_MS, so the standby can tell a quiet primary from
+ * a dead one.
+ *
+ * A frame is a uint8_t kind and a uint32_t length, followed by that many
+ * bytes. A batch of changes is an image of records, each a uint8_t
+ * replica_op followed by its fields. Names in records are strings as in
+ * the image, so a group name as long as a message reaches the standby
+ * whole. A standby only follows a primary of the same HANDOFF_VERSION.
+*/
+
+// How often the primary ships the changes recorded since the last batch, in milliseconds
+#define REPLICA_BATCH_MS 5
+// How often the primary sends an empty batch when there are no changes, in milliseconds
+#define REPLICA_HEARTBEAT_MS 100
+// How long without hearing from the primary before the standby takes over, in milliseconds
+#define REPLICA_FAILOVER_MS 1000
+// Changes the primary holds for a standby that has stopped reading, before dropping it
+#define REPLICA_MAX_BATCH (16 * 1024 * 1024)
+// How long the primary blocks writing to a standby before dropping it, in milliseconds
+#define REPLICA_SEND_TIMEOUT_MS 2000
+// How often the standby retries connecting to the primary, in milliseconds
+#define REPLICA_RETRY_MS 10
+
+namespace chat {
+
+/**
+ * @brief Kinds of replication frame
+*/
+enum replica_frame : uint8_t {
+    REPLICA_SNAPSHOT,   // state image, replaces all state on the standby
+    REPLICA_CHANGES,    // batch of records, empty as a heartbeat
+};
+
+/**
+ * @brief Records in a batch of changes
+*/
+enum replica_op : uint8_t {
+    REPLICA_JOIN,               // username, address, resume token
+    REPLICA_LEAVE,              // username
+    REPLICA_GROUP_ADD,          // groupname, username, creates the group if it is new
+    REPLICA_GROUP_REMOVE,       // groupname, username, deletes the group once empty
+    REPLICA_MULTICAST_ON,       // username
+    REPLICA_MULTICAST_OFF,      // username
+    REPLICA_PRESENCE,           // username, uint32_t count, interests
+    REPLICA_RESUME,             // username, address the session resumed from
+    REPLICA_GROUP_DELETE,       // groupname, deleted as abandoned
+    REPLICA_SUB_JOIN,           // username, gateway, follows the JOIN of a user behind a gateway
+    REPLICA_TELEMETRY,          // username, stream, mode as in TELEMETRY_SUB
+    REPLICA_EXIT,               // server told to exit, all state is cleared
+};
+
+/**
+ * @brief Write a frame to a stream socket
+*/
+inline bool write_frame(int fd, replica_frame kind, std::string_view data) {
+    char header[5];
+    header[0] = (char)kind;
+    uint32_t length = data.length();
+    memcpy(header + 1, &length, sizeof(length));
+    return write_all(fd, header, sizeof(header)) && write_all(fd, data.data(), data.length());
+}
+
+/**
+ * @brief Read a frame from a stream socket
+ * @return false if the connection closed or timed out
+*/
+inline bool read_frame(int fd, replica_frame& kind, std::string& data) {
+    char header[5];
+    if (!read_all(fd, header, sizeof(header))) {
+        return false;
+    }
+    kind = (replica_frame)header[0];
+    uint32_t length;
+    memcpy(&length, header + 1, sizeof(length));
+    data.resize(length);
+    return read_all(fd, data.data(), length);
+}
+
+/**
+ * @brief Connect to a TCP address, giving up after a timeout
+ * @return connected socket, -1 on failure
+*/
+inline int connect_stream(const sockaddr_in& address, int timeout_ms) {
+    int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    // non-blocking, as a connect to a host that has gone can otherwise hang for minutes
+    int flags = fcntl(fd, F_GETFL, 0);
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    int result = ::connect(fd, (const sockaddr*)&address, sizeof(address));
+    if (result != 0 && errno == EINPROGRESS) {
+        pollfd p{fd, POLLOUT, 0};
+        int error = 0;
+        socklen_t length = sizeof(error);
+        if (poll(&p, 1, timeout_ms) == 1 &&
+            getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length) == 0 && error == 0) {
+            result = 0;
+        }
+    }
+    if (result != 0) {
+        close(fd);
+        return -1;
+    }
+    fcntl(fd, F_SETFL, flags);
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+/**
+ * @brief Set how long a blocking read or write on a socket waits
+*/
+inline void set_stream_timeout(int fd, int option, int timeout_ms) {
+    timeval timeout{timeout_ms / 1000, (timeout_ms % 1000) * 1000};
+    setsockopt(fd, SOL_SOCKET, option, &timeout, sizeof(timeout));
+}
+
+/**
+ * @brief Primary side of replication
+ *
+ * The recording functions are called by the router as it changes state,
+ * and only take a lock, uncontended but for the replication thread swapping
+ * out the batch, when a standby is attached. A standby is attached by the
+ * router, with a snapshot of the state taken on the router thread, so
+ * the snapshot and the changes after it line up exactly.
+*/
+class replica_primary {
+public:
+    replica_primary() = default;
+    replica_primary(const replica_primary&) = delete;
+    replica_primary& operator=(const replica_primary&) = delete;
+
+    ~replica_primary() {
+        stop();
+        if (listen_fd_ >= 0) {
+            close(listen_fd_);
+        }
+    }
+
+    /**
+     * @brief Listen for a standby
+     * @param address TCP address to listen on
+     * @return true if listening
+    */
+    bool listen(const sockaddr_in& address) {
+        listen_fd_ = ::socket(AF_INET, SOCK_STREAM, 0);
+        if (listen_fd_ < 0) {
+            return false;
+        }
+        // a server taking over by handoff listens while the one it replaces still does
+        int one = 1;
+        setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+        return ::bind(listen_fd_, (const sockaddr*)&address, sizeof(address)) == 0 &&
+            ::listen(listen_fd_, 1) == 0;
+    }
+
+    /**
+     * @brief Start the replication thread
+     * @param router_bell rung when a standby is waiting to be attached
+    */
+    void start(doorbell& router_bell) {
+        thread_ = std::thread([this, &router_bell]() { run(router_bell); });
+    }
+
+    /**
+     * @brief Ship any changes still held and stop the replication thread
+    */
+    void stop() {
+        if (thread_.joinable()) {
+            stopping_.store(true);
+            thread_.join();
+        }
+    }
+
+    /**
+     * @brief A standby has connected and needs a snapshot, checked by the router
+    */
+    bool standby_waiting() const {
+        return waiting_.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief Attach the waiting standby, on the router thread
+     * @param snapshot state image taken at this point in the change stream
+    */
+    void attach(std::string snapshot) {
+        std::lock_guard<std::mutex> guard{lock_};
+        if (!waiting_.load(std::memory_order_relaxed)) {
+            // lost again before the router got to it
+            return;
+        }
+        snapshot_ = std::move(snapshot);
+        batch_ = image_writer{};
+        records_ = 0;
+        dropped_ = false;
+        attached_.store(true, std::memory_order_relaxed);
+        waiting_.store(false, std::memory_order_relaxed);
+    }
+
+    void join(std::string_view username, const sockaddr_in& address, std::string_view token) {
+        if (attached()) {
+            std::lock_guard<std::mutex> guard{lock_};
+            if (begin(REPLICA_JOIN)) {
+                batch_.put_string(username);
+                batch_.put_address(address);
+                batch_.put_string(token);
+            }
+        }
+    }
+
+    void resume(std::string_view username, const sockaddr_in& address) {
+        if (attached()) {
+            std::lock_guard<std::mutex> guard{lock_};
+            if (begin(REPLICA_RESUME)) {
+                batch_.put_string(username);
+                batch_.put_address(address);
+            }
+        }
+    }
+
+    void leave(std::string_view username) {
+        if (attached()) {
+            std::lock_guard<std::mutex> guard{lock_};
+            if (begin(REPLICA_LEAVE)) {
+                batch_.put_string(username);
+            }
+        }
+    }
+
+    void group_add(std::string_view groupname, std::string_view username) {
+        member(REPLICA_GROUP_ADD, groupname, username);
+    }
+
+    void group_remove(std::string_view groupname, std::string_view username) {
+        member(REPLICA_GROUP_REMOVE, groupname, username);
+    }
+
+    void group_delete(std::string_view groupname) {
+        if (attached()) {
+            std::lock_guard<std::mutex> guard{lock_};
+            if (begin(REPLICA_GROUP_DELETE)) {
+                batch_.put_string(groupname);
+            }
+        }
+    }
+
+    void sub_join(std::string_view username, std::string_view gateway) {
+        if (attached()) {
+            std::lock_guard<std::mutex> guard{lock_};
+            if (begin(REPLICA_SUB_JOIN)) {
+                batch_.put_string(username);
+                batch_.put_string(gateway);
+            }
+        }
+    }
+
+    void telemetry(std::string_view username, std::string_view stream, std::string_view mode) {
+        if (attached()) {
+            std::lock_guard<std::mutex> guard{lock_};
+            if (begin(REPLICA_TELEMETRY)) {
+                batch_.put_string(username);
+                batch_.put_string(stream);
+                batch_.put_string(mode);
+            }
+        }
+    }
+
+    void multicast(std::string_view username, bool on) {
+        if (attached()) {
+            std::lock_guard<std::mutex> guard{lock_};
+            if (begin(on ? REPLICA_MULTICAST_ON : REPLICA_MULTICAST_OFF)) {
+                batch_.put_string(username);
+            }
+        }
+    }
+
+    template <typename Interests>
+    void presence(std::string_view username, const Interests& interests) {
+        if (attached()) {
+            std::lock_guard<std::mutex> guard{lock_};
+            if (begin(REPLICA_PRESENCE)) {
+                batch_.put_string(username);
+                batch_.put_u32(interests.size());
+                for (std::string_view interest : interests) {
+                    batch_.put_string(interest);
+                }
+            }
+        }
+    }
+
+    void exit() {
+        if (attached()) {
+            std::lock_guard<std::mutex> guard{lock_};
+            begin(REPLICA_EXIT);
+        }
+    }
+
+private:
+    bool attached() const {
+        return attached_.load(std::memory_order_relaxed);
+    }
+
+    void member(replica_op op, std::string_view groupname, std::string_view username) {
+        if (attached()) {
+            std::lock_guard<std::mutex> guard{lock_};
+            if (begin(op)) {
+                batch_.put_string(groupname);
+                batch_.put_string(username);
+            }
+        }
+    }
+
+    /**
+     * @brief Start a record, with the lock held
+     * @return false if the standby is not attached, or was dropped for falling behind
+    */
+    bool begin(replica_op op) {
+        if (!attached_.load(std::memory_order_relaxed)) {
+            return false;
+        }
+        if (batch_.data().size() > REPLICA_MAX_BATCH) {
+            // it starts again from a snapshot when it reconnects
+            DEBUG("Standby is not keeping up, dropping it\n");
+            attached_.store(false, std::memory_order_relaxed);
+            dropped_ = true;
+            return false;
+        }
+        batch_.put_u8(op);
+        records_++;
+        return true;
+    }
+
+    void detach(int& conn) {
+        std::lock_guard<std::mutex> guard{lock_};
+        attached_.store(false, std::memory_order_relaxed);
+        waiting_.store(false, std::memory_order_relaxed);
+        snapshot_.clear();
+        batch_ = image_writer{};
+        records_ = 0;
+        dropped_ = false;
+        close(conn);
+        conn = -1;
+    }
+
+    void run(doorbell& router_bell) {
+        int conn = -1;
+        uint64_t sent_ns = 0;
+        for (bool last = false; !last;) {
+            last = stopping_.load();
+
+            if (conn < 0) {
+                if (last) {
+                    break;
+                }
+                pollfd p{listen_fd_, POLLIN, 0};
+                if (poll(&p, 1, REPLICA_HEARTBEAT_MS) == 1 && (conn = ::accept(listen_fd_, nullptr, nullptr)) >= 0) {
+                    int one = 1;
+                    setsockopt(conn, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+                    set_stream_timeout(conn, SO_SNDTIMEO, REPLICA_SEND_TIMEOUT_MS);
+                    DEBUG("Standby connected\n");
+                    waiting_.store(true);
+                    router_bell.ring();
+                }
+                continue;
+            }
+
+            if (!last) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(REPLICA_BATCH_MS));
+            }
+
+            // take what the router has recorded, and leave it a fresh batch
+            std::string snapshot;
+            image_writer batch;
+            size_t records;
+            bool dropped;
+            {
+                std::lock_guard<std::mutex> guard{lock_};
+                snapshot.swap(snapshot_);
+                std::swap(batch, batch_);
+                records = records_;
+                records_ = 0;
+                dropped = dropped_;
+            }
+            if (dropped) {
+                detach(conn);
+                continue;
+            }
+
+            uint64_t now_ns = monotonic_ns();
+            bool ok = true;
+            if (!snapshot.empty()) {
+                ok = write_frame(conn, REPLICA_SNAPSHOT, snapshot);
+                sent_ns = now_ns;
+            }
+            if (ok && (records > 0 || now_ns - sent_ns >= REPLICA_HEARTBEAT_MS * 1000000ull)) {
+                ok = write_frame(conn, REPLICA_CHANGES, batch.data());
+                sent_ns = now_ns;
+            }
+            if (!ok) {
+                DEBUG("Lost standby\n");
+                detach(conn);
+            }
+        }
+        if (conn >= 0) {
+            close(conn);
+        }
+    }
+
+    int listen_fd_ = -1;
+    std::thread thread_;
+    std::atomic<bool> stopping_{false};
+    // a standby has connected, but is not yet attached by the router
+    std::atomic<bool> waiting_{false};
+    // changes are being recorded for a standby
+    std::atomic<bool> attached_{false};
+
+    // guards the fields below, shared between the router and replication thread
+    std::mutex lock_;
+    std::string snapshot_;
+    image_writer batch_;
+    size_t records_ = 0;
+    bool dropped_ = false;
+};
+
+/**
+ * @brief Standby side of replication, a connection to the primary
+*/
+class replica_standby {
+public:
+    replica_standby() = default;
+    replica_standby(const replica_standby&) = delete;
+    replica_standby& operator=(const replica_standby&) = delete;
+
+    ~replica_standby() {
+        disconnect();
+    }
+
+    /**
+     * @brief Connect to the primary
+     * @param primary address the primary listens for a standby on
+     * @param failover_ms how long the primary may be silent, reads time out after this
+     * @return true if connected
+    */
+    bool connect(const sockaddr_in& primary, int failover_ms) {
+        disconnect();
+        fd_ = connect_stream(primary, REPLICA_HEARTBEAT_MS);
+        if (fd_ < 0) {
+            return false;
+        }
+        set_stream_timeout(fd_, SO_RCVTIMEO, failover_ms);
+        return true;
+    }
+
+    void disconnect() {
+        if (fd_ >= 0) {
+            close(fd_);
+            fd_ = -1;
+        }
+    }
+
+    bool connected() const {
+        return fd_ >= 0;
+    }
+
+    /**
+     * @brief Wait for the next frame from the primary
+     * @return false, and disconnected, if the primary closed the connection or went silent
+    */
+    bool receive(replica_frame& kind, std::string& data) {
+        if (read_frame(fd_, kind, data)) {
+            return true;
+        }
+        disconnect();
+        return false;
+    }
+
+private:
+    int fd_ = -1;
+};
+
+}; // namespace chat
@@ -0,0 +1,311 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <semaphore.h>
+#include <time.h>
+
+#include <atomic>
+#include <thread>
+
+#include "chat_ex.hpp"
+
+// Assumed size of a cache line, used to keep producer and consumer state apart
+#define CACHE_LINE_SIZE 64
+
+namespace chat {
+
+/**
+ * @brief Bounded single-producer/single-consumer lock-free ring
+ *
+ * Exactly one thread may call push and exactly one (other) thread may call
+ * pop. N must be a power of two.
+*/
+template <typename T, size_t N>
+class spsc_ring {
+    static_assert(N > 0 && (N & (N - 1)) == 0, "spsc_ring capacity must be a power of two");
+
+public:
+    /**
+     * @brief Append an element (producer only)
+     * @param value to append
+     * @return false if the ring is full
+    */
+    bool push(const T& value) {
+        size_t tail = tail_.load(std::memory_order_relaxed);
+        if (tail - head_cache_ == N) {
+            head_cache_ = head_.load(std::memory_order_acquire);
+            if (tail - head_cache_ == N) {
+                return false;
+            }
+        }
+        slots_[tail & (N - 1)] = value;
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * @brief Remove the oldest element (consumer only)
+     * @param value receives the element
+     * @return false if the ring is empty
+    */
+    bool pop(T& value) {
+        size_t head = head_.load(std::memory_order_relaxed);
+        if (head == tail_cache_) {
+            tail_cache_ = tail_.load(std::memory_order_acquire);
+            if (head == tail_cache_) {
+                return false;
+            }
+        }
+        value = slots_[head & (N - 1)];
+        head_.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool empty() const {
+        return head_.load(std::memory_order_acquire) == tail_.load(std::memory_order_acquire);
+    }
+
+private:
+    // consumer side
+    alignas(CACHE_LINE_SIZE) std::atomic<size_t> head_{0};
+    size_t tail_cache_ = 0;
+    // producer side
+    alignas(CACHE_LINE_SIZE) std::atomic<size_t> tail_{0};
+    size_t head_cache_ = 0;
+
+    alignas(CACHE_LINE_SIZE) T slots_[N];
+};
+
+/**
+ * @brief Wakes a consumer that is waiting for a ring to become non-empty
+ *
+ * The consumer only sleeps (on a semaphore) after announcing it is about
+ * to and re-checking for work, so a producer that rings after publishing
+ * can never be missed. Ringing a doorbell nobody waits on is just a fence
+ * and a load.
+*/
+class doorbell {
+public:
+    doorbell() {
+        sem_init(&sem_, 0, 0);
+    }
+
+    doorbell(const doorbell&) = delete;
+    doorbell& operator=(const doorbell&) = delete;
+
+    ~doorbell() {
+        sem_destroy(&sem_);
+    }
+
+    /**
+     * @brief Wake the waiting consumer, call after publishing work
+    */
+    void ring() {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (sleeping_.load(std::memory_order_relaxed) && sleeping_.exchange(false)) {
+            sem_post(&sem_);
+        }
+    }
+
+    /**
+     * @brief Sleep until rung, unless there is already work
+     *
+     * May return spuriously, callers re-check for work in a loop.
+     * @param ready returns true if there is work to do
+    */
+    template <typename Ready>
+    void wait(Ready ready) {
+        sleeping_.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (ready()) {
+            sleeping_.store(false, std::memory_order_relaxed);
+            return;
+        }
+        sem_wait(&sem_);
+    }
+
+    /**
+     * @brief As wait, but sleeping for no longer than a timeout
+     * @param ready returns true if there is work to do
+     * @param timeout_ms longest to sleep, in milliseconds
+    */
+    template <typename Ready>
+    void wait(Ready ready, uint32_t timeout_ms) {
+        sleeping_.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (ready()) {
+            sleeping_.store(false, std::memory_order_relaxed);
+            return;
+        }
+        timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += timeout_ms / 1000;
+        deadline.tv_nsec += (timeout_ms % 1000) * 1000000l;
+        if (deadline.tv_nsec >= 1000000000l) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000l;
+        }
+        if (sem_timedwait(&sem_, &deadline) != 0) {
+            // a ring that comes after this posts anyway, and the next wait returns at once
+            sleeping_.store(false, std::memory_order_relaxed);
+        }
+    }
+
+private:
+    std::atomic<bool> sleeping_{false};
+    sem_t sem_;
+};
+
+/**
+ * @brief What a receive_channel does when all of its buffers are in use
+ * @var overflow_policy::OVERFLOW_DROP
+ * Newly arriving messages are discarded (and counted) until a buffer is free
+ * @var overflow_policy::OVERFLOW_BLOCK
+ * The producer waits for a free buffer, leaving packets queued in the socket
+*/
+enum overflow_policy {
+    OVERFLOW_DROP = 0,
+    OVERFLOW_BLOCK,
+};
+
+/**
+ * @brief Bounded channel of received messages backed by a preallocated pool
+ *
+ * The producer acquires a free buffer, receives straight into it and
+ * publishes its index; the consumer handles the message in place and then
+ * releases the buffer. Messages are never copied or allocated on the way.
+ * Both the ready queues and the free list are spsc_rings, the free list
+ * running in the opposite direction (consumer to producer).
+ *
+ * With several lanes, each has its own ready queue and recv takes from the
+ * lowest numbered lane that has a message, so a message in lane 0 is never
+ * left waiting behind the others.
+*/
+template <size_t N, typename T = chat_message, size_t Lanes = 1>
+class receive_channel {
+public:
+    explicit receive_channel(overflow_policy policy) : policy_{policy} {
+        for (uint32_t slot = 0; slot < N; slot++) {
+            free_.push(slot);
+        }
+    }
+
+    receive_channel(const receive_channel&) = delete;
+    receive_channel& operator=(const receive_channel&) = delete;
+
+    overflow_policy policy() const {
+        return policy_;
+    }
+
+    /**
+     * @brief Get a free buffer to receive into (producer only)
+     * @param slot receives the buffer index
+     * @return false if all buffers are in use
+    */
+    bool acquire(uint32_t& slot) {
+        return free_.pop(slot);
+    }
+
+    /**
+     * @brief Get a free buffer, waiting for the consumer if necessary (producer only)
+     * @return the buffer index
+    */
+    uint32_t acquire_wait() {
+        uint32_t slot;
+        acquire_wait(slot, []() { return false; });
+        return slot;
+    }
+
+    /**
+     * @brief Get a free buffer, waiting for the consumer unless told to stop (producer only)
+     * @param slot receives the buffer index
+     * @param stop called while waiting, true gives up
+     * @return false if stop gave up before a buffer was free
+    */
+    template <typename Stop>
+    bool acquire_wait(uint32_t& slot, Stop stop) {
+        while (!free_.pop(slot)) {
+            if (stop()) {
+                return false;
+            }
+            std::this_thread::yield();
+        }
+        return true;
+    }
+
+    /**
+     * @brief Publish a filled buffer to the consumer (producer only)
+     * @param slot index of buffer
+     * @param lane to publish it in
+    */
+    void send(uint32_t slot, size_t lane = 0) {
+        // cannot fail, every ready queue has room for every buffer in the pool
+        ready_[lane].push(slot);
+    }
+
+    /**
+     * @brief Take the next published buffer, from the first lane with one (consumer only)
+     * @param slot receives the buffer index
+     * @return false if no message is waiting
+    */
+    bool recv(uint32_t& slot) {
+        for (auto& ready: ready_) {
+            if (ready.pop(slot)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /**
+     * @brief Take the next published buffer of a lane (consumer only)
+     * @param slot receives the buffer index
+     * @param lane to take it from
+     * @return false if no message is waiting in the lane
+    */
+    bool recv(uint32_t& slot, size_t lane) {
+        return ready_[lane].pop(slot);
+    }
+
+    /**
+     * @brief Hand a buffer back once its message has been handled (consumer only)
+     * @param slot index of buffer
+    */
+    void release(uint32_t slot) {
+        free_.push(slot);
+    }
+
+    T& operator[](uint32_t slot) {
+        return buffers_[slot];
+    }
+
+    bool empty() const {
+        for (const auto& ready: ready_) {
+            if (!ready.empty()) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /**
+     * @brief Count a message discarded because of overflow (producer only)
+    */
+    void record_drop() {
+        dropped_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    uint64_t dropped() const {
+        return dropped_.load(std::memory_order_relaxed);
+    }
+
+private:
+    overflow_policy policy_;
+    std::atomic<uint64_t> dropped_{0};
+    spsc_ring<uint32_t, N> ready_[Lanes];
+    spsc_ring<uint32_t, N> free_;
+    T buffers_[N];
+};
+
+}; // namespace chat
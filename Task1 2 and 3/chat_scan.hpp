@@ -0,0 +1,209 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string_view>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/**
+ * @brief Vectorised scanning of packet fields
+ *
+ * Protocol fields are NUL terminated within fixed size arrays, and carry
+ * lists separated by ':'. The kernels here compare a whole vector of bytes
+ * at a time: 32 with AVX2, when the build enables it (-mavx2), otherwise
+ * 16 with SSE2, which every x86-64 has. Other targets, and the tail of a
+ * field, fall back to one byte at a time. No load reads past the length
+ * it is given, so fields can be scanned in place.
+*/
+#if defined(__AVX2__)
+#define SCAN_WIDTH 32
+#elif defined(__SSE2__)
+#define SCAN_WIDTH 16
+#else
+#define SCAN_WIDTH 1
+#endif
+
+namespace chat {
+
+/**
+ * @brief Bit i is set where byte i of a SCAN_WIDTH block equals the given byte
+*/
+inline uint32_t match_mask(const char * block, char byte) {
+#if defined(__AVX2__)
+    __m256i chunk = _mm256_loadu_si256((const __m256i*)block);
+    return (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, _mm256_set1_epi8(byte)));
+#elif defined(__SSE2__)
+    __m128i chunk = _mm_loadu_si128((const __m128i*)block);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, _mm_set1_epi8(byte)));
+#else
+    return block[0] == byte ? 1 : 0;
+#endif
+}
+
+/**
+ * @brief Bit i is set where byte i of a SCAN_WIDTH block has its top bit set
+*/
+inline uint32_t high_mask(const unsigned char * block) {
+#if defined(__AVX2__)
+    return (uint32_t)_mm256_movemask_epi8(_mm256_loadu_si256((const __m256i*)block));
+#elif defined(__SSE2__)
+    return (uint32_t)_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)block));
+#else
+    return block[0] >> 7;
+#endif
+}
+
+/**
+ * @brief Find the first occurrence of a byte
+ * @param data to scan
+ * @param length of data
+ * @param byte to find
+ * @return index of the byte, length if not found
+*/
+inline size_t find_byte(const char * data, size_t length, char byte) {
+    size_t i = 0;
+    for (; i + SCAN_WIDTH <= length; i += SCAN_WIDTH) {
+        if (uint32_t found = match_mask(data + i, byte)) {
+            return i + __builtin_ctz(found);
+        }
+    }
+    for (; i < length; i++) {
+        if (data[i] == byte) {
+            return i;
+        }
+    }
+    return length;
+}
+
+/**
+ * @brief Length of a NUL terminated field, bounded by the size of the field
+ * @param field fixed size array from a packet
+ * @param size of the array
+ * @return index of the first NUL, size if the NUL is missing
+*/
+inline size_t field_length(const int8_t * field, size_t size) {
+    return find_byte((const char*)field, size, '\0');
+}
+
+/**
+ * @brief View of a NUL terminated field
+*/
+inline std::string_view field_view(const int8_t * field, size_t size) {
+    return std::string_view{(const char*)field, field_length(field, size)};
+}
+
+/**
+ * @brief Skip ASCII bytes
+ * @return index of the first byte with the top bit set, length if there is none
+*/
+inline size_t skip_ascii(const unsigned char * data, size_t length, size_t i) {
+    for (; i + SCAN_WIDTH <= length; i += SCAN_WIDTH) {
+        if (uint32_t high = high_mask(data + i)) {
+            return i + __builtin_ctz(high);
+        }
+    }
+    for (; i < length; i++) {
+        if (data[i] & 0x80) {
+            return i;
+        }
+    }
+    return length;
+}
+
+/**
+ * @brief Check text is well formed UTF-8
+ *
+ * Runs of ASCII, which is almost all chat traffic, are skipped a vector at
+ * a time; multi byte sequences are decoded one by one, rejecting overlong
+ * encodings, surrogates and code points above U+10FFFF.
+ *
+ * @param text to check
+ * @return true if valid
+*/
+inline bool valid_utf8(std::string_view text) {
+    const unsigned char * data = (const unsigned char*)text.data();
+    size_t length = text.length();
+    size_t i = 0;
+    for (;;) {
+        i = skip_ascii(data, length, i);
+        if (i == length) {
+            return true;
+        }
+
+        unsigned char lead = data[i];
+        size_t sequence;
+        uint32_t code_point;
+        if ((lead & 0xe0) == 0xc0) {
+            sequence = 2;
+            code_point = lead & 0x1f;
+        }
+        else if ((lead & 0xf0) == 0xe0) {
+            sequence = 3;
+            code_point = lead & 0x0f;
+        }
+        else if ((lead & 0xf8) == 0xf0) {
+            sequence = 4;
+            code_point = lead & 0x07;
+        }
+        else {
+            return false;
+        }
+        if (length - i < sequence) {
+            return false;
+        }
+        for (size_t k = 1; k < sequence; k++) {
+            if ((data[i + k] & 0xc0) != 0x80) {
+                return false;
+            }
+            code_point = (code_point << 6) | (data[i + k] & 0x3f);
+        }
+        if ((sequence == 2 && code_point < 0x80) ||
+            (sequence == 3 && code_point < 0x800) ||
+            (sequence == 4 && (code_point < 0x10000 || code_point > 0x10ffff)) ||
+            (code_point >= 0xd800 && code_point <= 0xdfff)) {
+            return false;
+        }
+        i += sequence;
+    }
+}
+
+/**
+ * @brief Split text on a separator without copying
+ *
+ * Every separator ends a field, so "a::b" gives "a", "" and "b", and empty
+ * text gives a single empty field.
+ *
+ * @param text to split
+ * @param separator character between fields
+ * @param fields receives a view of each field, anything with push_back(std::string_view)
+*/
+template <typename Fields>
+inline void split(std::string_view text, char separator, Fields& fields) {
+    const char * data = text.data();
+    size_t length = text.length();
+    size_t start = 0;
+    size_t i = 0;
+    // every separator in a block comes out of one compare
+    for (; i + SCAN_WIDTH <= length; i += SCAN_WIDTH) {
+        for (uint32_t found = match_mask(data + i, separator); found != 0; found &= found - 1) {
+            size_t end = i + __builtin_ctz(found);
+            fields.push_back(std::string_view{data + start, end - start});
+            start = end + 1;
+        }
+    }
+    for (; i < length; i++) {
+        if (data[i] == separator) {
+            fields.push_back(std::string_view{data + start, i - start});
+            start = i + 1;
+        }
+    }
+    fields.push_back(std::string_view{data + start, length - start});
+}
+
+}; // namespace chat
@@ -3,28 +3,235 @@
 #include <iot/socket.hpp>
 
 #include <arpa/inet.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
-#include <sstream>
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <set>
+#include <string_view>
+#include <thread>
 
 
+#include "chat_arena.hpp"
+#include "chat_egress.hpp"
 #include "chat_ex.hpp"
+#include "chat_gateway.hpp"
+#include "chat_group.hpp"
+#include "chat_handoff.hpp"
+#include "chat_lanes.hpp"
+#include "chat_latency.hpp"
+#include "chat_memory.hpp"
+#include "chat_multicast.hpp"
+#include "chat_presence.hpp"
+#include "chat_replica.hpp"
+#include "chat_ring.hpp"
+#include "chat_scan.hpp"
+#include "chat_server.hpp"
+#include "chat_session.hpp"
+#include "chat_trace.hpp"
+#include "chat_transport.hpp"
 
 #define USER_ALL "__ALL"
 #define USER_END "END"
 
+// Number of received packets that can be waiting to be routed
+#define SERVER_RECV_CAPACITY 4096
+// Most chat packets waiting to be routed, the rest of the buffers are kept for control packets
+#define SERVER_BULK_QUEUE (SERVER_RECV_CAPACITY - 256)
+
+// Size of the arena used for temporaries while handling a single packet
+#define PACKET_ARENA_SIZE (64 * 1024)
+// How often the server logs its counters
+#define SERVER_STATS_INTERVAL_NS 10000000000ull
+
+/**
+ * @brief scratch memory for handling the current packet, reset after each loop pass
+*/
+chat::arena packet_arena{PACKET_ARENA_SIZE};
+
+/**
+ * @brief messages with fixed content, encoded once and sent many times
+ *
+ * JACK is set up when the server starts, as it announces the multicast group
+ * and how long sessions may be silent.
+*/
+chat::chat_message JACK_MSG = chat::jack_msg();
+const chat::chat_message LACK_MSG = chat::lack_msg();
+const chat::chat_message EXIT_MSG = chat::exit_msg();
+
+/**
+ * @brief the server's multicast group, not open if multicast is disabled
+*/
+chat::multicast_sender multicast;
+
+/**
+ * @brief users that receive broadcast and presence traffic by multicast
+*/
+std::set<std::string, std::less<>> multicast_users;
+
+/**
+ * @brief groups, by name, deleted once abandoned for their time to live
+*/
+chat::group_table groups;
+
+/**
+ * @brief who is sent JOIN and LEAVE announcements about whom
+*/
+chat::presence_index presence;
+
+/**
+ * @brief sessions a presence announcement goes to, kept to reuse its memory
+*/
+chat::bitset presence_targets;
+
+/**
+ * @brief changes to the state are recorded here for a standby server, if one is attached
+*/
+chat::replica_primary replication;
+
+/**
+ * @brief resume tokens of the sessions online, and the messages held for suspended ones
+*/
+chat::session_table sessions;
+
+/**
+ * @brief how long the tokens of brokered peers last, in milliseconds, 0 if DMs are only relayed
+*/
+uint32_t peer_ttl_ms = 0;
+
+/**
+ * @brief tokens shared by the peers the server brokers
+*/
+chat::token_source peer_tokens;
+
+/**
+ * @brief pairs of peers brokered
+*/
+uint64_t peers_brokered = 0;
+
+/**
+ * @brief users online behind gateways, and the addresses they were given
+*/
+chat::gateway_table gateways;
+
+/**
+ * @brief telemetry streams, their subscribers and the current window
+*/
+chat::telemetry_table telemetry;
+
+/**
+ * @brief chat received but not yet routed, waiting its sender's turn
+*/
+chat::fair_queue bulk_lane{SERVER_BULK_QUEUE};
+
 /**
- * @brief map of current online clients
+ * @brief clock the server state runs on, for when sessions, groups and telemetry windows expire
 */
-typedef std::map<std::string, sockaddr_in *> online_users;
+uint64_t (*state_clock)() = chat::monotonic_ns;
 
-std::vector<std::string> usernames;
+void set_state_clock(uint64_t (*clock)()) {
+    state_clock = clock;
+}
+
+/**
+ * @brief memory held for the users online
+*/
+chat::memory_account user_memory;
+
+/**
+ * @brief estimated heap held for an online user: its map node and address, and its presence entry
+*/
+size_t user_bytes(std::string_view username) {
+    return chat::node_bytes(sizeof(online_users::value_type), username.length()) + sizeof(sockaddr_in) +
+        chat::node_bytes(sizeof(std::pair<const std::string, uint32_t>), username.length()) +
+        chat::string_bytes(username.length());
+}
+
+const std::string& add_user(
+    online_users& online_users, std::string_view username, const sockaddr_in& address, std::string_view token) {
+    online_users.emplace(username, new sockaddr_in(address));
+    presence.join(username);
+    user_memory.charge(user_bytes(username));
+    return sessions.open(username, address, token, state_clock());
+}
+
+/**
+ * @brief Take a user offline
+ * @param online_users users currently online
+ * @param user to remove, invalid afterwards
+*/
+void remove_user(online_users& online_users, online_users::iterator user) {
+    // users behind a gateway cannot stay online without it
+    for (const std::string& sub: gateways.subs(user->first)) {
+        if (auto search = online_users.find(sub); search != online_users.end()) {
+            remove_user(online_users, search);
+        }
+    }
+    gateways.detach(user->first);
+    telemetry.unsubscribe_all(user->first);
+    delete user->second;
+    presence.leave(user->first);
+    user_memory.credit(user_bytes(user->first));
+    sessions.close(user->first);
+    multicast_users.erase(user->first);
+    online_users.erase(user);
+}
 
 void handle_list(
-    online_users& online_users, std::string username, std::string,
-    struct sockaddr_in& client_address, uwe::socket& sock, bool& exit_loop);
+    online_users& online_users, std::string_view username, std::string_view,
+    struct sockaddr_in& client_address, chat::egress& out, bool& exit_loop);
+
+/**
+ * @brief Record the user a multicast message originates from
+ *
+ * Multicast members receive their own traffic too, and use groupname_
+ * to recognise and drop it.
+ *
+ * @param msg to stamp
+ * @param username of originating user
+*/
+void set_origin(chat::chat_message& msg, std::string_view username) {
+    std::string_view safe_username = username.substr(0, MAX_USERNAME_LENGTH - 1);
+    memcpy(msg.groupname_, safe_username.data(), safe_username.length());
+    msg.groupname_[safe_username.length()] = '\0';
+}
+
+/**
+ * @brief Send to an online user, or hold the message while their session is suspended
+ *
+ * @param msg encoded message
+ * @param user online user to send to
+ * @param out egress stage sending to clients
+*/
+void send_user(const chat::outgoing& msg, const online_users::value_type& user, chat::egress& out) {
+    if (!sessions.any_suspended() || !sessions.hold(user.first, out.message(msg))) {
+        out.send(msg, *user.second);
+    }
+}
+
+/**
+ * @brief A user is sent multicast traffic by the group datagram alone
+ *
+ * A suspended session is not: what is sent to it must be held until it
+ * resumes, so it goes through send_user like any other.
+ *
+ * @param username of online user
+*/
+bool multicast_only(std::string_view username) {
+    return multicast_users.find(username) != multicast_users.end() &&
+        (!sessions.any_suspended() || !sessions.suspended(username));
+}
+
+/**
+ * @brief Every user online is sent multicast traffic by the group datagram alone
+*/
+bool multicast_covers_all(const online_users& online_users) {
+    return multicast_users.size() == online_users.size() && !sessions.any_suspended();
+}
 
 /**
  * @brief Send a given message to all clients
@@ -32,21 +239,80 @@ void handle_list(
  * @param msg to send
  * @param username used if  not to send to that particular user
  * @param online_users current online users
- * @param sock socket for communicting with client 
+ * @param out egress stage sending to clients
  * @param send_to_username determines also to send to username
+ * @param allow_multicast send as one multicast datagram to users that have asked for it
 */
 void send_all(
-    chat::chat_message& msg, std::string username, online_users& online_users, 
-    uwe::socket& sock, bool send_to_username = true) {
-    for (const auto user: online_users) {    
+    const chat::chat_message& msg, std::string_view username, online_users& online_users, 
+    chat::egress& out, bool send_to_username = true, bool allow_multicast = false) {
+    bool use_multicast = allow_multicast && multicast.is_open() && !multicast_users.empty();
+
+    // encode once, the egress workers share the buffer between all sends
+    chat::chat_message stamped = msg;
+    if (use_multicast && !send_to_username) {
+        set_origin(stamped, username);
+    }
+    auto encoded = out.encode(stamped);
+
+    if (use_multicast) {
+        out.send_multicast(encoded);
+        if (multicast_covers_all(online_users)) {
+            return;
+        }
+    }
+
+    for (const auto& user: online_users) {    
+        if (use_multicast && multicast_only(user.first)) {
+            continue;
+        }
         if ((send_to_username && user.first.compare(username) == 0) || user.first.compare(username) != 0) { 
-            int len = sock.sendto(
-                reinterpret_cast<const char*>(&msg), sizeof(chat::chat_message), 0,
-                (sockaddr*)user.second, sizeof(struct sockaddr_in));
+            send_user(encoded, user, out);
         }
     }   
 }
 
+/**
+ * @brief Send a JOIN or LEAVE announcement to the users interested in it
+ *
+ * While no session has narrowed its presence interest this is send_all,
+ * multicast included. Otherwise the announcement goes by unicast to the
+ * sessions interested in the subject, found from their bitsets rather
+ * than by looking at every user online, and the members of the subject's
+ * own groups, found from the group table's index of them.
+ *
+ * @param msg to send
+ * @param subject user the announcement is about
+ * @param online_users current online users
+ * @param out egress stage sending to clients
+ * @param send_to_subject also send to the subject, interested or not
+*/
+void send_presence(
+    const chat::chat_message& msg, std::string_view subject, online_users& online_users,
+    chat::egress& out, bool send_to_subject) {
+    if (presence.everyone_interested()) {
+        send_all(msg, subject, online_users, out, send_to_subject, true);
+        return;
+    }
+
+    presence.interested(subject, presence_targets);
+    if (presence.groups_wanted()) {
+        groups.for_each_group(subject, [&](const std::string&, const chat::group_members& members) {
+            members.for_each([&](const std::string& member) {
+                presence.add_co_member(member, presence_targets);
+            });
+        });
+    }
+    presence.mark(subject, presence_targets, send_to_subject);
+
+    auto encoded = out.encode(msg);
+    presence_targets.for_each([&](uint32_t session) {
+        if (auto user = online_users.find(presence.name(session)); user != online_users.end()) {
+            send_user(encoded, *user, out);
+        }
+    });
+}
+
 /**
  * @brief handle sending an error and incoming error messages
  * 
@@ -54,14 +320,12 @@ void send_all(
  * 
  * @param err code for error
  * @param client_address address of client to send message to
- * @param sock socket for communicting with client
+ * @param out egress stage sending to clients
  * @parm exit_loop set to true if event loop is to terminate
 */
-void handle_error(uint16_t err, struct sockaddr_in& client_address, uwe::socket& sock, bool& exit_loop) {
+void handle_error(uint16_t err, struct sockaddr_in& client_address, chat::egress& out, bool& exit_loop) {
     auto msg = chat::error_msg(err);
-    int len = sock.sendto(
-        reinterpret_cast<const char*>(&msg), sizeof(chat::chat_message), 0,
-        (sockaddr*)&client_address, sizeof(struct sockaddr_in));
+    out.send(msg, client_address);
 }
 
 /**
@@ -71,33 +335,45 @@ void handle_error(uint16_t err, struct sockaddr_in& client_address, uwe::socket&
  * @param username part of chat protocol packet
  * @param msg part of chat protocol packet
  * @param client_address address of client to send message to
- * @param sock socket for communicting with client
+ * @param out egress stage sending to clients
  * @parm exit_loop set to true if event loop is to terminate
 */
 void handle_broadcast(
-    online_users& online_users, std::string username, std::string msg,
-    struct sockaddr_in& client_address, uwe::socket& sock, bool& exit_loop) {
+    online_users& online_users, std::string_view username, std::string_view msg,
+    struct sockaddr_in& client_address, chat::egress& out, bool& exit_loop) {
     
     DEBUG("Received broadcast\n");
 
-    auto m = chat::broadcast_msg(username, msg); // Create the broadcast message once
+    auto broadcast = chat::broadcast_msg(username, msg); // Create the broadcast message once
+    set_origin(broadcast, username);
+    auto m = out.encode(broadcast);
+
+    // One datagram reaches every multicast member, the sender drops its own copy
+    bool use_multicast = multicast.is_open() && !multicast_users.empty();
+    if (use_multicast) {
+        out.send_multicast(m);
+        if (multicast_covers_all(online_users)) {
+            return;
+        }
+    }
 
     // Iterate over the map of online users and send the message to each user except the sender
     for (const auto& user_pair : online_users) {
+        if (use_multicast && multicast_only(user_pair.first)) {
+            continue;
+        }
         // Check if the user is not the sender
         if (client_address.sin_addr.s_addr != user_pair.second->sin_addr.s_addr ||
             client_address.sin_port != user_pair.second->sin_port) {
 
             // Send the broadcast message to the user
-            int len = sock.sendto(
-                reinterpret_cast<const char*>(&m), sizeof(chat::chat_message), 0,
-                (struct sockaddr*)user_pair.second, sizeof(struct sockaddr_in));
+            send_user(m, user_pair, out);
                 
             // Log the send operation
             DEBUG("Broadcast message sent to %s\n", user_pair.first.c_str());
         } else {
             // This is the sender, do not send the message back to them
-            DEBUG("Not sending message to self: %s\n", msg.c_str());
+            DEBUG("Not sending message to self: %.*s\n", (int)msg.length(), msg.data());
         }
     }
 }
@@ -109,30 +385,33 @@ void handle_broadcast(
  * @param username part of chat protocol packet
  * @param msg part of chat protocol packet
  * @param client_address address of client to send message to
- * @param sock socket for communicting with client
+ * @param out egress stage sending to clients
  * @parm exit_loop set to true if event loop is to terminate
 */
 void handle_join(
-    online_users& users, std::string username, std::string,
-    struct sockaddr_in& client_address, uwe::socket& sock, bool& exit_loop) {
+    online_users& users, std::string_view username, std::string_view,
+    struct sockaddr_in& client_address, chat::egress& out, bool& exit_loop) {
     
     if (users.find(username) != users.end()) {
-        handle_error(ERR_USER_ALREADY_ONLINE, client_address, sock, exit_loop);
+        handle_error(ERR_USER_ALREADY_ONLINE, client_address, out, exit_loop);
+    } else if (user_memory.full()) {
+        DEBUG("Refused %.*s, users are at their memory cap\n", (int)username.length(), username.data());
+        handle_error(ERR_MEMORY_FULL, client_address, out, exit_loop);
     } else {
-        auto* addr = new sockaddr_in(client_address);
-        users[username] = addr;
+        const std::string& token = add_user(users, username, client_address);
+        replication.join(username, client_address, token);
         
-        auto msg = chat::jack_msg();
-        sock.sendto(reinterpret_cast<const char*>(&msg), sizeof(msg), 0, (sockaddr*)&client_address, sizeof(client_address));
+        // the JACK carries the session's resume token
+        out.send(chat::jack_msg(JACK_MSG, token), client_address);
         
-        for (const auto& user : users) {
-            if (user.first != username) {
-                auto broadcastMsg = chat::broadcast_msg("Server", username + " has joined the chat.");
-                sock.sendto(reinterpret_cast<const char*>(&broadcastMsg), sizeof(broadcastMsg), 0, (sockaddr*)user.second, sizeof(sockaddr_in));
-            }
-        }
-
-        handle_list(users, USER_ALL, "", client_address, sock, exit_loop);
+        // encode the announcement once, then send it to everyone else
+        chat::arena_string text{username, packet_arena};
+        text.append(" has joined the chat.");
+        auto broadcastMsg = chat::broadcast_msg("Server", text);
+        send_presence(broadcastMsg, username, users, out, false);
+
+        // everyone interested in the new user is sent the list, as well as the user
+        handle_list(users, USER_ALL, username, client_address, out, exit_loop);
     }
 }
 
@@ -143,14 +422,14 @@ void handle_join(
  * @param username part of chat protocol packet
  * @param msg part of chat protocol packet
  * @param client_address address of client to send message to
- * @param sock socket for communicting with client
+ * @param out egress stage sending to clients
  * @parm exit_loop set to true if event loop is to terminate
 */
 void handle_jack(
-    online_users& online_users, std::string username, std::string, 
-    struct sockaddr_in& client_address, uwe::socket& sock, bool& exit_loop) {
+    online_users& online_users, std::string_view username, std::string_view, 
+    struct sockaddr_in& client_address, chat::egress& out, bool& exit_loop) {
     DEBUG("Received jack\n");
-    handle_error(ERR_UNEXPECTED_MSG, client_address, sock, exit_loop);
+    handle_error(ERR_UNEXPECTED_MSG, client_address, out, exit_loop);
 }
 
 /**
@@ -160,18 +439,18 @@ void handle_jack(
  * @param username part of chat protocol packet
  * @param msg part of chat protocol packet
  * @param client_address address of client to send message to
- * @param sock socket for communicting with client
+ * @param out egress stage sending to clients
  * @parm exit_loop set to true if event loop is to terminate
 */
 // handle_directmessage implementation
 void handle_directmessage(
-    online_users& users, std::string sender_username, std::string message,
-    struct sockaddr_in& sender_address, uwe::socket& sock, bool& exit_loop) {
+    online_users& users, std::string_view sender_username, std::string_view message,
+    struct sockaddr_in& sender_address, chat::egress& out, bool& exit_loop) {
     
-    auto separator_pos = message.find(':');
-    if (separator_pos != std::string::npos) {
-        std::string recipient_username = message.substr(0, separator_pos);
-        std::string actual_message = message.substr(separator_pos + 1);
+    size_t separator_pos = chat::find_byte(message.data(), message.length(), ':');
+    if (separator_pos != message.length()) {
+        std::string_view recipient_username = message.substr(0, separator_pos);
+        std::string_view actual_message = message.substr(separator_pos + 1);
 
         auto it = users.find(recipient_username);
         if (it != users.end()) {
@@ -179,53 +458,57 @@ void handle_directmessage(
             auto dm_msg = chat::dm_msg(sender_username, actual_message);
             
             // Send the direct message to the intended recipient
-            sock.sendto(reinterpret_cast<const char*>(&dm_msg), sizeof(dm_msg), 0,
-                        (sockaddr*)it->second, sizeof(sockaddr_in));
-            DEBUG("Direct message sent from %s to %s: %s\n", sender_username.c_str(), recipient_username.c_str(), actual_message.c_str());
+            send_user(out.encode(dm_msg), *it, out);
+            DEBUG("Direct message sent from %.*s to %.*s: %.*s\n",
+                (int)sender_username.length(), sender_username.data(),
+                (int)recipient_username.length(), recipient_username.data(),
+                (int)actual_message.length(), actual_message.data());
         } else {
             // Recipient user not found, handle error
-            handle_error(ERR_UNEXPECTED_MSG, sender_address, sock, exit_loop);
+            handle_error(ERR_UNEXPECTED_MSG, sender_address, out, exit_loop);
         }
     } else {
         // Malformed direct message, handle error
-        handle_error(ERR_UNEXPECTED_MSG, sender_address, sock, exit_loop);
+        handle_error(ERR_UNEXPECTED_MSG, sender_address, out, exit_loop);
     }
 }
 
-std::map<std::string, std::vector<std::string>> groups;
-
 void handle_creategroup(
-    online_users& users, std::string, std::string msg, // Notice the groupname parameter is removed from here
-    struct sockaddr_in& client_address, uwe::socket& sock, bool& exit_loop) {
+    online_users& users, std::string_view, std::string_view msg, // Notice the groupname parameter is removed from here
+    struct sockaddr_in& client_address, chat::egress& out, bool& exit_loop) {
         
     // Split the input message to extract the group name and the member usernames
-    std::istringstream iss(msg);
-    std::string groupname;
-    getline(iss, groupname, ':'); // Extract the first part as the group name
+    chat::arena_vector<std::string_view> fields{packet_arena};
+    chat::split(msg, ':', fields);
+    std::string_view groupname = fields[0]; // Extract the first part as the group name
 
     // Log the extracted group name
-    DEBUG("Attempting to create group with name: '%s'\n", groupname.c_str());
-    DEBUG("this is msg: '%s'\n", msg.c_str()); 
+    DEBUG("Attempting to create group with name: '%.*s'\n", (int)groupname.length(), groupname.data());
+    DEBUG("this is msg: '%.*s'\n", (int)msg.length(), msg.data()); 
 
     // Continue with the check if the group already exists
     if (groups.find(groupname) != groups.end()) {
-        DEBUG("Group '%s' already exists\n", groupname.c_str());
-        handle_error(ERR_UNEXPECTED_MSG, client_address, sock, exit_loop);
+        DEBUG("Group '%.*s' already exists\n", (int)groupname.length(), groupname.data());
+        handle_error(ERR_UNEXPECTED_MSG, client_address, out, exit_loop);
+        return;
+    }
+    if (groups.full()) {
+        DEBUG("Groups are at their memory cap\n");
+        handle_error(ERR_MEMORY_FULL, client_address, out, exit_loop);
         return;
     }
 
     // Parse the rest of the user list from the message
-    std::vector<std::string> usernames;
-    std::string user;
-    while (getline(iss, user, ':')) {
-        if (users.find(user) != users.end()) { // Ensure user is online
-            usernames.push_back(user);
+    chat::arena_vector<std::string_view> usernames{packet_arena};
+    for (size_t i = 1; i < fields.size(); i++) {
+        if (users.find(fields[i]) != users.end()) { // Ensure user is online
+            usernames.push_back(fields[i]);
         }
     }
 
     // The rest of the function remains unchanged
     // Add the creator to the group if not already in the list
-    std::string creatorUsername;
+    std::string_view creatorUsername;
     for (const auto& user_pair : users) {
         if (client_address.sin_addr.s_addr == user_pair.second->sin_addr.s_addr &&
             client_address.sin_port == user_pair.second->sin_port) {
@@ -239,22 +522,29 @@ void handle_creategroup(
 
     // Check if we have at least two members (including the creator)
     if (usernames.size() < 2) {
-        DEBUG("Not enough members to create group '%s'\n", groupname.c_str());
-        handle_error(ERR_UNEXPECTED_MSG, client_address, sock, exit_loop);
+        DEBUG("Not enough members to create group '%.*s'\n", (int)groupname.length(), groupname.data());
+        handle_error(ERR_UNEXPECTED_MSG, client_address, out, exit_loop);
         return;
     }
 
     // Create the group in the map
-    groups[groupname] = usernames;
+    auto group = groups.create(groupname, state_clock());
+    for (const auto& user : usernames) {
+        groups.add(group, user);
+        replication.group_add(groupname, user);
+    }
 
     // Send a confirmation message back to the creator
-    auto confirm_msg = chat::broadcast_msg("Server", "Group '" + groupname + "' created successfully.");
-    DEBUG("Group '%s' created successfully with members:\n", groupname.c_str());
+    chat::arena_string text{"Group '", packet_arena};
+    text.append(groupname);
+    text.append("' created successfully.");
+    auto confirm_msg = chat::broadcast_msg("Server", text);
+    DEBUG("Group '%.*s' created successfully with members:\n", (int)groupname.length(), groupname.data());
     for (const auto& user : usernames) {
-        DEBUG(" - %s\n", user.c_str());
+        DEBUG(" - %.*s\n", (int)user.length(), user.data());
+        (void)user;
     }
-    sock.sendto(reinterpret_cast<const char*>(&confirm_msg), sizeof(confirm_msg), 0,
-                (sockaddr*)&client_address, sizeof(struct sockaddr_in));
+    out.send(confirm_msg, client_address);
 }
 
 /**
@@ -264,13 +554,13 @@ void handle_creategroup(
  * @param groupname part of chat protocol packet
  * @param message part of chat protocol packet
  * @param client_address address of client to send message to
- * @param sock socket for communicting with client
+ * @param out egress stage sending to clients
  * @parm exit_loop set to true if event loop is to terminate
 */
 
 void handle_messagegroup(
-    online_users& users, std::string username, std::string message,
-    struct sockaddr_in& client_address, uwe::socket& sock, bool& exit_loop) {
+    online_users& users, std::string_view username, std::string_view message,
+    struct sockaddr_in& client_address, chat::egress& out, bool& exit_loop) {
     DEBUG("Received messagegroup\n");
     //find group and send a debug message of the group name
     for (const auto& group : groups) {
@@ -280,31 +570,169 @@ void handle_messagegroup(
     }
     // Extract the groupname from the username field of the chat_message
     // Assuming the groupname is correctly placed in the username field for the group message scenario
-    std::string groupname = username; 
+    std::string_view groupname = username; 
 
     // Check if the group exists
     auto it = groups.find(groupname);
     if (it == groups.end()) {
         // Group does not exist, send an error message
-        handle_error(ERR_UNKNOWN_USERNAME, client_address, sock, exit_loop);
+        handle_error(ERR_UNKNOWN_USERNAME, client_address, out, exit_loop);
         return;
     }
+    it->second.touch(state_clock());
 
     // Log for debugging
-    DEBUG("Group message to '%s': %s\n", groupname.c_str(), message.c_str());
+    DEBUG("Group message to '%.*s': %.*s\n",
+        (int)groupname.length(), groupname.data(), (int)message.length(), message.data());
 
     // Construct the group message
-    auto gm_msg = chat::messagegroup_msg(groupname, message);
+    auto gm_msg = out.encode(chat::messagegroup_msg(groupname, message));
 
     // Send the message to all group members
-    for (const std::string& username : it->second) {
+    it->second.for_each([&](const std::string& username) {
         auto user_it = users.find(username);
         if (user_it != users.end()) { // Ensure member is online
-            sock.sendto(reinterpret_cast<const char*>(&gm_msg), sizeof(gm_msg), 0,
-                        (sockaddr*)user_it->second, sizeof(sockaddr_in));
+            send_user(gm_msg, *user_it, out);
             DEBUG("Sent to %s\n", username.c_str());
         }
+    });
+}
+
+/**
+ * @brief The user online at an address is a member of a group, and so may change its members
+*/
+bool sent_by_member(const chat::group_members& members, const sockaddr_in& address) {
+    const std::string * username = sessions.at(address);
+    return username != nullptr && members.contains(*username);
+}
+
+/**
+ * @brief handle group add message
+ *
+ * Only a member may add to a group. Members listed that are not online are
+ * skipped, as for CREATEGROUP.
+ * 
+ * @param online_users map of usernames to their corresponding IP:PORT address
+ * @param groupname part of chat protocol packet
+ * @param msg part of chat protocol packet, usernames separated by ':'
+ * @param client_address address of client to send message to
+ * @param out egress stage sending to clients
+ * @parm exit_loop set to true if event loop is to terminate
+*/
+void handle_groupadd(
+    online_users& users, std::string_view groupname, std::string_view msg,
+    struct sockaddr_in& client_address, chat::egress& out, bool& exit_loop) {
+    auto it = groups.find(groupname);
+    if (it == groups.end()) {
+        handle_error(ERR_UNKNOWN_USERNAME, client_address, out, exit_loop);
+        return;
+    }
+    if (!sent_by_member(it->second, client_address)) {
+        handle_error(ERR_UNEXPECTED_MSG, client_address, out, exit_loop);
+        return;
+    }
+
+    if (groups.full()) {
+        handle_error(ERR_MEMORY_FULL, client_address, out, exit_loop);
+        return;
+    }
+    it->second.touch(state_clock());
+
+    chat::arena_vector<std::string_view> usernames{packet_arena};
+    chat::split(msg, ':', usernames);
+    for (std::string_view username : usernames) {
+        if (users.find(username) != users.end() && groups.add(it, username)) {
+            replication.group_add(groupname, username);
+        }
+    }
+    DEBUG("Group '%.*s' now has %zu members\n", (int)groupname.length(), groupname.data(), it->second.size());
+}
+
+/**
+ * @brief handle group remove message
+ *
+ * Only a member may remove from a group. A group is deleted once its last
+ * member is removed.
+ * 
+ * @param online_users map of usernames to their corresponding IP:PORT address
+ * @param groupname part of chat protocol packet
+ * @param msg part of chat protocol packet, usernames separated by ':'
+ * @param client_address address of client to send message to
+ * @param out egress stage sending to clients
+ * @parm exit_loop set to true if event loop is to terminate
+*/
+void handle_groupremove(
+    online_users& users, std::string_view groupname, std::string_view msg,
+    struct sockaddr_in& client_address, chat::egress& out, bool& exit_loop) {
+    auto it = groups.find(groupname);
+    if (it == groups.end()) {
+        handle_error(ERR_UNKNOWN_USERNAME, client_address, out, exit_loop);
+        return;
+    }
+    if (!sent_by_member(it->second, client_address)) {
+        handle_error(ERR_UNEXPECTED_MSG, client_address, out, exit_loop);
+        return;
+    }
+
+    chat::arena_vector<std::string_view> usernames{packet_arena};
+    chat::split(msg, ':', usernames);
+    for (std::string_view username : usernames) {
+        if (groups.remove(it, username)) {
+            replication.group_remove(groupname, username);
+        }
+    }
+    DEBUG("Group '%.*s' now has %zu members\n", (int)groupname.length(), groupname.data(), it->second.size());
+    if (it->second.empty()) {
+        groups.erase(it);
+    }
+}
+
+/**
+ * @brief handle group info message
+ *
+ * The members are sent back as a stream of GROUP_INFO messages, as many
+ * as fit in each, and the last is terminated with user END. Only a member
+ * is sent them, so that neither the list nor the stream can be had by
+ * forging another address.
+ * 
+ * @param online_users map of usernames to their corresponding IP:PORT address
+ * @param groupname part of chat protocol packet
+ * @param msg part of chat protocol packet
+ * @param client_address address of client to send message to
+ * @param out egress stage sending to clients
+ * @parm exit_loop set to true if event loop is to terminate
+*/
+void handle_groupinfo(
+    online_users& users, std::string_view groupname, std::string_view,
+    struct sockaddr_in& client_address, chat::egress& out, bool& exit_loop) {
+    auto it = groups.find(groupname);
+    if (it == groups.end()) {
+        handle_error(ERR_UNKNOWN_USERNAME, client_address, out, exit_loop);
+        return;
+    }
+    if (!sent_by_member(it->second, client_address)) {
+        handle_error(ERR_UNEXPECTED_MSG, client_address, out, exit_loop);
+        return;
     }
+
+    auto reply = chat::group_info_msg(groupname);
+    size_t used = 0;
+    // append a name and its ':', sending the message first if it would not fit with its NUL
+    auto append = [&](std::string_view name) {
+        if (used + name.length() + 1 >= MAX_MESSAGE_LENGTH) {
+            reply.message_[used] = '\0';
+            out.send(reply, client_address);
+            used = 0;
+        }
+        memcpy(&reply.message_[used], name.data(), name.length());
+        used += name.length();
+        reply.message_[used++] = ':';
+    };
+    it->second.for_each(append);
+    append(USER_END);
+    // no ':' after END
+    reply.message_[used - 1] = '\0';
+    out.send(reply, client_address);
 }
 
 
@@ -312,15 +740,15 @@ void handle_messagegroup(
  * @brief handle list message
  * 
  * @param online_users map of usernames to their corresponding IP:PORT address
- * @param username part of chat protocol packet
- * @param msg part of chat protocol packet
+ * @param username part of chat protocol packet, USER_ALL to send to everyone interested in subject
+ * @param subject user that has just joined, when sending to USER_ALL
  * @param client_address address of client to send message to
- * @param sock socket for communicting with client
+ * @param out egress stage sending to clients
  * @parm exit_loop set to true if event loop is to terminate
 */
 void handle_list(
-    online_users& online_users, std::string username, std::string,
-    struct sockaddr_in& client_address, uwe::socket& sock, bool& exit_loop) {
+    online_users& online_users, std::string_view username, std::string_view subject,
+    struct sockaddr_in& client_address, chat::egress& out, bool& exit_loop) {
     DEBUG("Received list\n");
 
     int username_size = MAX_USERNAME_LENGTH;
@@ -332,11 +760,11 @@ void handle_list(
     char * message_ptr = &message_data[0];
 
     bool using_username = true;
-    bool full = false;
 
-    for (const auto user: online_users) {
+    for (const auto& user: online_users) {
         if (using_username) {
-            if (username_size - (user.first.length()+1) >= 0) {
+            // keep room for the terminating NUL
+            if (username_size > (int)(user.first.length()+1)) {
                 memcpy(username_ptr, user.first.c_str(), user.first.length());
                 *(username_ptr+user.first.length()) = ':';
                 username_ptr = username_ptr+user.first.length()+1;
@@ -350,7 +778,7 @@ void handle_list(
         
         // otherwise we fill the message field
         if(!using_username) {
-            if (message_size - (user.first.length()+1) >= 0) {
+            if (message_size > (int)(user.first.length()+1)) {
                 memcpy(message_ptr, user.first.c_str(), user.first.length());
                 *(message_ptr+user.first.length()) = ':';
                 message_ptr = message_ptr+user.first.length()+1;
@@ -366,12 +794,10 @@ void handle_list(
 
                 // 
                 if (username.compare("__ALL") == 0) {
-                    send_all(msg, "__ALL", online_users, sock);
+                    send_presence(msg, subject, online_users, out, true);
                 }
                 else {
-                    int len = sock.sendto(
-                        reinterpret_cast<const char*>(&msg), sizeof(chat::chat_message), 0,
-                        (sockaddr*)&client_address, sizeof(struct sockaddr_in));
+                    out.send(msg, client_address);
                 }
 
                 username_size = MAX_USERNAME_LENGTH;
@@ -381,12 +807,18 @@ void handle_list(
                 message_ptr = &message_data[0];
 
                 using_username = false;
+
+                // the user that did not fit starts the next packet
+                memcpy(message_ptr, user.first.c_str(), user.first.length());
+                *(message_ptr+user.first.length()) = ':';
+                message_ptr = message_ptr+user.first.length()+1;
+                message_size = message_size - (user.first.length()+1);
             }
         }
     }
 
     if (using_username) {
-        if (username_size >= 4) { 
+        if (username_size > 4) { 
             // enough space to store end in username
             memcpy(&username_data[MAX_USERNAME_LENGTH - username_size], USER_END, strlen(USER_END) );
             username_size = username_size - (strlen(USER_END)+1);
@@ -409,13 +841,39 @@ void handle_list(
     memcpy(msg.message_, &message_data[0], MAX_MESSAGE_LENGTH - message_size );
 
     if (username.compare("__ALL") == 0) {
-        send_all(msg, "__ALL", online_users, sock);
+        send_presence(msg, subject, online_users, out, true);
     }
     else {
-        int len = sock.sendto(
-            reinterpret_cast<const char*>(&msg), sizeof(chat::chat_message), 0,
-            (sockaddr*)&client_address, sizeof(struct sockaddr_in));
+        out.send(msg, client_address);
+    }
+}
+
+/**
+ * @brief Take a user offline and announce that they have left
+ *
+ * @param online_users map of usernames to their corresponding IP:PORT address
+ * @param user to remove, invalid afterwards
+ * @param out egress stage sending to clients
+*/
+void drop_user(online_users& online_users, online_users::iterator user, chat::egress& out) {
+    // build LEAVE announcement while the username still refers to the map key
+    auto msg = chat::chat_message{chat::LEAVE, '\0', '\0'};
+    memcpy(msg.username_, user->first.data(), user->first.length());
+    msg.username_[user->first.length()] = '\0';
+
+    // users behind a gateway leave before it does
+    for (const std::string& sub: gateways.subs(user->first)) {
+        if (auto search = online_users.find(sub); search != online_users.end()) {
+            drop_user(online_users, search, out);
+        }
     }
+
+    // free memory for sockaddr, and delete from username map
+    replication.leave(user->first);
+    remove_user(online_users, user);
+
+    // the leaving user is no longer online, but stamp them as origin for multicast members
+    send_presence(msg, std::string_view{(const char*)msg.username_}, online_users, out, false);
 }
 
 /**
@@ -425,49 +883,36 @@ void handle_list(
  * @param username part of chat protocol packet
  * @param msg part of chat protocol packet
  * @param client_address address of client to send message to
- * @param sock socket for communicting with client
+ * @param out egress stage sending to clients
  * @parm exit_loop set to true if event loop is to terminate
 */
 void handle_leave(
-    online_users& online_users, std::string username, std::string,
-    struct sockaddr_in& client_address, uwe::socket& sock, bool& exit_loop) {
+    online_users& online_users, std::string_view username, std::string_view,
+    struct sockaddr_in& client_address, chat::egress& out, bool& exit_loop) {
     DEBUG("Received leave\n");
 
     username = "";
     // find username
-    for (const auto user: online_users) {
-        if (strcmp(inet_ntoa(client_address.sin_addr), inet_ntoa(user.second->sin_addr)) == 0 &&
+    for (const auto& user: online_users) {
+        // compared as numbers, inet_ntoa returns the same static buffer for both sides
+        if (client_address.sin_addr.s_addr == user.second->sin_addr.s_addr &&
             client_address.sin_port == user.second->sin_port) {
                 username = user.first;
         }
     }
-    DEBUG("%s is leaving the sever\n", username.c_str());
+    DEBUG("%.*s is leaving the sever\n", (int)username.length(), username.data());
 
     if (username.length() == 0) {
         // this should never happen
-        handle_error(ERR_UNKNOWN_USERNAME, client_address, sock, exit_loop); 
+        handle_error(ERR_UNKNOWN_USERNAME, client_address, out, exit_loop); 
     }
     else if (auto search = online_users.find(username); search != online_users.end()) {
-        // first free memory for sockaddr
-        struct sockaddr_in * addr = search->second;
-        delete addr;
-
-        // now delete from username map
-        online_users.erase(search);
-
-        // finally send back LACK
-        auto msg = chat::lack_msg();
-        int len = sock.sendto(
-            reinterpret_cast<const char*>(&msg), sizeof(chat::chat_message), 0,
-            (sockaddr*)&client_address, sizeof(struct sockaddr_in));
-
-        //handle_broadcast(online_users, username, "has left the server", client_address, sock, exit_loop);
-        msg = chat::chat_message{chat::LEAVE, '\0', '\0'};
-        memcpy(msg.username_, username.c_str(), username.length()+1);
-        send_all(msg, username, online_users, sock, false);
+        // send back LACK, then tell everyone else
+        out.send(LACK_MSG, client_address);
+        drop_user(online_users, search, out);
     }
     else {
-        handle_error(ERR_UNKNOWN_USERNAME, client_address, sock, exit_loop); 
+        handle_error(ERR_UNKNOWN_USERNAME, client_address, out, exit_loop); 
     }
 }
 
@@ -478,14 +923,14 @@ void handle_leave(
  * @param username part of chat protocol packet
  * @param msg part of chat protocol packet
  * @param client_address address of client to send message to
- * @param sock socket for communicting with client
+ * @param out egress stage sending to clients
  * @parm exit_loop set to true if event loop is to terminate
 */
 void handle_lack(
-    online_users& online_users, std::string username, std::string,
-    struct sockaddr_in& client_address, uwe::socket& sock, bool& exit_loop) {
+    online_users& online_users, std::string_view username, std::string_view,
+    struct sockaddr_in& client_address, chat::egress& out, bool& exit_loop) {
     DEBUG("Received lack\n");
-    handle_error(ERR_UNEXPECTED_MSG, client_address, sock, exit_loop);
+    handle_error(ERR_UNEXPECTED_MSG, client_address, out, exit_loop);
 }
 
 /**
@@ -495,18 +940,17 @@ void handle_lack(
  * @param username part of chat protocol packet
  * @param msg part of chat protocol packet
  * @param client_address address of client to send message to
- * @param sock socket for communicting with client
+ * @param out egress stage sending to clients
  * @parm exit_loop set to true if event loop is to terminate
 */
 void handle_exit(
-    online_users& users, std::string, std::string, 
-    struct sockaddr_in& client_address, uwe::socket& sock, bool& exit_loop) {
+    online_users& users, std::string_view, std::string_view, 
+    struct sockaddr_in& client_address, chat::egress& out, bool& exit_loop) {
     
-    for (const auto& user : users) {
-        auto msg = chat::exit_msg();
-        sock.sendto(reinterpret_cast<const char*>(&msg), sizeof(msg), 0, (sockaddr*)user.second, sizeof(sockaddr_in));
-    }
-    users.clear();
+    // sent by unicast, so every client's receiver sees it
+    send_all(EXIT_MSG, "", users, out);
+    clear_state(users);
+    replication.exit();
     exit_loop = true;
 }
 
@@ -517,92 +961,1343 @@ void handle_exit(
  * @param username part of chat protocol packet
  * @param msg part of chat protocol packet
  * @param client_address address of client to send message to
- * @param sock socket for communicting with client
+ * @param out egress stage sending to clients
  * @parm exit_loop set to true if event loop is to terminate
 */
 void handle_error(
-    online_users& online_users, std::string username, std::string, 
-    struct sockaddr_in& client_address, uwe::socket& sock, bool& exit_loop) {
+    online_users& online_users, std::string_view username, std::string_view, 
+    struct sockaddr_in& client_address, chat::egress& out, bool& exit_loop) {
     DEBUG("Received error\n");
 }
 
 /**
- * @brief function table, mapping command type to handler.
-*/
-void (*handle_messages[11])(online_users&, std::string, std::string, struct sockaddr_in&, uwe::socket&, bool& exit_loop) = {
-    handle_join, handle_jack, handle_broadcast, handle_directmessage,
-    handle_list, handle_leave, handle_lack, handle_exit, handle_creategroup, handle_messagegroup, handle_error,
-};
-
-/**
- * @brief server for chat protocol
+ * @brief handle multicast message
+ * 
+ * @param online_users map of usernames to their corresponding IP:PORT address
+ * @param username part of chat protocol packet
+ * @param msg part of chat protocol packet, "on" or "off"
+ * @param client_address address of client to send message to
+ * @param out egress stage sending to clients
+ * @parm exit_loop set to true if event loop is to terminate
 */
-void server() {
-    // keep track of online users
-    online_users online_users;
-
-    // port to start the server on
-
-	// socket address used for the server
-	struct sockaddr_in server_address;
-	memset(&server_address, 0, sizeof(server_address));
-	server_address.sin_family = AF_INET;
+void handle_multicast(
+    online_users& online_users, std::string_view username, std::string_view msg, 
+    struct sockaddr_in& client_address, chat::egress& out, bool& exit_loop) {
+    DEBUG("Received multicast\n");
 
-	// htons: host to network short: transforms a value in host byte
-	// ordering format to a short value in network byte ordering format
-	server_address.sin_port = htons(SERVER_PORT);
-
-	// htons: host to network long: same as htons but to long
-	// server_address.sin_addr.s_addr = htonl(INADDR_ANY);
-	// creates binary representation of server name and stores it as sin_addr
-	inet_pton(AF_INET, uwe::get_ipaddr().c_str(), &server_address.sin_addr);
-
-    // create a UDP socket
-	uwe::socket sock{AF_INET, SOCK_DGRAM, 0};
-
-	sock.bind((struct sockaddr *)&server_address, sizeof(server_address));
-
-	// socket address used to store client address
-	struct sockaddr_in client_address;
-	size_t client_address_len = 0;
-
-	char buffer[sizeof(chat::chat_message)];
-    DEBUG("Entering server loop\n");
-    bool exit_loop = false;
-	for (;!exit_loop;) {
-        int len = sock.recvfrom(
-			buffer, sizeof(buffer), 0, (struct sockaddr *)&client_address, &client_address_len);
-
-
-        // DEBUG("Received message:\n");
-        if (len == sizeof(chat::chat_message)) {
-            // handle incoming packet
-            chat::chat_message * message = reinterpret_cast<chat::chat_message*>(buffer);
-            auto type = static_cast<chat::chat_type>(message->type_);
-            std::string username{(const char*)&message->username_[0]};
-            std::string msg{(const char*)&message->message_[0]};
-            std::string groupname{(const char*)&message->groupname_[0]};
-            std::vector <std::string> groupusers;
-
-            if (is_valid_type(type)) {
-                DEBUG("handling msg type %d\n", type);
-
-                handle_messages[type](online_users, username, msg, client_address, sock, exit_loop);
-            }
+    // find username
+    username = "";
+    for (const auto& user: online_users) {
+        if (client_address.sin_addr.s_addr == user.second->sin_addr.s_addr &&
+            client_address.sin_port == user.second->sin_port) {
+            username = user.first;
+            break;
         }
-        else {
-            DEBUG("Unexpected packet length\n");
+    }
+
+    if (username.length() == 0) {
+        handle_error(ERR_UNKNOWN_USERNAME, client_address, out, exit_loop);
+    }
+    else if (msg.compare("on") == 0 && multicast.is_open()) {
+        multicast_users.emplace(username);
+        replication.multicast(username, true);
+    }
+    else if (msg.compare("off") == 0) {
+        if (auto search = multicast_users.find(username); search != multicast_users.end()) {
+            multicast_users.erase(search);
+            replication.multicast(username, false);
         }
     }
+    else {
+        handle_error(ERR_UNEXPECTED_MSG, client_address, out, exit_loop);
+    }
 }
 
 /**
- * @brief entry point for chat server application
+ * @brief handle presence message
+ *
+ * Replaces the sender's presence interest, which starts as everyone.
+ * The username field must be the sender's own, which is checked against
+ * the address it was sent from.
+ * 
+ * @param online_users map of usernames to their corresponding IP:PORT address
+ * @param username part of chat protocol packet
+ * @param msg part of chat protocol packet, usernames, "*" or "@groups" separated by ':'
+ * @param client_address address of client to send message to
+ * @param out egress stage sending to clients
+ * @parm exit_loop set to true if event loop is to terminate
+*/
+void handle_presence(
+    online_users& online_users, std::string_view username, std::string_view msg, 
+    struct sockaddr_in& client_address, chat::egress& out, bool& exit_loop) {
+    auto user = online_users.find(username);
+    if (user == online_users.end() ||
+        user->second->sin_addr.s_addr != client_address.sin_addr.s_addr ||
+        user->second->sin_port != client_address.sin_port) {
+        handle_error(ERR_UNKNOWN_USERNAME, client_address, out, exit_loop);
+        return;
+    }
+
+    chat::arena_vector<std::string_view> interests{packet_arena};
+    chat::split(msg, ':', interests);
+    presence.set_interest(username, interests);
+    replication.presence(username, interests);
+}
+
+/**
+ * @brief Send a session what was held for it while it was suspended, ending the suspension
+ *
+ * @param online_users map of usernames to their corresponding IP:PORT address
+ * @param username of session
+ * @param client_address address the session sends from
+ * @param out egress stage sending to clients
+ * @parm exit_loop set to true if event loop is to terminate
+*/
+void flush_session(
+    online_users& online_users, std::string_view username,
+    struct sockaddr_in& client_address, chat::egress& out, bool& exit_loop) {
+    std::deque<chat::chat_message> held;
+    bool roster_missed = sessions.resume(username, state_clock(), held);
+    for (const auto& msg: held) {
+        out.send(msg, client_address);
+    }
+    // the list as it is now stands in for every one missed
+    if (roster_missed) {
+        handle_list(online_users, username, username, client_address, out, exit_loop);
+    }
+    if (!held.empty() || roster_missed) {
+        DEBUG("Sent %zu held messages to %.*s\n", held.size(), (int)username.length(), username.data());
+    }
+}
+
+/**
+ * @brief handle resume message
+ *
+ * Takes a session back for a client, from whatever address it now sends
+ * from, in exchange for the session's resume token. The client is sent a
+ * JACK and whatever was held for the session, and no one else is told.
+ * Online clients also send it, from their own address, to keep their
+ * session from being suspended.
+ * 
+ * @param online_users map of usernames to their corresponding IP:PORT address
+ * @param username part of chat protocol packet
+ * @param msg part of chat protocol packet, the resume token
+ * @param client_address address of client to send message to
+ * @param out egress stage sending to clients
+ * @parm exit_loop set to true if event loop is to terminate
+*/
+void handle_resume(
+    online_users& online_users, std::string_view username, std::string_view msg, 
+    struct sockaddr_in& client_address, chat::egress& out, bool& exit_loop) {
+    auto user = online_users.find(username);
+    if (user == online_users.end() || !sessions.valid(username, msg)) {
+        handle_error(ERR_RESUME_REJECTED, client_address, out, exit_loop);
+        return;
+    }
+
+    if (user->second->sin_addr.s_addr != client_address.sin_addr.s_addr ||
+        user->second->sin_port != client_address.sin_port) {
+        DEBUG("%.*s resumed from a new address\n", (int)username.length(), username.data());
+        *user->second = client_address;
+        sessions.move(username, client_address);
+        replication.resume(username, client_address);
+        // a new client asks for multicast again, once it has the JACK
+        if (auto search = multicast_users.find(username); search != multicast_users.end()) {
+            multicast_users.erase(search);
+            replication.multicast(username, false);
+        }
+    }
+
+    out.send(chat::jack_msg(JACK_MSG, msg), client_address);
+    flush_session(online_users, username, client_address, out, exit_loop);
+
+    // a gateway's keepalive keeps the users behind it alive too
+    if (sessions.tracking()) {
+        uint64_t now_ns = state_clock();
+        for (const std::string& sub: gateways.subs(username)) {
+            sockaddr_in address = gateways.find(sub)->address_;
+            if (const std::string * suspended = sessions.heard(address, now_ns)) {
+                flush_session(online_users, *suspended, address, out, exit_loop);
+            }
+        }
+    }
+}
+
+std::string memory_report(const online_users& online_users) {
+    const chat::memory_account * accounts[chat::MEMORY_POOLS] = {
+        &user_memory, &groups.memory(), &sessions.memory(), &gateways.memory(), &telemetry.memory()};
+    const size_t counts[chat::MEMORY_POOLS] = {
+        online_users.size(), groups.size(), sessions.size(), gateways.size(), telemetry.size()};
+
+    std::string report;
+    char field[160];
+    for (int pool = 0; pool < chat::MEMORY_POOLS; pool++) {
+        const char * name = chat::memory_pool_name((chat::memory_pool)pool);
+        snprintf(field, sizeof(field), "%s=%zu %s_bytes=%zu %s_high=%zu %s_cap=%zu ",
+            name, counts[pool], name, accounts[pool]->used(), name, accounts[pool]->high_water(),
+            name, accounts[pool]->cap());
+        report += field;
+    }
+    snprintf(field, sizeof(field), "held=%zu held_dropped=%llu rss=%zu",
+        sessions.held(), (unsigned long long)sessions.dropped(), chat::resident_bytes());
+    report += field;
+    return report;
+}
+
+/**
+ * @brief handle stats message
+ *
+ * Replies with the memory readout of memory_report, only to a user
+ * online, so that a forged source address cannot have the readout sent
+ * to a third party.
+ * 
+ * @param online_users map of usernames to their corresponding IP:PORT address
+ * @param username part of chat protocol packet
+ * @param msg part of chat protocol packet
+ * @param client_address address of client to send message to
+ * @param out egress stage sending to clients
+ * @parm exit_loop set to true if event loop is to terminate
+*/
+void handle_stats(
+    online_users& online_users, std::string_view, std::string_view, 
+    struct sockaddr_in& client_address, chat::egress& out, bool& exit_loop) {
+    if (sessions.at(client_address) == nullptr) {
+        handle_error(ERR_UNKNOWN_USERNAME, client_address, out, exit_loop);
+        return;
+    }
+    out.send(chat::stats_msg(memory_report(online_users)), client_address);
+}
+
+/**
+ * @brief handle peer message
+ *
+ * Brokers a direct path for DMs between the sender, named in the username
+ * field, and the user named in the message. Both are sent the other's
+ * address and a new token, with which they exchange DMs without the server
+ * until it expires. The server keeps nothing of it. The sender is sent an
+ * empty grant, and goes on relaying, if brokering is off, or either user
+ * cannot be reached directly: suspended, attached through shared memory, or
+ * behind a gateway.
+ * 
+ * @param online_users map of usernames to their corresponding IP:PORT address
+ * @param username part of chat protocol packet
+ * @param msg part of chat protocol packet, the user to pair with
+ * @param client_address address of client to send message to
+ * @param out egress stage sending to clients
+ * @parm exit_loop set to true if event loop is to terminate
+*/
+void handle_peer(
+    online_users& online_users, std::string_view username, std::string_view msg, 
+    struct sockaddr_in& client_address, chat::egress& out, bool& exit_loop) {
+    auto sender = online_users.find(username);
+    if (sender == online_users.end() || sender->second->sin_addr.s_addr != client_address.sin_addr.s_addr ||
+        sender->second->sin_port != client_address.sin_port) {
+        handle_error(ERR_UNKNOWN_USERNAME, client_address, out, exit_loop);
+        return;
+    }
+
+    auto recipient = online_users.find(msg);
+    if (peer_ttl_ms == 0 || recipient == online_users.end() || recipient == sender ||
+        sessions.suspended(recipient->first) ||
+        chat::shm_server_transport::is_local(client_address) ||
+        chat::shm_server_transport::is_local(*recipient->second) || chat::is_sub_address(*recipient->second)) {
+        out.send(chat::peer_msg(msg), client_address);
+        return;
+    }
+
+    std::string token = peer_tokens.next();
+    out.send(chat::peer_msg(recipient->first, chat::peer_grant(*recipient->second, token, peer_ttl_ms)), client_address);
+    out.send(chat::peer_msg(sender->first, chat::peer_grant(client_address, token, peer_ttl_ms)), *recipient->second);
+    peers_brokered++;
+    DEBUG("Brokered %.*s and %.*s as peers\n",
+        (int)username.length(), username.data(), (int)msg.length(), msg.data());
+}
+
+/**
+ * @brief handle sub join message
+ *
+ * Puts the user named in the username field online behind the gateway
+ * sending it, which must be online itself. The user is given an address
+ * in GATEWAY_SUB_NET and joins from it like any other user, and whatever
+ * is sent to that address reaches the gateway coalesced with what is sent
+ * to the gateway's other users, the JACK or ERROR of the join included.
+ * Gateways attached through shared memory are refused, the coalesced
+ * datagrams do not fit its slots.
+ * 
+ * @param online_users map of usernames to their corresponding IP:PORT address
+ * @param username part of chat protocol packet, the user to put online
+ * @param msg part of chat protocol packet
+ * @param client_address address of client to send message to
+ * @param out egress stage sending to clients
+ * @parm exit_loop set to true if event loop is to terminate
+*/
+void handle_subjoin(
+    online_users& online_users, std::string_view username, std::string_view msg, 
+    struct sockaddr_in& client_address, chat::egress& out, bool& exit_loop) {
+    const std::string * gateway_name = sessions.at(client_address);
+    auto gateway = gateway_name == nullptr ? online_users.end() : online_users.find(*gateway_name);
+    if (gateway == online_users.end() || username.empty() || gateways.find(username) != nullptr ||
+        chat::shm_server_transport::is_local(client_address)) {
+        handle_error(ERR_UNEXPECTED_MSG, client_address, out, exit_loop);
+        return;
+    }
+    if (gateways.full()) {
+        DEBUG("Refused %.*s, gateways are at their memory cap\n", (int)username.length(), username.data());
+        handle_error(ERR_MEMORY_FULL, client_address, out, exit_loop);
+        return;
+    }
+
+    sockaddr_in address = gateways.attach(gateway->first, gateway->second, username);
+    handle_join(online_users, username, msg, address, out, exit_loop);
+
+    auto user = online_users.find(username);
+    if (user == online_users.end() || user->second->sin_addr.s_addr != address.sin_addr.s_addr ||
+        user->second->sin_port != address.sin_port) {
+        // refused, and the ERROR is already on its way
+        gateways.detach(username);
+        return;
+    }
+    replication.sub_join(username, gateway->first);
+}
+
+/**
+ * @brief handle sub leave message
+ *
+ * Takes the user named in the username field, which must be behind the
+ * gateway sending it, offline. Its LACK goes through the gateway.
+ * 
+ * @param online_users map of usernames to their corresponding IP:PORT address
+ * @param username part of chat protocol packet, the user to take offline
+ * @param msg part of chat protocol packet
+ * @param client_address address of client to send message to
+ * @param out egress stage sending to clients
+ * @parm exit_loop set to true if event loop is to terminate
+*/
+void handle_subleave(
+    online_users& online_users, std::string_view username, std::string_view, 
+    struct sockaddr_in& client_address, chat::egress& out, bool& exit_loop) {
+    const chat::gateway_table::sub * sub = gateways.find(username);
+    auto user = online_users.find(username);
+    if (sub == nullptr || user == online_users.end() ||
+        sub->gateway_address_->sin_addr.s_addr != client_address.sin_addr.s_addr ||
+        sub->gateway_address_->sin_port != client_address.sin_port) {
+        handle_error(ERR_UNKNOWN_USERNAME, client_address, out, exit_loop);
+        return;
+    }
+    out.send(LACK_MSG, sub->address_);
+    drop_user(online_users, user, out);
+}
+
+/**
+ * @brief handle telemetry message
+ *
+ * Records the samples in the message against the stream named in the
+ * username field, for the aggregate sent when the window closes, and
+ * passes the message on as it is to the stream's raw subscribers. Samples
+ * of a stream nobody is subscribed to are dropped unparsed. The sender
+ * must be online.
+ * 
+ * @param online_users map of usernames to their corresponding IP:PORT address
+ * @param username part of chat protocol packet, the stream
+ * @param msg part of chat protocol packet, the samples
+ * @param client_address address of client to send message to
+ * @param out egress stage sending to clients
+ * @parm exit_loop set to true if event loop is to terminate
+*/
+void handle_telemetry(
+    online_users& online_users, std::string_view username, std::string_view msg, 
+    struct sockaddr_in& client_address, chat::egress& out, bool& exit_loop) {
+    if (!telemetry.enabled() || sessions.at(client_address) == nullptr) {
+        handle_error(ERR_UNKNOWN_USERNAME, client_address, out, exit_loop);
+        return;
+    }
+    size_t recorded;
+    const chat::telemetry_table::stream * stream = telemetry.record(username, msg, recorded);
+    if (stream == nullptr) {
+        return;
+    }
+    if (recorded == 0) {
+        handle_error(ERR_UNEXPECTED_MSG, client_address, out, exit_loop);
+        return;
+    }
+    if (!stream->raw_.empty()) {
+        auto m = out.encode(chat::telemetry_msg(chat::TELEMETRY, username, msg));
+        for (const std::string& subscriber: stream->raw_) {
+            if (auto user = online_users.find(subscriber); user != online_users.end()) {
+                send_user(m, *user, out);
+            }
+        }
+    }
+}
+
+/**
+ * @brief handle telemetry subscribe message
+ *
+ * Subscribes the sender to the stream named in the username field: for
+ * one TELEMETRY_WINDOW per window with an empty message, for every
+ * TELEMETRY with TELEMETRY_RAW, or not at all any more with TELEMETRY_OFF.
+ * 
+ * @param online_users map of usernames to their corresponding IP:PORT address
+ * @param username part of chat protocol packet, the stream
+ * @param msg part of chat protocol packet, the mode
+ * @param client_address address of client to send message to
+ * @param out egress stage sending to clients
+ * @parm exit_loop set to true if event loop is to terminate
+*/
+void handle_telemetry_sub(
+    online_users& online_users, std::string_view username, std::string_view msg, 
+    struct sockaddr_in& client_address, chat::egress& out, bool& exit_loop) {
+    const std::string * subscriber = sessions.at(client_address);
+    if (!telemetry.enabled() || subscriber == nullptr) {
+        handle_error(ERR_UNKNOWN_USERNAME, client_address, out, exit_loop);
+        return;
+    }
+    if (username.empty() || (!msg.empty() && msg != TELEMETRY_RAW && msg != TELEMETRY_OFF)) {
+        handle_error(ERR_UNEXPECTED_MSG, client_address, out, exit_loop);
+        return;
+    }
+    if (msg == TELEMETRY_OFF) {
+        telemetry.unsubscribe(*subscriber, username);
+    }
+    else if (!telemetry.subscribe(*subscriber, username, msg == TELEMETRY_RAW, state_clock())) {
+        DEBUG("Refused subscription to %.*s, telemetry is at its memory cap\n", (int)username.length(), username.data());
+        handle_error(ERR_MEMORY_FULL, client_address, out, exit_loop);
+        return;
+    }
+    replication.telemetry(*subscriber, username, msg);
+}
+
+/**
+ * @brief handle telemetry window message, which only the server sends
+ * 
+ * @param online_users map of usernames to their corresponding IP:PORT address
+ * @param username part of chat protocol packet
+ * @param msg part of chat protocol packet
+ * @param client_address address of client to send message to
+ * @param out egress stage sending to clients
+ * @parm exit_loop set to true if event loop is to terminate
+*/
+void handle_telemetry_window(
+    online_users& online_users, std::string_view, std::string_view,
+    struct sockaddr_in& client_address, chat::egress& out, bool& exit_loop) {
+    handle_error(ERR_UNEXPECTED_MSG, client_address, out, exit_loop);
+}
+
+/**
+ * @brief Types a gateway may send for a user behind it, the rest only concern the gateway's own session
+*/
+bool sub_may_send(chat::chat_type type) {
+    switch (type) {
+        case chat::JOIN:
+        case chat::MULTICAST:
+        case chat::RESUME:
+        case chat::PEER:
+        case chat::SUB_JOIN:
+        case chat::SUB_LEAVE:
+            return false;
+        default:
+            return true;
+    }
+}
+
+/**
+ * @brief function table, mapping command type to handler.
+*/
+void (*handle_messages[chat::UNKNOWN])(online_users&, std::string_view, std::string_view, struct sockaddr_in&, chat::egress&, bool& exit_loop) = {
+    handle_join, handle_jack, handle_broadcast, handle_directmessage,
+    handle_list, handle_leave, handle_lack, handle_exit, handle_creategroup, handle_messagegroup, handle_error,
+    handle_multicast, handle_groupadd, handle_groupremove, handle_groupinfo, handle_presence, handle_resume, handle_stats,
+    handle_peer, handle_subjoin, handle_subleave, handle_telemetry, handle_telemetry_sub,
+    handle_telemetry_window,
+};
+
+void handle_packet(
+    online_users& online_users, const char * buffer, int len,
+    struct sockaddr_in& client_address, chat::egress& out, bool& exit_loop) {
+    // DEBUG("Received message:\n");
+    chat::latency_trailer latency;
+    bool traced = chat::read_trailer(buffer, len, latency);
+    // a gateway sending for one of the users behind it
+    std::string_view sub_username;
+    bool from_sub = chat::read_sub_message(buffer, len, sub_username);
+    if (len == sizeof(chat::chat_message) || traced || from_sub) {
+        // handle incoming packet
+        const chat::chat_message * message = reinterpret_cast<const chat::chat_message*>(buffer);
+        auto type = static_cast<chat::chat_type>(message->type_);
+        // views into the packet, bounded by the field size in case the NUL is missing
+        std::string_view username = chat::field_view(message->username_, MAX_USERNAME_LENGTH);
+        std::string_view msg = chat::field_view(message->message_, MAX_MESSAGE_LENGTH);
+
+        // the user behind a gateway is handled as if it sent from the address it was given
+        const chat::gateway_table::sub * sub = from_sub ? gateways.find(sub_username) : nullptr;
+        sockaddr_in sub_address;
+        if (sub != nullptr) {
+            sub_address = sub->address_;
+        }
+        sockaddr_in& sender_address = sub != nullptr ? sub_address : client_address;
+
+        if (from_sub && (sub == nullptr || !sub_may_send(type) ||
+            sub->gateway_address_->sin_addr.s_addr != client_address.sin_addr.s_addr ||
+            sub->gateway_address_->sin_port != client_address.sin_port)) {
+            DEBUG("Gateway sent for a user not behind it\n");
+            handle_error(ERR_UNEXPECTED_MSG, client_address, out, exit_loop);
+        }
+        else if (username.length() == MAX_USERNAME_LENGTH) {
+            DEBUG("Username is not NUL terminated\n");
+            handle_error(ERR_UNEXPECTED_MSG, sender_address, out, exit_loop);
+        }
+        else if (!chat::valid_utf8(username) || !chat::valid_utf8(msg)) {
+            DEBUG("Packet is not valid UTF-8\n");
+            handle_error(ERR_UNEXPECTED_MSG, sender_address, out, exit_loop);
+        }
+        else if (is_valid_type(type)) {
+            DEBUG("handling msg type %d\n", type);
+
+            // a suspended session that is heard from again picks up where it left off
+            if (sessions.tracking() && type != chat::RESUME) {
+                if (const std::string * suspended = sessions.heard(sender_address, state_clock())) {
+                    flush_session(online_users, *suspended, sender_address, out, exit_loop);
+                }
+            }
+
+            // messages sent while handling a traced packet carry its stamps on
+            if (traced) {
+                latency.stamps_[chat::STAMP_SERVER_ROUTE] = chat::monotonic_ns();
+                out.set_latency(&latency);
+            }
+            handle_messages[type](online_users, username, msg, sender_address, out, exit_loop);
+            out.set_latency(nullptr);
+        }
+    }
+    else {
+        DEBUG("Unexpected packet length\n");
+    }
+
+    // what was sent to users behind gateways goes out coalesced
+    out.flush();
+    // temporaries of this loop pass are no longer needed
+    packet_arena.reset();
+}
+
+/**
+ * @brief a packet waiting between the ingress and route stages
+*/
+struct received_packet {
+    chat::chat_message message_;
+    // latency trailer of traced packets, or trailer of a gateway's, received along with message_
+    char trailer_[std::max(sizeof(chat::latency_trailer), sizeof(chat::gateway_trailer))];
+    struct sockaddr_in client_address_;
+    int length_;
+    // counts up from the first packet received, ordering packets across lanes
+    uint64_t order_;
+};
+
+static_assert(offsetof(received_packet, trailer_) == sizeof(chat::chat_message), "trailer must follow the message");
+static_assert(GATEWAY_MESSAGE_LENGTH != TRACED_MESSAGE_LENGTH, "gateway and traced packets are told apart by length");
+
+/**
+ * @brief key of the address a packet was sent from, its sender in the bulk lane
+*/
+uint64_t sender_key(const sockaddr_in& address) {
+    return ((uint64_t)address.sin_addr.s_addr << 16) | address.sin_port;
+}
+
+/**
+ * @brief share of the bulk lane a sender gets, a gateway's is one more than the users behind it
+*/
+uint32_t sender_weight(const sockaddr_in& address) {
+    const std::string * username = sessions.at(address);
+    return username == nullptr ? 1 : 1 + gateways.count(*username);
+}
+
+/**
+ * @brief Log the server counters
+ * @param sock transport the server is running on
+ * @param online_users users currently online
+ * @param ingress_drops packets the ingress thread dropped for want of a buffer
+*/
+void log_stats(const chat::transport& sock, const online_users& online_users, uint64_t ingress_drops) {
+    chat::transport_stats stats = sock.stats();
+    // packets lost are reported in every build, whenever more were lost since the last report
+    static uint64_t reported_drops = 0;
+    static uint64_t reported_shed = 0;
+    static uint64_t reported_ingress = 0;
+    if (stats.dropped_ != reported_drops || bulk_lane.dropped() != reported_shed || ingress_drops != reported_ingress) {
+        fprintf(stderr, "kernel drops %llu ingress drops %llu chat shed %llu rcvbuf %d\n",
+            (unsigned long long)stats.dropped_, (unsigned long long)ingress_drops,
+            (unsigned long long)bulk_lane.dropped(), stats.rcvbuf_);
+        reported_drops = stats.dropped_;
+        reported_shed = bulk_lane.dropped();
+        reported_ingress = ingress_drops;
+    }
+    DEBUG("received %llu sent %llu kernel drops %llu rcvbuf %d sndbuf %d users %zu arena high water %zu "
+        "peers brokered %llu telemetry samples %llu unsubscribed %llu chat waiting %zu shed %llu\n",
+        (unsigned long long)stats.received_, (unsigned long long)stats.sent_,
+        (unsigned long long)stats.dropped_, stats.rcvbuf_, stats.sndbuf_,
+        online_users.size(), packet_arena.high_water(), (unsigned long long)peers_brokered,
+        (unsigned long long)telemetry.samples(), (unsigned long long)telemetry.unsubscribed(),
+        bulk_lane.size(), (unsigned long long)bulk_lane.dropped());
+    DEBUG("memory %s\n", memory_report(online_users).c_str());
+}
+
+void configure_state(const server_config& config) {
+    sessions.configure(config.session_idle_ms_, config.session_grace_ms_, config.memory_caps_[chat::MEMORY_SESSIONS]);
+    groups.configure(config.group_ttl_ms_, config.memory_caps_[chat::MEMORY_GROUPS]);
+    user_memory.set_cap(config.memory_caps_[chat::MEMORY_USERS]);
+    gateways.set_cap(config.memory_caps_[chat::MEMORY_GATEWAYS]);
+    telemetry.configure(config.telemetry_window_ms_, config.memory_caps_[chat::MEMORY_TELEMETRY]);
+    peer_ttl_ms = config.peer_ttl_ms_;
+    // clients only keep their sessions alive when told they must
+    JACK_MSG = chat::jack_msg("", config.session_idle_ms_);
+}
+
+void sweep_state(online_users& online_users, uint64_t now_ns, chat::egress& out) {
+    // suspend sessions that have gone silent, and end those not resumed in time
+    if (sessions.tracking()) {
+        sessions.expire(now_ns,
+            [](const std::string& username) {
+                DEBUG("Suspended %s\n", username.c_str());
+            },
+            [&](const std::string& username) {
+                DEBUG("%s did not resume in time\n", username.c_str());
+                if (auto user = online_users.find(username); user != online_users.end()) {
+                    drop_user(online_users, user, out);
+                }
+                else {
+                    sessions.close(username);
+                }
+            });
+    }
+
+    groups.expire(now_ns,
+        [&](const std::string& member) {
+            return online_users.find(member) != online_users.end();
+        },
+        [](const std::string& groupname) {
+            DEBUG("Deleted abandoned group %s\n", groupname.c_str());
+            replication.group_delete(groupname);
+        });
+
+    // one aggregate per stream with samples, to each of its aggregate subscribers
+    if (telemetry.due(now_ns)) {
+        telemetry.close(now_ns, [&](const chat::telemetry_table::value_type& stream, const chat::telemetry_accumulator& acc) {
+            if (stream.second.aggregate_.empty()) {
+                return;
+            }
+            auto m = out.encode(chat::telemetry_msg(chat::TELEMETRY_WINDOW, stream.first, chat::format_window(acc)));
+            for (const std::string& subscriber: stream.second.aggregate_) {
+                if (auto user = online_users.find(subscriber); user != online_users.end()) {
+                    send_user(m, *user, out);
+                }
+            }
+        });
+    }
+    out.flush();
+}
+
+/**
+ * @brief Time for sweep_state
+*/
+bool sweep_due(uint64_t now_ns) {
+    return sessions.due(now_ns) || groups.due(now_ns) || telemetry.due(now_ns);
+}
+
+/**
+ * @brief Put a user online behind its gateway again, at the address it had, e.g. on a server taking over
+ * @param online_users users currently online, the user and its gateway among them
+ * @param username of user behind the gateway
+ * @param gateway username of gateway
+*/
+void attach_sub(online_users& online_users, std::string_view username, std::string_view gateway) {
+    auto user = online_users.find(username);
+    auto gateway_user = online_users.find(gateway);
+    if (user != online_users.end() && gateway_user != online_users.end()) {
+        gateways.attach(gateway_user->first, gateway_user->second, username, *user->second);
+    }
+}
+
+/**
+ * @brief Save the server state, for a server taking over
+ * @param online_users users currently online
+ * @return state image
+*/
+std::string save_state(const online_users& online_users) {
+    chat::image_writer image;
+
+    image.put_u32(online_users.size());
+    for (const auto& user: online_users) {
+        image.put_string(user.first);
+        image.put_address(*user.second);
+        image.put_string(sessions.token(user.first));
+    }
+
+    image.put_u32(groups.size());
+    for (const auto& group: groups) {
+        image.put_string(group.first);
+        image.put_u32(group.second.size());
+        group.second.for_each([&](const std::string& member) {
+            image.put_string(member);
+        });
+    }
+
+    image.put_u32(multicast_users.size());
+    for (const auto& user: multicast_users) {
+        image.put_string(user);
+    }
+
+    // presence interests, of the users that have set any
+    std::vector<std::string_view> interests;
+    image.put_u32(std::count_if(online_users.begin(), online_users.end(), [](const auto& user) {
+        return presence.narrowed(user.first);
+    }));
+    for (const auto& user: online_users) {
+        if (presence.narrowed(user.first)) {
+            interests.clear();
+            presence.interests(user.first, interests);
+            image.put_string(user.first);
+            image.put_u32(interests.size());
+            for (std::string_view interest: interests) {
+                image.put_string(interest);
+            }
+        }
+    }
+
+    // users behind gateways, whose addresses were saved with the users above
+    image.put_u32(gateways.size());
+    gateways.for_each([&](const std::string& username, const chat::gateway_table::sub& sub) {
+        image.put_string(username);
+        image.put_string(sub.gateway_);
+    });
+
+    // telemetry subscriptions, the current window is not handed over
+    uint32_t subscriptions = 0;
+    telemetry.for_each([&](const std::string&, const std::string&, bool) {
+        subscriptions++;
+    });
+    image.put_u32(subscriptions);
+    telemetry.for_each([&](const std::string& username, const std::string& stream, bool raw) {
+        image.put_string(username);
+        image.put_string(stream);
+        image.put_string(raw ? TELEMETRY_RAW : "");
+    });
+
+    return image.data();
+}
+
+/**
+ * @brief Restore the state saved by the server being taken over
+ * @param data state image
+ * @param online_users receives the users online
+ * @return true if the image was read in full
+*/
+bool load_state(std::string_view data, online_users& online_users) {
+    chat::image_reader image{data};
+
+    for (uint32_t users = image.get_u32(); image.ok() && users > 0; users--) {
+        std::string_view username = image.get_string();
+        sockaddr_in address = image.get_address();
+        std::string_view token = image.get_string();
+        if (image.ok()) {
+            add_user(online_users, username, address, token);
+        }
+    }
+
+    // groups taken over are given a full time to live
+    uint64_t now_ns = state_clock();
+    std::vector<std::string_view> members;
+    for (uint32_t count = image.get_u32(); image.ok() && count > 0; count--) {
+        std::string_view groupname = image.get_string();
+        members.clear();
+        for (uint32_t member = image.get_u32(); image.ok() && member > 0; member--) {
+            members.push_back(image.get_string());
+        }
+        if (image.ok()) {
+            auto group = groups.create(groupname, now_ns);
+            for (std::string_view member: members) {
+                groups.add(group, member);
+            }
+        }
+    }
+
+    for (uint32_t users = image.get_u32(); image.ok() && users > 0; users--) {
+        std::string_view username = image.get_string();
+        // without a group of our own, these users are back on unicast
+        if (image.ok() && multicast.is_open()) {
+            multicast_users.emplace(username);
+        }
+    }
+
+    std::vector<std::string_view> interests;
+    for (uint32_t users = image.get_u32(); image.ok() && users > 0; users--) {
+        std::string_view username = image.get_string();
+        interests.clear();
+        for (uint32_t count = image.get_u32(); image.ok() && count > 0; count--) {
+            interests.push_back(image.get_string());
+        }
+        if (image.ok()) {
+            presence.set_interest(username, interests);
+        }
+    }
+
+    for (uint32_t subs = image.get_u32(); image.ok() && subs > 0; subs--) {
+        std::string_view username = image.get_string();
+        std::string_view gateway = image.get_string();
+        if (image.ok()) {
+            attach_sub(online_users, username, gateway);
+        }
+    }
+
+    for (uint32_t subscriptions = image.get_u32(); image.ok() && subscriptions > 0; subscriptions--) {
+        std::string_view username = image.get_string();
+        std::string_view stream = image.get_string();
+        std::string_view mode = image.get_string();
+        if (image.ok()) {
+            telemetry.subscribe(username, stream, mode == TELEMETRY_RAW, state_clock());
+        }
+    }
+
+    return image.ok();
+}
+
+void clear_state(online_users& online_users) {
+    for (auto& user: online_users) {
+        delete user.second;
+    }
+    online_users.clear();
+    user_memory.reset();
+    groups.clear();
+    multicast_users.clear();
+    presence.clear();
+    sessions.clear();
+    gateways.clear();
+    telemetry.clear();
+}
+
+/**
+ * @brief Apply a batch of changes replicated from the primary
+ * @param data batch of changes
+ * @param online_users users currently online
+ * @param exit_loop set to true if the primary was told to exit
+ * @return true if the batch was read in full
 */
-int main(void) { 
-    // Set server IP address
-    uwe::set_ipaddr("192.168.1.27");
-    server();
+bool apply_changes(std::string_view data, online_users& online_users, bool& exit_loop) {
+    chat::image_reader image{data};
+
+    while (!image.at_end()) {
+        auto op = static_cast<chat::replica_op>(image.get_u8());
+        switch (op) {
+            case chat::REPLICA_JOIN: {
+                std::string_view username = image.get_string();
+                sockaddr_in address = image.get_address();
+                std::string_view token = image.get_string();
+                if (image.ok() && online_users.find(username) == online_users.end()) {
+                    add_user(online_users, username, address, token);
+                }
+                break;
+            }
+            case chat::REPLICA_RESUME: {
+                std::string_view username = image.get_string();
+                sockaddr_in address = image.get_address();
+                if (auto search = online_users.find(username); image.ok() && search != online_users.end()) {
+                    *search->second = address;
+                    sessions.move(username, address);
+                }
+                break;
+            }
+            case chat::REPLICA_LEAVE: {
+                std::string_view username = image.get_string();
+                if (auto search = online_users.find(username); search != online_users.end()) {
+                    remove_user(online_users, search);
+                }
+                break;
+            }
+            case chat::REPLICA_GROUP_ADD: {
+                std::string_view groupname = image.get_string();
+                std::string_view username = image.get_string();
+                if (image.ok()) {
+                    groups.add(groups.create(groupname, state_clock()), username);
+                }
+                break;
+            }
+            case chat::REPLICA_GROUP_REMOVE: {
+                std::string_view groupname = image.get_string();
+                std::string_view username = image.get_string();
+                if (auto it = groups.find(groupname); image.ok() && it != groups.end()) {
+                    groups.remove(it, username);
+                    if (it->second.empty()) {
+                        groups.erase(it);
+                    }
+                }
+                break;
+            }
+            case chat::REPLICA_GROUP_DELETE: {
+                std::string_view groupname = image.get_string();
+                if (auto it = groups.find(groupname); image.ok() && it != groups.end()) {
+                    groups.erase(it);
+                }
+                break;
+            }
+            case chat::REPLICA_MULTICAST_ON: {
+                std::string_view username = image.get_string();
+                if (image.ok() && multicast.is_open()) {
+                    multicast_users.emplace(username);
+                }
+                break;
+            }
+            case chat::REPLICA_MULTICAST_OFF: {
+                std::string_view username = image.get_string();
+                if (auto search = multicast_users.find(username); search != multicast_users.end()) {
+                    multicast_users.erase(search);
+                }
+                break;
+            }
+            case chat::REPLICA_PRESENCE: {
+                std::string_view username = image.get_string();
+                std::vector<std::string_view> interests;
+                for (uint32_t count = image.get_u32(); image.ok() && count > 0; count--) {
+                    interests.push_back(image.get_string());
+                }
+                if (image.ok()) {
+                    presence.set_interest(username, interests);
+                }
+                break;
+            }
+            case chat::REPLICA_SUB_JOIN: {
+                std::string_view username = image.get_string();
+                std::string_view gateway = image.get_string();
+                if (image.ok()) {
+                    attach_sub(online_users, username, gateway);
+                }
+                break;
+            }
+            case chat::REPLICA_TELEMETRY: {
+                std::string_view username = image.get_string();
+                std::string_view stream = image.get_string();
+                std::string_view mode = image.get_string();
+                if (!image.ok()) {
+                    break;
+                }
+                if (mode == TELEMETRY_OFF) {
+                    telemetry.unsubscribe(username, stream);
+                }
+                else {
+                    telemetry.subscribe(username, stream, mode == TELEMETRY_RAW, state_clock());
+                }
+                break;
+            }
+            case chat::REPLICA_EXIT: {
+                clear_state(online_users);
+                exit_loop = true;
+                break;
+            }
+            default: {
+                return false;
+            }
+        }
+    }
+
+    return image.ok();
+}
+
+/**
+ * @brief Follow the primary's state as a standby, until the primary fails
+ *
+ * The primary is taken to have failed once nothing has been heard from it
+ * for the failover window, and it cannot be reconnected to.
+ *
+ * @param config runtime options
+ * @param online_users receives the users online
+ * @return true to take over from the primary, false if the server is to exit
+*/
+bool follow_primary(const server_config& config, online_users& online_users) {
+    sockaddr_in primary;
+    if (!chat::parse_address(config.replica_primary_, primary)) {
+        DEBUG("Invalid primary address %s\n", config.replica_primary_.c_str());
+        return false;
+    }
+    DEBUG("Standby of %s\n", config.replica_primary_.c_str());
+
+    chat::replica_standby standby;
+    std::string data;
+    // a standby that has never had a snapshot has nothing to take over with
+    bool synced = false;
+    uint64_t heard_ns = chat::monotonic_ns();
+    for (;;) {
+        if (!standby.connected()) {
+            uint64_t silent_ns = chat::monotonic_ns() - heard_ns;
+            if (synced && silent_ns >= config.failover_ms_ * 1000000ull) {
+                DEBUG("Primary silent for %.3f ms, taking over %zu users and %zu groups\n",
+                    silent_ns / 1e6, online_users.size(), groups.size());
+                return true;
+            }
+            if (!standby.connect(primary, config.failover_ms_)) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(REPLICA_RETRY_MS));
+                continue;
+            }
+            DEBUG("Connected to primary\n");
+        }
+
+        chat::replica_frame kind;
+        if (!standby.receive(kind, data)) {
+            DEBUG("Lost primary\n");
+            continue;
+        }
+        heard_ns = chat::monotonic_ns();
+
+        if (kind == chat::REPLICA_SNAPSHOT) {
+            clear_state(online_users);
+            synced = load_state(data, online_users);
+            if (synced) {
+                DEBUG("Synced %zu users and %zu groups from primary\n", online_users.size(), groups.size());
+            }
+            else {
+                // e.g. a primary of another version, which is never taken over from
+                DEBUG("Invalid snapshot from primary\n");
+            }
+        }
+        else if (kind == chat::REPLICA_CHANGES && synced) {
+            bool exit_loop = false;
+            if (!apply_changes(data, online_users, exit_loop)) {
+                // start again from a snapshot
+                DEBUG("Invalid batch from primary\n");
+                standby.disconnect();
+            }
+            if (exit_loop) {
+                DEBUG("Primary told to exit\n");
+                return false;
+            }
+        }
+    }
+}
+
+void server(const server_config& config) {
+    // keep track of online users
+    online_users online_users;
+    configure_state(config);
+
+    // optional capture of all incoming traffic, for replay with chat_replay
+    chat::trace_writer trace;
+    if (!config.trace_path_.empty()) {
+        if (trace.open(config.trace_path_)) {
+            DEBUG("Capturing traffic to %s\n", config.trace_path_.c_str());
+        }
+        else {
+            DEBUG("Failed to open trace file %s\n", config.trace_path_.c_str());
+        }
+    }
 
-    return 0;
-}
\ No newline at end of file
+    // optional multicast delivery of broadcast and presence traffic
+    if (!config.multicast_group_.empty()) {
+        if (multicast.open(config.multicast_group_, config.multicast_interface_)) {
+            DEBUG("Multicast enabled on %s\n", multicast.group().c_str());
+            JACK_MSG = chat::jack_msg(multicast.group(), config.session_idle_ms_);
+        }
+        else {
+            DEBUG("Failed to open multicast group %s\n", config.multicast_group_.c_str());
+        }
+    }
+
+    // a standby serves only once the primary has failed
+    if (!config.replica_primary_.empty() && !follow_primary(config, online_users)) {
+        return;
+    }
+
+    // port to start the server on
+
+	// socket address used for the server
+	struct sockaddr_in server_address;
+	memset(&server_address, 0, sizeof(server_address));
+	server_address.sin_family = AF_INET;
+
+	// htons: host to network short: transforms a value in host byte
+	// ordering format to a short value in network byte ordering format
+	server_address.sin_port = htons(SERVER_PORT);
+
+	// htons: host to network long: same as htons but to long
+	// server_address.sin_addr.s_addr = htonl(INADDR_ANY);
+	// creates binary representation of server name and stores it as sin_addr
+	inet_pton(AF_INET, uwe::get_ipaddr().c_str(), &server_address.sin_addr);
+
+    // create a UDP socket, or take over the socket of a running server
+    std::unique_ptr<chat::transport> transport;
+    // serves clients on this host through shared memory, alongside the UDP socket
+    chat::shm_server_transport * shm = nullptr;
+    bool taken_over = false;
+    if (config.kernel_socket_) {
+        auto udp = std::make_unique<chat::udp_transport>(config.rcvbuf_, config.rcvbuf_max_);
+        if (!config.handoff_path_.empty()) {
+            uint64_t start_ns = chat::monotonic_ns();
+            (void)start_ns;
+            std::string image;
+            int fd = chat::receive_handoff(config.handoff_path_, image);
+            if (fd >= 0) {
+                udp->adopt(fd);
+                taken_over = true;
+                if (load_state(image, online_users)) {
+                    DEBUG("Took over %zu users and %zu groups in %.3f ms\n",
+                        online_users.size(), groups.size(), (chat::monotonic_ns() - start_ns) / 1e6);
+                }
+                else {
+                    DEBUG("Took over socket, but the state image is invalid\n");
+                }
+            }
+        }
+        if (!config.local_path_.empty()) {
+            auto local = std::make_unique<chat::shm_server_transport>(std::move(udp));
+            shm = local.get();
+            transport = std::move(local);
+        }
+        else {
+            transport = std::move(udp);
+        }
+    }
+    else {
+        if (!config.local_path_.empty()) {
+            DEBUG("Local clients need a kernel socket\n");
+        }
+        transport = std::make_unique<chat::iot_transport>();
+    }
+    chat::transport& sock = *transport;
+    // sessions taken over have not been heard from by us yet
+    sessions.refresh(state_clock());
+
+	if (!taken_over && !sock.bind(server_address)) {
+        DEBUG("Failed to bind server socket\n");
+        return;
+    }
+
+    if (shm != nullptr) {
+        if (shm->listen(config.local_path_)) {
+            DEBUG("Accepting local clients on %s\n", config.local_path_.c_str());
+        }
+        else {
+            DEBUG("Failed to listen for local clients on %s\n", config.local_path_.c_str());
+        }
+    }
+
+    // a replacement server takes over through this socket
+    chat::handoff_listener listener;
+    bool handoff_enabled = false;
+    if (!config.handoff_path_.empty()) {
+        if (sock.fd() < 0) {
+            DEBUG("Handoff needs a kernel socket\n");
+        }
+        else if (listener.listen(config.handoff_path_)) {
+            DEBUG("Waiting for handoff on %s\n", config.handoff_path_.c_str());
+            handoff_enabled = true;
+        }
+        else {
+            DEBUG("Failed to listen for handoff on %s\n", config.handoff_path_.c_str());
+        }
+    }
+
+    // a standby server follows our state through this socket
+    bool replicating = false;
+    if (!config.replica_listen_.empty()) {
+        sockaddr_in replica_address;
+        if (chat::parse_address(config.replica_listen_, replica_address) && replication.listen(replica_address)) {
+            DEBUG("Replicating to a standby on %s\n", config.replica_listen_.c_str());
+            replicating = true;
+        }
+        else {
+            DEBUG("Failed to listen for a standby on %s\n", config.replica_listen_.c_str());
+        }
+    }
+
+    // sends to clients happen on the egress workers
+    auto out = std::make_unique<chat::egress>(sock);
+    if (multicast.is_open()) {
+        out->set_multicast(&multicast);
+    }
+    out->set_gateways(&gateways);
+
+    // packets received but not yet routed
+    auto ingress = std::make_unique<chat::receive_channel<SERVER_RECV_CAPACITY, received_packet, chat::LANE_COUNT>>(
+        config.ingress_overflow_);
+    chat::doorbell router_bell;
+    std::atomic<bool> stopping{false};
+    std::atomic<bool> ingress_done{false};
+    // connection from the server taking over, -1 until one arrives
+    std::atomic<int> handoff_conn{-1};
+
+    std::thread handoff_thread;
+    if (handoff_enabled) {
+        handoff_thread = std::thread([&]() {
+            while (!stopping.load()) {
+                int conn = listener.accept(200);
+                if (conn >= 0) {
+                    handoff_conn.store(conn);
+                    router_bell.ring();
+                    break;
+                }
+            }
+        });
+    }
+
+    if (replicating) {
+        replication.start(router_bell);
+    }
+
+    // receive/decode stage, keeps reading while the router is busy with a packet
+    std::thread ingress_thread([&]() {
+        uint64_t received = 0;
+        // on an exit the router stops taking packets, so there may never be a buffer free again
+        auto exiting = [&]() { return stopping.load() && handoff_conn.load() < 0; };
+        // packets dropped for want of a buffer are read into this one
+        received_packet overflow;
+        for (;;) {
+            uint32_t slot;
+            if (ingress->policy() == chat::OVERFLOW_BLOCK) {
+                if (!ingress->acquire_wait(slot, exiting)) {
+                    break;
+                }
+            }
+            else if (!ingress->acquire(slot)) {
+                overflow.length_ = sock.recvfrom(&overflow.message_,
+                    sizeof(overflow.message_) + sizeof(overflow.trailer_), overflow.client_address_);
+                if (stopping.load() && (handoff_conn.load() < 0 || overflow.length_ == 1)) {
+                    break;
+                }
+                ingress->record_drop();
+                continue;
+            }
+            received_packet& packet = (*ingress)[slot];
+
+            packet.length_ = sock.recvfrom(
+                &packet.message_, sizeof(packet.message_) + sizeof(packet.trailer_), packet.client_address_);
+            if (packet.length_ == (int)TRACED_MESSAGE_LENGTH) {
+                chat::write_stamp(reinterpret_cast<char*>(&packet.message_), chat::STAMP_SERVER_RECV, chat::monotonic_ns());
+            }
+
+            // when handing over, packets before our own wake up are still routed here,
+            // and the ones after it stay queued in the socket for the new server
+            if (stopping.load() && (handoff_conn.load() < 0 || packet.length_ == 1)) {
+                break;
+            }
+
+            if (packet.length_ > 0) {
+                trace.write(packet.client_address_, reinterpret_cast<const char*>(&packet.message_), packet.length_);
+            }
+
+            packet.order_ = received++;
+            // a byte is enough to tell the type, shorter packets are rejected when routed
+            ingress->send(slot, packet.length_ > 0 ? chat::lane_of(packet.message_.type_) : chat::LANE_BULK);
+            router_bell.ring();
+        }
+        ingress_done.store(true);
+        router_bell.ring();
+    });
+
+    DEBUG("Entering server loop\n");
+    uint64_t stats_ns = state_clock();
+    uint64_t handoff_ns = 0;
+    (void)handoff_ns;
+    bool handing_off = false;
+    bool exit_loop = false;
+    // route stage, handlers queue their sends on the egress workers
+    auto route = [&](uint32_t slot) {
+        received_packet& packet = (*ingress)[slot];
+        handle_packet(
+            online_users, reinterpret_cast<const char*>(&packet.message_), packet.length_,
+            packet.client_address_, *out, exit_loop);
+        ingress->release(slot);
+    };
+    // how the lanes see a received packet
+    auto sender = [&](uint32_t waiting) { return sender_key((*ingress)[waiting].client_address_); };
+    auto weight = [&](uint32_t waiting) { return sender_weight((*ingress)[waiting].client_address_); };
+    auto order = [&](uint32_t waiting) { return (*ingress)[waiting].order_; };
+
+	for (;!exit_loop;) {
+        if (!handing_off && handoff_conn.load() >= 0) {
+            // stop receiving, wake the ingress thread from recvfrom
+            DEBUG("Handing over to new server\n");
+            handoff_ns = chat::monotonic_ns();
+            handing_off = true;
+            stopping.store(true);
+            sock.sendto("", 1, server_address);
+        }
+
+        // the snapshot is taken between packets, so the changes recorded after it follow on exactly
+        if (replication.standby_waiting()) {
+            replication.attach(save_state(online_users));
+        }
+
+        uint32_t slot = 0;
+        if (!chat::next_packet(*ingress, bulk_lane, sender, weight, order, route, slot)) {
+            // handed over once everything the ingress thread received is routed
+            if (handing_off && ingress_done.load() && ingress->empty()) {
+                break;
+            }
+            uint64_t now_ns = state_clock();
+            if (sweep_due(now_ns)) {
+                sweep_state(online_users, now_ns, *out);
+                continue;
+            }
+            auto ready = [&]() {
+                return !ingress->empty() || ingress_done.load() || (!handing_off && handoff_conn.load() >= 0) ||
+                    replication.standby_waiting();
+            };
+            // windows are closed, silent sessions and abandoned groups looked for, even when nothing arrives
+            if (telemetry.windowing()) {
+                router_bell.wait(ready, TELEMETRY_SWEEP_MS);
+            }
+            else if (sessions.tracking()) {
+                router_bell.wait(ready, SESSION_SWEEP_MS);
+            }
+            else if (groups.expiring()) {
+                router_bell.wait(ready, GROUP_SWEEP_MS);
+            }
+            else {
+                router_bell.wait(ready);
+            }
+            continue;
+        }
+
+        route(slot);
+
+        uint64_t now_ns = state_clock();
+        if (now_ns - stats_ns >= SERVER_STATS_INTERVAL_NS) {
+            log_stats(sock, online_users, ingress->dropped());
+            stats_ns = now_ns;
+        }
+        if (sweep_due(now_ns)) {
+            sweep_state(online_users, now_ns, *out);
+        }
+    }
+    log_stats(sock, online_users, ingress->dropped());
+    // chat still waiting on an exit is dropped, and its buffers go back to the ingress thread
+    bulk_lane.clear([&](uint32_t slot) { ingress->release(slot); });
+    // ships the last changes, including an exit, before the standby sees us go
+    replication.stop();
+
+    if (handing_off) {
+        ingress_thread.join();
+        // everything routed is sent before the new server starts sending
+        out.reset();
+
+        int conn = handoff_conn.load();
+        if (chat::send_handoff(conn, sock.fd(), save_state(online_users))) {
+            DEBUG("Handed over %zu users in %.3f ms\n",
+                online_users.size(), (chat::monotonic_ns() - handoff_ns) / 1e6);
+        }
+        else {
+            DEBUG("Failed to hand over to new server\n");
+        }
+        close(conn);
+    }
+    else {
+        // wake the ingress thread from recvfrom so it can see it should stop
+        stopping.store(true);
+        sock.sendto("", 1, server_address);
+        // packets received but not routed are dropped with their buffers
+        uint32_t slot;
+        while (ingress->recv(slot)) {
+            ingress->release(slot);
+        }
+        ingress_thread.join();
+    }
+
+    if (handoff_thread.joinable()) {
+        handoff_thread.join();
+    }
+}
@@ -0,0 +1,183 @@
+#pragma once
+
+#include <map>
+#include <string>
+#include <string_view>
+// IOT socket api
+#include <iot/socket.hpp>
+
+#include <arpa/inet.h>
+
+#include "chat_egress.hpp"
+#include "chat_ex.hpp"
+#include "chat_group.hpp"
+#include "chat_memory.hpp"
+#include "chat_replica.hpp"
+#include "chat_ring.hpp"
+#include "chat_session.hpp"
+#include "chat_shm.hpp"
+#include "chat_telemetry.hpp"
+#include "chat_transport.hpp"
+
+/**
+ * @brief map of current online clients
+*/
+typedef std::map<std::string, sockaddr_in *, std::less<>> online_users;
+
+/**
+ * @brief decode a single received packet and pass it to its handler
+ *
+ * @param online_users map of usernames to their corresponding IP:PORT address
+ * @param buffer raw packet as received from the socket
+ * @param len length of the raw packet
+ * @param client_address address the packet was received from
+ * @param out egress stage sending to clients
+ * @parm exit_loop set to true if event loop is to terminate
+*/
+void handle_packet(
+    online_users& online_users, const char * buffer, int len,
+    struct sockaddr_in& client_address, chat::egress& out, bool& exit_loop);
+
+/**
+ * @brief put a user online
+ *
+ * @param online_users map of usernames to their corresponding IP:PORT address
+ * @param username of user
+ * @param address the user sends from
+ * @param token resume token to keep, e.g. from a server being taken over, a new one is made if empty
+ * @return resume token of the session
+*/
+const std::string& add_user(
+    online_users& online_users, std::string_view username, const sockaddr_in& address, std::string_view token = "");
+
+/**
+ * @brief take every user offline and delete every group
+ *
+ * @param online_users map of usernames to their corresponding IP:PORT address
+*/
+void clear_state(online_users& online_users);
+
+/**
+ * @struct server_config
+ * @brief Runtime options of the server
+ * @var server_config::trace_path_
+ *  Member 'trace_path_' if not empty, all received packets are captured to this trace file
+ * @var server_config::multicast_group_
+ *  Member 'multicast_group_' if not empty, multicast group used for broadcast and presence traffic
+ * @var server_config::multicast_interface_
+ *  Member 'multicast_interface_' address of interface to send multicast on, empty for the default
+ * @var server_config::kernel_socket_
+ *  Member 'kernel_socket_' serve on a kernel UDP socket rather than the iot library
+ * @var server_config::rcvbuf_
+ *  Member 'rcvbuf_' initial socket buffer size of the kernel socket, in bytes
+ * @var server_config::rcvbuf_max_
+ *  Member 'rcvbuf_max_' largest receive buffer the kernel socket grows to under drops, in bytes
+ * @var server_config::handoff_path_
+ *  Member 'handoff_path_' if not empty, Unix socket used to take over from, and hand over to, another server process
+ * @var server_config::local_path_
+ *  Member 'local_path_' if not empty, Unix socket on which clients on this host attach through shared memory
+ * @var server_config::replica_listen_
+ *  Member 'replica_listen_' if not empty, "<ip>:<port>" on which to listen for a standby server and replicate state to it
+ * @var server_config::replica_primary_
+ *  Member 'replica_primary_' if not empty, run as a standby of the primary replicating on this "<ip>:<port>"
+ * @var server_config::failover_ms_
+ *  Member 'failover_ms_' how long a standby waits without hearing from the primary before taking over, in milliseconds
+ * @var server_config::session_idle_ms_
+ *  Member 'session_idle_ms_' how long a session may be silent before it is suspended, in milliseconds, 0 to never suspend
+ * @var server_config::session_grace_ms_
+ *  Member 'session_grace_ms_' how long a suspended session is kept for its client to resume, in milliseconds
+ * @var server_config::group_ttl_ms_
+ *  Member 'group_ttl_ms_' how long a group with no member online is kept, in milliseconds, 0 to keep groups forever
+ * @var server_config::peer_ttl_ms_
+ *  Member 'peer_ttl_ms_' how long the token of a brokered peer-to-peer DM path lasts, in milliseconds, 0 to only relay DMs
+ * @var server_config::telemetry_window_ms_
+ *  Member 'telemetry_window_ms_' length of the windows telemetry is aggregated over, in milliseconds, 0 to turn telemetry off
+ * @var server_config::memory_caps_
+ *  Member 'memory_caps_' most memory each chat::memory_pool may hold, in bytes, 0 for no cap
+ * @var server_config::ingress_overflow_
+ *  Member 'ingress_overflow_' what the ingress thread does when every buffer waiting for the router is full
+ */
+struct server_config {
+    std::string trace_path_;
+    std::string multicast_group_;
+    std::string multicast_interface_;
+    bool kernel_socket_ = false;
+    int rcvbuf_ = SOCKET_BUFFER_INITIAL;
+    int rcvbuf_max_ = SOCKET_BUFFER_MAX;
+    std::string handoff_path_;
+    std::string local_path_;
+    std::string replica_listen_;
+    std::string replica_primary_;
+    int failover_ms_ = REPLICA_FAILOVER_MS;
+    int session_idle_ms_ = 0;
+    int session_grace_ms_ = SESSION_GRACE_MS;
+    int group_ttl_ms_ = GROUP_TTL_MS;
+    int peer_ttl_ms_ = 0;
+    int telemetry_window_ms_ = TELEMETRY_WINDOW_MS;
+    size_t memory_caps_[chat::MEMORY_POOLS] = {};
+    chat::overflow_policy ingress_overflow_ = chat::OVERFLOW_BLOCK;
+};
+
+/**
+ * @brief apply the limits in a config to the server state: session expiry, group time to live, memory caps, peer tokens
+ * and telemetry windows
+ *
+ * @param config runtime options
+*/
+void configure_state(const server_config& config);
+
+/**
+ * @brief expire what the server state has outgrown: silent sessions and abandoned groups, and close telemetry windows
+ *
+ * The server calls this between packets every so often, and it can be
+ * called directly to force a pass, as the soak test does.
+ *
+ * @param online_users map of usernames to their corresponding IP:PORT address
+ * @param now_ns current time
+ * @param out egress stage sending to clients
+*/
+void sweep_state(online_users& online_users, uint64_t now_ns, chat::egress& out);
+
+/**
+ * @brief Time for sweep_state
+ *
+ * @param now_ns current time
+*/
+bool sweep_due(uint64_t now_ns);
+
+/**
+ * @brief run the server state on another clock than the monotonic one, e.g. the timeline of a trace being replayed
+ *
+ * Only the state's expiry (sessions, groups, telemetry windows) follows the
+ * clock, latency stamps are always taken from the monotonic clock.
+ *
+ * @param clock returns the current time in nanoseconds
+*/
+void set_state_clock(uint64_t (*clock)());
+
+/**
+ * @brief readout of the memory held by the server state, as sent in reply to STATS
+ *
+ * @param online_users map of usernames to their corresponding IP:PORT address
+ * @return space separated <name>=<value> pairs, sizes in bytes
+*/
+std::string memory_report(const online_users& online_users);
+
+/**
+ * @brief server for chat protocol
+ *
+ * The server is a pipeline: an ingress thread receives packets, the calling
+ * thread routes them through the handlers, and a pool of egress workers
+ * performs the sends, so a large fan-out does not hold up receiving.
+ *
+ * Joins, leaves, resumes and exits travel in a control lane, routed ahead
+ * of any chat waiting, and their replies are sent ahead of any chat queued.
+ * Chat waits per sender, senders taking turns, and when too much is waiting
+ * the sender with the most waiting has its newest chat dropped.
+ *
+ * Run as a standby, it first follows the primary's state, and only binds
+ * the server socket once the primary has failed.
+ *
+ * @param config runtime options
+*/
+void server(const server_config& config);
@@ -0,0 +1,117 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// IOT socket api
+#include <iot/socket.hpp>
+
+#include "chat_server.hpp"
+
+/**
+ * @brief entry point for chat server application
+*/
+int main(int argc, char ** argv) { 
+    server_config config;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "c:m:i:kb:B:u:L:R:S:w:I:G:T:M:P:W:D")) != -1) {
+        switch (opt) {
+            case 'c': {
+                config.trace_path_ = optarg;
+                break;
+            }
+            case 'm': {
+                config.multicast_group_ = optarg;
+                break;
+            }
+            case 'i': {
+                config.multicast_interface_ = optarg;
+                break;
+            }
+            case 'k': {
+                config.kernel_socket_ = true;
+                break;
+            }
+            case 'b': {
+                config.rcvbuf_ = atoi(optarg);
+                break;
+            }
+            case 'B': {
+                config.rcvbuf_max_ = atoi(optarg);
+                break;
+            }
+            case 'u': {
+                config.handoff_path_ = optarg;
+                break;
+            }
+            case 'L': {
+                config.local_path_ = optarg;
+                break;
+            }
+            case 'R': {
+                config.replica_listen_ = optarg;
+                break;
+            }
+            case 'S': {
+                config.replica_primary_ = optarg;
+                break;
+            }
+            case 'w': {
+                config.failover_ms_ = atoi(optarg);
+                break;
+            }
+            case 'I': {
+                config.session_idle_ms_ = atoi(optarg);
+                break;
+            }
+            case 'G': {
+                config.session_grace_ms_ = atoi(optarg);
+                break;
+            }
+            case 'T': {
+                config.group_ttl_ms_ = atoi(optarg);
+                break;
+            }
+            case 'P': {
+                config.peer_ttl_ms_ = atoi(optarg);
+                break;
+            }
+            case 'W': {
+                config.telemetry_window_ms_ = atoi(optarg);
+                break;
+            }
+            case 'D': {
+                config.ingress_overflow_ = chat::OVERFLOW_DROP;
+                break;
+            }
+            case 'M': {
+                // "<pool>=<size>", once for each pool to cap
+                chat::memory_pool pool;
+                size_t bytes;
+                if (!chat::parse_memory_cap(optarg, pool, bytes)) {
+                    printf("Memory cap must be users, groups, sessions, gateways or telemetry=<bytes>[K|M|G]: %s\n", optarg);
+                    return 0;
+                }
+                config.memory_caps_[pool] = bytes;
+                break;
+            }
+            default: {
+                printf(
+                    "USAGE: %s [-c <trace file>] [-m <multicast group> [-i <interface address>]] "
+                    "[-k [-b <initial buffer bytes>] [-B <max buffer bytes>] [-u <handoff socket>] "
+                    "[-L <local client socket>]] "
+                    "[-R <replication address>] [-S <primary replication address> [-w <failover ms>]] "
+                    "[-I <session idle ms> [-G <session grace ms>]] "
+                    "[-T <group ttl ms>] [-M <pool>=<max bytes>]... [-P <peer token ttl ms>] "
+                    "[-W <telemetry window ms>] [-D]\n", argv[0]);
+                return 0;
+            }
+        }
+    }
+
+    // Set server IP address
+    uwe::set_ipaddr("192.168.1.27");
+    server(config);
+
+    return 0;
+}
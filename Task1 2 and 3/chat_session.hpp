@@ -0,0 +1,415 @@
+#pragma once
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/random.h>
+
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include <arpa/inet.h>
+
+#include "chat_ex.hpp"
+#include "chat_memory.hpp"
+
+// Random bytes in a resume token, which is sent as twice as many hex digits
+#define SESSION_TOKEN_BYTES 16
+// How long a suspended session waits for its client to resume, by default, in milliseconds
+#define SESSION_GRACE_MS 30000
+// Most messages held for a suspended session, later ones are dropped
+#define SESSION_QUEUE_MAX 256
+// Tokens' worth of random bytes fetched from the kernel at once
+#define SESSION_TOKEN_BATCH 256
+// Longest the server goes without looking for silent sessions, in milliseconds
+#define SESSION_SWEEP_MS 100
+
+namespace chat {
+
+/**
+ * @brief Random tokens, as hex digits, e.g. for resuming sessions or pairing peers
+*/
+class token_source {
+public:
+    /**
+     * @brief New random token, of SESSION_TOKEN_BYTES random bytes
+     *
+     * Aborts if the kernel cannot supply random bytes, rather than issue a
+     * token that could be guessed.
+    */
+    std::string next() {
+        static const char digits[] = "0123456789abcdef";
+        if (random_used_ == sizeof(random_)) {
+            refill();
+        }
+        std::string token(SESSION_TOKEN_BYTES * 2, '0');
+        for (size_t i = 0; i < SESSION_TOKEN_BYTES; i++) {
+            uint8_t byte = random_[random_used_ + i];
+            token[i * 2] = digits[byte >> 4];
+            token[i * 2 + 1] = digits[byte & 0xf];
+        }
+        random_used_ += SESSION_TOKEN_BYTES;
+        return token;
+    }
+
+private:
+    /**
+     * @brief Fill the whole batch from the kernel, which may hand it over in parts
+    */
+    void refill() {
+        size_t filled = 0;
+        while (filled < sizeof(random_)) {
+            ssize_t n = getrandom(random_ + filled, sizeof(random_) - filled, 0);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                fprintf(stderr, "getrandom failed: %s\n", strerror(errno));
+                abort();
+            }
+            filled += n;
+        }
+        random_used_ = 0;
+    }
+
+    uint8_t random_[SESSION_TOKEN_BYTES * SESSION_TOKEN_BATCH];
+    size_t random_used_ = sizeof(random_);
+};
+
+/**
+ * @brief Resume tokens and liveness of the sessions online
+ *
+ * Every session has a token, sent to the client in its JACK, with which
+ * the client can take the session back from another address. When the
+ * server is told to suspend silent sessions, a session that has sent
+ * nothing for the idle time is suspended: messages for it are held, up to
+ * SESSION_QUEUE_MAX, until it resumes or its grace period runs out. LIST
+ * replies are not held, a suspended session is only marked as having
+ * missed one and is sent the current list when it resumes. Once the
+ * table's account is at its cap, messages are no longer held.
+*/
+class session_table {
+public:
+    /**
+     * @brief Suspend sessions that are silent, and end them after a grace period
+     * @param idle_ms silence before a session is suspended, 0 to never suspend
+     * @param grace_ms how long a suspended session is kept
+     * @param cap most memory sessions may hold, in bytes, 0 for no cap
+    */
+    void configure(uint32_t idle_ms, uint32_t grace_ms, size_t cap = 0) {
+        idle_ns_ = idle_ms * 1000000ull;
+        grace_ns_ = grace_ms * 1000000ull;
+        memory_.set_cap(cap);
+        // a session is suspended at most an eighth of the idle time late
+        sweep_ns_ = std::min<uint64_t>(idle_ns_ / 8, SESSION_SWEEP_MS * 1000000ull);
+    }
+
+    /**
+     * @brief Silent sessions are suspended, so packets must be passed to heard
+    */
+    bool tracking() const {
+        return idle_ns_ > 0;
+    }
+
+    /**
+     * @brief Start a session
+     * @param username of session
+     * @param address the client sends from
+     * @param token to keep, e.g. from a server being taken over, a new one is made if empty
+     * @param now_ns current time
+     * @return token of the session
+    */
+    const std::string& open(std::string_view username, const sockaddr_in& address, std::string_view token, uint64_t now_ns) {
+        auto it = sessions_.find(username);
+        if (it != sessions_.end()) {
+            close(it);
+        }
+        it = sessions_.emplace(username, session{}).first;
+        session& s = it->second;
+        s.name_ = &it->first;
+        s.token_ = token.empty() ? tokens_.next() : std::string{token};
+        s.address_ = key(address);
+        s.heard_ns_ = now_ns;
+        addresses_[s.address_] = &s;
+        memory_.charge(session_bytes(username, s.token_));
+        return s.token_;
+    }
+
+    void close(std::string_view username) {
+        if (auto it = sessions_.find(username); it != sessions_.end()) {
+            close(it);
+        }
+    }
+
+    void clear() {
+        sessions_.clear();
+        addresses_.clear();
+        suspended_ = 0;
+        held_ = 0;
+        memory_.reset();
+    }
+
+    /**
+     * @brief Token of a session, empty if there is no such session
+    */
+    std::string_view token(std::string_view username) const {
+        auto it = sessions_.find(username);
+        return it == sessions_.end() ? std::string_view{} : std::string_view{it->second.token_};
+    }
+
+    /**
+     * @brief A token is the one of a session, compared in constant time
+    */
+    bool valid(std::string_view username, std::string_view token) const {
+        auto it = sessions_.find(username);
+        if (it == sessions_.end() || token.length() != it->second.token_.length()) {
+            return false;
+        }
+        unsigned char diff = 0;
+        for (size_t i = 0; i < token.length(); i++) {
+            diff |= token[i] ^ it->second.token_[i];
+        }
+        return diff == 0;
+    }
+
+    /**
+     * @brief Move a session to another address
+    */
+    void move(std::string_view username, const sockaddr_in& address) {
+        auto it = sessions_.find(username);
+        if (it == sessions_.end()) {
+            return;
+        }
+        session& s = it->second;
+        forget_address(s);
+        s.address_ = key(address);
+        addresses_[s.address_] = &s;
+    }
+
+    /**
+     * @brief End a session's suspension, handing over what was held for it
+     * @param username of session
+     * @param now_ns current time
+     * @param held receives the messages held for the session, in order
+     * @return true if the session missed a LIST, and should be sent the current one
+    */
+    bool resume(std::string_view username, uint64_t now_ns, std::deque<chat_message>& held) {
+        auto it = sessions_.find(username);
+        if (it == sessions_.end()) {
+            return false;
+        }
+        session& s = it->second;
+        s.heard_ns_ = now_ns;
+        if (s.suspended_ns_ == 0) {
+            return false;
+        }
+        s.suspended_ns_ = 0;
+        suspended_--;
+        forget_held(s);
+        held.swap(s.held_);
+        s.held_.clear();
+        bool roster_missed = s.roster_missed_;
+        s.roster_missed_ = false;
+        return roster_missed;
+    }
+
+    /**
+     * @brief Note a packet from an address
+     * @param address packet was received from
+     * @param now_ns current time
+     * @return username of the session at the address if it was suspended, and should be resumed, nullptr otherwise
+    */
+    const std::string * heard(const sockaddr_in& address, uint64_t now_ns) {
+        auto it = addresses_.find(key(address));
+        if (it == addresses_.end()) {
+            return nullptr;
+        }
+        it->second->heard_ns_ = now_ns;
+        return it->second->suspended_ns_ != 0 ? it->second->name_ : nullptr;
+    }
+
+    /**
+     * @brief Username of the session at an address, nullptr if there is none
+    */
+    const std::string * at(const sockaddr_in& address) const {
+        auto it = addresses_.find(key(address));
+        return it == addresses_.end() ? nullptr : it->second->name_;
+    }
+
+    /**
+     * @brief Treat every session as just heard from, e.g. when taking over from another server
+    */
+    void refresh(uint64_t now_ns) {
+        for (auto& entry: sessions_) {
+            entry.second.heard_ns_ = now_ns;
+        }
+    }
+
+    /**
+     * @brief A session is suspended
+    */
+    bool suspended(std::string_view username) const {
+        auto it = sessions_.find(username);
+        return it != sessions_.end() && it->second.suspended_ns_ != 0;
+    }
+
+    /**
+     * @brief Some session is suspended, so sends must be passed to hold
+    */
+    bool any_suspended() const {
+        return suspended_ > 0;
+    }
+
+    /**
+     * @brief Hold a message for a session, if it is suspended
+     * @return false if the session is not suspended, and the message should be sent
+    */
+    bool hold(std::string_view username, const chat_message& msg) {
+        auto it = sessions_.find(username);
+        if (it == sessions_.end() || it->second.suspended_ns_ == 0) {
+            return false;
+        }
+        session& s = it->second;
+        if (msg.type_ == LIST) {
+            s.roster_missed_ = true;
+        }
+        else if (s.held_.size() < SESSION_QUEUE_MAX && !memory_.full()) {
+            s.held_.push_back(msg);
+            held_++;
+            memory_.charge(sizeof(chat_message));
+        }
+        else {
+            dropped_++;
+        }
+        return true;
+    }
+
+    /**
+     * @brief Time to call expire
+    */
+    bool due(uint64_t now_ns) const {
+        return tracking() && now_ns - swept_ns_ >= sweep_ns_;
+    }
+
+    /**
+     * @brief Suspend silent sessions, and end those whose grace period is over
+     * @param now_ns current time
+     * @param suspend called with the username of each session suspended
+     * @param end called with the username of each session to end, which must close it
+    */
+    template <typename Suspend, typename End>
+    void expire(uint64_t now_ns, Suspend suspend, End end) {
+        swept_ns_ = now_ns;
+        std::vector<std::string> ended;
+        for (auto& entry: sessions_) {
+            session& s = entry.second;
+            if (s.suspended_ns_ == 0) {
+                if (now_ns - s.heard_ns_ >= idle_ns_) {
+                    s.suspended_ns_ = now_ns;
+                    suspended_++;
+                    suspend(entry.first);
+                }
+            }
+            else if (now_ns - s.suspended_ns_ >= grace_ns_) {
+                ended.push_back(entry.first);
+            }
+        }
+        for (const std::string& username: ended) {
+            end(username);
+        }
+    }
+
+    /**
+     * @brief Messages not held because a suspended session's queue, or the table, was full
+    */
+    uint64_t dropped() const {
+        return dropped_;
+    }
+
+    size_t size() const {
+        return sessions_.size();
+    }
+
+    /**
+     * @brief Messages held for all suspended sessions
+    */
+    size_t held() const {
+        return held_;
+    }
+
+    const memory_account& memory() const {
+        return memory_;
+    }
+
+private:
+    struct session {
+        // key of the session in sessions_
+        const std::string * name_ = nullptr;
+        std::string token_;
+        uint64_t address_ = 0;
+        uint64_t heard_ns_ = 0;
+        // when the session was suspended, 0 if it is not
+        uint64_t suspended_ns_ = 0;
+        std::deque<chat_message> held_;
+        bool roster_missed_ = false;
+    };
+
+    static uint64_t key(const sockaddr_in& address) {
+        return ((uint64_t)address.sin_addr.s_addr << 16) | address.sin_port;
+    }
+
+    /**
+     * @brief Estimated heap held by a session, besides the messages held for it
+    */
+    static size_t session_bytes(std::string_view username, std::string_view token) {
+        return node_bytes(sizeof(std::pair<const std::string, session>), username.length()) +
+            string_bytes(token.length()) + node_bytes(sizeof(std::pair<const uint64_t, session *>));
+    }
+
+    void close(std::map<std::string, session, std::less<>>::iterator it) {
+        if (it->second.suspended_ns_ != 0) {
+            suspended_--;
+        }
+        forget_held(it->second);
+        forget_address(it->second);
+        memory_.credit(session_bytes(it->first, it->second.token_));
+        sessions_.erase(it);
+    }
+
+    void forget_held(const session& s) {
+        held_ -= s.held_.size();
+        memory_.credit(s.held_.size() * sizeof(chat_message));
+    }
+
+    void forget_address(const session& s) {
+        // another session may have taken the address over since
+        if (auto it = addresses_.find(s.address_); it != addresses_.end() && it->second == &s) {
+            addresses_.erase(it);
+        }
+    }
+
+    std::map<std::string, session, std::less<>> sessions_;
+    // sessions by the address they send from
+    std::unordered_map<uint64_t, session *> addresses_;
+    size_t suspended_ = 0;
+    size_t held_ = 0;
+    uint64_t dropped_ = 0;
+    memory_account memory_;
+
+    uint64_t idle_ns_ = 0;
+    uint64_t grace_ns_ = SESSION_GRACE_MS * 1000000ull;
+    uint64_t sweep_ns_ = SESSION_SWEEP_MS * 1000000ull;
+    uint64_t swept_ns_ = 0;
+
+    token_source tokens_;
+};
+
+}; // namespace chat
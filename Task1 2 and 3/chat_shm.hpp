@@ -0,0 +1,679 @@
+#pragma once
+
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string>
+#include <thread>
+
+// IOT socket api
+#include <iot/socket.hpp>
+
+#include "chat_handoff.hpp"
+#include "chat_latency.hpp"
+#include "chat_ring.hpp"
+#include "chat_transport.hpp"
+
+// Most clients attached to a server's shared memory at once
+#define SHM_MAX_CLIENTS 64
+// Datagrams each ring of an attached client holds, a power of two
+#define SHM_RING_SIZE 256
+// How long a client waits for the server to answer an attach, in milliseconds
+#define SHM_ATTACH_TIMEOUT_MS 1000
+// Local datagrams the server receives before it looks at the network again
+#define SHM_NETWORK_CHECK 16
+// Times a client yields for room in a full ring before dropping the datagram
+#define SHM_SEND_RETRIES 1000
+
+namespace chat {
+
+/**
+ * @struct shm_datagram
+ * @brief A datagram in a shared memory ring
+ * @var shm_datagram::generation_
+ *  Member 'generation_' attachment the datagram belongs to, stale ones are dropped
+ * @var shm_datagram::length_
+ *  Member 'length_' length of the datagram
+ * @var shm_datagram::data_
+ *  Member 'data_' content of the datagram
+ */
+struct shm_datagram {
+    uint32_t generation_;
+    uint32_t length_;
+    char data_[TRACED_MESSAGE_LENGTH];
+};
+
+/**
+ * @brief Memory shared between the server and one attached client
+ *
+ * Each side announces it is about to sleep on its eventfd, as with a
+ * doorbell, so the other side only makes a system call to wake it when it
+ * really is asleep. A region is created for a slot the first time a client
+ * attaches to it and kept, and reused, for as long as the server runs.
+*/
+struct shm_region {
+    alignas(CACHE_LINE_SIZE) std::atomic<bool> server_sleeping_;
+    alignas(CACHE_LINE_SIZE) std::atomic<bool> client_sleeping_;
+    spsc_ring<shm_datagram, SHM_RING_SIZE> to_server_;
+    spsc_ring<shm_datagram, SHM_RING_SIZE> to_client_;
+};
+
+static_assert(std::atomic<size_t>::is_always_lock_free && std::atomic<bool>::is_always_lock_free,
+    "shared memory rings need lock free atomics");
+
+/**
+ * @struct shm_attach
+ * @brief What the server tells a client that attaches, along with its region and eventfds
+ * @var shm_attach::slot_
+ *  Member 'slot_' slot of the client
+ * @var shm_attach::generation_
+ *  Member 'generation_' attachment of the client, tags every datagram
+ */
+struct shm_attach {
+    uint32_t slot_;
+    uint32_t generation_;
+};
+
+/**
+ * @brief Wake the other side of a region, call after pushing to its ring
+*/
+inline void shm_wake(std::atomic<bool>& sleeping, int efd) {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (sleeping.load(std::memory_order_relaxed) && sleeping.exchange(false)) {
+        uint64_t one = 1;
+        ssize_t n = ::write(efd, &one, sizeof(one));
+        (void)n;
+    }
+}
+
+/**
+ * @brief Reset an eventfd, which is nonblocking, so it can be waited on again
+*/
+inline void shm_drain(int efd) {
+    uint64_t count;
+    ssize_t n = ::read(efd, &count, sizeof(count));
+    (void)n;
+}
+
+/**
+ * @brief Map a region
+ * @return region, nullptr on failure
+*/
+inline shm_region * shm_map(int memfd) {
+    void * memory = mmap(nullptr, sizeof(shm_region), PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    return memory == MAP_FAILED ? nullptr : static_cast<shm_region*>(memory);
+}
+
+/**
+ * @brief Server transport for clients on the same host, over UDP for everyone else
+ *
+ * Local clients attach through a Unix socket and are given a region of
+ * shared memory with a ring in each direction, so their messages never
+ * pass through the network stack. The server sees each of them as an
+ * address in 0.0.0.0/8, which no datagram ever comes from, with the slot
+ * in the port and the attachment's generation in the address, and the
+ * handlers serve them exactly like remote clients.
+ *
+ * Sends to a slot are serialised by a lock per slot, so a client whose
+ * slot is reused can never receive what was meant for the one before.
+ * A client detaches by closing its Unix socket, or by exiting.
+*/
+class shm_server_transport : public transport {
+public:
+    /**
+     * @param network transport for remote clients
+    */
+    explicit shm_server_transport(std::unique_ptr<udp_transport> network) : network_{std::move(network)} {
+        server_efd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        for (int slot = 0; slot < SHM_MAX_CLIENTS; slot++) {
+            memfds_[slot] = -1;
+            client_efds_[slot] = -1;
+            conns_[slot] = -1;
+            regions_[slot] = nullptr;
+        }
+    }
+
+    shm_server_transport(const shm_server_transport&) = delete;
+    shm_server_transport& operator=(const shm_server_transport&) = delete;
+
+    ~shm_server_transport() {
+        stopping_.store(true);
+        if (attach_thread_.joinable()) {
+            attach_thread_.join();
+        }
+        if (listen_fd_ >= 0) {
+            close(listen_fd_);
+            unlink(path_.c_str());
+        }
+        for (int slot = 0; slot < SHM_MAX_CLIENTS; slot++) {
+            if (conns_[slot] >= 0) {
+                close(conns_[slot]);
+            }
+            if (regions_[slot] != nullptr) {
+                munmap(regions_[slot], sizeof(shm_region));
+                close(memfds_[slot]);
+                close(client_efds_[slot]);
+            }
+        }
+        close(server_efd_);
+    }
+
+    bool bind(const sockaddr_in& address) override {
+        return network_->bind(address);
+    }
+
+    /**
+     * @brief Accept local clients on a Unix socket, replacing any socket a previous server left there
+     * @param path of the Unix socket
+     * @return true if listening
+    */
+    bool listen(const std::string& path) {
+        sockaddr_un address;
+        if (!unix_address(path, address)) {
+            return false;
+        }
+        listen_fd_ = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (listen_fd_ < 0) {
+            return false;
+        }
+        unlink(path.c_str());
+        if (::bind(listen_fd_, (const sockaddr*)&address, sizeof(address)) != 0 ||
+            ::listen(listen_fd_, SHM_MAX_CLIENTS) != 0) {
+            return false;
+        }
+        path_ = path;
+        attach_thread_ = std::thread([this]() {
+            run();
+        });
+        return true;
+    }
+
+    /**
+     * @brief The network socket, local clients are not handed over
+    */
+    int fd() const override {
+        return network_->fd();
+    }
+
+    transport_stats stats() const override {
+        transport_stats s = transport::stats();
+        transport_stats network = network_->stats();
+        s.dropped_ = network.dropped_ + dropped_.load(std::memory_order_relaxed);
+        s.rcvbuf_ = network.rcvbuf_;
+        s.sndbuf_ = network.sndbuf_;
+        return s;
+    }
+
+    /**
+     * @brief An address belongs to a local client
+    */
+    static bool is_local(const sockaddr_in& address) {
+        return (ntohl(address.sin_addr.s_addr) >> 24) == 0 && address.sin_port != 0;
+    }
+
+protected:
+    int receive(void * buffer, size_t length, sockaddr_in& from) override {
+        for (;;) {
+            // local clients never starve the network, nor the other way round
+            if (network_ready_ || ++since_network_ >= SHM_NETWORK_CHECK) {
+                since_network_ = 0;
+                int len = network_->try_receive(buffer, length, from);
+                if (len >= 0) {
+                    return len;
+                }
+                network_ready_ = false;
+            }
+            int len = receive_local(buffer, length, from);
+            if (len >= 0) {
+                return len;
+            }
+            wait();
+        }
+    }
+
+    int send(const void * buffer, size_t length, const sockaddr_in& to) override {
+        if (!is_local(to)) {
+            return network_->sendto(buffer, length, to);
+        }
+        uint32_t slot = ntohs(to.sin_port) - 1;
+        uint32_t generation = ntohl(to.sin_addr.s_addr);
+        if (slot >= SHM_MAX_CLIENTS || length > sizeof(shm_datagram::data_)) {
+            return -1;
+        }
+
+        std::lock_guard<std::mutex> lock(slot_locks_[slot]);
+        shm_region * region = regions_[slot];
+        if (region == nullptr || generations_[slot].load(std::memory_order_relaxed) != generation) {
+            // the client has gone
+            return -1;
+        }
+        shm_datagram& d = outgoing_[slot];
+        d.generation_ = generation;
+        d.length_ = length;
+        memcpy(d.data_, buffer, length);
+        if (!region->to_client_.push(d)) {
+            dropped_.fetch_add(1, std::memory_order_relaxed);
+            return -1;
+        }
+        shm_wake(region->client_sleeping_, client_efds_[slot]);
+        return length;
+    }
+
+private:
+    static sockaddr_in local_address(uint32_t slot, uint32_t generation) {
+        sockaddr_in address;
+        memset(&address, 0, sizeof(address));
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(generation);
+        address.sin_port = htons(slot + 1);
+        return address;
+    }
+
+    /**
+     * @brief Take a datagram from the attached clients, in turn
+     * @return length of datagram, negative if every ring is empty
+    */
+    int receive_local(void * buffer, size_t length, sockaddr_in& from) {
+        uint64_t attached = attached_.load(std::memory_order_acquire);
+        for (uint32_t i = 0; i < SHM_MAX_CLIENTS && attached != 0; i++) {
+            uint32_t slot = (next_ + i) % SHM_MAX_CLIENTS;
+            if (((attached >> slot) & 1) == 0) {
+                continue;
+            }
+            uint32_t generation = generations_[slot].load(std::memory_order_acquire);
+            while (regions_[slot]->to_server_.pop(incoming_)) {
+                if (incoming_.generation_ != generation) {
+                    // left behind by a client that has detached
+                    continue;
+                }
+                size_t len = incoming_.length_ < length ? incoming_.length_ : length;
+                memcpy(buffer, incoming_.data_, len);
+                from = local_address(slot, generation);
+                next_ = slot + 1;
+                return len;
+            }
+        }
+        return -1;
+    }
+
+    /**
+     * @brief Sleep until a local client or the network has something
+    */
+    void wait() {
+        uint64_t attached = attached_.load(std::memory_order_acquire);
+        for_each_slot(attached, [&](uint32_t slot) {
+            regions_[slot]->server_sleeping_.store(true, std::memory_order_relaxed);
+        });
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+
+        bool ready = false;
+        for_each_slot(attached, [&](uint32_t slot) {
+            ready = ready || !regions_[slot]->to_server_.empty();
+        });
+        if (!ready) {
+            pollfd fds[2] = {{network_->fd(), POLLIN, 0}, {server_efd_, POLLIN, 0}};
+            poll(fds, 2, -1);
+            if (fds[0].revents != 0) {
+                network_ready_ = true;
+            }
+            if (fds[1].revents != 0) {
+                shm_drain(server_efd_);
+            }
+        }
+
+        for_each_slot(attached, [&](uint32_t slot) {
+            regions_[slot]->server_sleeping_.store(false, std::memory_order_relaxed);
+        });
+    }
+
+    template <typename Visit>
+    static void for_each_slot(uint64_t slots, Visit visit) {
+        for (; slots != 0; slots &= slots - 1) {
+            visit((uint32_t)__builtin_ctzll(slots));
+        }
+    }
+
+    /**
+     * @brief Attaches and detaches local clients
+    */
+    void run() {
+        while (!stopping_.load()) {
+            pollfd fds[SHM_MAX_CLIENTS + 1];
+            uint32_t slots[SHM_MAX_CLIENTS + 1];
+            nfds_t count = 0;
+            fds[count++] = pollfd{listen_fd_, POLLIN, 0};
+            for (uint32_t slot = 0; slot < SHM_MAX_CLIENTS; slot++) {
+                if (conns_[slot] >= 0) {
+                    slots[count] = slot;
+                    fds[count++] = pollfd{conns_[slot], POLLIN, 0};
+                }
+            }
+            if (poll(fds, count, 200) <= 0) {
+                continue;
+            }
+            for (nfds_t i = 1; i < count; i++) {
+                if (fds[i].revents != 0) {
+                    // clients say nothing after attaching, so this is the connection closing
+                    detach(slots[i]);
+                }
+            }
+            if (fds[0].revents != 0) {
+                int conn = ::accept4(listen_fd_, nullptr, nullptr, SOCK_CLOEXEC);
+                if (conn >= 0) {
+                    attach(conn);
+                }
+            }
+        }
+    }
+
+    void attach(int conn) {
+        uint32_t slot = 0;
+        while (slot < SHM_MAX_CLIENTS && conns_[slot] >= 0) {
+            slot++;
+        }
+        if (slot == SHM_MAX_CLIENTS) {
+            DEBUG("No room to attach another local client\n");
+            close(conn);
+            return;
+        }
+
+        if (regions_[slot] == nullptr) {
+            int memfd = memfd_create("chat_shm", MFD_CLOEXEC);
+            shm_region * region = nullptr;
+            if (memfd >= 0 && ftruncate(memfd, sizeof(shm_region)) == 0) {
+                region = shm_map(memfd);
+            }
+            if (region == nullptr) {
+                DEBUG("Failed to create shared memory for a local client\n");
+                if (memfd >= 0) {
+                    close(memfd);
+                }
+                close(conn);
+                return;
+            }
+            new (region) shm_region{};
+            memfds_[slot] = memfd;
+            client_efds_[slot] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            std::lock_guard<std::mutex> lock(slot_locks_[slot]);
+            regions_[slot] = region;
+        }
+
+        shm_attach header{slot, next_generation()};
+        {
+            std::lock_guard<std::mutex> lock(slot_locks_[slot]);
+            generations_[slot].store(header.generation_, std::memory_order_release);
+        }
+        if (!send_attach(conn, header, slot)) {
+            detach_slot(slot);
+            close(conn);
+            return;
+        }
+        conns_[slot] = conn;
+        attached_.fetch_or(1ull << slot, std::memory_order_release);
+        // the receiving thread may be asleep without watching the new region
+        uint64_t one = 1;
+        ssize_t n = ::write(server_efd_, &one, sizeof(one));
+        (void)n;
+    }
+
+    void detach(uint32_t slot) {
+        detach_slot(slot);
+        close(conns_[slot]);
+        conns_[slot] = -1;
+    }
+
+    void detach_slot(uint32_t slot) {
+        attached_.fetch_and(~(1ull << slot), std::memory_order_release);
+        std::lock_guard<std::mutex> lock(slot_locks_[slot]);
+        generations_[slot].store(0, std::memory_order_release);
+    }
+
+    /**
+     * @brief Generation of a new attachment, never 0 and within the low 24 bits of an address
+    */
+    uint32_t next_generation() {
+        generation_ = (generation_ + 1) & 0xffffff;
+        if (generation_ == 0) {
+            generation_ = 1;
+        }
+        return generation_;
+    }
+
+    /**
+     * @brief Pass a client its slot, region, and the eventfds of both sides
+    */
+    bool send_attach(int conn, const shm_attach& header, uint32_t slot) {
+        int fds[3] = {memfds_[slot], server_efd_, client_efds_[slot]};
+        iovec iov{(void*)&header, sizeof(header)};
+        char control[CMSG_SPACE(sizeof(fds))];
+        memset(control, 0, sizeof(control));
+
+        msghdr message;
+        memset(&message, 0, sizeof(message));
+        message.msg_iov = &iov;
+        message.msg_iovlen = 1;
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+
+        cmsghdr * c = CMSG_FIRSTHDR(&message);
+        c->cmsg_level = SOL_SOCKET;
+        c->cmsg_type = SCM_RIGHTS;
+        c->cmsg_len = CMSG_LEN(sizeof(fds));
+        memcpy(CMSG_DATA(c), fds, sizeof(fds));
+
+        return sendmsg(conn, &message, MSG_NOSIGNAL) == sizeof(header);
+    }
+
+    std::unique_ptr<udp_transport> network_;
+    int server_efd_;
+    int listen_fd_ = -1;
+    std::string path_;
+    std::thread attach_thread_;
+    std::atomic<bool> stopping_{false};
+    // slots with a client attached
+    std::atomic<uint64_t> attached_{0};
+    std::atomic<uint64_t> dropped_{0};
+
+    // per slot, the region is set once and kept until the transport is destroyed
+    shm_region * regions_[SHM_MAX_CLIENTS];
+    int memfds_[SHM_MAX_CLIENTS];
+    int client_efds_[SHM_MAX_CLIENTS];
+    std::atomic<uint32_t> generations_[SHM_MAX_CLIENTS] = {};
+    std::mutex slot_locks_[SHM_MAX_CLIENTS];
+    shm_datagram outgoing_[SHM_MAX_CLIENTS];
+
+    // attach thread only
+    int conns_[SHM_MAX_CLIENTS];
+    uint32_t generation_ = 0;
+
+    // receiving thread only
+    shm_datagram incoming_;
+    uint32_t next_ = 0;
+    uint32_t since_network_ = 0;
+    bool network_ready_ = true;
+};
+
+/**
+ * @brief Client transport over the shared memory of a server on the same host
+ *
+ * The server address given to sendto is ignored, everything goes to the
+ * server the transport is attached to. fd is the client's eventfd, so the
+ * transport can be waited on by a client_reactor like a socket. Sends may
+ * come from several threads, and are serialised by a lock.
+*/
+class shm_client_transport : public transport {
+public:
+    /**
+     * @param path Unix socket the server accepts local clients on
+    */
+    explicit shm_client_transport(std::string path) : path_{std::move(path)} {
+        memset(&self_, 0, sizeof(self_));
+    }
+
+    shm_client_transport(const shm_client_transport&) = delete;
+    shm_client_transport& operator=(const shm_client_transport&) = delete;
+
+    ~shm_client_transport() {
+        if (region_ != nullptr) {
+            munmap(region_, sizeof(shm_region));
+        }
+        for (int fd : {conn_, server_efd_, client_efd_}) {
+            if (fd >= 0) {
+                close(fd);
+            }
+        }
+    }
+
+    /**
+     * @brief Attach to the server
+     * @return false if there is no server on this host to attach to
+    */
+    bool attach() {
+        sockaddr_un address;
+        if (!unix_address(path_, address)) {
+            return false;
+        }
+        conn_ = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (conn_ < 0) {
+            return false;
+        }
+        timeval timeout{SHM_ATTACH_TIMEOUT_MS / 1000, (SHM_ATTACH_TIMEOUT_MS % 1000) * 1000};
+        setsockopt(conn_, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        if (::connect(conn_, (const sockaddr*)&address, sizeof(address)) != 0) {
+            return false;
+        }
+
+        shm_attach header;
+        iovec iov{&header, sizeof(header)};
+        int fds[3] = {-1, -1, -1};
+        char control[CMSG_SPACE(sizeof(fds))];
+        msghdr message;
+        memset(&message, 0, sizeof(message));
+        message.msg_iov = &iov;
+        message.msg_iovlen = 1;
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+
+        if (recvmsg(conn_, &message, MSG_WAITALL | MSG_CMSG_CLOEXEC) != sizeof(header)) {
+            return false;
+        }
+        for (cmsghdr * c = CMSG_FIRSTHDR(&message); c != nullptr; c = CMSG_NXTHDR(&message, c)) {
+            if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS && c->cmsg_len == CMSG_LEN(sizeof(fds))) {
+                memcpy(fds, CMSG_DATA(c), sizeof(fds));
+            }
+        }
+        server_efd_ = fds[1];
+        client_efd_ = fds[2];
+        if (fds[0] >= 0) {
+            region_ = shm_map(fds[0]);
+            close(fds[0]);
+        }
+        generation_ = header.generation_;
+        if (region_ == nullptr || server_efd_ < 0 || client_efd_ < 0) {
+            return false;
+        }
+        // nothing has been received yet, so the server must wake us for the first datagram
+        region_->client_sleeping_.store(true);
+        return true;
+    }
+
+    /**
+     * @brief Remember the client's own address, sending to it wakes the receiver
+     * @return true if attached
+    */
+    bool bind(const sockaddr_in& address) override {
+        self_ = address;
+        return region_ != nullptr;
+    }
+
+    int fd() const override {
+        return client_efd_;
+    }
+
+protected:
+    int receive(void * buffer, size_t length, sockaddr_in& from) override {
+        for (int attempt = 0;; attempt++) {
+            while (region_->to_client_.pop(incoming_)) {
+                if (incoming_.generation_ != generation_) {
+                    continue;
+                }
+                size_t len = incoming_.length_ < length ? incoming_.length_ : length;
+                memcpy(buffer, incoming_.data_, len);
+                memset(&from, 0, sizeof(from));
+                from.sin_family = AF_INET;
+                return len;
+            }
+            if (attempt > 0) {
+                // woken with nothing for us, e.g. by our own wake up
+                return -1;
+            }
+
+            // reset before announcing sleep, so a wake up after the check is not lost
+            shm_drain(client_efd_);
+            region_->client_sleeping_.store(true, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (!region_->to_client_.empty()) {
+                region_->client_sleeping_.store(false, std::memory_order_relaxed);
+                continue;
+            }
+            if (fcntl(client_efd_, F_GETFL) & O_NONBLOCK) {
+                // driven by a reactor, which waits on the eventfd
+                return -1;
+            }
+            pollfd p{client_efd_, POLLIN, 0};
+            poll(&p, 1, -1);
+            region_->client_sleeping_.store(false, std::memory_order_relaxed);
+        }
+    }
+
+    int send(const void * buffer, size_t length, const sockaddr_in& to) override {
+        if (to.sin_addr.s_addr == self_.sin_addr.s_addr && to.sin_port == self_.sin_port) {
+            uint64_t one = 1;
+            return ::write(client_efd_, &one, sizeof(one)) == sizeof(one) ? length : -1;
+        }
+        if (length > sizeof(shm_datagram::data_)) {
+            return -1;
+        }
+
+        std::lock_guard<std::mutex> lock(send_lock_);
+        outgoing_.generation_ = generation_;
+        outgoing_.length_ = length;
+        memcpy(outgoing_.data_, buffer, length);
+        for (int retry = 0; !region_->to_server_.push(outgoing_); retry++) {
+            if (retry == SHM_SEND_RETRIES) {
+                return -1;
+            }
+            shm_wake(region_->server_sleeping_, server_efd_);
+            std::this_thread::yield();
+        }
+        shm_wake(region_->server_sleeping_, server_efd_);
+        return length;
+    }
+
+private:
+    std::string path_;
+    sockaddr_in self_;
+    int conn_ = -1;
+    int server_efd_ = -1;
+    int client_efd_ = -1;
+    shm_region * region_ = nullptr;
+    uint32_t generation_ = 0;
+
+    std::mutex send_lock_;
+    shm_datagram outgoing_;
+    // receiving thread only
+    shm_datagram incoming_;
+};
+
+}; // namespace chat
@@ -0,0 +1,192 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <arpa/inet.h>
+
+#include "chat_egress.hpp"
+#include "chat_ex.hpp"
+#include "chat_memory.hpp"
+#include "chat_server.hpp"
+#include "chat_trace.hpp"
+#include "chat_transport.hpp"
+
+// Operations churned through the server, unless set with -n
+#define SOAK_OPERATIONS 2000000
+// Users that join, group up and leave in each round, unless set with -u
+#define SOAK_ROUND_USERS 1000
+// Members of each group created
+#define SOAK_GROUP_SIZE 8
+// Share of the operations run before the resident set size is taken as the baseline, in percent
+#define SOAK_WARMUP_PERCENT 10
+// Growth of the resident set size over the baseline that fails the soak, in percent, unless set with -g
+#define SOAK_GROWTH_PERCENT 10
+// Time to live of abandoned groups during the soak, in milliseconds
+#define SOAK_GROUP_TTL_MS 1
+// Times the resident set size is reported over the soak
+#define SOAK_REPORTS 10
+
+/**
+ * @brief everything the soak drives handle_packet with
+*/
+struct soak_server {
+    chat::memory_transport sock_;
+    chat::egress out_{sock_, 0};
+    online_users users_;
+    uint64_t ops_ = 0;
+
+    /**
+     * @brief hand a single packet to the server
+    */
+    void deliver(const chat::chat_message& msg, sockaddr_in from) {
+        bool exit_loop = false;
+        handle_packet(users_, (const char*)&msg, sizeof(msg), from, out_, exit_loop);
+        ops_++;
+    }
+};
+
+/**
+ * @brief address of user slot i, reused by a new user every round
+*/
+sockaddr_in slot_address(size_t i) {
+    sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(0x0a000000u + (uint32_t)(i / 50000));
+    address.sin_port = htons(10000 + (uint16_t)(i % 50000));
+    return address;
+}
+
+/**
+ * @brief one round of churn: users join under new names, form groups, message, and all leave again
+ * @param s server to drive
+ * @param round number of the round, which makes the names new
+ * @param users joining in the round
+*/
+void churn(soak_server& s, uint64_t round, size_t users) {
+    std::string prefix = "s" + std::to_string(round) + "_";
+    std::vector<std::string> names;
+    for (size_t i = 0; i < users; i++) {
+        names.push_back(prefix + std::to_string(i));
+        s.deliver(chat::join_msg(names.back()), slot_address(i));
+        // interest in just the next user keeps a JOIN from being announced to the whole round
+        s.deliver(chat::presence_msg(names.back(), {prefix + std::to_string((i + 1) % users)}), slot_address(i));
+    }
+
+    std::vector<std::string> members;
+    for (size_t first = 0; first + SOAK_GROUP_SIZE <= users; first += SOAK_GROUP_SIZE) {
+        members.assign(names.begin() + first, names.begin() + first + SOAK_GROUP_SIZE);
+        std::string groupname = "g" + prefix + std::to_string(first);
+        const sockaddr_in creator = slot_address(first);
+        const std::vector<std::string> last{members.back()};
+
+        s.deliver(chat::creategroup_msg(groupname, members), creator);
+        s.deliver(chat::messagegroup_msg(groupname, "soak"), creator);
+        s.deliver(chat::group_members_msg(chat::GROUP_REMOVE, groupname, last), creator);
+        s.deliver(chat::group_members_msg(chat::GROUP_ADD, groupname, last), creator);
+    }
+
+    for (size_t i = 0; i < users; i++) {
+        s.deliver(chat::dm_msg(names[i], names[(i + 1) % users] + ":soak"), slot_address(i));
+    }
+
+    // the groups are abandoned, and deleted by the sweeps of later rounds
+    for (size_t i = 0; i < users; i++) {
+        s.deliver(chat::leave_msg(), slot_address(i));
+    }
+    sweep_state(s.users_, chat::monotonic_ns(), s.out_);
+}
+
+/**
+ * @brief usage message for soak test application
+*/
+void usage(const char * name) {
+    printf("USAGE: %s [-n <operations>] [-u <users per round>] [-g <allowed rss growth %%>]\n", name);
+}
+
+/**
+ * @brief entry point for the memory soak test
+ *
+ * Millions of JOIN, PRESENCE, CREATEGROUP, GROUP_ADD, GROUP_REMOVE,
+ * MESSAGEGROUP, DIRECTMESSAGE and LEAVE are driven in process through the handlers, by
+ * users with new names every round, and the resident set size must stay
+ * flat once the first rounds have warmed the allocator up.
+ *
+ * @return 0 if the resident set size stayed within the allowed growth, 1 otherwise
+*/
+int main(int argc, char ** argv) {
+    uint64_t operations = SOAK_OPERATIONS;
+    size_t round_users = SOAK_ROUND_USERS;
+    uint64_t growth_percent = SOAK_GROWTH_PERCENT;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:u:g:")) != -1) {
+        switch (opt) {
+            case 'n': {
+                operations = strtoull(optarg, nullptr, 10);
+                break;
+            }
+            case 'u': {
+                round_users = std::max<size_t>(strtoul(optarg, nullptr, 10), SOAK_GROUP_SIZE);
+                break;
+            }
+            case 'g': {
+                growth_percent = strtoull(optarg, nullptr, 10);
+                break;
+            }
+            default: {
+                usage(argv[0]);
+                return 0;
+            }
+        }
+    }
+
+    server_config config;
+    config.group_ttl_ms_ = SOAK_GROUP_TTL_MS;
+    configure_state(config);
+
+    soak_server s;
+    uint64_t start_ns = chat::monotonic_ns();
+    uint64_t warmup = operations * SOAK_WARMUP_PERCENT / 100;
+    uint64_t next_report = operations / SOAK_REPORTS;
+    size_t baseline = 0;
+    size_t peak = 0;
+    uint64_t round = 0;
+
+    while (s.ops_ < operations) {
+        churn(s, round++, round_users);
+
+        if (baseline == 0 && s.ops_ >= warmup) {
+            baseline = chat::resident_bytes();
+            printf("baseline rss %zu bytes after %llu operations\n", baseline, (unsigned long long)s.ops_);
+        }
+        if (baseline > 0) {
+            peak = std::max(peak, chat::resident_bytes());
+        }
+        if (s.ops_ >= next_report || s.ops_ >= operations) {
+            printf("%10llu ops %8llu rounds %8.1f s  %s\n",
+                (unsigned long long)s.ops_, (unsigned long long)round,
+                (chat::monotonic_ns() - start_ns) / 1e9, memory_report(s.users_).c_str());
+            fflush(stdout);
+            next_report += operations / SOAK_REPORTS;
+        }
+    }
+
+    // once their time to live is up, a last sweep deletes every group
+    std::this_thread::sleep_for(std::chrono::milliseconds(SOAK_GROUP_TTL_MS));
+    sweep_state(s.users_, chat::monotonic_ns(), s.out_);
+    printf("drained: %s\n", memory_report(s.users_).c_str());
+
+    double growth = baseline > 0 ? 100.0 * ((double)peak - baseline) / baseline : 0;
+    bool flat = growth <= growth_percent;
+    printf("%s: peak rss %zu bytes, %.1f%% over the baseline, %llu%% allowed\n",
+        flat ? "PASS" : "FAIL", peak, growth, (unsigned long long)growth_percent);
+    return flat ? 0 : 1;
+}
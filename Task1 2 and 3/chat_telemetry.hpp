@@ -0,0 +1,491 @@
+#pragma once
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <charconv>
+#include <map>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <vector>
+
+#include "chat_ex.hpp"
+#include "chat_memory.hpp"
+
+// Length of a telemetry window, by default, in milliseconds
+#define TELEMETRY_WINDOW_MS 1000
+// Longest the server waits before looking for a window to close, in milliseconds
+#define TELEMETRY_SWEEP_MS 10
+// Mode of a TELEMETRY_SUB asking for every sample rather than one aggregate per window
+#define TELEMETRY_RAW "raw"
+// Mode of a TELEMETRY_SUB ending the subscription
+#define TELEMETRY_OFF "off"
+// Longest text of one sample, as formatted by append_sample
+#define TELEMETRY_SAMPLE_LENGTH 32
+
+namespace chat {
+
+/**
+ * @struct telemetry_accumulator
+ * @brief A stream's samples over the current window, one cache line each
+ * @var telemetry_accumulator::count_
+ *  Member 'count_' samples in the window
+ * @var telemetry_accumulator::min_
+ *  Member 'min_' smallest sample, +inf while there are none
+ * @var telemetry_accumulator::max_
+ *  Member 'max_' largest sample, -inf while there are none
+ * @var telemetry_accumulator::sum_
+ *  Member 'sum_' sum of the samples
+ * @var telemetry_accumulator::last_
+ *  Member 'last_' latest sample
+ */
+struct alignas(64) telemetry_accumulator {
+    uint64_t count_ = 0;
+    double min_ = INFINITY;
+    double max_ = -INFINITY;
+    double sum_ = 0;
+    double last_ = 0;
+};
+
+/**
+ * @struct telemetry_window
+ * @brief Aggregate of a stream over one window, as sent in TELEMETRY_WINDOW
+ * @var telemetry_window::count_
+ *  Member 'count_' samples in the window
+ * @var telemetry_window::min_
+ *  Member 'min_' smallest sample
+ * @var telemetry_window::max_
+ *  Member 'max_' largest sample
+ * @var telemetry_window::mean_
+ *  Member 'mean_' mean of the samples
+ * @var telemetry_window::last_
+ *  Member 'last_' latest sample
+ */
+struct telemetry_window {
+    uint64_t count_;
+    double min_;
+    double max_;
+    double mean_;
+    double last_;
+};
+
+/**
+ * @brief Parse a plain decimal sample, e.g. "-12.375", or leave it to from_chars
+ *
+ * With at most 15 significant digits, the digits read as an integer and
+ * the power of ten are both exact doubles, so one division rounds exactly
+ * as from_chars would, in a fraction of the time.
+ * @param p start of sample
+ * @param end end of samples
+ * @param value receives the sample
+ * @return end of the sample, at end or a ':', nullptr if it is not plain enough
+*/
+inline const char * parse_decimal(const char * p, const char * end, double& value) {
+    static const double powers[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15};
+    bool negative = p < end && *p == '-';
+    p += negative;
+    uint64_t mantissa = 0;
+    int digits = 0;
+    int decimals = 0;
+    for (; p < end && (unsigned)(*p - '0') < 10 && digits <= 15; p++, digits++) {
+        mantissa = mantissa * 10 + (*p - '0');
+    }
+    if (p < end && *p == '.') {
+        for (p++; p < end && (unsigned)(*p - '0') < 10 && digits <= 15; p++, digits++, decimals++) {
+            mantissa = mantissa * 10 + (*p - '0');
+        }
+    }
+    if (digits == 0 || digits > 15 || (p != end && *p != ':')) {
+        return nullptr;
+    }
+    value = (double)mantissa / powers[decimals];
+    value = negative ? -value : value;
+    return p;
+}
+
+/**
+ * @brief Add samples to an accumulator
+ *
+ * The hot path of telemetry, a parse and a handful of register operations
+ * per sample, with the accumulator written back once.
+ * @param samples finite decimal numbers separated by ':'
+ * @param acc accumulator of the stream
+ * @return samples added, parsing stops at the first that is malformed or not finite
+*/
+inline size_t accumulate(std::string_view samples, telemetry_accumulator& acc) {
+    const char * p = samples.data();
+    const char * end = p + samples.length();
+    uint64_t count = 0;
+    double min = acc.min_;
+    double max = acc.max_;
+    double sum = 0;
+    double last = acc.last_;
+    while (p < end) {
+        double value;
+        const char * next = parse_decimal(p, end, value);
+        if (next == nullptr) {
+            // exponents, long mantissas, inf and nan
+            std::from_chars_result result = std::from_chars(p, end, value);
+            next = result.ptr;
+            if (result.ec != std::errc{} || (next != end && *next != ':') || !isfinite(value)) {
+                break;
+            }
+        }
+        min = value < min ? value : min;
+        max = value > max ? value : max;
+        sum += value;
+        last = value;
+        count++;
+        p = next == end ? end : next + 1;
+    }
+    acc.count_ += count;
+    acc.min_ = min;
+    acc.max_ = max;
+    acc.sum_ += sum;
+    acc.last_ = last;
+    return count;
+}
+
+/**
+ * @brief Append a sample to a TELEMETRY message body, in the shortest text that reads back the same
+ * @param samples body so far, samples separated by ':'
+ * @param value sample
+ * @return false if the sample does not fit in a message, and was not appended
+*/
+inline bool append_sample(std::string& samples, double value) {
+    char text[TELEMETRY_SAMPLE_LENGTH];
+    auto [end, ec] = std::to_chars(text, text + sizeof(text), value);
+    size_t length = (ec == std::errc{} ? end : text) - text;
+    size_t separator = samples.empty() ? 0 : 1;
+    if (length == 0 || samples.length() + separator + length > MAX_MESSAGE_LENGTH - 1) {
+        return false;
+    }
+    if (separator) {
+        samples.push_back(':');
+    }
+    samples.append(text, length);
+    return true;
+}
+
+/**
+ * @brief Format the aggregate of a window
+ * @return "<count>:<min>:<max>:<mean>:<last>"
+*/
+inline std::string format_window(const telemetry_accumulator& acc) {
+    std::string text = std::to_string(acc.count_);
+    for (double value: {acc.min_, acc.max_, acc.sum_ / acc.count_, acc.last_}) {
+        append_sample(text, value);
+    }
+    return text;
+}
+
+/**
+ * @brief Parse the aggregate of a window, as sent in TELEMETRY_WINDOW
+ * @param text "<count>:<min>:<max>:<mean>:<last>"
+ * @param window receives the aggregate
+ * @return false if malformed
+*/
+inline bool parse_window(std::string_view text, telemetry_window& window) {
+    const char * end = text.data() + text.length();
+    std::from_chars_result result = std::from_chars(text.data(), end, window.count_);
+    for (double * value: {&window.min_, &window.max_, &window.mean_, &window.last_}) {
+        if (result.ec != std::errc{} || result.ptr == end || *result.ptr != ':') {
+            return false;
+        }
+        result = std::from_chars(result.ptr + 1, end, *value);
+    }
+    return result.ec == std::errc{} && result.ptr == end;
+}
+
+/**
+ * @brief Telemetry streams, their subscribers, and the accumulators of the current window
+ *
+ * A stream exists while anyone is subscribed to it, samples of other
+ * streams are dropped without being parsed, so publishers cannot grow the
+ * table. Accumulators are kept apart from the names and subscribers, in a
+ * dense array of cache lines indexed by stream, and the streams with
+ * samples in the current window are listed so closing it only looks at
+ * those. Only touched by the router.
+*/
+class telemetry_table {
+public:
+    /**
+     * @brief A stream, by name, and who is subscribed to it
+    */
+    struct stream {
+        // index of the stream's accumulator
+        uint32_t slot_;
+        // sent one TELEMETRY_WINDOW per window
+        std::vector<std::string> aggregate_;
+        // sent every TELEMETRY as it arrives
+        std::vector<std::string> raw_;
+    };
+
+    typedef std::map<std::string, stream, std::less<>>::value_type value_type;
+
+    /**
+     * @brief Set the window length, and cap the table
+     * @param window_ms length of a window, 0 to turn telemetry off
+     * @param cap most memory streams and subscriptions may hold, in bytes, 0 for no cap
+    */
+    void configure(uint32_t window_ms, size_t cap) {
+        window_ns_ = window_ms * 1000000ull;
+        memory_.set_cap(cap);
+    }
+
+    bool enabled() const {
+        return window_ns_ > 0;
+    }
+
+    /**
+     * @brief Subscribe a user to a stream, moving it between aggregate and raw if already subscribed
+     * @param username of subscriber
+     * @param name of stream
+     * @param raw sent every sample rather than aggregates
+     * @param now_ns current time
+     * @return false if the table is at its cap
+    */
+    bool subscribe(std::string_view username, std::string_view name, bool raw, uint64_t now_ns) {
+        auto it = streams_.find(name);
+        if (it != streams_.end() && (remove(it->second.aggregate_, username) || remove(it->second.raw_, username))) {
+            // moving between modes, the subscription is already charged
+            (raw ? it->second.raw_ : it->second.aggregate_).emplace_back(username);
+            return true;
+        }
+        if (memory_.full()) {
+            return false;
+        }
+        if (it == streams_.end()) {
+            if (streams_.empty()) {
+                opened_ns_ = now_ns;
+            }
+            it = streams_.emplace(name, stream{new_slot(), {}, {}}).first;
+            slots_[it->second.slot_] = &*it;
+            memory_.charge(stream_bytes(name));
+        }
+        (raw ? it->second.raw_ : it->second.aggregate_).emplace_back(username);
+        subscriptions_[std::string{username}].emplace_back(name);
+        memory_.charge(subscription_bytes(username, name));
+        return true;
+    }
+
+    /**
+     * @brief Unsubscribe a user from a stream, deleting the stream once nobody is subscribed
+    */
+    void unsubscribe(std::string_view username, std::string_view name) {
+        auto user = subscriptions_.find(username);
+        if (user == subscriptions_.end() || !remove(user->second, name)) {
+            return;
+        }
+        if (user->second.empty()) {
+            subscriptions_.erase(user);
+        }
+        drop(username, name);
+    }
+
+    /**
+     * @brief Unsubscribe a user from every stream, e.g. when it goes offline
+    */
+    void unsubscribe_all(std::string_view username) {
+        auto user = subscriptions_.find(username);
+        if (user == subscriptions_.end()) {
+            return;
+        }
+        for (const std::string& name: user->second) {
+            drop(username, name);
+        }
+        subscriptions_.erase(user);
+    }
+
+    /**
+     * @brief Record samples of a stream
+     * @param name of stream
+     * @param samples finite decimal numbers separated by ':'
+     * @param recorded receives the number of samples recorded
+     * @return the stream, nullptr if nobody is subscribed to it and the samples were dropped
+    */
+    const stream * record(std::string_view name, std::string_view samples, size_t& recorded) {
+        recorded = 0;
+        auto it = streams_.find(name);
+        if (it == streams_.end()) {
+            unsubscribed_++;
+            return nullptr;
+        }
+        telemetry_accumulator& acc = accumulators_[it->second.slot_];
+        bool idle = acc.count_ == 0;
+        recorded = accumulate(samples, acc);
+        if (idle && recorded > 0) {
+            active_.push_back(it->second.slot_);
+        }
+        samples_ += recorded;
+        return &it->second;
+    }
+
+    /**
+     * @brief Streams are subscribed to, so windows must be closed
+    */
+    bool windowing() const {
+        return enabled() && !streams_.empty();
+    }
+
+    /**
+     * @brief Time to call close
+    */
+    bool due(uint64_t now_ns) const {
+        return windowing() && now_ns - opened_ns_ >= window_ns_;
+    }
+
+    /**
+     * @brief Close the current window, handing over the aggregate of every stream with samples in it
+     * @param now_ns current time
+     * @param emit called with the stream and its accumulator, for each stream with samples
+    */
+    template <typename Emit>
+    void close(uint64_t now_ns, Emit emit) {
+        for (uint32_t slot: active_) {
+            telemetry_accumulator& acc = accumulators_[slot];
+            // listed twice, or deleted since, if it was reused within the window
+            if (acc.count_ == 0 || slots_[slot] == nullptr) {
+                continue;
+            }
+            emit(*slots_[slot], acc);
+            acc = telemetry_accumulator{};
+        }
+        active_.clear();
+        // windows keep to their length, unless the server fell a whole window behind
+        opened_ns_ += window_ns_;
+        if (now_ns - opened_ns_ >= window_ns_) {
+            opened_ns_ = now_ns;
+        }
+    }
+
+    /**
+     * @brief Call f with the username, stream and mode of every subscription
+    */
+    template <typename F>
+    void for_each(F f) const {
+        for (const auto& entry: streams_) {
+            for (const std::string& username: entry.second.aggregate_) {
+                f(username, entry.first, false);
+            }
+            for (const std::string& username: entry.second.raw_) {
+                f(username, entry.first, true);
+            }
+        }
+    }
+
+    void clear() {
+        streams_.clear();
+        subscriptions_.clear();
+        accumulators_.clear();
+        slots_.clear();
+        free_.clear();
+        active_.clear();
+        memory_.reset();
+    }
+
+    size_t size() const {
+        return streams_.size();
+    }
+
+    bool full() const {
+        return memory_.full();
+    }
+
+    /**
+     * @brief Samples recorded
+    */
+    uint64_t samples() const {
+        return samples_;
+    }
+
+    /**
+     * @brief Messages dropped as nobody was subscribed to their stream
+    */
+    uint64_t unsubscribed() const {
+        return unsubscribed_;
+    }
+
+    const memory_account& memory() const {
+        return memory_;
+    }
+
+private:
+    /**
+     * @brief Estimated heap held for a stream, besides its subscriptions
+    */
+    static size_t stream_bytes(std::string_view name) {
+        return node_bytes(sizeof(value_type), name.length()) + sizeof(telemetry_accumulator) + sizeof(value_type *);
+    }
+
+    /**
+     * @brief Estimated heap held for a subscription, in the stream and in the subscriber's list
+    */
+    static size_t subscription_bytes(std::string_view username, std::string_view name) {
+        return sizeof(std::string) + string_bytes(username.length()) + sizeof(std::string) + string_bytes(name.length());
+    }
+
+    template <typename Names>
+    static bool remove(Names& names, std::string_view name) {
+        auto it = std::find(names.begin(), names.end(), name);
+        if (it == names.end()) {
+            return false;
+        }
+        *it = std::move(names.back());
+        names.pop_back();
+        return true;
+    }
+
+    uint32_t new_slot() {
+        if (!free_.empty()) {
+            uint32_t slot = free_.back();
+            free_.pop_back();
+            return slot;
+        }
+        accumulators_.emplace_back();
+        slots_.push_back(nullptr);
+        return accumulators_.size() - 1;
+    }
+
+    /**
+     * @brief Take a subscriber off a stream, deleting the stream once nobody is subscribed
+    */
+    void drop(std::string_view username, std::string_view name) {
+        memory_.credit(subscription_bytes(username, name));
+        auto it = streams_.find(name);
+        if (it == streams_.end()) {
+            return;
+        }
+        stream& s = it->second;
+        if (!remove(s.aggregate_, username)) {
+            remove(s.raw_, username);
+        }
+        if (s.aggregate_.empty() && s.raw_.empty()) {
+            accumulators_[s.slot_] = telemetry_accumulator{};
+            slots_[s.slot_] = nullptr;
+            free_.push_back(s.slot_);
+            memory_.credit(stream_bytes(name));
+            streams_.erase(it);
+        }
+    }
+
+    std::map<std::string, stream, std::less<>> streams_;
+    // streams of each subscriber, to unsubscribe it from all of them
+    std::map<std::string, std::vector<std::string>, std::less<>> subscriptions_;
+    // accumulators of the streams, and the stream of each, by slot
+    std::vector<telemetry_accumulator> accumulators_;
+    std::vector<value_type *> slots_;
+    std::vector<uint32_t> free_;
+    // slots with samples in the current window
+    std::vector<uint32_t> active_;
+    uint64_t window_ns_ = TELEMETRY_WINDOW_MS * 1000000ull;
+    uint64_t opened_ns_ = 0;
+    uint64_t samples_ = 0;
+    uint64_t unsubscribed_ = 0;
+    memory_account memory_;
+};
+
+}; // namespace chat
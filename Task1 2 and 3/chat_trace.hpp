@@ -0,0 +1,184 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <chrono>
+#include <string>
+#include <cstring>
+#include <arpa/inet.h>
+
+namespace chat {
+
+/**
+ * @brief Traffic trace file format
+ *
+ * A trace starts with a trace_file_header followed by one record per captured
+ * datagram. Each record is a trace_record_header followed by length_ bytes of
+ * the raw packet exactly as it was returned by recvfrom.
+ * All fields are stored in host byte order, except for addr_ and port_ which
+ * are kept in network byte order as found in sockaddr_in.
+*/
+#define TRACE_MAGIC "CHTR"
+#define TRACE_VERSION 1
+
+/**
+ * @struct trace_file_header
+ * @brief Header written once at the start of a trace file
+ * @var trace_file_header::magic_
+ *  Member 'magic_' always TRACE_MAGIC
+ * @var trace_file_header::version_
+ *  Member 'version_' format version, currently TRACE_VERSION
+ */
+struct trace_file_header {
+    char magic_[4];
+    uint32_t version_;
+};
+
+/**
+ * @struct trace_record_header
+ * @brief Header written in front of each captured packet
+ * @var trace_record_header::timestamp_ns_
+ *  Member 'timestamp_ns_' nanoseconds since capture started (monotonic clock)
+ * @var trace_record_header::addr_
+ *  Member 'addr_' source IPv4 address (network byte order)
+ * @var trace_record_header::port_
+ *  Member 'port_' source port (network byte order)
+ * @var trace_record_header::length_
+ *  Member 'length_' number of packet bytes following the header
+ */
+struct trace_record_header {
+    uint64_t timestamp_ns_;
+    uint32_t addr_;
+    uint16_t port_;
+    uint16_t length_;
+};
+
+/**
+ * @brief Monotonic time in nanoseconds
+*/
+inline uint64_t monotonic_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * @brief Append only writer for trace files
+ *
+ * Writes are buffered, so capturing adds a memcpy per packet to the
+ * server loop rather than a system call.
+*/
+class trace_writer {
+public:
+    trace_writer() = default;
+    trace_writer(const trace_writer&) = delete;
+    trace_writer& operator=(const trace_writer&) = delete;
+
+    ~trace_writer() {
+        close();
+    }
+
+    /**
+     * @brief Create (or truncate) a trace file and write its header
+     * @param path of the trace file
+     * @return true if the file is ready for capture, otherwise false
+    */
+    bool open(const std::string& path) {
+        file_ = fopen(path.c_str(), "wb");
+        if (file_ == nullptr) {
+            return false;
+        }
+        setvbuf(file_, nullptr, _IOFBF, 1 << 20);
+
+        trace_file_header header;
+        memcpy(header.magic_, TRACE_MAGIC, sizeof(header.magic_));
+        header.version_ = TRACE_VERSION;
+        fwrite(&header, sizeof(header), 1, file_);
+        start_ns_ = monotonic_ns();
+        return true;
+    }
+
+    bool is_open() const {
+        return file_ != nullptr;
+    }
+
+    /**
+     * @brief Record a single received packet
+     * @param from source address of the packet
+     * @param data raw packet
+     * @param length of raw packet
+    */
+    void write(const sockaddr_in& from, const char * data, uint16_t length) {
+        if (file_ == nullptr) {
+            return;
+        }
+        trace_record_header record;
+        record.timestamp_ns_ = monotonic_ns() - start_ns_;
+        record.addr_ = from.sin_addr.s_addr;
+        record.port_ = from.sin_port;
+        record.length_ = length;
+        fwrite(&record, sizeof(record), 1, file_);
+        fwrite(data, 1, length, file_);
+    }
+
+    void close() {
+        if (file_ != nullptr) {
+            fclose(file_);
+            file_ = nullptr;
+        }
+    }
+
+private:
+    FILE * file_ = nullptr;
+    uint64_t start_ns_ = 0;
+};
+
+/**
+ * @brief Sequential reader for trace files
+*/
+class trace_reader {
+public:
+    trace_reader() = default;
+    trace_reader(const trace_reader&) = delete;
+    trace_reader& operator=(const trace_reader&) = delete;
+
+    ~trace_reader() {
+        if (file_ != nullptr) {
+            fclose(file_);
+        }
+    }
+
+    /**
+     * @brief Open a trace file and validate its header
+     * @param path of the trace file
+     * @return true if the file is a trace this reader understands
+    */
+    bool open(const std::string& path) {
+        file_ = fopen(path.c_str(), "rb");
+        if (file_ == nullptr) {
+            return false;
+        }
+        setvbuf(file_, nullptr, _IOFBF, 1 << 20);
+
+        trace_file_header header;
+        return fread(&header, sizeof(header), 1, file_) == 1 &&
+               memcmp(header.magic_, TRACE_MAGIC, sizeof(header.magic_)) == 0 &&
+               header.version_ == TRACE_VERSION;
+    }
+
+    /**
+     * @brief Read the next record
+     * @param record filled with the record header
+     * @param data buffer receiving the packet, must hold 64KiB
+     * @return false at end of trace (or on a truncated record)
+    */
+    bool next(trace_record_header& record, char * data) {
+        return fread(&record, sizeof(record), 1, file_) == 1 &&
+               fread(data, 1, record.length_, file_) == record.length_;
+    }
+
+private:
+    FILE * file_ = nullptr;
+};
+
+}; // namespace chat
@@ -0,0 +1,385 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <deque>
+#include <string>
+#include <vector>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+// IOT socket api
+#include <iot/socket.hpp>
+
+#include "chat_trace.hpp"
+
+// Receive buffer requested when a kernel socket is opened
+#define SOCKET_BUFFER_INITIAL (256 * 1024)
+// Largest receive buffer the server grows to when it sees drops
+#define SOCKET_BUFFER_MAX (16 * 1024 * 1024)
+// Period over which kernel drops are counted before the buffer is grown
+#define SOCKET_TUNE_INTERVAL_NS 1000000000ull
+
+namespace chat {
+
+/**
+ * @struct transport_stats
+ * @brief Counters of a transport
+ * @var transport_stats::received_
+ *  Member 'received_' datagrams received
+ * @var transport_stats::sent_
+ *  Member 'sent_' datagrams sent
+ * @var transport_stats::dropped_
+ *  Member 'dropped_' datagrams dropped by the kernel because the receive queue was full
+ * @var transport_stats::rcvbuf_
+ *  Member 'rcvbuf_' current receive buffer size in bytes, 0 if unknown
+ * @var transport_stats::sndbuf_
+ *  Member 'sndbuf_' current send buffer size in bytes, 0 if unknown
+ */
+struct transport_stats {
+    uint64_t received_;
+    uint64_t sent_;
+    uint64_t dropped_;
+    int rcvbuf_;
+    int sndbuf_;
+};
+
+/**
+ * @brief Datagram socket the server runs on
+ *
+ * recvfrom is only called from one thread, sendto may be called from
+ * several threads at once.
+*/
+class transport {
+public:
+    virtual ~transport() = default;
+
+    virtual bool bind(const sockaddr_in& address) = 0;
+
+    /**
+     * @brief Receive a datagram
+     * @param buffer to receive into
+     * @param length of buffer
+     * @param from receives the source address
+     * @return length of datagram, negative on error
+    */
+    int recvfrom(void * buffer, size_t length, sockaddr_in& from) {
+        int len = receive(buffer, length, from);
+        if (len >= 0) {
+            received_.fetch_add(1, std::memory_order_relaxed);
+        }
+        return len;
+    }
+
+    /**
+     * @brief Send a datagram
+     * @param buffer to send
+     * @param length of buffer
+     * @param to destination address
+     * @return number of bytes sent, negative on error
+    */
+    int sendto(const void * buffer, size_t length, const sockaddr_in& to) {
+        sent_.fetch_add(1, std::memory_order_relaxed);
+        return send(buffer, length, to);
+    }
+
+    /**
+     * @brief Socket descriptor, for waiting on the transport with poll/epoll
+     * @return descriptor, -1 if the transport has none
+    */
+    virtual int fd() const {
+        return -1;
+    }
+
+    virtual transport_stats stats() const {
+        return transport_stats{
+            received_.load(std::memory_order_relaxed), sent_.load(std::memory_order_relaxed), 0, 0, 0};
+    }
+
+protected:
+    virtual int receive(void * buffer, size_t length, sockaddr_in& from) = 0;
+    virtual int send(const void * buffer, size_t length, const sockaddr_in& to) = 0;
+
+private:
+    std::atomic<uint64_t> received_{0};
+    std::atomic<uint64_t> sent_{0};
+};
+
+/**
+ * @brief Transport over the iot socket library
+*/
+class iot_transport : public transport {
+public:
+    iot_transport() : sock_{AF_INET, SOCK_DGRAM, 0} {
+    }
+
+    bool bind(const sockaddr_in& address) override {
+        sock_.bind((struct sockaddr *)&address, sizeof(address));
+        return true;
+    }
+
+protected:
+    int receive(void * buffer, size_t length, sockaddr_in& from) override {
+        size_t from_len = sizeof(from);
+        return sock_.recvfrom(buffer, length, 0, (struct sockaddr *)&from, &from_len);
+    }
+
+    int send(const void * buffer, size_t length, const sockaddr_in& to) override {
+        return sock_.sendto(
+            reinterpret_cast<const char*>(buffer), length, 0, (struct sockaddr *)&to, sizeof(to));
+    }
+
+private:
+    uwe::socket sock_;
+};
+
+/**
+ * @brief Transport over a kernel UDP socket
+ *
+ * Kernel drops on the receive queue are reported with every datagram
+ * (SO_RXQ_OVFL). When drops are seen within a tuning interval the receive
+ * buffer is doubled, up to the configured maximum, so the socket grows to
+ * absorb the server's peak backlog.
+*/
+class udp_transport : public transport {
+public:
+    /**
+     * @param rcvbuf initial receive (and send) buffer size in bytes
+     * @param rcvbuf_max largest receive buffer size to grow to
+    */
+    udp_transport(int rcvbuf = SOCKET_BUFFER_INITIAL, int rcvbuf_max = SOCKET_BUFFER_MAX) :
+        fd_{::socket(AF_INET, SOCK_DGRAM, 0)}, rcvbuf_max_{rcvbuf_max} {
+        int one = 1;
+        setsockopt(fd_, SOL_SOCKET, SO_RXQ_OVFL, &one, sizeof(one));
+        set_buffer(SO_SNDBUF, SO_SNDBUFFORCE, rcvbuf);
+        set_buffer(SO_RCVBUF, SO_RCVBUFFORCE, rcvbuf);
+        window_start_ns_ = monotonic_ns();
+    }
+
+    udp_transport(const udp_transport&) = delete;
+    udp_transport& operator=(const udp_transport&) = delete;
+
+    ~udp_transport() {
+        close(fd_);
+    }
+
+    bool bind(const sockaddr_in& address) override {
+        return ::bind(fd_, (const struct sockaddr *)&address, sizeof(address)) == 0;
+    }
+
+    /**
+     * @brief Replace the socket with an already bound one, e.g. handed over by another process
+     *
+     * The socket keeps its buffer sizes and whatever is in its receive queue.
+     * @param fd socket to take ownership of
+    */
+    void adopt(int fd) {
+        close(fd_);
+        fd_ = fd;
+        int one = 1;
+        setsockopt(fd_, SOL_SOCKET, SO_RXQ_OVFL, &one, sizeof(one));
+        int size = 0;
+        socklen_t size_len = sizeof(size);
+        getsockopt(fd_, SOL_SOCKET, SO_RCVBUF, &size, &size_len);
+        rcvbuf_.store(size / 2, std::memory_order_relaxed);
+        size_len = sizeof(size);
+        getsockopt(fd_, SOL_SOCKET, SO_SNDBUF, &size, &size_len);
+        sndbuf_.store(size / 2, std::memory_order_relaxed);
+    }
+
+    int fd() const override {
+        return fd_;
+    }
+
+    transport_stats stats() const override {
+        transport_stats s = transport::stats();
+        s.dropped_ = dropped_.load(std::memory_order_relaxed);
+        s.rcvbuf_ = rcvbuf_.load(std::memory_order_relaxed);
+        s.sndbuf_ = sndbuf_.load(std::memory_order_relaxed);
+        return s;
+    }
+
+    /**
+     * @brief Receive a datagram if one is already queued, without waiting
+     * @return length of datagram, negative if none is queued
+    */
+    int try_receive(void * buffer, size_t length, sockaddr_in& from) {
+        return receive_flags(buffer, length, from, MSG_DONTWAIT);
+    }
+
+protected:
+    int receive(void * buffer, size_t length, sockaddr_in& from) override {
+        return receive_flags(buffer, length, from, 0);
+    }
+
+    int send(const void * buffer, size_t length, const sockaddr_in& to) override {
+        return ::sendto(fd_, buffer, length, 0, (const struct sockaddr *)&to, sizeof(to));
+    }
+
+private:
+    int receive_flags(void * buffer, size_t length, sockaddr_in& from, int flags) {
+        iovec iov{buffer, length};
+        char control[CMSG_SPACE(sizeof(uint32_t))];
+        msghdr header;
+        memset(&header, 0, sizeof(header));
+        header.msg_name = &from;
+        header.msg_namelen = sizeof(from);
+        header.msg_iov = &iov;
+        header.msg_iovlen = 1;
+        header.msg_control = control;
+        header.msg_controllen = sizeof(control);
+
+        int len = recvmsg(fd_, &header, flags);
+        if (len >= 0) {
+            for (cmsghdr * c = CMSG_FIRSTHDR(&header); c != nullptr; c = CMSG_NXTHDR(&header, c)) {
+                if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SO_RXQ_OVFL) {
+                    // total drops on this socket since it was created
+                    uint32_t total;
+                    memcpy(&total, CMSG_DATA(c), sizeof(total));
+                    dropped_.store(total, std::memory_order_relaxed);
+                }
+            }
+            tune();
+        }
+        return len;
+    }
+
+    /**
+     * @brief Grow the receive buffer if the kernel dropped packets in the last interval
+    */
+    void tune() {
+        uint64_t now_ns = monotonic_ns();
+        if (now_ns - window_start_ns_ < SOCKET_TUNE_INTERVAL_NS) {
+            return;
+        }
+        uint64_t dropped = dropped_.load(std::memory_order_relaxed);
+        int rcvbuf = rcvbuf_.load(std::memory_order_relaxed);
+        if (dropped > window_dropped_ && rcvbuf < rcvbuf_max_) {
+            int target = rcvbuf > rcvbuf_max_ / 2 ? rcvbuf_max_ : rcvbuf * 2;
+            DEBUG("%llu packets dropped, growing receive buffer to %d bytes\n",
+                (unsigned long long)(dropped - window_dropped_), target);
+            set_buffer(SO_RCVBUF, SO_RCVBUFFORCE, target);
+        }
+        window_dropped_ = dropped;
+        window_start_ns_ = now_ns;
+    }
+
+    /**
+     * @brief Set a socket buffer size, beyond the system limit if permitted
+    */
+    void set_buffer(int option, int force_option, int size) {
+        if (setsockopt(fd_, SOL_SOCKET, force_option, &size, sizeof(size)) != 0) {
+            setsockopt(fd_, SOL_SOCKET, option, &size, sizeof(size));
+        }
+        // the kernel reports double the requested size, to account for bookkeeping
+        int actual = 0;
+        socklen_t actual_len = sizeof(actual);
+        getsockopt(fd_, SOL_SOCKET, option, &actual, &actual_len);
+        (option == SO_RCVBUF ? rcvbuf_ : sndbuf_).store(actual / 2, std::memory_order_relaxed);
+    }
+
+    int fd_;
+    int rcvbuf_max_;
+    std::atomic<uint64_t> dropped_{0};
+    std::atomic<int> rcvbuf_{0};
+    std::atomic<int> sndbuf_{0};
+    uint64_t window_start_ns_ = 0;
+    uint64_t window_dropped_ = 0;
+};
+
+/**
+ * @brief Transport that never touches the network
+ *
+ * Datagrams queued with inject are returned by recvfrom, and sends are
+ * counted, and kept when recording, so handlers can be driven and checked
+ * in process. Sends may come from several threads only when not recording.
+*/
+class memory_transport : public transport {
+public:
+    /**
+     * @struct datagram
+     * @brief A datagram passing through the transport
+     * @var datagram::address_
+     *  Member 'address_' source of a received datagram, destination of a sent one
+     * @var datagram::data_
+     *  Member 'data_' content of the datagram
+     */
+    struct datagram {
+        sockaddr_in address_;
+        std::string data_;
+    };
+
+    /**
+     * @param record keep a copy of every datagram sent, otherwise they are only counted
+    */
+    explicit memory_transport(bool record = false) : record_{record} {
+        memset(&address_, 0, sizeof(address_));
+    }
+
+    bool bind(const sockaddr_in& address) override {
+        address_ = address;
+        return true;
+    }
+
+    /**
+     * @brief Queue a datagram for recvfrom
+     * @param buffer content of datagram
+     * @param length of datagram
+     * @param from source address
+    */
+    void inject(const void * buffer, size_t length, const sockaddr_in& from) {
+        inbox_.push_back(datagram{from, std::string{(const char*)buffer, length}});
+    }
+
+    /**
+     * @brief Datagrams sent since the last clear, if recording
+    */
+    const std::vector<datagram>& sent() const {
+        return sent_;
+    }
+
+    void clear() {
+        sent_.clear();
+    }
+
+    /**
+     * @brief Bytes sent since the transport was created
+    */
+    uint64_t sent_bytes() const {
+        return sent_bytes_.load(std::memory_order_relaxed);
+    }
+
+protected:
+    int receive(void * buffer, size_t length, sockaddr_in& from) override {
+        if (inbox_.empty()) {
+            return -1;
+        }
+        datagram& d = inbox_.front();
+        size_t len = d.data_.length() < length ? d.data_.length() : length;
+        memcpy(buffer, d.data_.data(), len);
+        from = d.address_;
+        inbox_.pop_front();
+        return len;
+    }
+
+    int send(const void * buffer, size_t length, const sockaddr_in& to) override {
+        sent_bytes_.fetch_add(length, std::memory_order_relaxed);
+        if (record_) {
+            sent_.push_back(datagram{to, std::string{(const char*)buffer, length}});
+        }
+        return length;
+    }
+
+private:
+    bool record_;
+    sockaddr_in address_;
+    std::deque<datagram> inbox_;
+    std::vector<datagram> sent_;
+    std::atomic<uint64_t> sent_bytes_{0};
+};
+
+}; // namespace chat